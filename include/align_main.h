@@ -30,26 +30,331 @@
 #define ALIGN_SAM_SUB_STRAND_TAG "st"
 #define ALIGN_SAM_SUB_SEQ "su"
 #define ALIGN_SAM_PG_GDF "gd"
+#define ALIGN_SAM_GRAPH_TAG "gr"
 
 #include "cxxopts.hpp"
 #include "sam.h"
 #include "graphman.h"
+#include "scoring.h"
+#include "traceback.h"
+#include "htslib/bgzf.h"
 
 #include <stdexcept>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 
 // Forward decl to prevent main.cpp recompilation for alignment.h changes
 namespace vargas {
   class AlignerBase;
+  struct AlignerDeleter;
+  class KmerIndex;
+  class GraphReplicas;
   struct ScoreProfile;
+  struct AlignerStats;
+
+  /**
+   * @brief
+   * Instruction sets with an aligner kernel, in increasing vector width.
+   */
+  enum class ISA {SSE41, AVX2, AVX512BW};
+
+  /**
+   * @brief
+   * Per instruction set aligner factories, defined by each build of src/aligner.cpp.
+   * @details
+   * Only call a factory if the host supports its instruction set, see host_isa().
+   */
+  namespace sse {
+    std::unique_ptr<AlignerBase, AlignerDeleter>
+    make_aligner(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly);
+  }
+  namespace avx2 {
+    std::unique_ptr<AlignerBase, AlignerDeleter>
+    make_aligner(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly);
+  }
+  namespace avx512 {
+    std::unique_ptr<AlignerBase, AlignerDeleter>
+    make_aligner(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly);
+  }
 }
 
+class AlignCache;
+struct Shard;
+
 /**
  * Align given reads to specified target graphs.
  * @param argc command line argument count
  * @param argv command line arguments
+ * @param cache Graphs and aligners kept across calls, or nullptr to load them for this call. See serve_main().
+ */
+int align_main(int argc, char *argv[], AlignCache *cache = nullptr);
+
+/**
+ * @brief
+ * Round a read length up to its length bucket.
+ * @param len read length
+ * @param bucket bucket width, 0 for a single bucket
+ * @return upper bound of the bucket, 0 if bucket is 0
+ */
+inline size_t length_bucket(size_t len, size_t bucket) {
+    if (bucket == 0) return 0;
+    return len <= bucket ? bucket : ((len + bucket - 1) / bucket) * bucket;
+}
+
+/**
+ * @param prof Score profile
+ * @param read_len Read length
+ * @return true if end to end scores may saturate 8 bits, and their differences do not fit either.
+ * Local scores are realigned instead.
+ */
+bool use_wide_scores(const vargas::ScoreProfile &prof, size_t read_len);
+
+/**
+ * @param prof Score profile
+ * @param read_len Read length
+ * @return true if end to end scores may saturate 8 bits, but fit as 8 bit differences, see vargas::DiffAlignerT
+ */
+bool diff_scores(const vargas::ScoreProfile &prof, size_t read_len);
+
+/**
+ * @brief
+ * Align reads only to the windows of a graph their seeds hit.
+ * @details
+ * Windows of all reads are sorted and overlapping windows are aligned together as one tile, a window of the
+ * graph (see CompiledGraph). Results of a read over its tiles are merged, so the max score is exact within
+ * the windows, and the second best score is the best of the other windows and of each window's own.
+ * Reads without any hit, or only hits outside the graph, are aligned to the whole graph.
+ * @param aligner Aligner for the longest read
+ * @param index Index of the base graph, any target graph shares its coordinates
+ * @param graph Target graph
+ * @param reads Reads to align
+ * @param aligns Output results
+ * @param fwdonly Only seed and align the forward strand
+ */
+void align_prefiltered(vargas::AlignerBase &aligner, const vargas::KmerIndex &index,
+                       const vargas::CompiledGraph &graph, const vargas::EncodedReads &reads,
+                       vargas::Results &aligns, bool fwdonly);
+
+/**
+ * @brief
+ * Counters and stage timers of an alignment run. Threads keep their own, merged once aligning is done.
+ */
+struct AlignStats {
+    size_t tasks = 0; /**< Tasks aligned */
+    size_t reads = 0; /**< Reads aligned, before copies of --multi */
+    size_t tracebacks = 0; /**< Reads with a traceback */
+    double load_s = 0; /**< Loading and partitioning reads into tasks */
+    double fill_s = 0; /**< Aligner kernel fills */
+    double traceback_s = 0;
+    double serialize_s = 0;
+    double write_wait_s = 0; /**< Handing output to the writer, including waits on its lock and buffer */
+
+    AlignStats &merge(const AlignStats &o) {
+        tasks += o.tasks;
+        reads += o.reads;
+        tracebacks += o.tracebacks;
+        load_s += o.load_s;
+        fill_s += o.fill_s;
+        traceback_s += o.traceback_s;
+        serialize_s += o.serialize_s;
+        write_wait_s += o.write_wait_s;
+        return *this;
+    }
+};
+
+/**
+ * @brief
+ * Periodically reports the number of aligned reads and the rate.
+ * @details
+ * Each thread publishes its count to a slot on its own cache line, once per task, and a background
+ * thread sums the slots every interval. Threads never share a counter, so updates are relaxed stores.
+ */
+class ProgressMeter {
+  public:
+    /**
+     * @param threads Number of slots, one per aligner thread
+     * @param interval Seconds between reports, 0 to not report
+     * @param total Expected number of reads, 0 if unknown
+     * @param os Report stream
+     */
+    ProgressMeter(size_t threads, double interval, size_t total = 0, std::ostream &os = std::cerr);
+
+    ~ProgressMeter() { stop(); }
+
+    ProgressMeter(const ProgressMeter &) = delete;
+    ProgressMeter &operator=(const ProgressMeter &) = delete;
+
+    /**
+     * @param tid Thread slot
+     * @param reads Reads aligned by the thread so far
+     */
+    void update(size_t tid, uint64_t reads) { _slots[tid].reads.store(reads, std::memory_order_relaxed); }
+
+    /**
+     * @return Reads aligned over all threads
+     */
+    uint64_t count() const;
+
+    /**
+     * @brief
+     * Stop reporting. Called on destruction.
+     */
+    void stop();
+
+  private:
+    struct _slot {
+        std::atomic<uint64_t> reads{0};
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    std::unique_ptr<_slot[]> _slots;
+    size_t _threads, _total;
+    std::ostream &_os;
+    std::mutex _mut;
+    std::condition_variable _cv;
+    bool _stop = false;
+    std::thread _reporter;
+};
+
+/**
+ * @brief
+ * Aligners sized per read length bucket, created on first use. One pool per thread.
+ * @details
+ * Tasks hold reads of one bucket, so the DP only spans the rows of that bucket instead of the longest read.
+ */
+class AlignerPool {
+  public:
+    /**
+     * @param prof Score profile
+     * @param max_len Expected longest read, caps the aligner length of the last bucket. Grows with longer reads
+     * @param bucket Bucket width, 0 to use one aligner of max_len
+     * @param msonly
+     * @param maxonly
+     * @param isa Kernel instruction set
+     * @param groups Read vectors per graph pass
+     * @param threads Threads aligning segments of each graph, see AlignerBase::set_threads()
+     * @param device CUDA device of the aligners, or -1 for the SIMD aligners of isa
+     */
+    AlignerPool(const vargas::ScoreProfile &prof, size_t max_len, size_t bucket, bool msonly, bool maxonly,
+                vargas::ISA isa, unsigned groups, unsigned threads = 1, int device = -1);
+
+    /**
+     * @param records Reads in a task
+     * @return Aligner sized for the longest read in records
+     */
+    vargas::AlignerBase &get(const std::vector<vargas::SAM::Record> &records);
+
+    /**
+     * @param records Reads in a task
+     * @return Read length of the aligner get() returns for records
+     */
+    size_t length(const std::vector<vargas::SAM::Record> &records) const;
+
+    /**
+     * @return Number of aligners created
+     */
+    size_t size() const { return _aligners.size(); }
+
+    /**
+     * @return Reads realigned after saturating, summed over aligners
+     */
+    size_t realigned() const;
+
+    /**
+     * @return Kernel counters, summed over aligners
+     */
+    vargas::AlignerStats kernel_stats() const;
+
+    /**
+     * @return Counters and timers of the thread using the pool
+     */
+    AlignStats &stats() { return _stats; }
+    const AlignStats &stats() const { return _stats; }
+
+    /**
+     * @return Traceback buffers shared by the aligners of the pool
+     */
+    vargas::Traceback &traceback() { return _traceback; }
+
+    /**
+     * @return Encoded read buffer shared by the aligners of the pool
+     */
+    vargas::EncodedReads &reads() { return _reads; }
+
+  private:
+    vargas::ScoreProfile _prof;
+    std::map<size_t, std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>> _aligners; // Aligner length to aligner
+    vargas::Traceback _traceback;
+    vargas::EncodedReads _reads;
+    AlignStats _stats;
+    size_t _max_len, _bucket;
+    bool _msonly, _maxonly;
+    vargas::ISA _isa;
+    unsigned _groups, _threads;
+    int _device;
+};
+
+/**
+ * @brief
+ * Graphs, k-mer indices, and aligner pools kept resident across alignment jobs.
+ * @details
+ * Graph files are keyed by absolute path, so jobs from different working directories share them.
+ * Aligner pools are keyed by everything that sizes them, see align_main().
+ */
+class AlignCache {
+  public:
+    /**
+     * @param gdf Graph definition file
+     * @return Graph, loaded on first use
+     */
+    std::shared_ptr<vargas::GraphMan> graph(const std::string &gdf);
+
+    /**
+     * @param gdf Graph definition file
+     * @return K-mer index of the graph, loaded on first use
+     * @throws std::invalid_argument if the graph has no index
+     */
+    std::shared_ptr<vargas::KmerIndex> index(const std::string &gdf);
+
+    /**
+     * @param key Aligner parameters
+     * @return Pools for the parameters, empty on first use. At most max_pools sets are kept.
+     */
+    std::vector<AlignerPool> &aligners(const std::string &key);
+
+    /**
+     * @return Number of loaded graphs
+     */
+    size_t num_graphs() const { return _graphs.size(); }
+
+    static constexpr size_t max_pools = 16;
+
+  private:
+    std::map<std::string, std::shared_ptr<vargas::GraphMan>> _graphs;
+    std::map<std::string, std::shared_ptr<vargas::KmerIndex>> _indices;
+    std::map<std::string, std::vector<AlignerPool>> _pools;
+
+    static std::string _absolute(const std::string &path);
+};
+
+/**
+ * @brief
+ * Populate the alignment fields of each record from its results.
+ * @param gm GraphMan hosting target graphs
+ * @param label target subgraph
+ * @param records aligned reads, updated in place
+ * @param aligns Results of the records
+ * @param traceback CIGAR recovery for linear targets
+ * @param stats Traceback count and time are added
  */
-int align_main(int argc, char *argv[]);
+void tag_records(vargas::GraphMan &gm, const std::string &label, std::vector<vargas::SAM::Record> &records,
+                 const vargas::Results &aligns, vargas::Traceback &traceback, AlignStats &stats,
+                 bool msonly, bool maxonly, bool notraceback, char phred_offset);
 
 /**
  * @brief
@@ -57,19 +362,152 @@ int align_main(int argc, char *argv[]);
  * @param gm GraphMan hosting target graphs
  * @param task_list Parallel execution tasks
  * @param output SAM
- * @param aligners
+ * @param aligners One pool per thread
+ * @param index K-mer index to prefilter with, or nullptr
  * @param fwdonly
  * @param primary
  * @param msonly
  * @param maxonly
  * @param notraceback
  * @param phred_offset
+ * @param progress Progress to update after each task, or nullptr
+ * @param replicas Per NUMA node graph copies, pinning the threads to their nodes, or nullptr
+ * @return Stats of all threads
  */
-void align(vargas::GraphMan &gm,
-           std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
-           vargas::osam &out,
-           const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
-           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset);
+AlignStats align(vargas::GraphMan &gm,
+                 std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                 vargas::osam &out,
+                 std::vector<AlignerPool> &aligners, const vargas::KmerIndex *index,
+                 bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                 ProgressMeter *progress = nullptr, vargas::GraphReplicas *replicas = nullptr);
+
+/**
+ * @brief
+ * Produces alignment tasks from a read source while holding a bounded number of reads.
+ * @details
+ * Reads are partitioned per target subgraph and length bucket into chunks of at most chunk_size reads,
+ * or a per target size, see set_graph_lengths(). A batch is released once ring_size chunks are full, or when the
+ * source is exhausted. Partially filled chunks carry over to the next batch, so memory use is bounded by
+ * ring_size + (targets * buckets) chunks.
+ */
+class TaskStream {
+  public:
+    typedef std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> batch_t;
+
+    /**
+     * @param source Loads the next record, returns false when exhausted
+     * @param reads_hdr Header of the reads, ungrouped read group is added if missing
+     * @param align_targets List of targets : RG:Subgraph
+     * @param chunk_size Limit task size to N alignments
+     * @param ring_size Number of full chunks per batch
+     * @param bucket Read length bucket width. Chunks only hold reads of one bucket. 0 to not bucket
+     */
+    TaskStream(std::function<bool(vargas::SAM::Record &)> source, vargas::SAM::Header &reads_hdr,
+               std::string align_targets, size_t chunk_size, size_t ring_size, size_t bucket = 0);
+
+    /**
+     * @brief
+     * Load the next batch of tasks.
+     * @param batch cleared and populated with tasks
+     * @return false if there are no more tasks
+     */
+    bool next(batch_t &batch);
+
+    /**
+     * @brief
+     * Longest read so far, or the length set if longer.
+     */
+    size_t max_read_len() const { return _read_len; }
+
+    /**
+     * @brief
+     * Set the expected max read length, used to size the aligners up front.
+     * Longer reads still stream, see AlignerPool::get().
+     * @param len read length
+     */
+    void set_max_read_len(size_t len) { _read_len = len; }
+
+    /**
+     * @return Total number of alignments produced so far.
+     */
+    size_t total() const { return _total; }
+
+    /**
+     * @return Number of tasks produced so far.
+     */
+    size_t num_tasks() const { return _num_tasks; }
+
+    /**
+     * @return Number of target subgraphs
+     */
+    size_t num_targets() const { return _targets.size(); }
+
+    /**
+     * @brief
+     * Size chunks by estimated cost instead of a fixed number of reads.
+     * @details
+     * Chunks for the largest target hold chunk_size reads, and chunks for smaller targets hold
+     * proportionally more so each costs about as much to align. Chunk sizes are rounded up to a multiple of grain.
+     * @param graph_len Number of bases in a target subgraph
+     * @param grain Reads aligned per pass of an aligner
+     */
+    void set_graph_lengths(const std::function<size_t(const std::string &)> &graph_len, size_t grain);
+
+  private:
+    std::function<bool(vargas::SAM::Record &)> _source;
+    std::unordered_map<std::string, std::vector<size_t>> _rg_targets; // RG ID -> index in _targets
+    std::vector<std::string> _targets; // Target subgraph labels
+    std::map<std::pair<size_t, size_t>, std::vector<vargas::SAM::Record>> _open; // (target, bucket) -> partial chunk
+    std::vector<size_t> _chunk_limit; // Reads per chunk of each target, _chunk_size if empty
+    size_t _chunk_size, _ring_size, _bucket, _read_len = 0, _total = 0, _num_tasks = 0;
+    bool _done = false;
+};
+
+/**
+ * @brief
+ * Align tasks to their graphs while streaming them from the read source.
+ * @details
+ * A three stage pipeline: loading tasks, aligning a batch across the aligners, and writing.
+ * At most three batches are in memory at a time.
+ * @param gm GraphMan hosting target graphs
+ * @param tasks Task producer. The first batch may have been consumed to determine the read length
+ * @param first First batch of tasks
+ * @param output SAM
+ * @param aligners One pool per thread
+ * @param index K-mer index to prefilter with, or nullptr
+ * @param progress Progress to update after each task, or nullptr
+ * @param replicas Per NUMA node graph copies, pinning the threads to their nodes, or nullptr
+ * @return Stats of all threads, and the load and write stages of the pipeline
+ */
+AlignStats align_stream(vargas::GraphMan &gm,
+                        TaskStream &tasks,
+                        TaskStream::batch_t &first,
+                        vargas::osam &out,
+                        std::vector<AlignerPool> &aligners, const vargas::KmerIndex *index,
+                        bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                        ProgressMeter *progress = nullptr, vargas::GraphReplicas *replicas = nullptr);
+
+/**
+ * @brief
+ * Map target subgraph labels to the read groups aligned to them.
+ * @param reads_hdr Read SAM header
+ * @param align_targets List of targets : RG:Subgraph, or a single subgraph
+ * @param rgids Read groups to target when no explicit RG mapping is given
+ * @return Map of subgraph label to read group ID's
+ * @throws std::invalid_argument on a malformed target list
+ */
+std::unordered_map<std::string, std::vector<std::string>>
+map_targets(const vargas::SAM::Header &reads_hdr, std::string align_targets, const std::vector<std::string> &rgids);
+
+/**
+ * @brief
+ * Merge the targets of read groups aligned to several subgraphs.
+ * @param targets Map of subgraph label to read group ID's, see map_targets()
+ * @return Map of target to read group ID's, where a read group aligned to several subgraphs has a single
+ * target of their sorted labels joined by ','
+ */
+std::unordered_map<std::string, std::vector<std::string>>
+join_targets(const std::unordered_map<std::string, std::vector<std::string>> &targets);
 
 /**
  * @brief
@@ -77,45 +515,172 @@ void align(vargas::GraphMan &gm,
  * @param reads input read SAM stream
  * @param align_targets List of targets : RG:Subgraph
  * @param read_len Max readlen encountered
- * @param chunk_size Limit task size to N alignments
+ * @param chunk_size Limit task size to N alignments, 0 for one task per target and bucket
+ * @param bucket Read length bucket width. Tasks only hold reads of one bucket. 0 to not bucket
+ * @param multi Make one task for all the subgraphs of a read group, see join_targets()
+ * @param shard Only keep the reads of a read shard. Records of a graph shard are tagged with their input order.
+ * nullptr for all reads.
  * @return List of jobs of the form <subgraph label, [reads]>
  */
 std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>>
-create_tasks(vargas::isam &reads, std::string &align_targets, int chunk_size, size_t &read_len);
+create_tasks(vargas::isam &reads, std::string &align_targets, int chunk_size, size_t &read_len, size_t bucket = 0,
+             bool multi = false, const Shard *shard = nullptr);
+
+/**
+ * @brief
+ * Split tasks so that each costs about the same to align, and order them largest first.
+ * @details
+ * Cost is estimated as read bases times graph bases of the target. Tasks are split into pieces of a
+ * multiple of grain reads, targeting tasks_per_thread tasks per thread in total. Threads that run out of
+ * tasks take the next remaining one, so ordering largest first leaves the small tasks to fill the tail.
+ * @param task_list Tasks, replaced with the split tasks
+ * @param graph_len Number of bases in a target subgraph
+ * @param threads Number of aligner threads
+ * @param grain Reads aligned per pass of an aligner
+ * @param tasks_per_thread Target number of tasks per thread
+ * @param largest_first Order by cost. Otherwise the pieces of each task replace it in place, keeping task_list order.
+ */
+void balance_tasks(std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                   const std::function<size_t(const std::string &)> &graph_len,
+                   size_t threads, size_t grain, size_t tasks_per_thread = 8, bool largest_first = true);
 
 /**
  * @brief
  * Create a new aligner with given parameters
  * @param prof Score profile
- * @param node_len Maximum node length of graph
  * @param read_len Read length
  * @param use_wide use 16 bit cell elements instead of 8 bit
- * @param end_to_end End to end alignment
+ * @param msonly Only report max score
+ * @param maxonly Only report max score, position, and count
+ * @param isa Kernel instruction set
  * @return pointer to new aligner
+ * @throws std::invalid_argument if the kernel was not built or the host does not support it
  */
-std::unique_ptr<vargas::AlignerBase, rg::Deleter>
-make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly);
+std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>
+make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly,
+             vargas::ISA isa);
+
+/**
+ * @brief
+ * Widest instruction set supported by both the CPU and the OS, via cpuid and xgetbv.
+ * @return Instruction set
+ */
+vargas::ISA host_isa();
+
+/**
+ * @return Widest instruction set supported by the host that the kernel was built for.
+ */
+vargas::ISA best_isa();
+
+/**
+ * @param isa Instruction set
+ * @return true if the kernel was built for isa
+ */
+bool isa_built(vargas::ISA isa);
+
+/**
+ * @brief
+ * Parse an instruction set name, one of sse4.1, avx2, avx512bw.
+ * @param name
+ * @return Instruction set
+ * @throws std::invalid_argument on an unknown name
+ */
+vargas::ISA parse_isa(const std::string &name);
+
+/**
+ * @param isa Instruction set
+ * @return Instruction set name as accepted by parse_isa()
+ */
+std::string isa_name(vargas::ISA isa);
+
+/**
+ * @param isa Instruction set
+ * @param use_wide 16 bit aligner
+ * @return Reads per SIMD vector
+ */
+unsigned isa_read_capacity(vargas::ISA isa, bool use_wide);
+
+/**
+ * @brief
+ * Reads FASTA or FASTQ records one at a time from plain, gzip, or BGZF compressed files.
+ * @details
+ * Files are read through htslib BGZF, so only the current line is held and compression is detected
+ * from the contents. Each record is a name line and a single sequence line, plus both quality lines
+ * for FASTQ.
+ */
+class FastReader {
+  public:
+    /**
+     * @param file File name, empty for stdin
+     * @param fastq Records are FASTQ, otherwise FASTA
+     * @param p64 Qualities are Phred+64, converted to Phred+33
+     * @param threads Decompression threads for BGZF files
+     * @throws std::invalid_argument if the file cannot be opened
+     */
+    FastReader(const std::string &file, bool fastq, bool p64 = false, int threads = 0);
+
+    ~FastReader();
+
+    FastReader(const FastReader &) = delete;
+    FastReader &operator=(const FastReader &) = delete;
+
+    /**
+     * @brief
+     * Read the next record.
+     * @param rec Populated record
+     * @return false if there are no more records
+     * @throws std::runtime_error on a truncated record or read error
+     */
+    bool next(vargas::SAM::Record &rec);
+
+    /**
+     * @brief
+     * Read the next line, without the newline.
+     * @param line populated line
+     * @return false at the end of the file
+     * @throws std::runtime_error on a read error
+     */
+    bool getline(std::string &line);
+
+  private:
+    BGZF *_fp = nullptr;
+    kstring_t _line = {0, 0, nullptr};
+    bool _fastq, _p64;
+
+    bool _getline();
+};
 
 /**
  * @brief
  * Load a FASTA or FASTQ file into a SAM structure
- * @param file FAST file name
+ * @param file FAST file name, optionally compressed
  * @param fastq
  * @param ret
  * @param p64 Phred+64 encoding
+ * @param threads Decompression threads, see FastReader
  */
-void load_fast(std::string &file, bool fastq, vargas::isam &ret, bool p64=false);
+void load_fast(std::string &file, bool fastq, vargas::isam &ret, bool p64=false, int threads=0);
 
 /**
  * Read file format type.
  */
+/**
+ * @brief
+ * Add a header sequence for each contig of the graph that is not already in the header.
+ * @details
+ * BAM and CRAM store reference names as indices of the header sequences.
+ * @param hdr SAM header
+ * @param gm Graphs the records are aligned to, or simulated from
+ */
+void add_contigs(vargas::SAM::Header &hdr, vargas::GraphMan &gm);
+
 enum class ReadFmt {SAM, FASTQ, FASTA};
 
 /**
  * @brief
  * Identity read file type
  * @param filename
- * @return SAM, FASTA, or FASTQ
+ * @return SAM, FASTA, or FASTQ. BAM and CRAM files, by extension, are SAM. FASTA and FASTQ may be compressed.
  */
 ReadFmt read_fmt(const std::string& filename);
 
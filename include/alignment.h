@@ -28,6 +28,7 @@
 #include "graph.h"
 #include "doctest.h"
 #include "simd.h"
+#include "threadpool.h"
 
 #include <vector>
 #include <algorithm>
@@ -35,6 +36,8 @@
 #include <cstdlib>
 #include <string>
 #include <stdexcept>
+#include <cstring>
+#include <memory>
 
 #define VARGAS_ALIGN_DEBUG_SW 0 // Print SW Grids for each node
 #define VARGAS_ALIGN_DEBUG_QP 0  // Print Query profile
@@ -42,6 +45,25 @@
 
 namespace vargas {
 
+  /**
+   * @brief
+   * Work counters of an aligner. Each aligner only updates its own, so they are not atomic.
+   */
+  struct AlignerStats {
+      uint64_t cells = 0; /**< Score matrix cells filled, counting every lane of a vector */
+      uint64_t groups = 0; /**< Read groups filled over a graph, once per strand */
+      uint64_t slow_path = 0; /**< Cells that took a max or 2nd-max branch of _fill_cell_finish */
+      uint64_t seed_slots = 0; /**< Widest seed arena, see AlignerT::seed_slots() */
+
+      AlignerStats &merge(const AlignerStats &o) {
+          cells += o.cells;
+          groups += o.groups;
+          slow_path += o.slow_path;
+          seed_slots = std::max(seed_slots, o.seed_slots);
+          return *this;
+      }
+  };
+
   /**
    * @brief
    * Common base class to all template versions of Aligners
@@ -68,9 +90,53 @@ namespace vargas {
        * @param aligns Results packet to populate
        * @param fwdonly Only align to forward strand
        */
-      virtual void align_into(const std::vector<std::string> &,
-                              const std::vector<std::vector<char>> &,
-                              Graph::const_iterator, Graph::const_iterator, Results &, bool) = 0;
+      virtual void align_into(const std::vector<std::string> &read_group,
+                              const std::vector<std::vector<char>> &quals,
+                              Graph::const_iterator begin, Graph::const_iterator end, Results &aligns, bool fwdonly) {
+          align_into(read_group, quals, CompiledGraph(begin, end), aligns, fwdonly);
+      }
+
+      /**
+       * @brief
+       * Align a batch of reads to a compiled graph. Prefer this when aligning many batches to the same graph.
+       * @param read_group vector of reads to align to
+       * @param quals Quality values
+       * @param graph compiled graph
+       * @param aligns Results packet to populate
+       * @param fwdonly Only align to forward strand
+       */
+      virtual void align_into(const std::vector<std::string> &read_group,
+                              const std::vector<std::vector<char>> &quals,
+                              const CompiledGraph &graph, Results &aligns, bool fwdonly) {
+          _encoded.clear();
+          for (size_t i = 0; i < read_group.size(); ++i) {
+              if (quals.empty()) _encoded.push_back(read_group[i], std::vector<char>());
+              else _encoded.push_back(read_group[i], quals[i]);
+          }
+          align_into(_encoded, graph, aligns, fwdonly);
+      }
+
+      /**
+       * @brief
+       * Align a batch of encoded reads to a compiled graph.
+       * @param reads reads to align
+       * @param graph compiled graph
+       * @param aligns Results packet to populate
+       * @param fwdonly Only align to forward strand
+       */
+      virtual void align_into(const EncodedReads &reads, const CompiledGraph &graph, Results &aligns,
+                              bool fwdonly) = 0;
+
+      /**
+       * @brief
+       * Align a batch of encoded reads to every graph of a set.
+       * @param reads reads to align
+       * @param set graphs sharing the nodes of a base graph
+       * @param aligns Results packet of each graph in the set
+       * @param fwdonly Only align to forward strand
+       */
+      virtual void align_into(const EncodedReads &reads, const CompiledGraphSet &set, std::vector<Results> &aligns,
+                              bool fwdonly) = 0;
 
       /**
        * @brief
@@ -88,8 +154,57 @@ namespace vargas {
           return aligns;
       }
 
+      /**
+       * @brief
+       * Align a batch of reads to a compiled graph.
+       * @param read_group vector of reads to align to
+       * @param graph compiled graph
+       * @return Results packet
+       */
+      virtual Results align(const std::vector<std::string> &read_group, const CompiledGraph &graph,
+                            bool fwdonly=true) {
+          Results aligns;
+          align_into(read_group, {}, graph, aligns, fwdonly);
+          return aligns;
+      }
+
+      /**
+       * @brief
+       * Set the number of read groups advanced together through each node of the graph.
+       * @param k groups per graph pass
+       */
+      virtual void set_groups_per_pass(unsigned k) = 0;
+
+      /**
+       * @return Read groups advanced together through each node of the graph.
+       */
+      virtual unsigned groups_per_pass() const = 0;
+
+      /**
+       * @brief
+       * Set the number of threads that align segments of one graph in parallel.
+       * @param t threads per alignment
+       */
+      virtual void set_threads(unsigned t) = 0;
+
+      /**
+       * @return Number of reads aligned per SIMD vector.
+       */
+      virtual unsigned capacity() const = 0;
+
+      /**
+       * @return Number of reads realigned with a wider score after saturating, see AdaptiveAlignerT.
+       */
+      virtual size_t realigned() const { return 0; }
+
+      /**
+       * @return Work counters accumulated since construction.
+       */
+      virtual AlignerStats stats() const = 0;
+
     protected:
       ScoreProfile _prof;
+      EncodedReads _encoded; // Reads of the string interface
 
       /**
        * @brief
@@ -106,6 +221,22 @@ namespace vargas {
   };
   inline AlignerBase::~AlignerBase() = default;
 
+  /**
+   * @brief
+   * Deleter of aligners allocated with posix_memalign. Aligners own buffers and device streams,
+   * so are destroyed before being freed.
+   */
+  struct AlignerDeleter {
+      void operator()(AlignerBase *p) const {
+          if (!p) return;
+          p->~AlignerBase();
+          std::free(p);
+      }
+  };
+
+  VA_SIMD_TARGET_BEGIN
+  namespace VA_SIMD_NAMESPACE {
+
   /**
    * @brief Main SIMD SW Aligner.
    * @details
@@ -149,6 +280,7 @@ namespace vargas {
     public:
 
       using native_t = typename simd_t::native_t;
+      using lanes_t = Lanes32<native_t, simd_t::length>; // Positions and counts, one per read
       /**
        * @brief
        * Query profile type
@@ -161,8 +293,9 @@ namespace vargas {
       using qp_t = std::vector<std::array<simd_t, 5>, aligned_allocator<std::array<simd_t, 5>, simd_t::size>>;
 
       AlignerT(unsigned read_len, const ScoreProfile &prof) :
-      _alignment_group(read_len),
+      _groups(1, AlignmentGroup(read_len)), _state(1),
       _S(read_len + 1), _Dc(read_len + 1), _Ic(read_len + 1),
+      _scratch(1, _seed<simd_t>(read_len)),
       _read_len(read_len) {
           set_scores(prof); // May throw
       }
@@ -200,26 +333,17 @@ namespace vargas {
           AlignmentGroup() = delete;
 
           /**
-           * @param batch load the given vector of reads.
-           */
-          void load_reads(const std::vector<std::string> &batch,
-                          const std::vector<std::vector<char>> &quals,
-                          const ScoreProfile &prof,
-                          size_t begin, size_t end,
-                          bool revcomp) {
-              std::vector<std::vector<rg::Base>> _reads;
-              for (auto &b : batch) _reads.push_back(rg::seq_to_num(b));
-              _package_reads(_reads, quals, prof, revcomp, begin, end);
-          }
-
-          /**
-           * @param batch load the given vector of reads.
+           * @brief
+           * Build the query profile of reads [begin, end) of batch, in place.
+           * @param batch encoded reads
+           * @param prof ScoreProfile
+           * @param begin first read
+           * @param end one past the last read, at most begin + group_size()
+           * @param revcomp Use reverse complement
            */
-          void load_reads(const std::vector<std::vector<rg::Base>> &batch,
-                          const std::vector<std::vector<char>> &quals,
-                          const ScoreProfile &prof,
+          void load_reads(const EncodedReads &batch, const ScoreProfile &prof, size_t begin, size_t end,
                           bool revcomp) {
-              _package_reads(batch, quals, prof, revcomp, 0, batch.size());
+              _package_reads(batch, prof, revcomp, begin, end);
           }
 
           typename qp_t::value_type &at(const unsigned i) const {
@@ -266,14 +390,11 @@ namespace vargas {
           /**
            * Interleaves reads so all same-index base positions are in one
            * vector. Empty spaces are padded with Base::N.
-           * @param reads vector of reads to package
-           * @param quals Quality values for reads, Phred
+           * @param reads encoded reads to package, with Phred qualities
            * @param prof ScoreProfile
            * @param revcomp Use reverse complement
            */
-          void _package_reads(const std::vector<std::vector<rg::Base>> &reads,
-                              const std::vector<std::vector<char>> &quals,
-                              const ScoreProfile &prof,
+          void _package_reads(const EncodedReads &reads, const ScoreProfile &prof,
                               bool revcomp, const size_t vstart, const size_t vend) {
               assert(vend - vstart <= group_size());
               static constexpr std::array<rg::Base, 4> bases = {rg::Base::A, rg::Base::C, rg::Base::G, rg::Base::T};
@@ -284,25 +405,29 @@ namespace vargas {
 
               for (size_t r = vstart; r < vend; ++r) {
                   const unsigned qidx = r - vstart;
+                  const rg::Base *seq = reads.seq(r);
+                  const char *qual = reads.qual(r);
+                  const int len = reads.length(r);
 
                   // Prepend short reads with 0
-                  int pos = _rd_ln - reads[r].size();
+                  int pos = _rd_ln - len;
                   for (int i = 0; i < pos; ++i) {
-                      for (auto b : bases) _query_prof[i][b][r] = 0;
+                      for (auto b : bases) _query_prof[i][b][qidx] = 0;
+                      _query_prof[i][rg::Base::N][qidx] = 0;
                   }
 
-                  const int start = revcomp ? reads[r].size() - 1 : 0;
-                  const int end = revcomp ? -1 : reads[r].size();
+                  const int start = revcomp ? len - 1 : 0;
+                  const int end = revcomp ? -1 : len;
 
                   // Store in index pos, run through bases from idx start --> end based on revcomp
                   for (int p = start; p != end; p += inc) {
-                      const auto rdb = revcomp ? rg::complement_b(reads[r][p]) : reads[r][p];
+                      const auto rdb = revcomp ? rg::complement_b(seq[p]) : seq[p];
+                      const int mismatch = qual ? prof.penalty(qual[p]) : prof.mismatch_max;
                       _query_prof[pos][rg::Base::N][qidx] = -prof.ambig;
                       for (auto b : bases) {
                           if (rdb == rg::Base::N) _query_prof[pos][b][qidx] = -prof.ambig;
                           else if (rdb == b) _query_prof[pos][b][qidx] = prof.match;
-                          else if (quals.empty() || quals[r].empty()) _query_prof[pos][b][qidx] = -prof.mismatch_max;
-                          else _query_prof[pos][b][qidx] = -prof.penalty(quals[r][p]);
+                          else _query_prof[pos][b][qidx] = -mismatch;
                       }
                       ++pos;
                   }
@@ -312,18 +437,17 @@ namespace vargas {
               // Print query profile
               std::cerr << "\nQuery Profile (" << VARGAS_ALIGN_DEBUG_N << "), Reverse: " << revcomp
                         << ". MP=Mismatch, P=Phred." << std::endl;
-              for (unsigned i = 0; i < _rd_ln - reads[vstart + VARGAS_ALIGN_DEBUG_N].size(); ++i) std::cerr << "\t-";
-              for (auto b : reads[vstart + VARGAS_ALIGN_DEBUG_N]) std::cerr << "\t" << rg::num_to_base(b);
+              const size_t dbg = vstart + VARGAS_ALIGN_DEBUG_N, dbg_len = reads.length(dbg);
+              for (unsigned i = 0; i < _rd_ln - dbg_len; ++i) std::cerr << "\t-";
+              for (size_t i = 0; i < dbg_len; ++i) std::cerr << "\t" << rg::num_to_base(reads.seq(dbg)[i]);
 
-              if (quals.size()) {
+              if (reads.qual(dbg)) {
                   std::cerr << std::endl << "P";
-                  for (unsigned i = 0; i < _rd_ln - reads[vstart + VARGAS_ALIGN_DEBUG_N].size(); ++i)
-                      std::cerr << "\t-";
-                  for (auto b : quals[vstart + VARGAS_ALIGN_DEBUG_N]) std::cerr << "\t" << (int) b;
+                  for (unsigned i = 0; i < _rd_ln - dbg_len; ++i) std::cerr << "\t-";
+                  for (size_t i = 0; i < dbg_len; ++i) std::cerr << "\t" << (int) reads.qual(dbg)[i];
                   std::cerr << std::endl << "MP";
-                  for (unsigned i = 0; i < _rd_ln - reads[vstart + VARGAS_ALIGN_DEBUG_N].size(); ++i)
-                      std::cerr << "\t-";
-                  for (auto b : quals[vstart + VARGAS_ALIGN_DEBUG_N]) std::cerr << "\t" << int(prof.penalty(b));
+                  for (unsigned i = 0; i < _rd_ln - dbg_len; ++i) std::cerr << "\t-";
+                  for (size_t i = 0; i < dbg_len; ++i) std::cerr << "\t" << int(prof.penalty(reads.qual(dbg)[i]));
               }
 
               std::cerr << std::endl << "A\t";
@@ -374,134 +498,615 @@ namespace vargas {
        */
       static constexpr unsigned read_capacity() { return simd_t::length; }
 
-      void align_into(const std::vector<std::string> &read_group,
-                      const std::vector<std::vector<char>> &quals,
-                      Graph::const_iterator begin, Graph::const_iterator end,
-                      Results &aligns, bool fwdonly=true) override {
+      /**
+       * @return Number of seed slots allocated, the widest graph frontier seen so far.
+       */
+      size_t seed_slots() const { return _seeds.size() / _groups_per_pass; }
+
+      AlignerStats stats() const override {
+          AlignerStats ret = _stats;
+          ret.seed_slots = seed_slots();
+          for (const auto &w : _workers) ret.merge(w->stats());
+          return ret;
+      }
+
+      using AlignerBase::align_into;
+
+      void align_into(const EncodedReads &reads, const CompiledGraph &graph, Results &aligns,
+                      bool fwdonly) override {
+          if ((MSONLY || MAXONLY) && _threads > 1 && _align_segments(reads, graph, aligns, fwdonly)) return;
+          _align_graph(reads, graph, aligns, fwdonly);
+      }
+
+      /**
+       * @brief
+       * Align to every graph of the set in one pass over the base graph.
+       * @details
+       * In max score modes (MSONLY or MAXONLY), graphs entering a node with the same columns share its fill,
+       * see _fill_set(). Results match aligning to each graph on its own. The 2nd-max bookkeeping depends on
+       * every cell of a graph, so other modes align to each graph in turn.
+       */
+      void align_into(const EncodedReads &reads, const CompiledGraphSet &set, std::vector<Results> &aligns,
+                      bool fwdonly) override {
+          aligns.resize(set.size());
+          if (reads.empty()) {
+              for (auto &r : aligns) {
+                  r.resize(0);
+                  r.profile = _prof;
+              }
+              return;
+          }
+          if (!MSONLY && !MAXONLY) {
+              for (size_t t = 0; t < set.size(); ++t) align_into(reads, set.graph(t), aligns[t], fwdonly);
+              return;
+          }
+          _align_set(reads, set, aligns, fwdonly);
+      }
+
+      /**
+       * @brief
+       * Set the number of read groups (read_capacity() reads each) advanced together through each node.
+       * @details
+       * Each node's sequence and edges are loaded once per block of groups instead of once per group, at the
+       * cost of k seeds per live node. Results do not depend on k.
+       * @param k groups per graph pass, at least 1
+       * @throws std::invalid_argument if k is 0
+       */
+      void set_groups_per_pass(unsigned k) override {
+          if (k == 0) throw std::invalid_argument("At least one read group per graph pass is required.");
+          if (k == _groups_per_pass) return;
+          _groups_per_pass = k;
+          _seeds.clear();
+          _scratch.assign(k, _seed<simd_t>(_read_len));
+          _state.resize(k);
+          while (_groups.size() < k) _groups.emplace_back(_read_len);
+          for (auto &w : _workers) w->set_groups_per_pass(k);
+      }
+
+      unsigned groups_per_pass() const override { return _groups_per_pass; }
+
+      /**
+       * @brief
+       * Align segments of each graph with up to t threads.
+       * @details
+       * Only max score modes (MSONLY or MAXONLY) are split, since the 2nd-max bookkeeping of one segment
+       * depends on the max of the ones before it. Segments start at cut nodes of the graph, and start
+       * filling early enough that their scores match those of a single pass, see _align_segments().
+       * Results do not depend on t.
+       * @param t threads per alignment, at least 1
+       * @throws std::invalid_argument if t is 0
+       */
+      void set_threads(unsigned t) override {
+          if (t == 0) throw std::invalid_argument("At least one thread is required.");
+          if (t != _threads) _pool.reset();
+          _threads = t;
+      }
+
+      unsigned capacity() const override { return read_capacity(); }
+
+      /**
+       * @brief
+       * Highest score the cell width can hold. A max score equal to this may have saturated.
+       * @return score limit
+       */
+      int saturation_score() const { return std::numeric_limits<native_t>::max() - _bias; }
+
+    private:
+
+      /**
+       * @brief
+       * Align to the whole graph in one pass.
+       */
+      void _align_graph(const EncodedReads &read_group, const CompiledGraph &graph, Results &aligns, bool fwdonly) {
 
           const unsigned num_groups = 1 + ((read_group.size() - 1) / read_capacity());
           // Possible oversize if there is a partial group
           aligns.resize(num_groups * read_capacity());
 
-          // Keep the scores at the positions, overwrites position. [0] is current position, 1-:ead_capacity + 1 is pos
-          std::unordered_map<unsigned, _seed<simd_t>> seed_map; // Maps node ID to the ending matrix cols of the node
-          _seed <simd_t> seed(_read_len);
-
           if (fwdonly){
               std::fill(aligns.max_strand.begin(), aligns.max_strand.end(), Strand::FWD);
               std::fill(aligns.sub_strand.begin(), aligns.sub_strand.end(), Strand::FWD);
           }
 
-          for (unsigned group = 0; group < num_groups; ++group) {
-              seed_map.clear();
+          // Groups are aligned in blocks that share each pass over the graph
+          for (unsigned block = 0; block < num_groups; block += _groups_per_pass) {
+              const unsigned block_len = std::min(_groups_per_pass, num_groups - block);
 
-              // Subset of read set
-              const unsigned beg_offset = group * read_capacity();
-              const unsigned end_offset = std::min<unsigned>((group + 1) * read_capacity(), read_group.size());
-              const unsigned len = end_offset - beg_offset;
-              assert(len <= read_capacity());
+              for (unsigned k = 0; k < block_len; ++k) {
+                  auto &st = _state[k];
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
 
-              _max_score = std::numeric_limits<native_t>::min();
+                  st.max_score = std::numeric_limits<native_t>::min();
+                  st.pos.clear();
 
-              if (!MSONLY) {
-                  _max_pos = aligns.max_pos.data() + beg_offset;
-                  _max_last_pos = aligns.max_last_pos.data() + beg_offset;
-                  _max_count = aligns.max_count.data() + beg_offset;
+                  if (!MAXONLY) {
+                      st.sub_score = std::numeric_limits<native_t>::min();
+                      st.waiting_score = std::numeric_limits<native_t>::min();
+                  }
+
+                  // Forward
+                  _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, false);
               }
 
-              if (!MAXONLY) {
-                  _sub_score = std::numeric_limits<native_t>::min();
-                  _sub_pos = aligns.sub_pos.data() + beg_offset;
-                  _sub_last_pos = aligns.sub_last_pos.data() + beg_offset;
-                  _sub_count = aligns.sub_count.data() + beg_offset;
-                  _waiting_score = std::numeric_limits<native_t>::min();
-                  _waiting_pos = aligns.waiting_pos.data() + beg_offset;
-                  _waiting_last_pos = aligns.waiting_last_pos.data() + beg_offset;
+              _fill_graph(graph, block_len);
+              for (unsigned k = 0; k < block_len; ++k) {
+                  _swap_in(k);
+                  _commit_waiting();
+                  _swap_out(k);
               }
 
-              #ifdef VA_SIMD_USE_AVX512
-              MaskType _tmp0;
-              #else
-              simd_t _tmp0;
-              #endif
+              // Reverse
+              if (!fwdonly) {
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      auto &st = _state[k];
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                      _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, true);
+                      //reset "right-most non-adjacent occurrence of score value" to zero
+                      st.pos.max_last_pos = lanes_t(0);
+                      st.pos.sub_last_pos = lanes_t(0);
+                      //remember the scores on forward strand so we can tell if it increased and assign REV strand
+                      st.fwd_max = st.max_score;
+                      st.fwd_sub = st.sub_score;
+                  }
 
-              // Forward
-              _alignment_group.load_reads(read_group, quals, _prof, beg_offset, end_offset, false);
-              for (auto gi = begin; gi != end; ++gi) {
-                  _get_seed(gi.incoming(), seed_map, seed);
-                  if (gi->is_pinched()) seed_map.clear();
-                  _fill_node(*gi, _alignment_group.query_profile(), seed, seed_map.emplace(gi->id(), _read_len).first->second);
+                  _fill_graph(graph, block_len);
+
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      _swap_in(k);
+                      _commit_waiting();
+                      _swap_out(k);
+
+                      // Assign strands
+                      // if both strands have an occurrence of max or submax score, position will be wrt a fwd occurrence
+                      auto &st = _state[k];
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned len = std::min<unsigned>(read_capacity(), read_group.size() - beg_offset);
+                      for(size_t i = 0; i < len; ++i) {
+                          aligns.max_strand[beg_offset + i] = st.max_score[i] > st.fwd_max[i] ? Strand::REV : Strand::FWD;
+                          aligns.sub_strand[beg_offset + i] = st.sub_score[i] > st.fwd_sub[i] ? Strand::REV : Strand::FWD;
+                      }
+                  }
               }
 
-              _tmp0 = _waiting_score > _sub_score;
-              if (_tmp0) {
-                  // commit the waiting 2nd max score if we've got one and reached the end of the genome without
-                  // seeing a new _max_last_pos
-                  for (unsigned i = 0; i < read_capacity(); ++i) {
-                      if (_tmp0[i] && _max_last_pos[i] < _waiting_pos[i]) {
-                          _sub_score[i] = _waiting_score[i];
-                          _sub_count[i] = 1;
-                          _sub_pos[i] = _waiting_pos[i];
-                          _sub_last_pos[i] = _waiting_last_pos[i];
+              // Copy scores, positions and counts
+              for (unsigned k = 0; k < block_len; ++k) {
+                  auto &st = _state[k];
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned len = std::min<unsigned>(read_capacity(), read_group.size() - beg_offset);
+                  st.pos.store(aligns, beg_offset);
+                  for (unsigned i = 0; i < len; ++i) {
+                      aligns.max_score[beg_offset + i] = st.max_score[i] - _bias;
+                      if (!MSONLY && !MAXONLY) {
+                          aligns.sub_score[beg_offset + i] = st.sub_score[i] - _bias;
                       }
                   }
               }
 
-              // Reverse
-              if (!fwdonly) {
-                  seed_map.clear();
-                  _alignment_group.load_reads(read_group, quals, _prof, beg_offset, end_offset, true);
-                  //reset "right-most non-adjacent occurrence of score value" to zero
-                  if (!MSONLY) for (unsigned i = 0; i < read_capacity(); ++i) { _max_last_pos[i] = 0;}
-                  if (!MAXONLY) for (unsigned i = 0; i < read_capacity(); ++i) { _sub_last_pos[i] = 0;}
-                  //remember the scores on forward strand so we can tell if it increased and assign REV strand
-                  simd_t fwdmax = _max_score;
-                  simd_t fwdsub = _sub_score;
-
-                  for (auto gi = begin; gi != end; ++gi) {
-                      _get_seed(gi.incoming(), seed_map, seed);
-                      if (gi->is_pinched()) seed_map.clear();
-                      _fill_node(*gi, _alignment_group.query_profile(), seed, seed_map.emplace(gi->id(), _read_len).first->second);
+          }
+          // Crop off potential buffer
+          aligns.resize(read_group.size());
+          aligns.profile = _prof;
+
+      }
+
+      /**
+       * @brief
+       * Align segments of the graph in parallel and merge their max scores.
+       * @details
+       * A cell's score can only differ between two fills that start at different columns through a chain of
+       * cells that differ, back to where they started. Such a chain crossing more columns than
+       * _read_len + (score range + _read_len * match) / read_gext loses more to gaps than any score can
+       * hold, so segments that start filling that far back report the same scores, at the same positions,
+       * as a single pass. Merging them in graph order then reproduces the single pass exactly:
+       * a later segment with a higher max replaces the result, and one with an equal max adds its count,
+       * less the first occurrence if it is within a read length of the last one.
+       * Reads that never rise above the lowest score are aligned again in a single pass, since their
+       * count depends on cells that match the initial max.
+       * @return false if the graph does not split into at least two segments
+       */
+      bool _align_segments(const EncodedReads &read_group, const CompiledGraph &graph, Results &aligns,
+                           bool fwdonly) {
+          if (_prof.read_gext == 0 || read_group.empty()) return false;
+          const size_t range = size_t(std::numeric_limits<native_t>::max()) - std::numeric_limits<native_t>::min();
+          const size_t overlap = _read_len + (range + _read_len * _prof.match) / _prof.read_gext + 1;
+          const auto segs = graph.segments(overlap, std::max(4 * overlap, graph.length() / (4 * _threads)));
+          if (segs.size() < 2) return false;
+
+          // Workers and their aligners are kept for later calls
+          while (_workers.size() + 1 < _threads) {
+              void *ptr;
+              if (posix_memalign(&ptr, 64, sizeof(AlignerT))) throw std::bad_alloc();
+              _workers.emplace_back(new(ptr) AlignerT(_read_len, _prof));
+          }
+          for (auto &w : _workers) w->set_groups_per_pass(_groups_per_pass);
+          if (!_pool) _pool.reset(new rg::ForPool(_threads));
+
+          // Each job is a segment of one strand, worker tid fills with this aligner (0) or _workers[tid - 1]
+          const size_t strands = fwdonly ? 1 : 2, jobs = segs.size() * strands;
+          _segment_res.resize(jobs);
+          auto work = [&](long j, int tid) {
+              AlignerT *a = tid == 0 ? this : _workers[tid - 1].get();
+              a->_fill_segment(read_group, graph, segs[j % segs.size()], size_t(j) >= segs.size(), _segment_res[j]);
+          };
+          _pool->forpool(&_segment_job<decltype(work)>, &work, jobs);
+
+          const int floor = std::numeric_limits<native_t>::min();
+          aligns.resize(read_group.size());
+          _redo.clear();
+          for (size_t i = 0; i < read_group.size(); ++i) {
+              int score = floor, fwd = floor;
+              pos_t pos = 0, last = 0;
+              unsigned count = 0;
+              for (size_t s = 0; s < strands; ++s) {
+                  if (s == 1) {
+                      fwd = score;
+                      last = 0; // As in _align_graph, the position of the last max is reset for the reverse strand
                   }
-                  _tmp0 = _waiting_score > _sub_score;
-                  if (_tmp0) {
-                      // commit the waiting 2nd max score if we've got one and reached the end of the genome without
-                      // seeing a new _max_last_pos
-                      for (unsigned i = 0; i < read_capacity(); ++i) {
-                          if (_tmp0[i] && _max_last_pos[i] < _waiting_pos[i]) {
-                              _sub_score[i] = _waiting_score[i];
-                              _sub_count[i] = 1;
-                              _sub_pos[i] = _waiting_pos[i];
-                              _sub_last_pos[i] = _waiting_last_pos[i];
+                  for (size_t g = 0; g < segs.size(); ++g) {
+                      const Results &r = _segment_res[s * segs.size() + g];
+                      if (r.max_score[i] > score) {
+                          score = r.max_score[i];
+                          if (!MSONLY) {
+                              pos = r.max_pos[i];
+                              last = r.max_last_pos[i];
+                              count = r.max_count[i];
                           }
+                      } else if (!MSONLY && r.max_score[i] == score && score > floor) {
+                          count += r.max_count[i] - 1 + (r.max_pos[i] > last + _read_len);
+                          last = r.max_last_pos[i];
                       }
                   }
+              }
+              if (strands == 1) fwd = score;
+              if (!MSONLY && score == floor) _redo.push_back(i);
+              aligns.max_score[i] = score - _bias;
+              aligns.max_pos[i] = pos;
+              aligns.max_last_pos[i] = last;
+              aligns.max_count[i] = count;
+              aligns.max_strand[i] = score > fwd ? Strand::REV : Strand::FWD;
+              aligns.sub_strand[i] = Strand::FWD;
+          }
+
+          if (!_redo.empty()) {
+              _redo_reads.clear();
+              for (auto d : _redo) _redo_reads.push_back(read_group, d);
+              _align_graph(_redo_reads, graph, _redo_res, fwdonly);
+              for (size_t i = 0; i < _redo.size(); ++i) {
+                  const size_t d = _redo[i];
+                  aligns.max_score[d] = _redo_res.max_score[i];
+                  aligns.max_pos[d] = _redo_res.max_pos[i];
+                  aligns.max_last_pos[d] = _redo_res.max_last_pos[i];
+                  aligns.max_count[d] = _redo_res.max_count[i];
+                  aligns.max_strand[d] = _redo_res.max_strand[i];
+              }
+          }
+          aligns.profile = _prof;
+          return true;
+      }
+
+      /**
+       * @brief
+       * Fill one strand of a graph segment, reporting only cells from seg.begin on.
+       * @param res Max scores, unbiased, and the positions and counts of each read within the segment
+       */
+      void _fill_segment(const EncodedReads &read_group, const CompiledGraph &graph, const GraphSegment &seg,
+                         bool revcomp, Results &res) {
+          const unsigned num_groups = 1 + ((read_group.size() - 1) / read_capacity());
+          res.resize(num_groups * read_capacity());
+
+          for (unsigned block = 0; block < num_groups; block += _groups_per_pass) {
+              const unsigned block_len = std::min(_groups_per_pass, num_groups - block);
+              for (unsigned k = 0; k < block_len; ++k) {
+                  auto &st = _state[k];
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                  st.max_score = std::numeric_limits<native_t>::min();
+                  st.pos.clear();
+                  _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, revcomp);
+              }
+
+              _fill_graph(graph, block_len, seg.warm, seg.begin, seg.end);
+
+              for (unsigned k = 0; k < block_len; ++k) {
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  _state[k].pos.store(res, beg_offset);
+                  for (unsigned i = 0; i < read_capacity(); ++i) res.max_score[beg_offset + i] = _state[k].max_score[i];
+              }
+          }
+      }
+
+      /**
+       * @brief
+       * Align to every graph of a set in max score modes, see _fill_set().
+       * @details
+       * Reads that never rise above the lowest score in a graph are aligned to it again on their own, since
+       * their count depends on cells that match the initial max.
+       */
+      void _align_set(const EncodedReads &read_group, const CompiledGraphSet &set, std::vector<Results> &aligns,
+                      bool fwdonly) {
+          const unsigned num_groups = 1 + ((read_group.size() - 1) / read_capacity());
+          const unsigned stride = _groups_per_pass;
+          const size_t graphs = set.size();
+          _set_state.resize(graphs * stride);
+          for (auto &r : aligns) {
+              r.resize(num_groups * read_capacity());
+              std::fill(r.max_strand.begin(), r.max_strand.end(), Strand::FWD);
+              std::fill(r.sub_strand.begin(), r.sub_strand.end(), Strand::FWD);
+          }
 
-                  // Assign strands
-                  // if both strands have an occurrence of max or submax score, position will be wrt a fwd occurrence
-                  for(size_t i = 0; i < len; ++i) {
-                     aligns.max_strand[beg_offset + i] = _max_score[i] > fwdmax[i] ? Strand::REV : Strand::FWD;
-                     aligns.sub_strand[beg_offset + i] = _sub_score[i] > fwdsub[i] ? Strand::REV : Strand::FWD;
+          for (unsigned block = 0; block < num_groups; block += _groups_per_pass) {
+              const unsigned block_len = std::min(_groups_per_pass, num_groups - block);
+
+              for (unsigned k = 0; k < block_len; ++k) {
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                  for (size_t t = 0; t < graphs; ++t) {
+                      auto &st = _set_state[t * stride + k];
+                      st.max_score = std::numeric_limits<native_t>::min();
+                      st.pos.clear();
                   }
+                  _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, false);
               }
+              _fill_set(set, block_len);
 
+              if (!fwdonly) {
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                      for (size_t t = 0; t < graphs; ++t) {
+                          auto &st = _set_state[t * stride + k];
+                          st.pos.max_last_pos = lanes_t(0); // As in _align_graph
+                          st.fwd_max = st.max_score;
+                      }
+                      _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, true);
+                  }
+                  _fill_set(set, block_len);
+              }
 
-              // Copy scores
-              for (unsigned char i = 0; i < len; ++i) {
-                  aligns.max_score[beg_offset + i] = _max_score[i] - _bias;
-                  if (!MSONLY && !MAXONLY) {
-                      aligns.sub_score[beg_offset + i] = _sub_score[i] - _bias;
+              for (size_t t = 0; t < graphs; ++t) {
+                  auto &res = aligns[t];
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      auto &st = _set_state[t * stride + k];
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned len = std::min<unsigned>(read_capacity(), read_group.size() - beg_offset);
+                      st.pos.store(res, beg_offset);
+                      for (unsigned i = 0; i < len; ++i) {
+                          res.max_score[beg_offset + i] = st.max_score[i] - _bias;
+                          if (!fwdonly && st.max_score[i] > st.fwd_max[i]) res.max_strand[beg_offset + i] = Strand::REV;
+                      }
                   }
               }
+          }
 
+          const int floor = int(std::numeric_limits<native_t>::min()) - _bias;
+          for (size_t t = 0; t < graphs; ++t) {
+              auto &res = aligns[t];
+              res.resize(read_group.size());
+              res.profile = _prof;
+              if (MSONLY) continue;
+              _redo.clear();
+              for (size_t i = 0; i < read_group.size(); ++i) {
+                  if (res.max_score[i] == floor) _redo.push_back(i);
+              }
+              if (_redo.empty()) continue;
+              _redo_reads.clear();
+              for (auto d : _redo) _redo_reads.push_back(read_group, d);
+              _align_graph(_redo_reads, set.graph(t), _redo_res, fwdonly);
+              for (size_t i = 0; i < _redo.size(); ++i) {
+                  const size_t d = _redo[i];
+                  res.max_score[d] = _redo_res.max_score[i];
+                  res.max_pos[d] = _redo_res.max_pos[i];
+                  res.max_last_pos[d] = _redo_res.max_last_pos[i];
+                  res.max_count[d] = _redo_res.max_count[i];
+                  res.max_strand[d] = _redo_res.max_strand[i];
+              }
           }
-          // Crop off potential buffer
-          aligns.resize(read_group.size());
-          aligns.profile = _prof;
+      }
+
+      /**
+       * @brief
+       * Align the loaded read groups to every graph of the set, filling each base node once per class.
+       * @details
+       * Graphs including a node are split into classes that enter it with the same seeds: graphs that share
+       * the same predecessors, and the same seed slot at each of them. Each class fills the node once, in
+       * chunks from a fresh score state that is then folded into the state of each of its graphs, see
+       * _group_state::fold(). Nodes are visited in base order, which is the order of every graph, so the
+       * folds happen in the order a pass over each graph would see the cells. Classes whose columns are equal
+       * after a chunk are merged, so graphs that differ at a variant share fills again once its effect on
+       * the columns has passed.
+       * Each live node keeps a record in _set_recs of the seed slot of each graph, then the number of
+       * distinct slots and the slots themselves.
+       * @param set graphs to fill
+       * @param num_groups number of loaded groups, at most _groups_per_pass
+       */
+      void _fill_set(const CompiledGraphSet &set, const unsigned num_groups) {
+          const CompiledGraph &base = set.base();
+          const unsigned stride = _groups_per_pass;
+          const size_t graphs = set.size(), rec_len = 2 * graphs + 1;
+          _free_slots.clear();
+          for (size_t i = _seeds.size() / stride; i > 0; --i) _free_slots.push_back(i - 1);
+          _set_recs.resize(_set_recs.size() - _set_recs.size() % rec_len);
+          _free_recs.clear();
+          for (size_t i = _set_recs.size() / rec_len; i > 0; --i) _free_recs.push_back(i - 1);
+          _node_slot.resize(base.size());
+          _pending.resize(base.size());
+          _stats.groups += num_groups;
+
+          for (size_t n = 0; n < base.size(); ++n) {
+              const uint64_t m = set.members(n);
+              const uint32_t *prev_begin = base.pred_begin(n), *prev_end = base.pred_end(n);
+              const uint32_t succ = base.num_succ(n);
+              if (m) {
+                  // Classes of graphs entering the node with the same seeds, by a representative graph
+                  _class_rep.clear();
+                  _class_mask.clear();
+                  for (unsigned t = 0; t < graphs; ++t) {
+                      if (!((m >> t) & 1)) continue;
+                      size_t c = 0;
+                      while (c < _class_rep.size() && !_same_seed(set, prev_begin, prev_end, t, _class_rep[c])) ++c;
+                      if (c == _class_rep.size()) {
+                          _class_rep.push_back(t);
+                          _class_mask.push_back(0);
+                      }
+                      _class_mask[c] |= uint64_t(1) << t;
+                  }
+
+                  _class_slot.resize(_class_rep.size());
+                  for (size_t c = 0; c < _class_rep.size(); ++c) _class_slot[c] = _alloc_slot();
+                  size_t live = _class_rep.size();
+                  for (size_t c = 0; c < _class_rep.size(); ++c) {
+                      for (unsigned k = 0; k < num_groups; ++k) {
+                          _get_set_seed(set, prev_begin, prev_end, _class_rep[c], k, _seeds[_class_slot[c] * stride + k]);
+                      }
+                  }
+
+                  // Fill in chunks while there are several classes, so they merge soon after converging
+                  const rg::Base *seq = base.seq(n);
+                  const size_t seq_len = base.seq_len(n);
+                  const pos_t first_pos = base.end_pos(n) - seq_len + 2;
+                  size_t off = 0;
+                  do {
+                      const size_t len = live > 1 ? std::min<size_t>(2 * _read_len, seq_len - off) : seq_len - off;
+                      for (size_t c = 0; c < _class_rep.size() && len; ++c) {
+                          if (!_class_mask[c]) continue;
+                          for (unsigned k = 0; k < num_groups; ++k) {
+                              auto &st = _state[k];
+                              st.max_score = std::numeric_limits<native_t>::min();
+                              st.pos.clear();
+                              _swap_in(k);
+                              _fill_columns(seq + off, len, first_pos + off, _groups[k].query_profile(),
+                                            _seeds[_class_slot[c] * stride + k]);
+                              _swap_out(k);
+                              for (unsigned t = 0; t < graphs; ++t) {
+                                  if ((_class_mask[c] >> t) & 1) _set_state[t * stride + k].fold(st, _read_len);
+                              }
+                          }
+                      }
+                      off += len;
+
+                      // Merge classes with equal columns
+                      for (size_t c = 1; c < _class_rep.size() && live > 1; ++c) {
+                          if (!_class_mask[c]) continue;
+                          for (size_t d = 0; d < c; ++d) {
+                              if (!_class_mask[d] || !_equal_slots(_class_slot[c], _class_slot[d], num_groups)) continue;
+                              _class_mask[d] |= _class_mask[c];
+                              _class_mask[c] = 0;
+                              _free_slots.push_back(_class_slot[c]);
+                              --live;
+                              break;
+                          }
+                      }
+                  } while (off < seq_len);
+
+                  if (!succ) {
+                      for (size_t c = 0; c < _class_rep.size(); ++c) {
+                          if (_class_mask[c]) _free_slots.push_back(_class_slot[c]);
+                      }
+                  } else {
+                      if (_free_recs.empty()) {
+                          _free_recs.push_back(_set_recs.size() / rec_len);
+                          _set_recs.resize(_set_recs.size() + rec_len);
+                      }
+                      const uint32_t r = _free_recs.back();
+                      _free_recs.pop_back();
+                      uint32_t *rec = _set_recs.data() + size_t(r) * rec_len;
+                      std::fill(rec, rec + graphs, std::numeric_limits<uint32_t>::max());
+                      uint32_t &distinct = rec[graphs];
+                      distinct = 0;
+                      for (size_t c = 0; c < _class_rep.size(); ++c) {
+                          if (!_class_mask[c]) continue;
+                          for (unsigned t = 0; t < graphs; ++t) {
+                              if ((_class_mask[c] >> t) & 1) rec[t] = _class_slot[c];
+                          }
+                          rec[graphs + 1 + distinct++] = _class_slot[c];
+                      }
+                      _node_slot[n] = r;
+                  }
+              }
 
+              for (auto p = prev_begin; p != prev_end; ++p) {
+                  if (--_pending[*p] || !set.members(*p)) continue;
+                  const uint32_t *rec = _set_recs.data() + size_t(_node_slot[*p]) * rec_len;
+                  for (uint32_t i = 0; i < rec[graphs]; ++i) _free_slots.push_back(rec[graphs + 1 + i]);
+                  _free_recs.push_back(_node_slot[*p]);
+              }
+              _pending[n] = succ;
+          }
       }
 
-    private:
+      /**
+       * @return true if graphs t and u enter a node with the same seeds
+       */
+      bool _same_seed(const CompiledGraphSet &set, const uint32_t *prev_begin, const uint32_t *prev_end,
+                      const unsigned t, const unsigned u) const {
+          const size_t rec_len = 2 * set.size() + 1;
+          for (auto p = prev_begin; p != prev_end; ++p) {
+              const uint64_t m = set.members(*p);
+              const bool in_t = (m >> t) & 1, in_u = (m >> u) & 1;
+              if (in_t != in_u) return false;
+              const uint32_t *rec = _set_recs.data() + size_t(_node_slot[*p]) * rec_len;
+              if (in_t && rec[t] != rec[u]) return false;
+          }
+          return true;
+      }
+
+      /**
+       * @brief
+       * Best seed from the predecessors of a node within graph t, see _get_seed().
+       */
+      void _get_set_seed(const CompiledGraphSet &set, const uint32_t *prev_begin, const uint32_t *prev_end,
+                         const unsigned t, const unsigned group, _seed<simd_t> &seed) const {
+          const unsigned stride = _groups_per_pass;
+          const size_t rec_len = 2 * set.size() + 1;
+          bool first = true;
+          for (auto p = prev_begin; p != prev_end; ++p) {
+              if (!((set.members(*p) >> t) & 1)) continue;
+              const uint32_t slot = _set_recs[size_t(_node_slot[*p]) * rec_len + t];
+              const auto &s = _seeds[slot * stride + group];
+              if (first) {
+                  seed.S_col = s.S_col;
+                  seed.I_col = s.I_col;
+                  first = false;
+                  continue;
+              }
+              for (unsigned i = 1; i < _read_len + 1; ++i) {
+                  seed.S_col[i] = max(seed.S_col[i], s.S_col[i]);
+                  seed.I_col[i] = max(seed.I_col[i], s.I_col[i]);
+              }
+          }
+          if (first) _seed_matrix(seed);
+      }
+
+      /**
+       * @return Index of a free seed slot, growing the arena if there is none
+       */
+      uint32_t _alloc_slot() {
+          const unsigned stride = _groups_per_pass;
+          if (_free_slots.empty()) {
+              _free_slots.push_back(_seeds.size() / stride);
+              for (unsigned k = 0; k < stride; ++k) _seeds.emplace_back(_read_len);
+          }
+          const uint32_t slot = _free_slots.back();
+          _free_slots.pop_back();
+          return slot;
+      }
+
+      /**
+       * @return true if the seeds of the first num_groups groups of two slots are equal
+       */
+      bool _equal_slots(const uint32_t a, const uint32_t b, const unsigned num_groups) const {
+          const unsigned stride = _groups_per_pass;
+          const size_t bytes = (_read_len + 1) * sizeof(simd_t);
+          for (unsigned k = 0; k < num_groups; ++k) {
+              const auto &x = _seeds[a * stride + k], &y = _seeds[b * stride + k];
+              if (std::memcmp(x.S_col.data(), y.S_col.data(), bytes) || std::memcmp(x.I_col.data(), y.I_col.data(), bytes)) {
+                  return false;
+              }
+          }
+          return true;
+      }
 
       /**
        * @brief
@@ -523,70 +1128,176 @@ namespace vargas {
           seed.I_col = seed.S_col;
       }
 
+      /**
+       * @brief
+       * Align the loaded read groups to every node of the graph.
+       * @details
+       * Each node is visited once, and all groups in the block are advanced through it while its sequence is
+       * hot. Seeds are kept in arena slots of _groups_per_pass seeds, indexed through _node_slot. A slot is
+       * returned to the free list once all successors of its node have consumed it, so the number of live
+       * slots is bounded by the widest frontier of the graph. Nodes without successors are filled into the
+       * scratch seeds.
+       * A range of nodes can be filled instead, see GraphSegment. Only the max score state is reset at begin,
+       * so ranges are only used in max score modes.
+       * @param graph
+       * @param num_groups number of loaded groups, at most _groups_per_pass
+       * @param warm First node to fill, seeded as if it had no predecessors
+       * @param begin Node to reset the max score state at
+       * @param end One past the last node to fill
+       */
+      void _fill_graph(const CompiledGraph &graph, const unsigned num_groups,
+                       size_t warm = 0, size_t begin = 0, size_t end = SIZE_MAX) {
+          const unsigned stride = _groups_per_pass;
+          _free_slots.clear();
+          for (size_t i = _seeds.size() / stride; i > 0; --i) _free_slots.push_back(i - 1);
+          _node_slot.resize(graph.size());
+          _pending.resize(graph.size());
+          _stats.groups += num_groups;
+
+          end = std::min(end, graph.size());
+          for (size_t n = warm; n < end; ++n) {
+              if (n == begin && begin > warm) {
+                  // Discard the warm-up
+                  for (unsigned k = 0; k < num_groups; ++k) {
+                      auto &st = _state[k];
+                      st.max_score = std::numeric_limits<native_t>::min();
+                      st.pos.clear();
+                  }
+              }
+              const uint32_t *prev_begin = graph.pred_begin(n), *prev_end = graph.pred_end(n);
+              if (n == warm) prev_end = prev_begin;
+              const uint32_t succ = graph.num_succ(n);
+              uint32_t slot = 0;
+              if (succ) {
+                  if (_free_slots.empty()) {
+                      _free_slots.push_back(_seeds.size() / stride);
+                      for (unsigned k = 0; k < stride; ++k) _seeds.emplace_back(_read_len);
+                  }
+                  slot = _free_slots.back();
+                  _free_slots.pop_back();
+              }
+
+              for (unsigned k = 0; k < num_groups; ++k) {
+                  auto &seed = _scratch[k];
+                  _get_seed(prev_begin, prev_end, k, seed);
+                  _swap_in(k);
+                  _fill_node(graph, n, _groups[k].query_profile(), seed, succ ? _seeds[slot * stride + k] : seed);
+                  _swap_out(k);
+              }
+
+              for (auto p = prev_begin; p != prev_end; ++p) {
+                  if (--_pending[*p] == 0) _free_slots.push_back(_node_slot[*p]);
+              }
+              if (succ) {
+                  _node_slot[n] = slot;
+                  _pending[n] = succ;
+              }
+          }
+      }
+
       /**
        * @brief
        * Returns the best seed from all previous nodes.
-       * Graph should be validated before alignment to ensure proper seed fetch
-       * @param prev_ids All nodes preceding _curr_pos node
-       * @param seed_map ID->seed map for all previous nodes
+       * @param prev_begin Dense indices of all nodes preceding _curr_pos node. Nodes must already be filled.
+       * @param prev_end
+       * @param group Read group within the block
        * @param seed best seed to populate
-       * @throws std::domain_error if a node listed as a previous node but it has not been encountered yet.
-       * i.e. not topologically sorted.
        */
       __RG_STRONG_INLINE__
-      void _get_seed(const std::vector<unsigned> &prev_ids,
-                     std::unordered_map<unsigned, _seed<simd_t>> &seed_map,
+      void _get_seed(const uint32_t *prev_begin, const uint32_t *prev_end, const unsigned group,
                      _seed<simd_t> &seed) const {
-          if (prev_ids.empty()) {
+          if (prev_begin == prev_end) {
               _seed_matrix(seed);
+              return;
           }
-          else {
+
+          const unsigned stride = _groups_per_pass;
+          const auto &s = _seeds[_node_slot[*prev_begin] * stride + group];
+          seed.S_col = s.S_col;
+          seed.I_col = s.I_col;
+          for (auto p = prev_begin + 1; p != prev_end; ++p) {
+              const auto &t = _seeds[_node_slot[*p] * stride + group];
               for (unsigned i = 1; i < _read_len + 1; ++i) {
-                  const auto &s = seed_map.at(prev_ids[0]);
-                  seed.S_col[i] = s.S_col[i];
-                  seed.I_col[i] = s.I_col[i];
-
-                  for (unsigned p = 1; p < prev_ids.size(); ++p) {
-                      const auto &t = seed_map.at(prev_ids[p]);
-                      seed.S_col[i] = max(seed.S_col[i], t.S_col[i]);
-                      seed.I_col[i] = max(seed.I_col[i], t.I_col[i]);
-                  }
+                  seed.S_col[i] = max(seed.S_col[i], t.S_col[i]);
+                  seed.I_col[i] = max(seed.I_col[i], t.I_col[i]);
               }
           }
-
       }
 
       /**
        * @brief
-       * @brief
-       * Computes local alignment to the node.
-       * @param n Node to align to
-       * @param read_group AlignmentGroup to align
-       * @param s seeds from previous nodes
-       * @param nxt seed for next nodes
+       * Make group k's score state the active state used by _fill_cell_finish.
        */
       __RG_STRONG_INLINE__
-      void _fill_node(const Graph::Node &n, const qp_t &read_group,
-                      const _seed <simd_t> &s, _seed <simd_t> &nxt) {
+      void _swap_in(const unsigned k) {
+          auto &st = _state[k];
+          _max_score = st.max_score;
+          _sub_score = st.sub_score;
+          _waiting_score = st.waiting_score;
+          _pos = &st.pos;
+      }
+
+      /**
+       * @brief
+       * Save the active score state back to group k. Positions and counts are written in place.
+       */
+      __RG_STRONG_INLINE__
+      void _swap_out(const unsigned k) {
+          auto &st = _state[k];
+          st.max_score = _max_score;
+          st.sub_score = _sub_score;
+          st.waiting_score = _waiting_score;
+      }
+
+      /**
+       * @brief
+       * Commit the waiting 2nd max score if we've got one and reached the end of the genome without
+       * seeing a new _max_last_pos
+       */
+      void _commit_waiting() {
+          if (MSONLY || MAXONLY) return;
+          auto &p = *_pos;
+          const auto sel = lanes_t::widen(_waiting_score > _sub_score) & (p.waiting_pos > p.max_last_pos);
+          _sub_score = blend(lanes_t::narrow(sel), _waiting_score, _sub_score);
+          p.sub_count.set(sel, lanes_t(1));
+          p.sub_pos.set(sel, p.waiting_pos);
+          p.sub_last_pos.set(sel, p.waiting_last_pos);
+      }
+
+      /**
+       * @brief
+       * Computes local alignment to the node. s and nxt may be the same seed.
+       * @param g Compiled graph
+       * @param n Dense index of the node to align to
+       * @param read_group AlignmentGroup to align
+       * @param s seeds from previous nodes
+       * @param nxt seed for next nodes
+       */
+      __RG_STRONG_INLINE__
+      void _fill_node(const CompiledGraph &g, const size_t n, const qp_t &read_group,
+                      const _seed <simd_t> &s, _seed <simd_t> &nxt) {
+          const size_t seq_len = g.seq_len(n);
           // Empty nodes represents deletions
-          if (n.seq().empty()) {
+          if (seq_len == 0) {
               nxt = s;
               return;
           }
+          const rg::Base *seq = g.seq(n);
 
           #if VARGAS_ALIGN_DEBUG_SW
-          if (n.seq().size() > 1000) throw std::runtime_error("Attempting debug run with seq > 1000bp.");
+          if (seq_len > 1000) throw std::runtime_error("Attempting debug run with seq > 1000bp.");
           std::vector<std::vector<char>> grid;
           grid.resize(_read_len);
-          for (auto &&r : grid) r.resize(n.seq().size());
+          for (auto &&r : grid) r.resize(seq_len);
           unsigned deb_col = 0;
           #endif
 
-          unsigned curr_pos = n.end_pos() - n.seq().size() + 2;
+          unsigned curr_pos = g.end_pos(n) - seq_len + 2;
 
           _S = s.S_col;
           _Ic = s.I_col;
-          for (const rg::Base ref_base : n) {
+          for (size_t c = 0; c < seq_len; ++c) {
+              const rg::Base ref_base = seq[c];
               _Sd = _bias;
 
               for (unsigned r = 0; r < _read_len; ++r) {
@@ -605,7 +1316,7 @@ namespace vargas {
 
           #if VARGAS_ALIGN_DEBUG_SW
           std::cerr << std::endl << "S";
-          for (auto b : n) std::cerr << '\t' << rg::num_to_base(b);
+          for (size_t c = 0; c < seq_len; ++c) std::cerr << '\t' << rg::num_to_base(seq[c]);
           std::cerr << std::endl;
           for (unsigned i = 0; i < grid.size(); ++i) {
               const auto &row = grid[i];
@@ -616,212 +1327,983 @@ namespace vargas {
               }
               std::cerr << '\n';
           }
-          #endif
+          #endif
+
+          _stats.cells += uint64_t(seq_len) * _read_len * read_capacity();
+          nxt.S_col = _S;
+          nxt.I_col = _Ic;
+      }
+
+      /**
+       * @brief
+       * Fill columns of a node in place, continuing from the columns in seed.
+       * @param seq bases of the columns
+       * @param len number of columns
+       * @param curr_pos position of the first column, as in _fill_node()
+       * @param read_group AlignmentGroup to align
+       * @param seed columns to continue from, replaced by the last column
+       */
+      __RG_STRONG_INLINE__
+      void _fill_columns(const rg::Base *seq, const size_t len, pos_t curr_pos, const qp_t &read_group,
+                         _seed<simd_t> &seed) {
+          _S = seed.S_col;
+          _Ic = seed.I_col;
+          for (size_t c = 0; c < len; ++c) {
+              _Sd = _bias;
+              for (unsigned r = 0; r < _read_len; ++r) _fill_cell(read_group[r], seq[c], r + 1, curr_pos);
+              if (END_TO_END) _fill_cell_finish(_read_len, curr_pos);
+              ++curr_pos;
+          }
+          _stats.cells += uint64_t(len) * _read_len * read_capacity();
+          seed.S_col = _S;
+          seed.I_col = _Ic;
+      }
+
+      /**
+       * @param read_base ReadBatch vector
+       * @param ref reference sequence base
+       * @param row _curr_pos row in matrix
+       * @param col _curr_pos column in matrix
+       * Does not consider adjacent gaps in read/reference (moving from D to I matrix consecutively)
+       */
+      __RG_STRONG_INLINE__
+      void _fill_cell(const typename qp_t::value_type &prof, const rg::Base &ref,
+                      const unsigned &row, const pos_t &curr_pos) {
+          assert(uint64_t(&_Dc[0]) % sizeof(_Dc[0]) == 0);
+          assert(uint64_t(&_S[0]) % sizeof(_S[0]) == 0);
+          _Dc[row] = max(_Dc[row - 1] - _gap_extend_vec_ref, _S[row - 1] - _gap_open_extend_vec_ref);
+          _Ic[row] = max(_Ic[row] - _gap_extend_vec_rd, _S[row] - _gap_open_extend_vec_rd);
+          simd_t sr = _Sd + prof[ref];
+          _Sd = _S[row]; // S(i-1, j-1) for the next cell to be filled in
+          _S[row] = max(_Ic[row], max(_Dc[row], sr));
+          if (!END_TO_END) _fill_cell_finish(row, curr_pos);
+      }
+
+      /**
+       * @brief
+       * Takes the max of D,I, and M vectors and stores the _curr_pos best score/position
+       * Currently does not support non-default template args
+       * @param row _curr_pos row
+       * @param curr_pos Current position, used to get absolute alignment position
+       */
+      __RG_STRONG_INLINE__ __RG_UNROLL__
+      void _fill_cell_finish(const unsigned &row, const pos_t &curr_pos) {
+          if (MSONLY) {
+              _max_score = max(_S[row], _max_score);
+              return;
+          }
+
+          // Lanes are only touched when a read hits its max or 2nd-max, so skip the masks otherwise
+          auto &p = *_pos;
+          const lanes_t pos(curr_pos);
+          const simd_t &s = _S[row];
+          typename lanes_t::mask_t sel;
+
+          // In local mode most cells are at the zero score (_S[0]), which is also where the max and 2nd-max
+          // start, so only lanes above it may hit them. A column of zeros only checks the waiting 2nd-max.
+          const auto live = END_TO_END ? (s == s) : (s > _S[0]);
+          if (END_TO_END || live) {
+              auto eq = (s == _max_score) & live;
+              if (eq) {
+                  ++_stats.slow_path;
+                  // Repeat max score. Update closest occurrence location; increment counter if > read_len
+                  // from closest occurrence of max
+                  sel = lanes_t::widen(eq);
+                  p.max_count.inc(sel & (pos > p.max_last_pos + _read_len));
+                  p.max_last_pos.set(sel, pos);
+                  if (!MAXONLY) {
+                      p.waiting_pos.set(sel, lanes_t(0));
+                      _waiting_score = blend(eq, _sub_score, _waiting_score);
+                  }
+              }
+
+              eq = s > _max_score;
+              if (eq) {
+                  ++_stats.slow_path;
+                  // New max score
+                  sel = lanes_t::widen(eq);
+                  p.max_count.set(sel, lanes_t(1));
+                  p.max_pos.set(sel, pos);
+                  p.max_last_pos.set(sel, pos);
+                  if (!MAXONLY) {
+                      p.waiting_pos.set(sel, lanes_t(0));
+                      _waiting_score = blend(eq, _sub_score, _waiting_score);
+                  }
+                  _max_score = max(s, _max_score);
+              }
+
+              if (MAXONLY) return;
+              // The genome is not a graph so we can look for the 2nd-max score
+
+              eq = (s == _waiting_score) & live;
+              if (eq) {
+                  ++_stats.slow_path;
+                  // Repeat waiting 2nd-max score. Update closest occurrence location.
+                  p.waiting_last_pos.set(lanes_t::widen(eq).and_not(p.waiting_pos.zero()), pos);
+              }
+
+              eq = (s == _sub_score) & live;
+              if (eq) {
+                  ++_stats.slow_path;
+                  // Repeat 2nd-max score. Update closest occurrence location; increment counter if
+                  // > read_len from closest occurence of max or 2nd-max score
+                  // TODO will overcount if there is an upcoming max within a read-length
+                  sel = lanes_t::widen(eq);
+                  p.sub_count.inc(sel & (pos > p.max_last_pos + _read_len) & (pos > p.sub_last_pos + _read_len));
+                  p.sub_last_pos.set(sel, pos);
+              }
+
+              // Greater than old 2nd-max and less than max score
+              eq = (s > _sub_score) & (s < _max_score);
+              if (eq) {
+                  ++_stats.slow_path;
+                  // New 2nd-max score. Set waiting 2nd max if it's greater than the current waiting 2nd max
+                  // or we have no waiting 2nd max
+                  sel = lanes_t::widen(eq) & (pos > p.max_last_pos + _read_len) &
+                        (p.waiting_pos.zero() | lanes_t::widen(s > _waiting_score));
+                  _waiting_score = blend(lanes_t::narrow(sel), s, _waiting_score);
+                  p.waiting_pos.set(sel, pos);
+                  p.waiting_last_pos.set(sel, pos);
+              }
+          }
+          else if (MAXONLY) return;
+
+          const auto eq = _waiting_score > _sub_score;
+          if (eq) {
+              ++_stats.slow_path;
+              // Commit the waiting 2nd max score if we're a read length beyond it
+              sel = lanes_t::widen(eq) & (pos > p.waiting_pos + _read_len);
+              sel = sel.and_not(p.waiting_pos.zero());
+              _sub_score = blend(lanes_t::narrow(sel), _waiting_score, _sub_score);
+              p.sub_count.set(sel, lanes_t(1));
+              p.sub_pos.set(sel, p.waiting_pos);
+              p.sub_last_pos.set(sel, p.waiting_last_pos);
+              p.waiting_pos.set(sel, lanes_t(0)); // if nonzero, indicates that something is waiting
+          }
+      }
+
+      static native_t _get_bias(const unsigned read_len, const unsigned match, const unsigned mismatch,
+                                const unsigned gopen, const unsigned gext) {
+          static bool has_warned = false;
+          // Local scores saturate at saturation_score(), and can be detected and realigned (see AdaptiveAlignerT)
+          if (!END_TO_END) return std::numeric_limits<native_t>::min();
+          if (read_len * match > std::numeric_limits<native_t>::max() - std::numeric_limits<native_t>::min()) {
+              throw std::domain_error("Insufficient bit-width for given match score and read length.");
+          }
+
+          // End to end alignment
+          unsigned int b = std::numeric_limits<native_t>::max() - (read_len * match);
+
+          if (!has_warned && (gopen + (gext * (read_len - 1)) > b || read_len * mismatch > b)) {
+              std::cerr << "[warn] Possibility of score saturation with parameters in end-to-end mode:\n"
+                        << "\tCell Width: "
+                        << (int) std::numeric_limits<native_t>::max() - (int) std::numeric_limits<native_t>::min()
+                        << ", Bias: " << b << ", Limits: gaplen=" << (b - gopen)/gext << " OR mismatches=" << b/mismatch << "\n";
+              has_warned = true;
+          }
+          return b;
+      }
+
+      /*********************************** Variables ***********************************/
+
+      /**
+       * @brief
+       * Score state of one read group in a block, see _swap_in().
+       */
+      struct _pos_state {
+          lanes_t max_pos, sub_pos, waiting_pos, max_last_pos, sub_last_pos, waiting_last_pos, max_count, sub_count;
+
+          void clear() {
+              max_pos = sub_pos = waiting_pos = max_last_pos = sub_last_pos = waiting_last_pos = max_count =
+              sub_count = lanes_t(0);
+          }
+
+          /**
+           * @brief
+           * Write the lanes to res, starting at read offset.
+           */
+          void store(Results &res, const unsigned offset) const {
+              if (MSONLY) return;
+              max_pos.store(res.max_pos.data() + offset);
+              max_last_pos.store(res.max_last_pos.data() + offset);
+              max_count.store(res.max_count.data() + offset);
+              if (MAXONLY) return;
+              sub_pos.store(res.sub_pos.data() + offset);
+              sub_last_pos.store(res.sub_last_pos.data() + offset);
+              sub_count.store(res.sub_count.data() + offset);
+              waiting_pos.store(res.waiting_pos.data() + offset);
+              waiting_last_pos.store(res.waiting_last_pos.data() + offset);
+          }
+      };
+
+      struct _group_state {
+          simd_t max_score, sub_score, waiting_score, fwd_max, fwd_sub;
+          _pos_state pos;
+
+          /**
+           * @brief
+           * Fold in the state of a node filled from a fresh state, see _fill_set().
+           * @details
+           * A higher max replaces this one, and an equal one adds its count, less the first occurrence if
+           * it is within a read length of the last one, as _align_segments() merges segments.
+           */
+          void fold(const _group_state &l, const unsigned read_len) {
+              if (!MSONLY) {
+                  const auto gt = lanes_t::widen(l.max_score > max_score);
+                  const auto eq = lanes_t::widen(l.max_score == max_score);
+                  const auto near = eq.and_not(l.pos.max_pos > pos.max_last_pos + read_len);
+                  pos.max_count.set(eq, pos.max_count + l.pos.max_count);
+                  pos.max_count.set(near, pos.max_count + uint32_t(-1));
+                  pos.max_count.set(gt, l.pos.max_count);
+                  pos.max_pos.set(gt, l.pos.max_pos);
+                  pos.max_last_pos.set(gt | eq, l.pos.max_last_pos);
+              }
+              max_score = max(max_score, l.max_score);
+          }
+      };
+
+      std::vector<AlignmentGroup> _groups; // Packaged reads of each group in the block
+      std::vector<_group_state, aligned_allocator<_group_state, simd_t::size>> _state;
+      SIMDVector<simd_t> _S, _Dc, _Ic;
+
+      unsigned _groups_per_pass = 1;
+      std::vector<_seed<simd_t>> _scratch; // One scratch seed per group in the block
+      // Seed arena of _groups_per_pass seeds per slot, grows to the widest frontier and is reused across groups
+      std::vector<_seed<simd_t>> _seeds;
+      std::vector<uint32_t> _free_slots; // Unused _seeds indices
+      std::vector<uint32_t> _node_slot; // Dense node index to its _seeds slot
+      std::vector<uint32_t> _pending; // Successors yet to consume each node's seed
+
+      // Graph set alignment, see _fill_set()
+      std::vector<_group_state, aligned_allocator<_group_state, simd_t::size>> _set_state; // Graph-major
+      std::vector<uint32_t> _set_recs, _free_recs; // Seed slot records of live nodes, and unused records
+      std::vector<unsigned> _class_rep; // Representative graph of each class of a node
+      std::vector<uint64_t> _class_mask; // Graphs of each class
+      std::vector<uint32_t> _class_slot; // Output seed slot of each class
+
+      // Segment alignment, see _align_segments()
+      struct _worker_deleter {
+          void operator()(AlignerT *a) const {
+              a->~AlignerT();
+              free(a);
+          }
+      };
+      template<typename F>
+      static void _segment_job(void *data, long j, int tid) {
+          (*(F *) data)(j, tid);
+      }
+      unsigned _threads = 1;
+      std::vector<std::unique_ptr<AlignerT, _worker_deleter>> _workers; // Aligners for the other threads
+      std::unique_ptr<rg::ForPool> _pool; // _threads workers, created on first use
+      std::vector<Results> _segment_res; // Results of each segment and strand
+      std::vector<size_t> _redo; // Reads aligned again in a single pass
+      EncodedReads _redo_reads;
+      Results _redo_res;
+
+      AlignerStats _stats; // Work counters of this aligner, see stats()
+
+      simd_t _Sd, _max_score, _sub_score, _waiting_score,
+      _gap_extend_vec_ref, _gap_open_extend_vec_ref, _gap_extend_vec_rd, _gap_open_extend_vec_rd;
+
+      _pos_state *_pos = nullptr; // Positions and counts of the active group, updated in place
+
+      native_t _bias;
+      const unsigned int _read_len;
+
+  };
+
+  using Aligner = AlignerT<int8_fast, false, false>;
+  using WordAligner = AlignerT<int16_fast, false, false>;
+  using AlignerETE = AlignerT<int8_fast, true, false>;
+  using WordAlignerETE = AlignerT<int16_fast, true, false>;
+
+  using MSAligner = AlignerT<int8_fast, false, true>;
+  using MSWordAligner = AlignerT<int16_fast, false, true>;
+  using MSAlignerETE = AlignerT<int8_fast, true, true>;
+  using MSWordAlignerETE = AlignerT<int16_fast, true, true>;
+
+  /**
+   * @brief
+   * Local aligner that uses 8 bit scores, and realigns reads with saturated scores with 16 bit scores.
+   * @details
+   * In local mode a cell can only saturate at the top of its range, so a read whose 8 bit max score is at
+   * the saturation score is realigned with the 16 bit aligner, and its results replaced. The 8 bit
+   * aligner keeps its full read capacity unless reads actually exceed its range, in contrast to picking
+   * the 16 bit aligner for the whole run based on the longest read. A batch with a saturated read costs an
+   * 8 bit pass and a 16 bit pass, more than the 16 bit pass alone, so after such a batch the next ones go
+   * straight to the 16 bit aligner until one fits in 8 bits again. Results are the same either way.
+   * End to end scores can also saturate at the bottom of the range on paths that later recover, which
+   * the max score does not show, so end to end alignment picks a width up front.
+   * @tparam MSONLY Only collect max score
+   * @tparam MAXONLY Only collect max score, max position, and count
+   */
+  template<bool MSONLY=false, bool MAXONLY=false>
+  class AdaptiveAlignerT: public AlignerBase {
+    public:
+      AdaptiveAlignerT(unsigned read_len, const ScoreProfile &prof) :
+      _narrow(read_len, prof), _wide(read_len, prof) {
+          _prof = prof;
+          _prof.end_to_end = false;
+      }
+
+      AdaptiveAlignerT(unsigned read_len, unsigned match = 2, unsigned mismatch = 2, unsigned open = 3,
+                       unsigned extend = 1) :
+      AdaptiveAlignerT(read_len, ScoreProfile(match, mismatch, open, extend)) {}
+
+      AdaptiveAlignerT(const AdaptiveAlignerT &) = delete;
+      AdaptiveAlignerT &operator=(const AdaptiveAlignerT &) = delete;
+
+      void set_scores(const ScoreProfile &prof) override {
+          _narrow.set_scores(prof);
+          _wide.set_scores(prof);
+          _prof = prof;
+          _prof.end_to_end = false;
+      }
+
+      using AlignerBase::align_into;
+
+      void align_into(const EncodedReads &reads, const CompiledGraph &graph, Results &aligns,
+                      bool fwdonly) override {
+          const int limit = _narrow.saturation_score();
+          if (_wide_first) {
+              _wide.align_into(reads, graph, aligns, fwdonly);
+              _wide_first = _saturated(aligns.max_score.begin(), aligns.max_score.end(), limit);
+              return;
+          }
+          _narrow.align_into(reads, graph, aligns, fwdonly);
+
+          _redo.clear();
+          for (size_t i = 0; i < aligns.size(); ++i) {
+              if (aligns.max_score[i] >= limit) _redo.push_back(i);
+          }
+          _wide_first = !_redo.empty();
+          if (_redo.empty()) return;
+          _realigned += _redo.size();
+
+          _redo_reads.clear();
+          for (auto d : _redo) _redo_reads.push_back(reads, d);
+          _wide.align_into(_redo_reads, graph, _redo_res, fwdonly);
+          _replace(_redo_res, aligns);
+      }
+
+      /**
+       * @brief
+       * Align to every graph of the set, and realign reads that saturated in any graph to the whole set.
+       */
+      void align_into(const EncodedReads &reads, const CompiledGraphSet &set, std::vector<Results> &aligns,
+                      bool fwdonly) override {
+          const int limit = _narrow.saturation_score();
+          if (_wide_first) {
+              _wide.align_into(reads, set, aligns, fwdonly);
+              _wide_first = false;
+              for (const auto &r : aligns) {
+                  _wide_first = _wide_first || _saturated(r.max_score.begin(), r.max_score.end(), limit);
+              }
+              return;
+          }
+          _narrow.align_into(reads, set, aligns, fwdonly);
+
+          _redo.clear();
+          for (size_t i = 0; i < reads.size(); ++i) {
+              for (const auto &r : aligns) {
+                  if (r.max_score[i] >= limit) {
+                      _redo.push_back(i);
+                      break;
+                  }
+              }
+          }
+          _wide_first = !_redo.empty();
+          if (_redo.empty()) return;
+          _realigned += _redo.size();
+
+          _redo_reads.clear();
+          for (auto d : _redo) _redo_reads.push_back(reads, d);
+          _wide.align_into(_redo_reads, set, _redo_set, fwdonly);
+          for (size_t t = 0; t < aligns.size(); ++t) _replace(_redo_set[t], aligns[t]);
+      }
+
+      void set_groups_per_pass(unsigned k) override {
+          _narrow.set_groups_per_pass(k);
+          _wide.set_groups_per_pass(k);
+      }
+
+      unsigned groups_per_pass() const override { return _narrow.groups_per_pass(); }
+
+      void set_threads(unsigned t) override {
+          _narrow.set_threads(t);
+          _wide.set_threads(t);
+      }
+
+      unsigned capacity() const override { return _narrow.capacity(); }
+
+      size_t realigned() const override { return _realigned; }
+
+      AlignerStats stats() const override { return _narrow.stats().merge(_wide.stats()); }
+
+    private:
+      /**
+       * @return True if a score in [begin, end) would saturate 8 bits
+       */
+      template<typename It>
+      static bool _saturated(It begin, It end, int limit) {
+          return std::any_of(begin, end, [limit](int s) { return s >= limit; });
+      }
+
+      /**
+       * @brief
+       * Replace the results of the realigned reads.
+       */
+      void _replace(const Results &redo, Results &aligns) const {
+          for (size_t i = 0; i < _redo.size(); ++i) {
+              const size_t d = _redo[i];
+              aligns.max_pos[d] = redo.max_pos[i];
+              aligns.sub_pos[d] = redo.sub_pos[i];
+              aligns.max_last_pos[d] = redo.max_last_pos[i];
+              aligns.sub_last_pos[d] = redo.sub_last_pos[i];
+              aligns.waiting_pos[d] = redo.waiting_pos[i];
+              aligns.waiting_last_pos[d] = redo.waiting_last_pos[i];
+              aligns.max_count[d] = redo.max_count[i];
+              aligns.sub_count[d] = redo.sub_count[i];
+              aligns.max_score[d] = redo.max_score[i];
+              aligns.sub_score[d] = redo.sub_score[i];
+              aligns.max_strand[d] = redo.max_strand[i];
+              aligns.sub_strand[d] = redo.sub_strand[i];
+          }
+      }
+
+      AlignerT<int8_fast, false, MSONLY, MAXONLY> _narrow;
+      AlignerT<int16_fast, false, MSONLY, MAXONLY> _wide;
+      std::vector<size_t> _redo; // Indices of reads with saturated scores in the last batch
+      EncodedReads _redo_reads;
+      Results _redo_res;
+      std::vector<Results> _redo_set;
+      size_t _realigned = 0;
+      bool _wide_first = false; // A read of the last batch saturated 8 bits
+  };
+
+  using AdaptiveAligner = AdaptiveAlignerT<false>;
+  using MSAdaptiveAligner = AdaptiveAlignerT<true>;
+
+  /**
+   * @brief
+   * End to end aligner on 8 bit differences between neighbouring cells, for reads whose scores need 16 bits.
+   * @details
+   * Follows the difference recurrence of Suzuki and Kasahara: instead of scores, each column holds the
+   * vertical difference S(r) - S(r-1) and the gap difference I(r) - S(r) of every row. Differences are bounded by
+   * the score profile rather than the read length, so long reads keep the read capacity of 8 bit cells,
+   * twice that of WordAlignerETE. Row 0 is 0 in every column in end to end mode, so the bottom row score is a running
+   * sum of its horizontal differences, kept in 32 bit lanes for the max, position and count bookkeeping. Seeds of
+   * several predecessors are merged on scores rebuilt by prefix sums, see _get_seed().
+   * Local alignment clips scores at 0, which needs absolute scores, so it uses AdaptiveAlignerT instead.
+   * Results match those of AlignerT<int16_fast, true, MSONLY, MAXONLY> in the cases it does not saturate.
+   * @tparam MSONLY Only collect max score
+   * @tparam MAXONLY Only collect max score, max position, and count
+   */
+  template<bool MSONLY=false, bool MAXONLY=false>
+  class DiffAlignerT: public AlignerBase {
+    public:
+      using simd_t = int8_fast;
+      using native_t = simd_t::native_t;
+      using lanes_t = Lanes32<native_t, simd_t::length>; // Bottom row scores, positions and counts
+      using AlignmentGroup = typename AlignerT<simd_t, true, MSONLY, MAXONLY>::AlignmentGroup;
+      using qp_t = typename AlignerT<simd_t, true, MSONLY, MAXONLY>::qp_t;
+
+      DiffAlignerT(unsigned read_len, const ScoreProfile &prof) :
+      _groups(1, AlignmentGroup(read_len)), _state(1), _U(read_len + 1), _G(read_len + 1),
+      _scratch(1, _dseed(read_len)), _read_len(read_len) {
+          set_scores(prof); // May throw
+      }
+
+      DiffAlignerT(unsigned read_len, unsigned match = 2, unsigned mismatch = 2, unsigned open = 3,
+                   unsigned extend = 1) :
+      DiffAlignerT(read_len, ScoreProfile(match, mismatch, open, extend)) {}
+
+      DiffAlignerT(const DiffAlignerT &) = delete;
+      DiffAlignerT &operator=(const DiffAlignerT &) = delete;
+
+      /**
+       * @brief
+       * Largest difference of two neighbouring cells, plus a gap open, must fit in a cell.
+       * @param prof
+       * @return true if the profile can be aligned on 8 bit differences
+       */
+      static bool fits(const ScoreProfile &prof) {
+          const unsigned span = prof.match + std::max<unsigned>(prof.mismatch_max, prof.ambig) +
+                                prof.read_gopen + prof.read_gext + prof.ref_gopen + prof.ref_gext;
+          return span <= unsigned(std::numeric_limits<native_t>::max());
+      }
+
+      /**
+       * @param prof
+       * @throws std::domain_error if the profile does not fit(), alignment is always end to end
+       */
+      void set_scores(const ScoreProfile &prof) override {
+          if (!fits(prof)) throw std::domain_error("Score profile is too wide for 8 bit score differences.");
+          _prof = prof;
+          _prof.end_to_end = true;
+          _gap_extend_vec_rd = prof.read_gext;
+          _gap_extend_vec_ref = prof.ref_gext;
+          _gap_open_extend_neg_rd = -int(prof.read_gopen + prof.read_gext);
+          _gap_open_extend_neg_ref = -int(prof.ref_gopen + prof.ref_gext);
+      }
+
+      /**
+       * @return maximum number of reads that can be aligned at once.
+       */
+      static constexpr unsigned read_capacity() { return simd_t::length; }
+
+      /**
+       * @return Number of seed slots allocated, the widest graph frontier seen so far.
+       */
+      size_t seed_slots() const { return _seeds.size() / _groups_per_pass; }
+
+      AlignerStats stats() const override {
+          AlignerStats ret = _stats;
+          ret.seed_slots = seed_slots();
+          return ret;
+      }
+
+      using AlignerBase::align_into;
+
+      void align_into(const EncodedReads &reads, const CompiledGraph &graph, Results &aligns,
+                      bool fwdonly) override {
+          _align_graph(reads, graph, aligns, fwdonly);
+      }
+
+      /**
+       * @brief
+       * Align to each graph of the set in turn.
+       */
+      void align_into(const EncodedReads &reads, const CompiledGraphSet &set, std::vector<Results> &aligns,
+                      bool fwdonly) override {
+          aligns.resize(set.size());
+          for (size_t t = 0; t < set.size(); ++t) {
+              if (reads.empty()) {
+                  aligns[t].resize(0);
+                  aligns[t].profile = _prof;
+              }
+              else align_into(reads, set.graph(t), aligns[t], fwdonly);
+          }
+      }
+
+      /**
+       * @brief
+       * Set the number of read groups advanced together through each node, see AlignerT::set_groups_per_pass().
+       * @param k groups per graph pass, at least 1
+       * @throws std::invalid_argument if k is 0
+       */
+      void set_groups_per_pass(unsigned k) override {
+          if (k == 0) throw std::invalid_argument("At least one read group per graph pass is required.");
+          if (k == _groups_per_pass) return;
+          _groups_per_pass = k;
+          _seeds.clear();
+          _scratch.assign(k, _dseed(_read_len));
+          _state.resize(k);
+          while (_groups.size() < k) _groups.emplace_back(_read_len);
+      }
+
+      unsigned groups_per_pass() const override { return _groups_per_pass; }
+
+      /**
+       * @brief
+       * Graphs are aligned in a single pass, t only checked.
+       * @param t threads per alignment, at least 1
+       * @throws std::invalid_argument if t is 0
+       */
+      void set_threads(unsigned t) override {
+          if (t == 0) throw std::invalid_argument("At least one thread is required.");
+      }
+
+      unsigned capacity() const override { return read_capacity(); }
+
+    private:
+
+      /**
+       * @brief
+       * Ending columns of a node, as differences.
+       */
+      struct _dseed {
+          explicit _dseed(const unsigned read_len) : U(read_len + 1), G(read_len + 1) {}
+          SIMDVector<simd_t> U; /**< S(r) - S(r-1) of rows 1 to read_len */
+          SIMDVector<simd_t> G; /**< I(r) - S(r), saturated below, which the next gap open masks */
+          lanes_t bottom; /**< S(read_len) offset by _zero */
+      };
+
+      /**
+       * @brief
+       * Bottom row score state of one read group, in 32 bit lanes.
+       */
+      struct _group_state {
+          lanes_t max_score, sub_score, waiting_score, fwd_max, fwd_sub;
+          lanes_t max_pos, sub_pos, waiting_pos, max_last_pos, sub_last_pos, waiting_last_pos, max_count, sub_count;
+
+          void clear() {
+              max_score = sub_score = waiting_score = max_pos = sub_pos = waiting_pos = max_last_pos =
+              sub_last_pos = waiting_last_pos = max_count = sub_count = lanes_t(0);
+          }
+
+          /**
+           * @brief
+           * Track the bottom row score s of a column, as AlignerT::_fill_cell_finish() does.
+           */
+          __RG_STRONG_INLINE__
+          void finish_column(const lanes_t &s, const pos_t curr_pos, const unsigned read_len) {
+              if (MSONLY) {
+                  max_score.set(s > max_score, s);
+                  return;
+              }
+              const lanes_t pos(curr_pos);
+
+              // Repeat max score
+              auto sel = s == max_score;
+              max_count.inc(sel & (pos > max_last_pos + read_len));
+              max_last_pos.set(sel, pos);
+              if (!MAXONLY) {
+                  waiting_pos.set(sel, lanes_t(0));
+                  waiting_score.set(sel, sub_score);
+              }
+
+              // New max score
+              sel = s > max_score;
+              max_count.set(sel, lanes_t(1));
+              max_pos.set(sel, pos);
+              max_last_pos.set(sel, pos);
+              if (!MAXONLY) {
+                  waiting_pos.set(sel, lanes_t(0));
+                  waiting_score.set(sel, sub_score);
+              }
+              max_score.set(sel, s);
+
+              if (MAXONLY) return;
+
+              // Repeat waiting 2nd-max score
+              waiting_last_pos.set((s == waiting_score).and_not(waiting_pos.zero()), pos);
+
+              // Repeat 2nd-max score
+              sel = s == sub_score;
+              sub_count.inc(sel & (pos > max_last_pos + read_len) & (pos > sub_last_pos + read_len));
+              sub_last_pos.set(sel, pos);
+
+              // New waiting 2nd-max score
+              sel = (s > sub_score) & (max_score > s) & (pos > max_last_pos + read_len) &
+                    (waiting_pos.zero() | (s > waiting_score));
+              waiting_score.set(sel, s);
+              waiting_pos.set(sel, pos);
+              waiting_last_pos.set(sel, pos);
+
+              // Commit the waiting 2nd max score a read length beyond it
+              sel = ((waiting_score > sub_score) & (pos > waiting_pos + read_len)).and_not(waiting_pos.zero());
+              commit(sel);
+              waiting_pos.set(sel, lanes_t(0)); // if nonzero, indicates that something is waiting
+          }
+
+          /**
+           * @brief
+           * Commit the waiting 2nd max score at the end of the graph, see AlignerT::_commit_waiting().
+           */
+          void commit_waiting() {
+              if (MSONLY || MAXONLY) return;
+              commit((waiting_score > sub_score) & (waiting_pos > max_last_pos));
+          }
 
-          nxt.S_col = _S;
-          nxt.I_col = _Ic;
-      }
+          /**
+           * @brief
+           * Make the waiting 2nd max of the lanes in sel the 2nd max. The waiting position is kept, as in
+           * AlignerT::_commit_waiting(), and cleared by the caller during a pass.
+           */
+          __RG_STRONG_INLINE__
+          void commit(const typename lanes_t::mask_t &sel) {
+              sub_score.set(sel, waiting_score);
+              sub_count.set(sel, lanes_t(1));
+              sub_pos.set(sel, waiting_pos);
+              sub_last_pos.set(sel, waiting_last_pos);
+          }
+
+          void store(Results &res, const unsigned offset) const {
+              if (MSONLY) return;
+              max_pos.store(res.max_pos.data() + offset);
+              max_last_pos.store(res.max_last_pos.data() + offset);
+              max_count.store(res.max_count.data() + offset);
+              if (MAXONLY) return;
+              sub_pos.store(res.sub_pos.data() + offset);
+              sub_last_pos.store(res.sub_last_pos.data() + offset);
+              sub_count.store(res.sub_count.data() + offset);
+              waiting_pos.store(res.waiting_pos.data() + offset);
+              waiting_last_pos.store(res.waiting_last_pos.data() + offset);
+          }
+      };
 
       /**
-       * @param read_base ReadBatch vector
-       * @param ref reference sequence base
-       * @param row _curr_pos row in matrix
-       * @param col _curr_pos column in matrix
-       * Does not consider adjacent gaps in read/reference (moving from D to I matrix consecutively)
+       * @brief
+       * Scores are kept in 32 bit lanes offset by this, so the unsigned comparisons of Lanes32 order them.
        */
-      __RG_STRONG_INLINE__
-      void _fill_cell(const typename qp_t::value_type &prof, const rg::Base &ref,
-                      const unsigned &row, const pos_t &curr_pos) {
-          assert(uint64_t(&_Dc[0]) % sizeof(_Dc[0]) == 0);
-          assert(uint64_t(&_S[0]) % sizeof(_S[0]) == 0);
-          _Dc[row] = max(_Dc[row - 1] - _gap_extend_vec_ref, _S[row - 1] - _gap_open_extend_vec_ref);
-          _Ic[row] = max(_Ic[row] - _gap_extend_vec_rd, _S[row] - _gap_open_extend_vec_rd);
-          simd_t sr = _Sd + prof[ref];
-          _Sd = _S[row]; // S(i-1, j-1) for the next cell to be filled in
-          _S[row] = max(_Ic[row], max(_Dc[row], sr));
-          if (!END_TO_END) _fill_cell_finish(row, curr_pos);
-      }
+      static constexpr uint32_t _zero = 0x80000000u;
 
       /**
        * @brief
-       * Takes the max of D,I, and M vectors and stores the _curr_pos best score/position
-       * Currently does not support non-default template args
-       * @param row _curr_pos row
-       * @param curr_pos Current position, used to get absolute alignment position
+       * Align to the whole graph in one pass, forward then reverse, as AlignerT does.
        */
-      __RG_STRONG_INLINE__ __RG_UNROLL__
-      void _fill_cell_finish(const unsigned &row, const pos_t &curr_pos) {
-          if (MSONLY) {
-              _max_score = max(_S[row], _max_score);
-          } else if (MAXONLY) {
-              #ifdef VA_SIMD_USE_AVX512
-              MaskType _tmp0;
-              #else
-              simd_t _tmp0;
-              #endif
-              _tmp0 = _S[row] == _max_score;
-              if (_tmp0) {
-                  // Check for repeat max score. Update closest occurrence location; increment counter if > read_len
-                  // from closest occurrence of max
-                  for (unsigned i = 0; i < read_capacity(); ++i) {
-                      if (_tmp0[i]) {
-                          if (curr_pos > _max_last_pos[i] + _read_len) ++(_max_count[i]);
-                          _max_last_pos[i] = curr_pos;
+      void _align_graph(const EncodedReads &read_group, const CompiledGraph &graph, Results &aligns, bool fwdonly) {
+          if (read_group.empty()) {
+              aligns.resize(0);
+              aligns.profile = _prof;
+              return;
+          }
+          const unsigned num_groups = 1 + ((read_group.size() - 1) / read_capacity());
+          // Possible oversize if there is a partial group
+          aligns.resize(num_groups * read_capacity());
+
+          if (fwdonly){
+              std::fill(aligns.max_strand.begin(), aligns.max_strand.end(), Strand::FWD);
+              std::fill(aligns.sub_strand.begin(), aligns.sub_strand.end(), Strand::FWD);
+          }
+
+          for (unsigned block = 0; block < num_groups; block += _groups_per_pass) {
+              const unsigned block_len = std::min(_groups_per_pass, num_groups - block);
+
+              for (unsigned k = 0; k < block_len; ++k) {
+                  auto &st = _state[k];
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                  st.clear();
+                  _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, false);
+              }
+
+              _fill_graph(graph, block_len);
+              for (unsigned k = 0; k < block_len; ++k) _state[k].commit_waiting();
+
+              if (!fwdonly) {
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      auto &st = _state[k];
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned end_offset = std::min<unsigned>(beg_offset + read_capacity(), read_group.size());
+                      _groups[k].load_reads(read_group, _prof, beg_offset, end_offset, true);
+                      st.max_last_pos = lanes_t(0);
+                      st.sub_last_pos = lanes_t(0);
+                      st.fwd_max = st.max_score;
+                      st.fwd_sub = st.sub_score;
+                  }
+
+                  _fill_graph(graph, block_len);
+
+                  for (unsigned k = 0; k < block_len; ++k) {
+                      auto &st = _state[k];
+                      st.commit_waiting();
+                      const unsigned beg_offset = (block + k) * read_capacity();
+                      const unsigned len = std::min<unsigned>(read_capacity(), read_group.size() - beg_offset);
+                      for (size_t i = 0; i < len; ++i) {
+                          aligns.max_strand[beg_offset + i] = st.max_score[i] > st.fwd_max[i] ? Strand::REV : Strand::FWD;
+                          aligns.sub_strand[beg_offset + i] = st.sub_score[i] > st.fwd_sub[i] ? Strand::REV : Strand::FWD;
                       }
                   }
               }
 
-              _tmp0 = _S[row] > _max_score;
-              if (_tmp0) {
-                  for (unsigned i = 0; i < read_capacity(); ++i) {
-                      if (_tmp0[i]) {
-                          // Check for new max score.
-                          _max_count[i] = 1;
-                          _max_pos[i] = curr_pos;
-                          _max_last_pos[i] = curr_pos;
-                      }
+              for (unsigned k = 0; k < block_len; ++k) {
+                  const auto &st = _state[k];
+                  const unsigned beg_offset = (block + k) * read_capacity();
+                  const unsigned len = std::min<unsigned>(read_capacity(), read_group.size() - beg_offset);
+                  st.store(aligns, beg_offset);
+                  for (unsigned i = 0; i < len; ++i) {
+                      aligns.max_score[beg_offset + i] = int32_t(st.max_score[i] - _zero);
+                      if (!MSONLY && !MAXONLY) aligns.sub_score[beg_offset + i] = int32_t(st.sub_score[i] - _zero);
                   }
-                  _max_score = max(_S[row], _max_score);
               }
           }
-          else { // the genome is not a graph so we can look for the 2nd-max score
-              #ifdef VA_SIMD_USE_AVX512
-              MaskType _tmp0;
-              #else
-              simd_t _tmp0;
-              #endif
-              _tmp0 = _S[row] == _max_score;
-              if (_tmp0) {
-                  // Check for repeat max score. Update closest occurrence location; increment counter if > read_len
-                  // from closest occurrence of max
-                  for (unsigned i = 0; i < read_capacity(); ++i) {
-                      if (_tmp0[i]) {
-                          if (curr_pos > _max_last_pos[i] + _read_len) ++(_max_count[i]);
-                          _max_last_pos[i] = curr_pos;
-                          _waiting_pos[i] = 0;
-                          _waiting_score[i] = _sub_score[i];
-                      }
+          // Crop off potential buffer
+          aligns.resize(read_group.size());
+          aligns.profile = _prof;
+      }
+
+      /**
+       * @brief
+       * Align the loaded read groups to every node of the graph, with seeds in arena slots as in
+       * AlignerT::_fill_graph().
+       * @param graph
+       * @param num_groups number of loaded groups, at most _groups_per_pass
+       */
+      void _fill_graph(const CompiledGraph &graph, const unsigned num_groups) {
+          const unsigned stride = _groups_per_pass;
+          _free_slots.clear();
+          for (size_t i = _seeds.size() / stride; i > 0; --i) _free_slots.push_back(i - 1);
+          _node_slot.resize(graph.size());
+          _pending.resize(graph.size());
+          _stats.groups += num_groups;
+
+          for (size_t n = 0; n < graph.size(); ++n) {
+              const uint32_t *prev_begin = graph.pred_begin(n), *prev_end = graph.pred_end(n);
+              const uint32_t succ = graph.num_succ(n);
+              uint32_t slot = 0;
+              if (succ) {
+                  if (_free_slots.empty()) {
+                      _free_slots.push_back(_seeds.size() / stride);
+                      for (unsigned k = 0; k < stride; ++k) _seeds.emplace_back(_read_len);
                   }
+                  slot = _free_slots.back();
+                  _free_slots.pop_back();
               }
 
-              _tmp0 = _S[row] > _max_score;
-              if (_tmp0) {
-                  for (unsigned i = 0; i < read_capacity(); ++i) {
-                      if (_tmp0[i]) {
-                          // Check for new max score.
-                          _max_count[i] = 1;
-                          _max_pos[i] = curr_pos;
-                          _max_last_pos[i] = curr_pos;
-                          _waiting_pos[i] = 0;
-                          _waiting_score[i] = _sub_score[i];
-                      }
-                  }
-                  _max_score = max(_S[row], _max_score);
+              for (unsigned k = 0; k < num_groups; ++k) {
+                  auto &seed = _scratch[k];
+                  _get_seed(prev_begin, prev_end, k, seed);
+                  _fill_node(graph, n, _groups[k].query_profile(), _state[k], seed,
+                             succ ? _seeds[slot * stride + k] : seed);
               }
 
-                _tmp0 = _S[row] == _waiting_score;
-                if (_tmp0) {
-                    // Check for repeat waiting 2nd-max score. Update closest occurrence location.
-                    for (unsigned i = 0; i < read_capacity(); ++i) {
-                        if (_tmp0[i] && _waiting_pos[i] > 0) _waiting_last_pos[i] = curr_pos;
-                    }
-                }
-
-                _tmp0 = _S[row] == _sub_score;
-                if (_tmp0) {
-                    // Check for repeat 2nd-max score. Update closest occurrence location; increment counter if
-                    // > read_len from closest occurence of max or 2nd-max score
-                    // TODO will overcount if there is an upcoming max within a read-length
-                    for (unsigned i = 0; i < read_capacity(); ++i) {
-                        if (_tmp0[i]) {
-                            if (curr_pos > _max_last_pos[i] + _read_len && curr_pos > _sub_last_pos[i] + _read_len) {
-                                ++(_sub_count[i]);
-                            }
-                            _sub_last_pos[i] = curr_pos;
-                        }
-                    }
-                }
-
-                // Greater than old 2nd-max and less than max score
-                _tmp0 = (_S[row] > _sub_score) & (_S[row] < _max_score);
-                if (_tmp0) {
-                    // Check for new 2nd-max score. Set waiting 2nd max if it's greater than the current waiting 2nd max
-                    // or we have no waiting 2nd max
-                    for (unsigned i = 0; i < read_capacity(); ++i) {
-                        if (_tmp0[i] && curr_pos > _max_last_pos[i] + _read_len && (_waiting_pos[i] == 0 || _S[row][i] > _waiting_score[i])) {
-                            _waiting_score[i] = _S[row][i];
-                            _waiting_pos[i] = curr_pos;
-                            _waiting_last_pos[i] = curr_pos;
-                        }
-                    }
-                }
-
-                _tmp0 = _waiting_score > _sub_score;
-                if (_tmp0) {
-                    // commit the waiting 2nd max score if we're a read length beyond it
-                    for (unsigned i = 0; i < read_capacity(); ++i) {
-                        if (_tmp0[i] && curr_pos > _waiting_pos[i] + _read_len && _waiting_pos[i] > 0) {
-                            //set the waiting 2nd max, if it's greater than the current waiting 2nd max
-                            _sub_score[i] = _waiting_score[i];
-                            _sub_count[i] = 1;
-                            _sub_pos[i] = _waiting_pos[i];
-                            _sub_last_pos[i] = _waiting_last_pos[i];
-                            _waiting_pos[i] = 0; //if nonzero, indicates that something is waiting
-                        }
-                    }
-                }
-            }
+              for (auto p = prev_begin; p != prev_end; ++p) {
+                  if (--_pending[*p] == 0) _free_slots.push_back(_node_slot[*p]);
+              }
+              if (succ) {
+                  _node_slot[n] = slot;
+                  _pending[n] = succ;
+              }
           }
+      }
 
+      /**
+       * @brief
+       * Seed of a node without predecessors, the end to end penalties of AlignerT::_seed_matrix().
+       * A gap in the read starts every row, so I(r) = S(r).
+       */
+      void _seed_matrix(_dseed &seed) const {
+          for (unsigned r = 1; r <= _read_len; ++r) seed.U[r] = -int(r == 1 ? _prof.ref_gopen + _prof.ref_gext : _prof.ref_gext);
+          std::fill(seed.G.begin(), seed.G.end(), simd_t(0));
+          seed.bottom = lanes_t(_zero - _prof.ref_gopen - _read_len * _prof.ref_gext);
+      }
 
+      /**
+       * @brief
+       * Best seed from all previous nodes.
+       * @details
+       * A single predecessor is copied. Otherwise S and I of each row are rebuilt by prefix sums of the
+       * differences in 32 bit lanes, their maxima taken per row as in AlignerT::_get_seed(), and the result is
+       * turned back into differences.
+       * @param prev_begin Dense indices of all nodes preceding the node. Nodes must already be filled.
+       * @param prev_end
+       * @param group Read group within the block
+       * @param seed best seed to populate
+       */
+      void _get_seed(const uint32_t *prev_begin, const uint32_t *prev_end, const unsigned group, _dseed &seed) {
+          if (prev_begin == prev_end) {
+              _seed_matrix(seed);
+              return;
+          }
 
-      static native_t _get_bias(const unsigned read_len, const unsigned match, const unsigned mismatch,
-                                const unsigned gopen, const unsigned gext) {
-          static bool has_warned = false;
-          if (read_len * match > std::numeric_limits<native_t>::max() - std::numeric_limits<native_t>::min()) {
-              throw std::domain_error("Insufficient bit-width for given match score and read length.");
+          const unsigned stride = _groups_per_pass;
+          if (prev_end - prev_begin == 1) {
+              const auto &s = _seeds[_node_slot[*prev_begin] * stride + group];
+              seed.U = s.U;
+              seed.G = s.G;
+              seed.bottom = s.bottom;
+              return;
           }
-          if (!END_TO_END) return std::numeric_limits<native_t>::min();
 
-          // End to end alignment
-          unsigned int b = std::numeric_limits<native_t>::max() - (read_len * match);
+          const size_t num_prev = prev_end - prev_begin;
+          _sums.assign(num_prev, lanes_t(_zero));
+          lanes_t last(_zero);
+          for (unsigned r = 1; r <= _read_len; ++r) {
+              lanes_t best_s(0), best_i(0);
+              for (size_t p = 0; p < num_prev; ++p) {
+                  const auto &t = _seeds[_node_slot[prev_begin[p]] * stride + group];
+                  auto &s = _sums[p];
+                  s = s + lanes_t::extend(t.U[r]);
+                  const lanes_t i = s + lanes_t::extend(t.G[r]);
+                  best_s.set(s > best_s, s);
+                  best_i.set(i > best_i, i);
+              }
+              seed.U[r] = (best_s - last).pack();
+              seed.G[r] = (best_i - best_s).pack();
+              last = best_s;
+          }
+          seed.bottom = last;
+      }
 
-          if (!has_warned && (gopen + (gext * (read_len - 1)) > b || read_len * mismatch > b)) {
-              std::cerr << "[warn] Possibility of score saturation with parameters in end-to-end mode:\n"
-                        << "\tCell Width: "
-                        << (int) std::numeric_limits<native_t>::max() - (int) std::numeric_limits<native_t>::min()
-                        << ", Bias: " << b << ", Limits: gaplen=" << (b - gopen)/gext << " OR mismatches=" << b/mismatch << "\n";
-              has_warned = true;
+      /**
+       * @brief
+       * Fill the columns of a node. s and nxt may be the same seed.
+       * @details
+       * With b = S(r-1, j) - S(r-1, j-1) carried down the column, f = D(r) - S(r-1), and every candidate taken
+       * relative to the diagonal S(r-1, j-1), the cell is
+       * @code
+       * a = U[r]                            S(r, j-1) - S(r-1, j-1)
+       * e = max(G[r] - ge_rd, -goe_rd)      I(r, j) - S(r, j-1)
+       * f = max(f - u - ge_ref, -goe_ref)   u is the new U[r-1]
+       * z = max(sub, a + e, f + b)          S(r, j) - S(r-1, j-1)
+       * U[r] = z - b, G[r] = a + e - z, b = z - a
+       * @endcode
+       * The last b of a column is the change of the bottom row score.
+       * @param g Compiled graph
+       * @param n Dense index of the node to align to
+       * @param read_group query profile of the group
+       * @param st score state of the group
+       * @param s seed from previous nodes
+       * @param nxt seed for next nodes
+       */
+      __RG_STRONG_INLINE__
+      void _fill_node(const CompiledGraph &g, const size_t n, const qp_t &read_group, _group_state &st,
+                      const _dseed &s, _dseed &nxt) {
+          const size_t seq_len = g.seq_len(n);
+          // Empty nodes represents deletions
+          if (seq_len == 0) {
+              if (&s != &nxt) nxt = s;
+              return;
           }
-          return b;
+          const rg::Base *seq = g.seq(n);
+          pos_t curr_pos = g.end_pos(n) - seq_len + 2;
+
+          _U = s.U;
+          _G = s.G;
+          lanes_t bottom = s.bottom;
+          for (size_t c = 0; c < seq_len; ++c) {
+              const rg::Base ref_base = seq[c];
+              simd_t b = 0, u = 0, f = std::numeric_limits<native_t>::min();
+              for (unsigned r = 1; r <= _read_len; ++r) {
+                  const simd_t a = _U[r];
+                  const simd_t ia = a + max(_G[r] - _gap_extend_vec_rd, _gap_open_extend_neg_rd);
+                  f = max(f - u - _gap_extend_vec_ref, _gap_open_extend_neg_ref);
+                  const simd_t z = max(read_group[r - 1][ref_base], max(ia, f + b));
+                  u = z - b;
+                  _U[r] = u;
+                  _G[r] = ia - z;
+                  b = z - a;
+              }
+              bottom = bottom + lanes_t::extend(b);
+              st.finish_column(bottom, curr_pos, _read_len);
+              ++curr_pos;
+          }
+
+          _stats.cells += uint64_t(seq_len) * _read_len * read_capacity();
+          nxt.U = _U;
+          nxt.G = _G;
+          nxt.bottom = bottom;
       }
 
       /*********************************** Variables ***********************************/
 
-      AlignmentGroup _alignment_group;
-      SIMDVector<simd_t> _S, _Dc, _Ic;
+      std::vector<AlignmentGroup> _groups; // Packaged reads of each group in the block
+      std::vector<_group_state, aligned_allocator<_group_state, simd_t::size>> _state;
+      SIMDVector<simd_t> _U, _G;
 
-      simd_t _Sd, _max_score, _sub_score, _waiting_score,
-      _gap_extend_vec_ref, _gap_open_extend_vec_ref, _gap_extend_vec_rd, _gap_open_extend_vec_rd;
+      unsigned _groups_per_pass = 1;
+      std::vector<_dseed, aligned_allocator<_dseed, simd_t::size>> _scratch; // One scratch seed per group
+      std::vector<_dseed, aligned_allocator<_dseed, simd_t::size>> _seeds; // Seed arena, as in AlignerT
+      std::vector<uint32_t> _free_slots; // Unused _seeds indices
+      std::vector<uint32_t> _node_slot; // Dense node index to its _seeds slot
+      std::vector<uint32_t> _pending; // Successors yet to consume each node's seed
+      std::vector<lanes_t, aligned_allocator<lanes_t, simd_t::size>> _sums; // Prefix sums of each predecessor
 
-      pos_t *_max_pos, *_sub_pos, *_waiting_pos;
-      pos_t *_max_last_pos, *_sub_last_pos, *_waiting_last_pos;
-      unsigned  *_max_count, *_sub_count;
+      AlignerStats _stats; // Work counters of this aligner, see stats()
 
-      native_t _bias;
-      const unsigned int _read_len;
+      simd_t _gap_extend_vec_ref, _gap_extend_vec_rd;
+      simd_t _gap_open_extend_neg_ref, _gap_open_extend_neg_rd; // Negated, floors of f and e in _fill_node()
 
+      const unsigned int _read_len;
   };
 
-  using Aligner = AlignerT<int8_fast, false, false>;
-  using WordAligner = AlignerT<int16_fast, false, false>;
-  using AlignerETE = AlignerT<int8_fast, true, false>;
-  using WordAlignerETE = AlignerT<int16_fast, true, false>;
+  using DiffAlignerETE = DiffAlignerT<false>;
+  using MSDiffAlignerETE = DiffAlignerT<true>;
 
-  using MSAligner = AlignerT<int8_fast, false, true>;
-  using MSWordAligner = AlignerT<int16_fast, false, true>;
-  using MSAlignerETE = AlignerT<int8_fast, true, true>;
-  using MSWordAlignerETE = AlignerT<int16_fast, true, true>;
+  } // namespace VA_SIMD_NAMESPACE
+  VA_SIMD_TARGET_END
 
 
 }
@@ -1334,6 +2816,503 @@ TEST_CASE("Target score") {
     CHECK(res.sub_pos[0] == 19); //max and 2nd max have to be far enough away, so sub_pos can't be 3
 }
 
+TEST_CASE("Seed arena") {
+    // Split one sequence into many nodes, with a SNP bubble every 10th node
+    const std::string ref = "ACGTTGCAAGGCTTACGATCGGATCCAGTTAGCATCGAGACGTAGCTAGGCATTACGACTAGCATCG";
+    vargas::Graph chain, linear;
+    {
+        vargas::Graph::Node n;
+        n.set_seq(ref);
+        n.set_endpos(ref.size() - 1);
+        linear.add_node(n);
+    }
+    std::vector<unsigned> tails;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        vargas::Graph::Node n;
+        n.set_seq(ref.substr(i, 1));
+        n.set_endpos(i);
+        const unsigned id = chain.add_node(n);
+        for (auto t : tails) chain.add_edge(t, id);
+        tails = {id};
+        if (i % 10 == 5) {
+            vargas::Graph::Node alt;
+            alt.set_seq("N");
+            alt.set_endpos(i);
+            tails.push_back(chain.add_node(alt));
+            for (auto p : chain.prev_map().at(id)) chain.add_edge(p, tails.back());
+        }
+    }
+    const std::vector<std::string> reads = {"GGATCCAGTT", "CGTAGCTAGG", "ACGTTGCAAG"};
+    vargas::Aligner a(10);
+    auto res = a.align(reads, chain.begin(), chain.end());
+    auto expected = a.align(reads, linear.begin(), linear.end());
+    REQUIRE(res.size() == 3);
+    for (size_t i = 0; i < res.size(); ++i) {
+        CHECK(res.max_score[i] == expected.max_score[i]);
+        CHECK(res.max_pos[i] == expected.max_pos[i]);
+    }
+    CHECK(a.seed_slots() <= 3);
+
+    // One forward pass of one group over each graph, every row of every column
+    size_t alts = 0;
+    for (size_t i = 0; i < ref.size(); ++i) alts += i % 10 == 5;
+    const auto st = a.stats();
+    CHECK(st.groups == 2);
+    CHECK(st.cells == (2 * ref.size() + alts) * 10 * a.read_capacity());
+    CHECK(st.seed_slots == a.seed_slots());
+    CHECK(st.slow_path > 0);
+}
+
+TEST_CASE("Saturation realignment") {
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    std::string ref;
+    unsigned x = 7;
+    for (unsigned i = 0; i < 300; ++i) {
+        x = x * 1103515245 + 12345;
+        ref += "ACGT"[(x >> 16) % 4];
+    }
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(ref.size() - 1);
+        n.set_seq(ref);
+        g.add_node(n);
+    }
+
+    // Three reads score above 255. Short reads share vectors with long ones, so they are padded.
+    std::vector<std::string> reads = {ref.substr(10, 150), ref.substr(0, 60), ref.substr(100, 140),
+                                      rg::reverse_complement(ref.substr(50, 150)), ref.substr(200, 100)};
+    for (size_t i = 0; i < 30; ++i) reads.push_back(ref.substr(i * 9, 20));
+
+    vargas::Aligner narrow(150);
+    CHECK(narrow.saturation_score() == 255);
+    auto sat = narrow.align(reads, g.begin(), g.end(), false);
+    CHECK(sat.max_score[0] == 255);
+
+    vargas::AdaptiveAligner a(150);
+    vargas::WordAligner w(150);
+    CHECK(a.capacity() == vargas::Aligner::read_capacity());
+    auto res = a.align(reads, g.begin(), g.end(), false);
+    auto expected = w.align(reads, g.begin(), g.end(), false);
+    CHECK(a.realigned() == 3);
+    REQUIRE(res.size() == reads.size());
+    CHECK(res.max_score[0] == 300);
+    CHECK(res.max_score[3] == 300);
+    CHECK(res.max_strand[3] == vargas::Strand::REV);
+    for (size_t i = 0; i < reads.size(); ++i) {
+        CHECK(res.max_score[i] == expected.max_score[i]);
+        CHECK(res.max_pos[i] == expected.max_pos[i]);
+        CHECK(res.max_count[i] == expected.max_count[i]);
+        CHECK(res.max_strand[i] == expected.max_strand[i]);
+        CHECK(res.sub_score[i] == expected.sub_score[i]);
+        CHECK(res.sub_pos[i] == expected.sub_pos[i]);
+    }
+
+    // After a saturated batch the next goes straight to 16 bits, until a batch fits in 8 bits
+    const auto again = a.align(reads, g.begin(), g.end(), false);
+    CHECK(a.realigned() == 3);
+    CHECK(again.max_score == res.max_score);
+    CHECK(again.max_pos == res.max_pos);
+    CHECK(again.sub_pos == res.sub_pos);
+    const std::vector<std::string> fit(reads.begin() + 5, reads.end());
+    a.align(fit, g.begin(), g.end(), false);
+    a.align(reads, g.begin(), g.end(), false);
+    CHECK(a.realigned() == 6);
+}
+
+TEST_CASE("Difference alignment") {
+    // A chain of SNP bubbles with a deletion, and a repeat for counts
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    std::string ref;
+    unsigned x = 5;
+    while (ref.size() < 1200) {
+        x = x * 1103515245 + 12345;
+        ref += "ACGT"[(x >> 16) % 4];
+        if (ref.size() == 400 || ref.size() == 900) ref += ref.substr(100, 160);
+    }
+    std::vector<unsigned> tails;
+    for (size_t pos = 0; pos + 150 <= ref.size(); pos += 150) {
+        vargas::Graph::Node n;
+        n.set_endpos(pos + 148);
+        n.set_seq(ref.substr(pos, 149));
+        g.add_node(n);
+        for (auto t : tails) g.add_edge(t, n.id());
+        tails.clear();
+        for (const int alt : {0, 1, 2}) {
+            vargas::Graph::Node b;
+            b.set_endpos(pos + 149);
+            if (alt == 0) b.set_seq(ref.substr(pos + 149, 1));
+            else if (alt == 1) b.set_seq(std::string(ref[pos + 149] == 'A' ? "C" : "A"));
+            else if (pos % 300 == 0) b.set_seq("");
+            else continue;
+            if (alt == 0) b.set_as_ref();
+            else b.set_not_ref();
+            g.add_node(b);
+            g.add_edge(n.id(), b.id());
+            tails.push_back(b.id());
+        }
+    }
+    vargas::CompiledGraph cg(g.begin(), g.end());
+
+    // Long reads with mismatches and indels, short reads padded with them, and reads that do not align
+    std::vector<std::string> reads;
+    for (size_t i = 0; i + 150 <= ref.size(); i += 23) {
+        std::string r = ref.substr(i, 150);
+        if (i % 2) r[i % 150] = r[i % 150] == 'G' ? 'T' : 'G';
+        if (i % 3 == 0) r.erase(40, 3);
+        if (i % 5 == 0) r.insert(90, "TTAC");
+        if (i % 4 == 0) r = rg::reverse_complement(r);
+        reads.push_back(r);
+    }
+    reads.push_back(ref.substr(120, 80));
+    reads.push_back(std::string(150, 'N'));
+    reads.push_back(std::string(150, 'A'));
+
+    vargas::ScoreProfile prof(2, 4, 5, 1);
+    prof.end_to_end = true;
+
+    vargas::WordAlignerETE w(155, prof);
+    vargas::DiffAlignerETE d(155, prof);
+    CHECK(d.capacity() == vargas::AlignerETE::read_capacity());
+    for (const bool fwdonly : {true, false}) {
+        const auto expected = w.align(reads, cg, fwdonly);
+        const auto res = d.align(reads, cg, fwdonly);
+        REQUIRE(res.size() == reads.size());
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(res.max_score[i] == expected.max_score[i]);
+            CHECK(res.max_pos[i] == expected.max_pos[i]);
+            CHECK(res.max_count[i] == expected.max_count[i]);
+            CHECK(res.max_strand[i] == expected.max_strand[i]);
+            CHECK(res.sub_count[i] == expected.sub_count[i]);
+            CHECK(res.sub_pos[i] == expected.sub_pos[i]);
+            CHECK(res.waiting_pos[i] == expected.waiting_pos[i]);
+            CHECK(res.waiting_last_pos[i] == expected.waiting_last_pos[i]);
+            // The score of a read without a 2nd-max is the lowest score of the cell type
+            if (expected.sub_count[i]) CHECK(res.sub_score[i] == expected.sub_score[i]);
+        }
+    }
+
+    SUBCASE("Max score only") {
+        vargas::MSWordAlignerETE mw(155, prof);
+        vargas::MSDiffAlignerETE md(155, prof);
+        md.set_groups_per_pass(3);
+        const auto expected = mw.align(reads, cg, false);
+        const auto res = md.align(reads, cg, false);
+        for (size_t i = 0; i < reads.size(); ++i) CHECK(res.max_score[i] == expected.max_score[i]);
+        CHECK(md.groups_per_pass() == 3);
+    }
+
+    SUBCASE("Profile limits") {
+        CHECK_THROWS(vargas::DiffAlignerETE(150, vargas::ScoreProfile(60, 40, 30, 10)));
+        CHECK(!vargas::DiffAlignerETE::fits(vargas::ScoreProfile(60, 40, 30, 10)));
+        CHECK(vargas::DiffAlignerETE::fits(prof));
+    }
+}
+
+TEST_CASE("Groups per pass") {
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    const std::string ref = "ACGTTGCAAGGCTTACGATCGGATCCAGTTAGCATCGAGACGTAGCTAGGCATTACGACTAGCATCG";
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(29);
+        n.set_seq(ref.substr(0, 30));
+        g.add_node(n);
+    }
+    for (const std::string alt : {"A", "TT", "C"}) {
+        vargas::Graph::Node n;
+        n.set_endpos(30);
+        n.set_seq(alt);
+        if (alt == "A") n.set_as_ref();
+        else n.set_not_ref();
+        g.add_node(n);
+    }
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(ref.size() - 1);
+        n.set_seq(ref.substr(31));
+        g.add_node(n);
+    }
+    for (unsigned i = 1; i < 4; ++i) {
+        g.add_edge(0, i);
+        g.add_edge(i, 4);
+    }
+
+    // Enough reads for several vectors and a partial one
+    std::vector<std::string> reads;
+    for (size_t i = 0; i + 12 <= ref.size(); ++i) {
+        std::string r = ref.substr(i, 12);
+        if (i % 3 == 0) r[i % 12] = 'T';
+        if (i % 4 == 0) r = rg::reverse_complement(r);
+        reads.push_back(r);
+    }
+    reads.push_back("GATTACAGATTA");
+
+    for (const bool fwdonly : {true, false}) {
+        vargas::Aligner a(12), b(12);
+        CHECK_THROWS(b.set_groups_per_pass(0));
+        b.set_groups_per_pass(3);
+        CHECK(b.groups_per_pass() == 3);
+        vargas::Results ra, rb;
+        a.align_into(reads, {}, g.begin(), g.end(), ra, fwdonly);
+        b.align_into(reads, {}, g.begin(), g.end(), rb, fwdonly);
+        REQUIRE(ra.size() == reads.size());
+        REQUIRE(rb.size() == reads.size());
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(ra.max_score[i] == rb.max_score[i]);
+            CHECK(ra.max_pos[i] == rb.max_pos[i]);
+            CHECK(ra.max_count[i] == rb.max_count[i]);
+            CHECK(ra.max_strand[i] == rb.max_strand[i]);
+            CHECK(ra.sub_score[i] == rb.sub_score[i]);
+            CHECK(ra.sub_pos[i] == rb.sub_pos[i]);
+            CHECK(ra.sub_count[i] == rb.sub_count[i]);
+            CHECK(ra.sub_strand[i] == rb.sub_strand[i]);
+        }
+    }
+}
+
+TEST_CASE("Segmented alignment") {
+    // A long chain of bubbles, with a motif repeated in several segments
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    std::string ref;
+    unsigned x = 11;
+    while (ref.size() < 8000) {
+        x = x * 1103515245 + 12345;
+        ref += "ACGT"[(x >> 16) % 4];
+        if (ref.size() % 1500 == 0) ref += "GATTACAGATTACA";
+    }
+    std::vector<unsigned> tails;
+    for (size_t pos = 0; pos + 100 <= ref.size(); pos += 100) {
+        vargas::Graph::Node n;
+        n.set_endpos(pos + 98);
+        n.set_seq(ref.substr(pos, 99));
+        g.add_node(n);
+        for (auto t : tails) g.add_edge(t, n.id());
+        tails.clear();
+        for (const bool is_ref : {true, false}) {
+            vargas::Graph::Node b;
+            b.set_endpos(pos + 99);
+            b.set_seq(is_ref ? ref.substr(pos + 99, 1) : std::string(ref[pos + 99] == 'A' ? "C" : "A"));
+            if (is_ref) b.set_as_ref();
+            else b.set_not_ref();
+            g.add_node(b);
+            g.add_edge(n.id(), b.id());
+            tails.push_back(b.id());
+        }
+    }
+
+    vargas::CompiledGraph cg(g.begin(), g.end());
+    const auto segs = cg.segments(300, 1000);
+    REQUIRE(segs.size() > 2);
+    CHECK(segs.front().warm == 0);
+    CHECK(segs.front().begin == 0);
+    CHECK(segs.back().end == cg.size());
+    for (size_t i = 1; i < segs.size(); ++i) {
+        CHECK(segs[i].begin == segs[i - 1].end);
+        CHECK(segs[i].warm < segs[i].begin);
+        CHECK(size_t(cg.seq(segs[i].begin) - cg.seq(segs[i].warm)) >= 300);
+    }
+
+    std::vector<std::string> reads;
+    for (size_t i = 0; i + 12 <= ref.size(); i += 37) {
+        std::string r = ref.substr(i, 12);
+        if (i % 3 == 0) r[i % 12] = 'T';
+        if (i % 4 == 0) r = rg::reverse_complement(r);
+        reads.push_back(r);
+    }
+    reads.push_back("GATTACAGATTA");
+    reads.push_back("TAATCTGTAATC");
+    reads.push_back("NNNNNNNNNNNN");
+
+    auto check = [&](vargas::AlignerBase &a, vargas::AlignerBase &b, bool fwdonly) {
+        vargas::Results ra, rb;
+        a.align_into(reads, {}, cg, ra, fwdonly);
+        b.align_into(reads, {}, cg, rb, fwdonly);
+        REQUIRE(ra.size() == reads.size());
+        REQUIRE(rb.size() == reads.size());
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(ra.max_score[i] == rb.max_score[i]);
+            CHECK(ra.max_strand[i] == rb.max_strand[i]);
+        }
+        return std::make_pair(ra, rb);
+    };
+
+    for (const bool fwdonly : {true, false}) {
+        {
+            vargas::AlignerT<vargas::int8_fast, false, false, true> a(12), b(12);
+            CHECK_THROWS(b.set_threads(0));
+            b.set_threads(4);
+            const auto r = check(a, b, fwdonly);
+            for (size_t i = 0; i < reads.size(); ++i) {
+                CHECK(r.first.max_pos[i] == r.second.max_pos[i]);
+                CHECK(r.first.max_count[i] == r.second.max_count[i]);
+            }
+            CHECK(r.second.max_count[reads.size() - 3] >= 5);
+        }
+        {
+            vargas::MSAligner a(12), b(12);
+            b.set_threads(3);
+            check(a, b, fwdonly);
+        }
+        {
+            vargas::MSAlignerETE a(12), b(12);
+            b.set_threads(3);
+            check(a, b, fwdonly);
+        }
+        {
+            vargas::MSAdaptiveAligner a(150), b(150);
+            b.set_threads(2);
+            check(a, b, fwdonly);
+        }
+    }
+}
+
+TEST_CASE("Graph set alignment") {
+    // A chain of bubbles, the alt allele is the most common one at every third bubble
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    std::string ref;
+    unsigned x = 5;
+    while (ref.size() < 3000) {
+        x = x * 1103515245 + 12345;
+        ref += "ACGT"[(x >> 16) % 4];
+    }
+    std::vector<unsigned> tails;
+    for (size_t pos = 0; pos + 100 <= ref.size(); pos += 100) {
+        vargas::Graph::Node n;
+        n.set_endpos(pos + 98);
+        n.set_seq(ref.substr(pos, 99));
+        g.add_node(n);
+        for (auto t : tails) g.add_edge(t, n.id());
+        tails.clear();
+        for (const bool is_ref : {true, false}) {
+            vargas::Graph::Node b;
+            b.set_endpos(pos + 99);
+            b.set_seq(is_ref ? ref.substr(pos + 99, 1) : std::string(ref[pos + 99] == 'A' ? "C" : "A"));
+            if (is_ref) b.set_as_ref();
+            else b.set_not_ref();
+            b.set_af(is_ref == (pos % 300 != 0) ? 0.7 : 0.3);
+            g.add_node(b);
+            g.add_edge(n.id(), b.id());
+            tails.push_back(b.id());
+        }
+    }
+
+    auto base = std::make_shared<const vargas::CompiledGraph>(g);
+    std::vector<std::shared_ptr<const vargas::CompiledGraph>> graphs = {
+    base,
+    std::make_shared<const vargas::CompiledGraph>(vargas::Graph(g, vargas::Graph::Type::REF)),
+    std::make_shared<const vargas::CompiledGraph>(vargas::Graph(g, vargas::Graph::Type::MAXAF))};
+    vargas::CompiledGraphSet set(base, graphs);
+
+    // Reads over both alleles of several bubbles
+    std::vector<std::string> reads;
+    for (size_t i = 90; i + 12 <= ref.size(); i += 50) {
+        std::string r = ref.substr(i, 12);
+        if (i % 200 == 90) r[9] = ref[i + 9] == 'A' ? 'C' : 'A';
+        if (i % 3 == 1) r = rg::reverse_complement(r);
+        reads.push_back(r);
+    }
+    reads.push_back(ref.substr(1000, 12));
+    reads.push_back("NNNNNNNNNNNN");
+    vargas::EncodedReads enc;
+    for (const auto &r : reads) enc.push_back(r, std::vector<char>());
+
+    auto check = [&](vargas::AlignerBase &a, bool fwdonly, bool positions) {
+        std::vector<vargas::Results> sets;
+        a.align_into(enc, set, sets, fwdonly);
+        REQUIRE(sets.size() == graphs.size());
+        for (size_t t = 0; t < graphs.size(); ++t) {
+            vargas::Results one;
+            a.align_into(enc, *graphs[t], one, fwdonly);
+            REQUIRE(sets[t].size() == reads.size());
+            for (size_t i = 0; i < reads.size(); ++i) {
+                CHECK(sets[t].max_score[i] == one.max_score[i]);
+                CHECK(sets[t].max_strand[i] == one.max_strand[i]);
+                if (!positions) continue;
+                CHECK(sets[t].max_pos[i] == one.max_pos[i]);
+                CHECK(sets[t].max_last_pos[i] == one.max_last_pos[i]);
+                CHECK(sets[t].max_count[i] == one.max_count[i]);
+            }
+        }
+        return sets;
+    };
+
+    for (const bool fwdonly : {true, false}) {
+        {
+            vargas::AlignerT<vargas::int8_fast, false, false, true> a(12);
+            const auto sets = check(a, fwdonly, true);
+            // The first read has the alt allele, which REF does not have
+            CHECK(sets[0].max_score[0] > sets[1].max_score[0]);
+        }
+        {
+            vargas::AlignerT<vargas::int16_fast, true, false, true> a(12);
+            a.set_groups_per_pass(2);
+            check(a, fwdonly, true);
+        }
+        {
+            vargas::MSAligner a(12);
+            a.set_groups_per_pass(3);
+            check(a, fwdonly, false);
+        }
+        {
+            vargas::MSAdaptiveAligner a(150);
+            check(a, fwdonly, false);
+        }
+        {
+            vargas::Aligner a(12);
+            check(a, fwdonly, true);
+        }
+    }
+}
+
+TEST_CASE("Encoded reads") {
+    vargas::EncodedReads enc;
+    enc.push_back("ACGN", "!!!!", 33);
+    enc.push_back("TTA", "", 33);
+    enc.push_back("GA", "@J", 64);
+    REQUIRE(enc.size() == 3);
+    CHECK(enc.length(0) == 4);
+    CHECK(enc.seq(0)[3] == rg::Base::N);
+    CHECK(enc.qual(0)[0] == 0);
+    CHECK(enc.qual(1) == nullptr);
+    CHECK(enc.qual(2)[1] == 10);
+    enc.clear();
+    CHECK(enc.empty());
+
+    // Qualities give the same results through either interface, for any offset
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(39);
+        n.set_seq("ACGTTGCAAGGCTTACGATCGGATCCAGTTAGCATCGAGA");
+        g.add_node(n);
+    }
+    const std::vector<std::string> reads = {"GCAAGGCTTAC", "GATCCTGTTAG", "TCGATGCTAAC"};
+    const std::vector<std::string> qual33 = {"IIIII#IIIII", "II#IIIIII5I", "+++++++++++"};
+    std::vector<std::vector<char>> phred(reads.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+        for (char c : qual33[i]) phred[i].push_back(c - 33);
+        std::string qual64 = qual33[i];
+        for (auto &c : qual64) c += 31;
+        enc.push_back(reads[i], qual64, 64);
+    }
+    vargas::CompiledGraph cg(g.begin(), g.end());
+    vargas::Aligner a(11);
+    vargas::Results ra, rb;
+    a.align_into(reads, phred, cg, ra, false);
+    a.align_into(enc, cg, rb, false);
+    for (size_t i = 0; i < reads.size(); ++i) {
+        CHECK(ra.max_score[i] == rb.max_score[i]);
+        CHECK(ra.max_pos[i] == rb.max_pos[i]);
+        CHECK(ra.sub_score[i] == rb.sub_score[i]);
+        CHECK(ra.max_strand[i] == rb.max_strand[i]);
+    }
+}
+
 TEST_SUITE_END();
 
 #endif //VARGAS_ALIGNMENT_H
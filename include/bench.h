@@ -0,0 +1,31 @@
+/**
+ * @brief
+ * Benchmarks of the aligner kernels, graph construction, simulation, and SAM I/O on synthetic data.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_BENCH_H
+#define VARGAS_BENCH_H
+
+#include "cxxopts.hpp"
+
+/**
+ * @brief
+ * Run the benchmark suite and report the results as JSON.
+ * @details
+ * A reference and SNPs are generated from the seed, so runs with the same parameters are over the same
+ * graph and reads. Each aligner kernel (instruction set, 8/16 bit scores, local/end to end, full/msonly/maxonly)
+ * is timed at each thread count.
+ * @param argc command line argument count
+ * @param argv command line arguments
+ */
+int bench_main(int argc, char *argv[]);
+
+void bench_help(const cxxopts::Options &opts);
+
+#endif //VARGAS_BENCH_H
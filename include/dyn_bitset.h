@@ -272,10 +272,11 @@ class dyn_bitset {
      * @return number of bits set.
      */
     size_t count() const {
+        if (_bitset.empty()) return 0;
         size_t count = 0;
-        for (size_t i = 0; i < size(); ++i) {
-            if (at(i)) ++count;
-        }
+        for (size_t i = 0; i < _bitset.size() - 1; ++i) count += _bitset[i].count();
+        // Padding bits may be set
+        for (size_t i = 0; i < core_size - _right_pad; ++i) count += _bitset.back()[i];
         return count;
     }
 
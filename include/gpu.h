@@ -0,0 +1,493 @@
+/**
+ * @brief
+ * GPU aligner backend. The per-read kernel is shared between the CUDA build and a host reference.
+ *
+ * @details
+ * The SIMD aligners put base i of every read in one vector, so each lane is an independent alignment. The GPU
+ * backend runs the same lane program with one read per thread: align_read() reproduces the cell width, bias,
+ * saturation and max/2nd-max bookkeeping of the aligner make_aligner() would pick, so results match it
+ * bit for bit. Arrays are laid out [array][row][read] so neighbouring threads make coalesced accesses.
+ * The host reference runs align_read() over host buffers with the same layout, see align_reference().
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_GPU_H
+#define VARGAS_GPU_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+
+#ifdef __CUDACC__
+#define VA_HD __host__ __device__
+#else
+#define VA_HD
+#include "graph.h"
+#include "scoring.h"
+#include "utils.h"
+#endif
+
+#define VA_GPU_PAD 5 // Base code of the rows that pad short reads
+
+namespace vargas {
+
+  class AlignerBase;
+  struct AlignerDeleter;
+  class CompiledGraph;
+  class EncodedReads;
+  struct ScoreProfile;
+  struct Results;
+
+  namespace gpu {
+
+      /**
+       * @brief
+       * Cell type of the aligner being reproduced, see config().
+       */
+      enum class Cells : uint8_t {
+          NARROW, /**< 8 bit, as Aligner and AlignerETE */
+          WIDE, /**< 16 bit, as WordAligner and WordAlignerETE */
+          ADAPTIVE, /**< 8 bit, realigned with 16 bits when saturated, as AdaptiveAligner */
+          EXACT /**< Unsaturated end to end scores, as DiffAlignerETE */
+      };
+
+      struct Config {
+          Cells cells = Cells::NARROW;
+          bool end_to_end = false, msonly = false;
+      };
+
+      /**
+       * @brief
+       * Scores of the profile as used by the kernel.
+       */
+      struct Params {
+          int32_t match, ambig, read_gext, read_goe, ref_gopen, ref_gext, ref_goe;
+          uint32_t read_len;
+      };
+
+      /**
+       * @brief
+       * Flattened compiled graph. Node n has bases seq[seq_off[n], seq_off[n+1]), predecessors
+       * pred_slot[pred_off[n], pred_off[n+1]) given by their seed slots, and fills seed slot slot[n], or none if -1.
+       */
+      struct GraphView {
+          const uint8_t *seq;
+          const uint64_t *seq_off;
+          const uint32_t *end_pos;
+          const uint32_t *pred_off;
+          const uint32_t *pred_slot;
+          const int32_t *slot;
+          uint32_t nodes, slots;
+      };
+
+      /**
+       * @brief
+       * Results of one read, scattered into Results by scatter().
+       */
+      struct Out {
+          int32_t max_score, sub_score;
+          uint32_t max_pos, sub_pos, max_last_pos, sub_last_pos, waiting_pos, waiting_last_pos, max_count, sub_count;
+          uint8_t max_strand, sub_strand;
+      };
+
+      /**
+       * @brief
+       * One launch: n reads against one graph.
+       */
+      struct Job {
+          GraphView g;
+          const uint8_t *base; /**< [strand][row][read] base code of the row, VA_GPU_PAD for padding */
+          const uint8_t *mismatch; /**< [strand][row][read] mismatch penalty of the row */
+          void *work; /**< [array][row][read] cells: S, I, then S and I of each seed slot, see work_bytes() */
+          Out *out; /**< [read] */
+          Params p;
+          uint32_t n;
+          bool fwdonly;
+      };
+
+      template<typename T> struct Cell;
+      template<> struct Cell<int8_t> {
+          using wide_t = int32_t;
+          static constexpr int32_t min = -128, max = 127;
+      };
+      template<> struct Cell<int16_t> {
+          using wide_t = int32_t;
+          static constexpr int32_t min = -32768, max = 32767;
+      };
+      template<> struct Cell<int32_t> {
+          using wide_t = int64_t;
+          static constexpr int32_t min = INT32_MIN, max = INT32_MAX;
+      };
+
+      /**
+       * @return a + b saturated to T, as the adds/subs of the SIMD cell types
+       */
+      template<typename T>
+      VA_HD inline T sat(const T a, const int32_t b) {
+          using w = typename Cell<T>::wide_t;
+          const w x = w(a) + w(b);
+          return T(x < w(Cell<T>::min) ? w(Cell<T>::min) : (x > w(Cell<T>::max) ? w(Cell<T>::max) : x));
+      }
+
+      template<typename T>
+      VA_HD inline T vmax(const T a, const T b) { return a > b ? a : b; }
+
+      /**
+       * @brief
+       * Max and 2nd-max bookkeeping of one read, the lane program of AlignerT::_fill_cell_finish()
+       * and AlignerT::_commit_waiting().
+       */
+      template<typename T, bool MSONLY>
+      struct ReadState {
+          T max_score, sub_score, waiting_score, fwd_max, fwd_sub;
+          uint32_t max_pos, sub_pos, waiting_pos, max_last_pos, sub_last_pos, waiting_last_pos, max_count, sub_count;
+
+          VA_HD void clear() {
+              max_score = sub_score = waiting_score = fwd_max = fwd_sub = T(Cell<T>::min);
+              max_pos = sub_pos = waiting_pos = max_last_pos = sub_last_pos = waiting_last_pos = max_count =
+              sub_count = 0;
+          }
+
+          /**
+           * @param live False for a local cell at the zero score, which only checks the waiting 2nd-max
+           */
+          VA_HD void finish(const T s, const uint32_t pos, const uint32_t read_len, const bool live = true) {
+              if (MSONLY) {
+                  max_score = vmax(s, max_score);
+                  return;
+              }
+              if (live) {
+                  if (s == max_score) {
+                      if (pos > max_last_pos + read_len) ++max_count;
+                      max_last_pos = pos;
+                      waiting_pos = 0;
+                      waiting_score = sub_score;
+                  }
+                  if (s > max_score) {
+                      max_count = 1;
+                      max_pos = max_last_pos = pos;
+                      waiting_pos = 0;
+                      waiting_score = sub_score;
+                      max_score = s;
+                  }
+                  if (s == waiting_score && waiting_pos != 0) waiting_last_pos = pos;
+                  if (s == sub_score) {
+                      if (pos > max_last_pos + read_len && pos > sub_last_pos + read_len) ++sub_count;
+                      sub_last_pos = pos;
+                  }
+                  if (s > sub_score && s < max_score && pos > max_last_pos + read_len &&
+                      (waiting_pos == 0 || s > waiting_score)) {
+                      waiting_score = s;
+                      waiting_pos = waiting_last_pos = pos;
+                  }
+              }
+              if (waiting_score > sub_score && pos > waiting_pos + read_len && waiting_pos != 0) {
+                  commit();
+                  waiting_pos = 0;
+              }
+          }
+
+          VA_HD void commit_waiting() {
+              if (!MSONLY && waiting_score > sub_score && waiting_pos > max_last_pos) commit();
+          }
+
+          VA_HD void commit() {
+              sub_score = waiting_score;
+              sub_count = 1;
+              sub_pos = waiting_pos;
+              sub_last_pos = waiting_last_pos;
+          }
+      };
+
+      /**
+       * @return Query profile score of a row against a reference base, as AlignmentGroup packs it
+       */
+      VA_HD inline int32_t profile_score(const uint8_t read_base, const uint8_t mismatch, const uint8_t ref_base,
+                                         const Params &p) {
+          if (read_base == VA_GPU_PAD) return 0;
+          if (ref_base == 0 || read_base == 0) return -p.ambig; // rg::Base::N
+          return read_base == ref_base ? p.match : -int32_t(mismatch);
+      }
+
+      /**
+       * @brief
+       * Fill the graph for read i on one strand, as AlignerT::_fill_graph() does for its lane.
+       */
+      template<typename T, bool END_TO_END, bool MSONLY>
+      VA_HD void fill_graph(const Job &job, const uint32_t i, const unsigned strand, const T bias,
+                            ReadState<T, MSONLY> &st) {
+          const uint32_t L = job.p.read_len;
+          const size_t n = job.n, col = size_t(L + 1) * n;
+          T *const S = static_cast<T *>(job.work) + i, *const I = S + col;
+          const uint8_t *const base = job.base + size_t(strand) * L * n + i;
+          const uint8_t *const mism = job.mismatch + size_t(strand) * L * n + i;
+          const GraphView &g = job.g;
+
+          for (uint32_t node = 0; node < g.nodes; ++node) {
+              // Seed
+              const uint32_t pb = g.pred_off[node], pe = g.pred_off[node + 1];
+              if (pb == pe) {
+                  S[0] = I[0] = bias;
+                  for (uint32_t r = 1; r <= L; ++r) {
+                      if (END_TO_END) {
+                          const int64_t v = int64_t(bias) - job.p.ref_gopen - int64_t(r) * job.p.ref_gext;
+                          S[r * n] = T(v < Cell<T>::min ? Cell<T>::min : v);
+                      }
+                      else S[r * n] = bias;
+                      I[r * n] = S[r * n];
+                  }
+              } else {
+                  const T *ps = S + (2 + 2 * size_t(g.pred_slot[pb])) * col, *pi = ps + col;
+                  for (uint32_t r = 0; r <= L; ++r) {
+                      S[r * n] = ps[r * n];
+                      I[r * n] = pi[r * n];
+                  }
+                  for (uint32_t e = pb + 1; e < pe; ++e) {
+                      ps = S + (2 + 2 * size_t(g.pred_slot[e])) * col;
+                      pi = ps + col;
+                      for (uint32_t r = 1; r <= L; ++r) {
+                          S[r * n] = vmax(S[r * n], ps[r * n]);
+                          I[r * n] = vmax(I[r * n], pi[r * n]);
+                      }
+                  }
+              }
+
+              // Columns
+              const uint64_t sb = g.seq_off[node], se = g.seq_off[node + 1];
+              uint32_t curr_pos = g.end_pos[node] - uint32_t(se - sb) + 2;
+              for (uint64_t c = sb; c < se; ++c) {
+                  const uint8_t ref = g.seq[c];
+                  T Sd = bias, D = T(Cell<T>::min);
+                  for (uint32_t r = 1; r <= L; ++r) {
+                      T &s = S[r * n], &ic = I[r * n];
+                      D = vmax(sat<T>(D, -job.p.ref_gext), sat<T>(S[(r - 1) * n], -job.p.ref_goe));
+                      ic = vmax(sat<T>(ic, -job.p.read_gext), sat<T>(s, -job.p.read_goe));
+                      const T sr = sat<T>(Sd, profile_score(base[(r - 1) * n], mism[(r - 1) * n], ref, job.p));
+                      Sd = s;
+                      s = vmax(ic, vmax(D, sr));
+                      if (!END_TO_END) st.finish(s, curr_pos, L, s > bias);
+                  }
+                  if (END_TO_END) st.finish(S[L * n], curr_pos, L);
+                  ++curr_pos;
+              }
+
+              if (g.slot[node] >= 0) {
+                  T *ns = S + (2 + 2 * size_t(g.slot[node])) * col, *ni = ns + col;
+                  for (uint32_t r = 0; r <= L; ++r) {
+                      ns[r * n] = S[r * n];
+                      ni[r * n] = I[r * n];
+                  }
+              }
+          }
+      }
+
+      /**
+       * @brief
+       * Align read i on both strands, as AlignerT::_align_graph() does for its lane.
+       */
+      template<typename T, bool END_TO_END, bool MSONLY>
+      VA_HD void align_strands(const Job &job, const uint32_t i, const T bias) {
+          ReadState<T, MSONLY> st;
+          st.clear();
+          Out &o = job.out[i];
+          fill_graph<T, END_TO_END, MSONLY>(job, i, 0, bias, st);
+          st.commit_waiting();
+          o.max_strand = o.sub_strand = 0; // Strand::FWD
+          if (!job.fwdonly) {
+              st.max_last_pos = st.sub_last_pos = 0;
+              st.fwd_max = st.max_score;
+              st.fwd_sub = st.sub_score;
+              fill_graph<T, END_TO_END, MSONLY>(job, i, 1, bias, st);
+              st.commit_waiting();
+              o.max_strand = st.max_score > st.fwd_max ? 1 : 0;
+              o.sub_strand = st.sub_score > st.fwd_sub ? 1 : 0;
+          }
+          o.max_score = int32_t(typename Cell<T>::wide_t(st.max_score) - bias);
+          o.sub_score = int32_t(typename Cell<T>::wide_t(st.sub_score) - bias);
+          o.max_pos = st.max_pos;
+          o.sub_pos = st.sub_pos;
+          o.max_last_pos = st.max_last_pos;
+          o.sub_last_pos = st.sub_last_pos;
+          o.waiting_pos = st.waiting_pos;
+          o.waiting_last_pos = st.waiting_last_pos;
+          o.max_count = st.max_count;
+          o.sub_count = st.sub_count;
+      }
+
+      template<bool MSONLY>
+      VA_HD void align_read_mode(const Config &c, const Job &job, const uint32_t i) {
+          const int32_t range = int32_t(job.p.read_len) * job.p.match;
+          switch (c.cells) {
+              case Cells::NARROW:
+                  if (c.end_to_end) align_strands<int8_t, true, MSONLY>(job, i, int8_t(Cell<int8_t>::max - range));
+                  else align_strands<int8_t, false, MSONLY>(job, i, int8_t(Cell<int8_t>::min));
+                  break;
+              case Cells::WIDE:
+                  if (c.end_to_end) align_strands<int16_t, true, MSONLY>(job, i, int16_t(Cell<int16_t>::max - range));
+                  else align_strands<int16_t, false, MSONLY>(job, i, int16_t(Cell<int16_t>::min));
+                  break;
+              case Cells::ADAPTIVE:
+                  align_strands<int8_t, false, MSONLY>(job, i, int8_t(Cell<int8_t>::min));
+                  // Saturated at the top of the 8 bit range, see AdaptiveAlignerT
+                  if (job.out[i].max_score >= Cell<int8_t>::max - Cell<int8_t>::min) {
+                      align_strands<int16_t, false, MSONLY>(job, i, int16_t(Cell<int16_t>::min));
+                  }
+                  break;
+              case Cells::EXACT:
+                  align_strands<int32_t, true, MSONLY>(job, i, 0);
+                  break;
+          }
+      }
+
+      /**
+       * @brief
+       * Align read i of the job.
+       */
+      VA_HD inline void align_read(const Config &c, const Job &job, const uint32_t i) {
+          if (c.msonly) align_read_mode<true>(c, job, i);
+          else align_read_mode<false>(c, job, i);
+      }
+
+      /**
+       * @brief
+       * Host copy of a compiled graph in the layout of GraphView.
+       * @details
+       * Seed slots are assigned as AlignerT::_fill_graph() assigns them: a slot is reused once every successor
+       * of its node is filled, so slots are bounded by the widest frontier of the graph.
+       */
+      struct FlatGraph {
+          explicit FlatGraph(const CompiledGraph &g);
+
+          /**
+           * @return View of the host arrays
+           */
+          GraphView view() const;
+
+          std::vector<uint8_t> seq;
+          std::vector<uint64_t> seq_off;
+          std::vector<uint32_t> end_pos, pred_off, pred_slot;
+          std::vector<int32_t> slot;
+          uint32_t slots = 0;
+      };
+
+      /**
+       * @brief
+       * CUDA stream and buffers of one aligner on a device. Defined by the CUDA build, src/aligner_cuda.cu.
+       * @details
+       * Graphs are uploaded once per device and shared by its streams, keyed by fingerprint().
+       */
+      class Stream {
+        public:
+          /**
+           * @param device CUDA device
+           * @throws std::invalid_argument if the backend was not built or the device does not exist
+           */
+          explicit Stream(int device);
+          ~Stream();
+          Stream(const Stream &) = delete;
+          Stream &operator=(const Stream &) = delete;
+
+          /**
+           * @return true if the graph with key is on the device
+           */
+          bool cached(uint64_t key) const;
+
+          /**
+           * @brief
+           * Copy a graph to the device, if no other stream has.
+           */
+          void upload(uint64_t key, const FlatGraph &g);
+
+          /**
+           * @brief
+           * Align the reads of job to a cached graph, and wait for the results.
+           * @param c Cells
+           * @param key Graph key
+           * @param job Host base, mismatch and out arrays, scores, read count and strands. g and work are set
+           * by the stream.
+           * @throws std::runtime_error on a CUDA error
+           */
+          void run(const Config &c, uint64_t key, const Job &job);
+
+        private:
+          struct Impl;
+          std::unique_ptr<Impl> _impl;
+      };
+
+      /**
+       * @param g Compiled graph
+       * @return 64 bit FNV-1a hash of the bases, positions and edges, identifying uploaded copies
+       */
+      uint64_t fingerprint(const CompiledGraph &g);
+
+      /**
+       * @brief
+       * Pick the cells of the aligner make_aligner() would return.
+       * @param prof Score profile
+       * @param read_len Aligner read length
+       * @param use_wide 16 bit cells
+       * @param msonly Only the max score. Max only aligners collect every field, as from make_aligner().
+       * @throws std::domain_error if the cells cannot hold the scores, as the SIMD aligners do
+       */
+      Config config(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly);
+
+      /**
+       * @return Kernel scores of prof
+       */
+      Params params(const ScoreProfile &prof, size_t read_len);
+
+      /**
+       * @return Bytes of Job::work for n reads
+       */
+      size_t work_bytes(const Config &c, size_t read_len, uint32_t slots, size_t n);
+
+      /**
+       * @brief
+       * Pack reads into the [strand][row][read] arrays of Job::base and Job::mismatch.
+       */
+      void pack_reads(const EncodedReads &reads, const ScoreProfile &prof, size_t read_len,
+                      std::vector<uint8_t> &base, std::vector<uint8_t> &mismatch);
+
+      /**
+       * @brief
+       * Copy kernel outputs into aligns, the fields the reproduced aligner writes.
+       */
+      void scatter(const std::vector<Out> &out, const Config &c, const ScoreProfile &prof, Results &aligns);
+
+      /**
+       * @brief
+       * Run the kernel on the host, for reads against one graph.
+       */
+      void align_reference(const Config &c, const ScoreProfile &prof, size_t read_len, const EncodedReads &reads,
+                           const CompiledGraph &graph, Results &aligns, bool fwdonly);
+
+      /**
+       * @return true if the CUDA backend was built
+       */
+      bool built();
+
+      /**
+       * @return Number of CUDA devices, 0 if none or not built
+       */
+      int devices();
+
+      #ifndef __CUDACC__
+      /**
+       * @brief
+       * Create an aligner on a CUDA device. Arguments as make_aligner().
+       * @throws std::invalid_argument if the backend was not built or the device does not exist
+       */
+      std::unique_ptr<AlignerBase, AlignerDeleter>
+      make_aligner(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, int device);
+      #endif
+
+  }
+}
+
+#endif //VARGAS_GPU_H
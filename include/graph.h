@@ -23,6 +23,7 @@
 #include "varfile.h"
 #include "utils.h"
 #include "dyn_bitset.h"
+#include "population.h"
 
 #include <set>
 #include <sstream>
@@ -31,6 +32,8 @@
 #include <type_traits>
 #include <stdexcept>
 #include <utility>
+#include <memory>
+#include <atomic>
 
 namespace vargas {
 
@@ -139,7 +142,7 @@ namespace vargas {
        * Represents a node in the directed graphs.
        * @details
        * Sequences are stored numerically.
-       * populations are stored as bitsets, where 1 indicates that individual has
+       * populations are stored as PackedPopulations, the set of individuals that have
        * the given allele.
        */
       class Node {
@@ -153,8 +156,8 @@ namespace vargas {
           Node(const Node &n) : _end_pos(n._end_pos), _seq(n._seq), _individuals(n._individuals),
                                 _ref(n._ref), _pinch(n._pinch), _af(n._af), _id(n._id) {}
 
-          Node(unsigned pos, const std::string &seq, Population pop, bool ref, float af) :
-          _end_pos(pos), _seq(rg::seq_to_num(seq)), _individuals(std::move(pop)), _ref(ref), _af(af), _id(_newID++) {}
+          Node(unsigned pos, const std::string &seq, const Population &pop, bool ref, float af) :
+          _end_pos(pos), _seq(rg::seq_to_num(seq)), _individuals(pop), _ref(ref), _af(af), _id(_newID++) {}
 
           Node &operator=(const Node &n) = default;
 
@@ -184,7 +187,7 @@ namespace vargas {
            * @param pop Population filter
            * @return belongs
            */
-          bool belongs(const Population &pop) const { return pop && _individuals; }
+          bool belongs(const Population &pop) const { return _individuals.intersects(pop); }
 
           /**
            * @brief
@@ -225,10 +228,10 @@ namespace vargas {
 
           /**
            * @brief
-           * Reference to the raw Population data member.
+           * Reference to the raw population data member.
            * @return individuals
            */
-          const Population &individuals() const { return _individuals; }
+          const PackedPopulation &individuals() const { return _individuals; }
 
           /**
            * @brief
@@ -242,7 +245,14 @@ namespace vargas {
            * Set the population from an existing Population
            * @param pop
            */
-          void set_population(const Population &pop) { _individuals = pop; }
+          void set_population(const Population &pop) { _individuals = PackedPopulation(pop); }
+
+          /**
+           * @brief
+           * Set the population, sharing storage with pop. See PopulationStore.
+           * @param pop
+           */
+          void set_population(const PackedPopulation &pop) { _individuals = pop; }
 
           /**
            * @brief
@@ -250,7 +260,7 @@ namespace vargas {
            * @param len number of genotypes
            * @param val true/false for each individual
            */
-          void set_population(unsigned len, bool val) { _individuals = Population(len, val); }
+          void set_population(unsigned len, bool val) { _individuals = PackedPopulation(len, val); }
 
           /**
            * @brief
@@ -272,7 +282,7 @@ namespace vargas {
            */
           void set_as_ref() {
               _ref = true;
-              _individuals.set();
+              _individuals = PackedPopulation(_individuals.size(), true);
           }
 
           /**
@@ -324,12 +334,12 @@ namespace vargas {
               return _seq.crend();
           }
 
-          static unsigned _newID; /**< ID of the next instance to be created */
+          static std::atomic<unsigned> _newID; /**< ID of the next instance to be created */
 
         private:
           pos_t _end_pos; // End position of the sequence
           std::vector<rg::Base> _seq; // sequence in numeric form
-          Population _individuals; // Each bit marks an individual, 1 if they have this node
+          PackedPopulation _individuals; // Individuals that have this node
           bool _ref = false; // Part of the reference sequence if true
           bool _pinch = false; // If this node is removed, the graph will split into two distinct subgraphs
           float _af = 1;
@@ -354,7 +364,9 @@ namespace vargas {
            * @param g Graph
            * @param idx Node in the insertion order to begin iterator at.
            */
-          explicit GraphIterator(const Graph &g, const unsigned idx = 0) : _graph(g), _currID(idx), _empty(0) {}
+          explicit GraphIterator(const Graph &g, const unsigned idx = 0) : _graph(g), _currID(idx), _empty(0) {
+              _skip();
+          }
 
           GraphIterator operator=(const GraphIterator &gi) {
               _graph = gi._graph;
@@ -388,15 +400,8 @@ namespace vargas {
            * @return iterator to the next Node.
            */
           GraphIterator &operator++() {
-              if (FWD) {
-                  if (_currID < _graph.get()._add_order.size()) ++_currID;
-              }
-              else {
-                  // reverse iterator
-                  const auto s = _graph.get()._add_order.size();
-                  if (_currID == 0) _currID = s;
-                  else if (_currID != s) --_currID;
-              }
+              _step();
+              _skip();
               return *this;
           }
 
@@ -407,14 +412,8 @@ namespace vargas {
            */
           GraphIterator operator++(int) {
               auto ret = *this;
-              if (FWD) {
-                  if (_currID < _graph.get()._add_order.size()) ++_currID;
-              }
-              else {
-                  const auto s = _graph.get()._add_order.size();
-                  if (_currID == 0) _currID = s;
-                  else if (_currID != s) --_currID;
-              }
+              _step();
+              _skip();
               return ret;
           }
 
@@ -424,7 +423,7 @@ namespace vargas {
            * @return Node
            */
           T &operator*() const {
-              return _graph.get()._IDMap->at(_graph.get()._add_order[_currID]);
+              return _graph.get()._IDMap->at(_graph.get()._source()._add_order[_currID]);
           }
 
           /**
@@ -437,23 +436,20 @@ namespace vargas {
           /**
            * @brief
            * All nodes that we've traversed that have incoming edges to the current node.
+           * @details
+           * For graph views the edges are filtered into a buffer, valid until the next call to
+           * incoming() or outgoing().
            * @return vector of previous nodes
            */
           const std::vector<unsigned> &incoming() const {
-              try {
-                  // Assume the previous edge existing is the common case (DAG w 1 start node)
-                  return _graph.get()._prev_map.at(_graph.get()._add_order[_currID]);
-              } catch (std::exception &e) { return _empty; }
+              return _edges_of(_graph.get()._source()._prev_map);
           }
 
           /**
-           * @return vector of all outgoing edges
+           * @return vector of all outgoing edges, see incoming()
            */
           const std::vector<unsigned> &outgoing() const {
-              try {
-                  // Assume the previous edge existing is the common case (DAG w 1 start node)
-                  return _graph.get()._next_map.at(_graph.get()._add_order[_currID]);
-              } catch (std::exception &e) { return _empty; }
+              return _edges_of(_graph.get()._source()._next_map);
           }
 
           //TODO icc has a problem with this
@@ -469,6 +465,45 @@ namespace vargas {
           std::reference_wrapper<const Graph> _graph;
           unsigned _currID;
           const std::vector<unsigned> _empty;
+          mutable std::vector<unsigned> _edges; // Filtered edges of views
+
+          /**
+           * @brief
+           * Move one node in the source order, end is the order size in both directions.
+           */
+          void _step() {
+              const unsigned s = _graph.get()._source()._add_order.size();
+              if (FWD) {
+                  if (_currID < s) ++_currID;
+              }
+              else {
+                  if (_currID == 0) _currID = s;
+                  else if (_currID < s) --_currID;
+              }
+          }
+
+          /**
+           * @brief
+           * Views iterate over their source order, skip nodes not in the view.
+           */
+          void _skip() {
+              const Graph &g = _graph.get();
+              if (!g._parent) return;
+              const auto &order = g._source()._add_order;
+              while (_currID < order.size() && !g.contains(order[_currID])) _step();
+          }
+
+          const std::vector<unsigned> &_edges_of(const edgemap_t &edges) const {
+              const Graph &g = _graph.get();
+              auto e = edges.find(g._source()._add_order[_currID]);
+              if (e == edges.end()) return _empty;
+              if (!g._parent) return e->second;
+              _edges.clear();
+              for (const unsigned n : e->second) {
+                  if (g.contains(n)) _edges.push_back(n);
+              }
+              return _edges;
+          }
       };
 
       using const_iterator = GraphIterator<const Graph::Node, true>;
@@ -485,15 +520,15 @@ namespace vargas {
        * @return end iterator.
        */
       const_iterator end() const {
-          return const_iterator(*this, _add_order.size());
+          return const_iterator(*this, _source()._add_order.size());
       }
 
       const_reverse_iterator rbegin() const {
-          return const_reverse_iterator(*this, _add_order.size() - 1);
+          return const_reverse_iterator(*this, _source()._add_order.size() - 1);
       }
 
       const_reverse_iterator rend() const {
-          return const_reverse_iterator(*this, _add_order.size());
+          return const_reverse_iterator(*this, _source()._add_order.size());
       }
 
       /**
@@ -558,6 +593,43 @@ namespace vargas {
         */
       Graph(const Graph &g, Type t);
 
+      /**
+       * @brief
+       * Create a view of another Graph with a population filter.
+       * @details
+       * The view has the same nodes and edges as Graph(*parent, filter), but does not copy the node order or
+       * edges. Membership and adjacency are computed from the parent while iterating, so a view costs
+       * little more than its filter. Views are read only and keep the parent alive. Views of views are
+       * supported; the node order and edges are those of the nearest graph that is not a view, see source().
+       * @param parent Graph to derive the view from
+       * @param filter population filter, only include nodes representative of this population
+       * @throws std::invalid_argument if parent is null
+       */
+      Graph(std::shared_ptr<const Graph> parent, const Population &filter);
+
+      /**
+       * @return true if this graph is a view of another graph
+       */
+      bool is_view() const { return bool(_parent); }
+
+      /**
+       * @return Graph the view was created from, null if this is not a view
+       */
+      std::shared_ptr<const Graph> parent() const { return _parent; }
+
+      /**
+       * @return Graph storing the node order and edges this graph is iterated with. Self if not a view.
+       */
+      const Graph &source() const { return _source(); }
+
+      /**
+       * @param id Node ID from the source graph
+       * @return true if the node is included in this graph
+       */
+      bool contains(unsigned id) const {
+          return !_parent || (_IDMap->at(id).belongs(_filter) && _parent->contains(id));
+      }
+
       /**
        * @brief
        * Add a new node to the Graph.
@@ -565,6 +637,7 @@ namespace vargas {
        * The first node added is set as the Graph root. Nodes must be added in topographical order.
        * @param n node to add, ID of original node is preserved.
        * @return ID of the inserted node
+       * @throws std::domain_error if the graph is a view
        */
       unsigned add_node(const Node &n);
 
@@ -574,6 +647,7 @@ namespace vargas {
        * n1->n2
        * @param n1 Node one ID
        * @param n2 Node two ID
+       * @throws std::domain_error if the graph is a view
        */
       bool add_edge(unsigned n1, unsigned n2);
 
@@ -590,15 +664,23 @@ namespace vargas {
        * @brief
        * Maps a node ID to a vector of all next nodes (outgoing edges)
        * @return map of ID, outgoing edge vectors
+       * @throws std::domain_error if the graph is a view, use the iterators or source()
        */
-      const edgemap_t &next_map() const { return _next_map; }
+      const edgemap_t &next_map() const {
+          _check_materialized();
+          return _next_map;
+      }
 
       /**
        * @brief
        *  Maps a node ID to a vector of all incoming edge nodes
        *  @return map of ID, incoming edges
+       *  @throws std::domain_error if the graph is a view, use the iterators or source()
        */
-      const edgemap_t &prev_map() const { return _prev_map; }
+      const edgemap_t &prev_map() const {
+          _check_materialized();
+          return _prev_map;
+      }
 
       /**
        * @brief
@@ -685,7 +767,12 @@ namespace vargas {
        */
       bool validate() const;
 
+      /**
+       * @return Node IDs in topological order
+       * @throws std::domain_error if the graph is a view, use the iterators or source()
+       */
       const std::vector<unsigned> &order() const {
+          _check_materialized();
           return _add_order;
       }
 
@@ -761,14 +848,13 @@ namespace vargas {
        */
       Stats statistics() const {
           Stats ret;
-          for (const auto& i : *this) {
+          for (auto gi = begin(); gi != end(); ++gi) {
+              const auto &i = *gi;
               ++ret.num_nodes;
               ret.total_length += i.length();
               ret.num_snps += (i.length() == 1 && !i.is_ref());
               ret.num_dels += (i.length() == 0);
-              if (_next_map.count(i.id())) {
-                  ret.num_edges += _next_map.at(i.id()).size();
-              }
+              ret.num_edges += gi.outgoing().size();
           }
           return ret;
       }
@@ -784,6 +870,13 @@ namespace vargas {
       std::vector<unsigned> _add_order; // Order nodes were added
       unsigned _pop_size = 0;
       Population _filter;
+      std::shared_ptr<const Graph> _parent; // Set for views, which leave the order and edges empty
+
+      const Graph &_source() const { return _parent ? _parent->_source() : *this; }
+
+      void _check_materialized() const {
+          if (_parent) throw std::domain_error("Graph view has no node order or edges of its own.");
+      }
 
       /**
        * Given a subset of nodes from Graph g, rebuild all applicable edges in the new graph.
@@ -832,6 +925,237 @@ namespace vargas {
       return os;
   }
 
+  /**
+   * @brief
+   * Range of a CompiledGraph that can be aligned independently, see CompiledGraph::segments().
+   */
+  struct GraphSegment {
+      size_t warm; /**< First node filled, seeded as if it had no predecessors */
+      size_t begin; /**< First node that alignments are reported for */
+      size_t end; /**< One past the last node */
+  };
+
+  /**
+   * @brief
+   * Immutable, flat view of a Graph for alignment.
+   * @details
+   * Nodes are stored by dense index in topological order. All sequences share one contiguous base array, and
+   * incoming edges are stored as CSR offset/index arrays of dense indices. End positions and pinch flags are
+   * parallel arrays. The view does not reference the source Graph once built. The arrays can also be viewed in
+   * place, for example in a memory mapped graph file, see Sections.\n
+   * Usage: \n
+   * @code{.cpp}
+   * vargas::CompiledGraph cg(g);
+   * for (size_t i = 0; i < cg.size(); ++i) {
+   *     for (auto p = cg.pred_begin(i); p != cg.pred_end(i); ++p) std::cout << cg.id(*p) << "->" << cg.id(i);
+   * }
+   * @endcode
+   */
+  class CompiledGraph {
+    public:
+      /**
+       * @brief
+       * Arrays of a compiled graph, owned by the graph or viewed in place.
+       */
+      struct Sections {
+          size_t nodes = 0, length = 0, edges = 0;
+          const unsigned *id = nullptr; /**< nodes */
+          const rg::Base *seq = nullptr; /**< length */
+          const size_t *seq_offset = nullptr; /**< nodes + 1 */
+          const uint32_t *pred_offset = nullptr; /**< nodes + 1 */
+          const uint32_t *pred = nullptr; /**< edges */
+          const uint32_t *num_succ = nullptr; /**< nodes */
+          const pos_t *end_pos = nullptr; /**< nodes */
+          const pos_t *max_end = nullptr; /**< nodes, running max of end_pos */
+          const uint8_t *pinch = nullptr; /**< nodes */
+      };
+
+      CompiledGraph() : _seq_offset(1, 0), _pred_offset(1, 0) { _own(); }
+
+      /**
+       * @brief
+       * Copies own their arrays, including copies of a view.
+       */
+      CompiledGraph(const CompiledGraph &g);
+      CompiledGraph &operator=(const CompiledGraph &g);
+
+      /**
+       * @brief
+       * View arrays in place without copying them.
+       * @param s Arrays, which must outlive the graph unless owner keeps them alive
+       * @param owner Kept while the graph is alive, e.g. the mapped file holding s
+       * @throws std::domain_error if the offsets or edges are inconsistent
+       */
+      CompiledGraph(const Sections &s, std::shared_ptr<const void> owner);
+
+      /**
+       * @param g Graph to compile
+       * @throws std::domain_error if the graph is not topologically sorted
+       */
+      explicit CompiledGraph(const Graph &g) : CompiledGraph(g.begin(), g.end()) {}
+
+      /**
+       * @brief
+       * Compile a range of a graph. Every incoming edge must be from a node within the range.
+       * @param begin
+       * @param end
+       * @throws std::domain_error if a node has an incoming edge from a node not yet seen in the range
+       */
+      CompiledGraph(Graph::const_iterator begin, Graph::const_iterator end);
+
+      /**
+       * @brief
+       * Window of a compiled graph including bases from min to max. Nodes overlapping either end are cropped,
+       * and edges from nodes outside the window are dropped.
+       * @details
+       * Nodes before the window are skipped with a binary search, so the cost is proportional to the window.
+       * @param g Compiled graph
+       * @param min First position, inclusive
+       * @param max Last position, inclusive
+       */
+      CompiledGraph(const CompiledGraph &g, pos_t min, pos_t max);
+
+      /**
+       * @return Number of nodes
+       */
+      size_t size() const { return _p.nodes; }
+
+      /**
+       * @return Total sequence length of all nodes
+       */
+      size_t length() const { return _p.length; }
+
+      /**
+       * @param i dense node index
+       * @return Original node ID
+       */
+      unsigned id(size_t i) const { return _p.id[i]; }
+
+      /**
+       * @param i dense node index
+       * @return Pointer to the first base of the node sequence
+       */
+      const rg::Base *seq(size_t i) const { return _p.seq + _p.seq_offset[i]; }
+
+      /**
+       * @param i dense node index
+       * @return Length of the node sequence
+       */
+      size_t seq_len(size_t i) const { return _p.seq_offset[i + 1] - _p.seq_offset[i]; }
+
+      /**
+       * @param i dense node index
+       * @return End position of the node, 0 indexed
+       */
+      pos_t end_pos(size_t i) const { return _p.end_pos[i]; }
+
+      bool is_pinched(size_t i) const { return _p.pinch[i]; }
+
+      /**
+       * @param i dense node index
+       * @return Dense indices of nodes with an edge into i
+       */
+      const uint32_t *pred_begin(size_t i) const { return _p.pred + _p.pred_offset[i]; }
+      const uint32_t *pred_end(size_t i) const { return _p.pred + _p.pred_offset[i + 1]; }
+      size_t num_pred(size_t i) const { return _p.pred_offset[i + 1] - _p.pred_offset[i]; }
+
+      /**
+       * @param i dense node index
+       * @return Number of outgoing edges from i within the view
+       */
+      uint32_t num_succ(size_t i) const { return _p.num_succ[i]; }
+
+      /**
+       * @return The arrays of the graph, valid while it is alive
+       */
+      const Sections &sections() const { return _p; }
+
+      /**
+       * @return true if the arrays are viewed in place rather than owned
+       */
+      bool in_place() const { return _view; }
+
+      /**
+       * @brief
+       * Partition the graph at cut nodes into segments of at least min_len bases.
+       * @details
+       * A cut node has no edge jumping over it, like a pinched node in a full graph. Each segment after the
+       * first starts filling at an earlier cut that is at least overlap bases before it along every path,
+       * so the scores reaching the segment do not depend on the nodes before the warm-up.
+       * @param overlap Minimum warm-up length in bases
+       * @param min_len Minimum segment length in bases
+       * @return Segments in order, a single segment if the graph cannot be split
+       */
+      std::vector<GraphSegment> segments(size_t overlap, size_t min_len) const;
+
+    private:
+      /**
+       * @brief
+       * Point the sections at the owned arrays.
+       */
+      void _own();
+
+      Sections _p; // Read by every accessor, over the vectors below or a view
+      std::shared_ptr<const void> _owner; // Keeps a view's arrays alive
+      bool _view = false;
+      std::vector<unsigned> _id;
+      std::vector<rg::Base, rg::page_allocator<rg::Base>> _seq; // Streamed by the aligners, may use huge pages
+      std::vector<size_t> _seq_offset; // size() + 1
+      std::vector<uint32_t> _pred_offset; // size() + 1
+      std::vector<uint32_t> _pred;
+      std::vector<uint32_t> _num_succ;
+      std::vector<pos_t> _end_pos;
+      std::vector<pos_t> _max_end; // Running max of _end_pos, to find the first node of a window
+      std::vector<uint8_t> _pinch;
+  };
+
+  /**
+   * @brief
+   * Graphs sharing the nodes of a base graph, for aligning reads to all of them in one pass.
+   * @details
+   * Each base node records which graphs include it. A graph must list its nodes in base order, and have
+   * exactly the base edges between its nodes, as graphs derived from the base (subgraphs, REF, MAXAF) do.
+   */
+  class CompiledGraphSet {
+    public:
+      static constexpr size_t max_graphs = 64;
+
+      /**
+       * @param base Graph including every node of the others
+       * @param graphs Graphs to align to
+       * @throws std::invalid_argument if there are no graphs or more than max_graphs
+       * @throws std::domain_error if a graph is not a restriction of base
+       */
+      CompiledGraphSet(std::shared_ptr<const CompiledGraph> base,
+                       std::vector<std::shared_ptr<const CompiledGraph>> graphs);
+
+      /**
+       * @return Graph including the nodes of every graph
+       */
+      const CompiledGraph &base() const { return *_base; }
+
+      /**
+       * @return Number of graphs
+       */
+      size_t size() const { return _graphs.size(); }
+
+      /**
+       * @param t graph index
+       */
+      const CompiledGraph &graph(size_t t) const { return *_graphs[t]; }
+
+      /**
+       * @param n dense node index of the base
+       * @return Bit t is set if graph t includes the node
+       */
+      uint64_t members(size_t n) const { return _members[n]; }
+
+    private:
+      std::shared_ptr<const CompiledGraph> _base;
+      std::vector<std::shared_ptr<const CompiledGraph>> _graphs;
+      std::vector<uint64_t> _members;
+  };
+
   /**
    * @brief
    * Takes a reference sequence and a variant file and builds a graph.
@@ -938,6 +1262,28 @@ namespace vargas {
           return open_vcf(file_name);
       }
 
+      /**
+       * @brief
+       * Number the nodes of each build from id, in the order they are added, rather than from the
+       * global Node counter. Graphs built by different factories can then be built concurrently and
+       * renumbered into one graph by shifting their IDs.
+       * @param id First node ID
+       */
+      void set_first_id(unsigned id) {
+          _local_ids = true;
+          _first_id = id;
+      }
+
+      /**
+       * @brief
+       * Decompress the variant file with n additional threads during build. BCF records are always
+       * read ahead of graph construction by a separate thread, see VCF::set_prefetch().
+       * @param n Number of decompression threads
+       */
+      void set_threads(unsigned n) {
+          _decode_threads = n;
+      }
+
       /**
        * @brief
        * Apply the various parameters and build the Graph from a VCF and a FASTA.
@@ -989,6 +1335,21 @@ namespace vargas {
       std::string _fa_file;
       std::unique_ptr<VCF> _vf;
       ifasta _fa;
+      PopulationStore _pops; // Carrier sets repeat across sites, nodes share them
+      bool _local_ids = false;
+      unsigned _first_id = 0, _next_id = 0;
+      unsigned _decode_threads = 0;
+      static constexpr size_t PREFETCH = 64; // Records read ahead of the build
+
+      /**
+       * @brief
+       * Number n if using local IDs, and add it to g.
+       * @return ID of the node
+       */
+      unsigned _add_node(Graph &g, Graph::Node &n) {
+          if (_local_ids) n.set_id(_next_id++);
+          return g.add_node(n);
+      }
 
   };
 
@@ -25,6 +25,9 @@
 #include <stdexcept>
 #include <random>
 #include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
 
 
 namespace vargas {
@@ -51,6 +54,92 @@ namespace vargas {
       std::vector<std::string> _contig_hdr_order; // contigs in the order they are listed in header
   };
 
+  /**
+   * @brief
+   * Read only memory map of a file. Pages are shared with other processes mapping the same file.
+   */
+  class MappedFile {
+    public:
+      /**
+       * @param filename File to map
+       * @throws std::invalid_argument if the file cannot be opened or mapped
+       */
+      explicit MappedFile(const std::string &filename);
+      ~MappedFile();
+
+      MappedFile(const MappedFile &) = delete;
+      MappedFile &operator=(const MappedFile &) = delete;
+
+      const char *data() const { return _data; }
+      size_t size() const { return _size; }
+
+    private:
+      const char *_data = nullptr;
+      size_t _size = 0;
+  };
+
+  /**
+   * @brief
+   * Layout of the binary graph definition file. All sections are 8 byte aligned, offsets are from the file start.
+   * @details
+   * @code{.txt}
+   * header      GDFHeader
+   * meta        u32 count, [u32 len, key, u32 len, value]...
+   * contigs     u32 count, [u32 offset, u32 len, name]...  (header order)
+   * nodes       GDFNode[num_nodes]
+   * sequence    rg::Base[seq_len], one byte per base
+   * graphs      u32 count, [GDFGraph, label, u32 order[order_len] (node indices),
+   *                         u64 out_offset[order_len + 1], u32 out[num_edges] (node indices)]...
+   * compiled    Compiled, then the CompiledGraph::Sections arrays of the base graph, each 8 byte aligned:
+   *             u32 id[n], u64 seq_offset[n + 1], u32 pred_offset[n + 1], u32 pred[e], u32 num_succ[n],
+   *             u32 end_pos[n], u32 max_end[n], u8 pinch[n], rg::Base seq[len]
+   * @endcode
+   * The compiled base graph is aligned to in place from the mapping. Other graphs are compiled from the decoded
+   * nodes on first use.
+   */
+  namespace gdf {
+      const char MAGIC[8] = {'V', 'G', 'D', 'F', 'B', 'I', 'N', '\0'};
+      const uint32_t VERSION = 2;
+      const uint32_t ENDIAN = 0x01020304;
+
+      struct Header {
+          char magic[8];
+          uint32_t version;
+          uint32_t endian;
+          uint64_t meta_off, contig_off, node_off, seq_off, graph_off;
+          uint64_t num_nodes, seq_len;
+          uint64_t compiled_off; /**< 0 if there is no base graph */
+      };
+
+      struct Node {
+          uint64_t seq_off;
+          uint32_t seq_len;
+          uint32_t id;
+          uint32_t end_pos;
+          float af;
+          uint8_t pinch, ref, pad[6];
+      };
+
+      struct Graph {
+          uint64_t order_len;
+          uint64_t num_edges;
+          uint32_t label_len, pad;
+      };
+
+      struct Compiled {
+          uint64_t num_nodes;
+          uint64_t seq_len;
+          uint64_t num_edges;
+      };
+
+      static_assert(sizeof(Header) == 80, "Unexpected GDF header size.");
+      static_assert(sizeof(Compiled) == 24, "Unexpected GDF compiled graph size.");
+      static_assert(sizeof(size_t) == 8 && sizeof(unsigned) == 4 && sizeof(rg::Base) == 1 && sizeof(pos_t) == 4,
+                    "Compiled graph arrays are mapped in place.");
+      static_assert(sizeof(Node) == 32, "Unexpected GDF node size.");
+      static_assert(sizeof(Graph) == 24, "Unexpected GDF graph size.");
+  }
+
   /*
    * @brief
    * Handle graph generation and file IO
@@ -80,6 +169,9 @@ namespace vargas {
    * ...
    *
    * @endcode
+   * A binary file (see gdf::Header) can be written instead. Binary files are memory mapped on open, and
+   * nodes and graphs are decoded from the mapping the first time a graph is requested. The compiled base graph
+   * is not decoded, it views the arrays of the mapping in place.
    */
   class GraphMan {
     public:
@@ -105,18 +197,24 @@ namespace vargas {
 
       /**
        * @brief
-       * Write graphs to a file. Graphs are consumed while written.
+       * Write graphs to a file.
        * @param filename Output file
+       * @param binary Write the binary format instead of text.
        */
-      void write(const std::string &filename);
+      void write(const std::string &filename, bool binary=false);
 
       /**
        * @brief
-       * Open a graph definition file.
+       * Open a graph definition file. The format (text or binary) is detected from the file.
        * @param filename
        */
       void open(const std::string &filename);
 
+      /**
+       * @return true if the file starts with the binary GDF magic.
+       */
+      static bool is_binary(const std::string &filename);
+
       /**
        * @brief
        * Return the contig and position relative to the contig beginning.
@@ -149,14 +247,37 @@ namespace vargas {
           return _graphs.count(label);
       }
 
-      std::shared_ptr<Graph> at(std::string label) const {
-          std::transform(label.begin(), label.end(), label.begin(), tolower);
-          if (!count(label)) throw std::domain_error("No graph named \"" + label + "\"");
-          return _graphs.at(label);
-      }
+      /**
+       * @brief
+       * Get a graph, decoding it first if it was opened from a binary file. Thread safe.
+       * @param label Graph label, not case sensitive
+       * @throws std::domain_error if there is no such graph
+       */
+      std::shared_ptr<Graph> at(std::string label) const;
+
+      /**
+       * @brief
+       * Compiled view of a graph for alignment. Built on first use and cached. Thread safe.
+       * @details
+       * A cached view does not reflect later changes made to the graph through operator[].
+       * @param label Graph label, not case sensitive
+       * @throws std::domain_error if there is no such graph
+       */
+      std::shared_ptr<const CompiledGraph> compiled(std::string label) const;
+
+      /**
+       * @brief
+       * Compiled views of several graphs over the base graph, for aligning to all of them in one pass.
+       * Built on first use and cached. Thread safe.
+       * @param labels Graph labels, not case sensitive
+       * @throws std::domain_error if there is no such graph, or a graph is not derived from the base
+       * @throws std::invalid_argument if there are no labels or more than CompiledGraphSet::max_graphs
+       */
+      std::shared_ptr<const CompiledGraphSet> compiled_set(std::vector<std::string> labels) const;
 
       std::shared_ptr<Graph> operator[](std::string label) {
           std::transform(label.begin(), label.end(), label.begin(), tolower);
+          if (_graphs.count(label)) return at(label);
           return _graphs[label];
       }
 
@@ -186,6 +307,16 @@ namespace vargas {
           _print = true;
       }
 
+      /**
+       * @brief
+       * Build up to n regions concurrently in create_base(). Each region is built into its own node ID
+       * and position range, and the regions are merged in order, so the graph does not depend on n.
+       * @param n threads, default 1
+       */
+      void set_threads(unsigned n) {
+          _threads = std::max(1u, n);
+      }
+
       /**
        * @brief
        * Parse a subgraph definition and create the child graph. This should be called after building the base.
@@ -193,19 +324,47 @@ namespace vargas {
        * a graph from a previous GDEF. Labels are not case sensitive.
        * @details
        * Format : [<parent>:]*<label>=[0-9]{1,2}[%]
-       * Implied root parent is the base graph, or all the samples.
+       * Implied root parent is the base graph, or all the samples. The child is a view of its parent (see
+       * Graph::is_view()), so only the population filter is stored until the graphs are written.
        * @return label of the graph
        */
       std::string derive(std::string def);
 
 
     private:
+      void _write_text(const std::string &filename);
+      void _write_binary(const std::string &filename);
+      void _open_text(const std::string &filename);
+      void _open_binary(const std::string &filename);
+
+      /**
+       * @brief
+       * Decode the node table, and the given graph, from the mapped file. Caller holds _mut.
+       */
+      std::shared_ptr<Graph> _decode(const std::string &label) const;
+
+      /**
+       * @brief
+       * Decode all graphs that have not been decoded yet.
+       */
+      void _decode_all() const;
+
       std::shared_ptr<Graph::nodemap_t> _nodes;
-      std::map<std::string, std::shared_ptr<vargas::Graph>> _graphs; // Map label to a graph
+      // Map label to a graph. Graphs from a binary file are null until decoded.
+      mutable std::map<std::string, std::shared_ptr<vargas::Graph>> _graphs;
+      mutable std::map<std::string, std::shared_ptr<const CompiledGraph>> _compiled;
+      mutable std::map<std::vector<std::string>, std::shared_ptr<const CompiledGraphSet>> _compiled_sets;
+      std::shared_ptr<MappedFile> _map;
+      std::map<std::string, size_t> _graph_offsets; // Binary graph record offsets in _map
+      CompiledGraph::Sections _base_sections; // Compiled base graph arrays in _map, if _mapped_base
+      bool _mapped_base = false;
+      mutable bool _nodes_decoded = true;
+      mutable std::mutex _mut;
       coordinate_resolver _resolver;
       std::map<std::string, std::string> _aux;
       bool _assume_contig = false;
       bool _print = false;
+      unsigned _threads = 1;
   };
 }
 
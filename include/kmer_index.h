@@ -0,0 +1,194 @@
+/**
+ * @brief
+ * Index of k-mers spelled along graph paths, used to find candidate windows for reads.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_KMER_INDEX_H
+#define VARGAS_KMER_INDEX_H
+
+#include "graph.h"
+#include "graphman.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace vargas {
+
+  /**
+   * @brief
+   * Graph positions a read may align to.
+   */
+  struct KmerWindow {
+      pos_t min, max; /**< First and last position, inclusive */
+      unsigned hits; /**< Seed hits supporting the window */
+  };
+
+  /**
+   * @brief
+   * Layout of the binary k-mer index file, written next to the graph definition file.
+   * @details
+   * @code{.txt}
+   * header      Header
+   * entries     Entry[count], sorted by k-mer then position
+   * @endcode
+   */
+  namespace kmi {
+      const char MAGIC[8] = {'V', 'K', 'M', 'I', 'D', 'X', '\0', '\0'};
+      const uint32_t VERSION = 2;
+
+      struct Header {
+          char magic[8];
+          uint32_t version;
+          uint32_t k;
+          uint64_t count;
+          uint64_t length; /**< Bases of the indexed graph */
+          uint32_t nodes; /**< Nodes of the indexed graph */
+          uint32_t pad;
+      };
+
+      struct Entry {
+          uint64_t kmer; /**< 2 bits per base, first base in the high bits */
+          pos_t pos; /**< Position of the last base */
+          uint32_t pad;
+      };
+
+      static_assert(sizeof(Header) == 40, "Unexpected k-mer index header size.");
+      static_assert(sizeof(Entry) == 16, "Unexpected k-mer index entry size.");
+  }
+
+  /**
+   * @brief
+   * Sorted table of the k-mers along every path of a graph, and the position each one ends at.
+   * @details
+   * K-mers cross node boundaries following the graph edges, so k-mers containing variant alleles are
+   * indexed. Where many short variant nodes are close together the number of distinct paths into a node
+   * is capped, and k-mers along the paths over the cap are not indexed. K-mers containing N are skipped.
+   * Indices opened from a file are memory mapped, and are read only and thread safe.
+   */
+  class KmerIndex {
+    public:
+      using Entry = kmi::Entry;
+
+      KmerIndex() = default;
+      KmerIndex(const KmerIndex &) = delete;
+      KmerIndex &operator=(const KmerIndex &) = delete;
+      KmerIndex(KmerIndex &&) = default;
+      KmerIndex &operator=(KmerIndex &&) = default;
+
+      /**
+       * @param g Graph to index
+       * @param k K-mer length, at most 32
+       * @param max_paths Max distinct k-1 base paths tracked into each node
+       * @throws std::invalid_argument if k is not in [1, 32]
+       */
+      KmerIndex(const CompiledGraph &g, unsigned k, unsigned max_paths = 16);
+
+      /**
+       * @param filename Index file
+       */
+      explicit KmerIndex(const std::string &filename) {
+          open(filename);
+      }
+
+      /**
+       * @param gdf Graph definition file
+       * @return Name of the index file stored alongside it
+       */
+      static std::string filename(const std::string &gdf) {
+          return gdf + ".kmi";
+      }
+
+      /**
+       * @brief
+       * Map an index file.
+       * @throws std::invalid_argument if the file is not a k-mer index
+       */
+      void open(const std::string &filename);
+
+      /**
+       * @brief
+       * Write the index to a file.
+       */
+      void write(const std::string &filename) const;
+
+      /**
+       * @brief
+       * Check the index was built from a graph of the same shape.
+       * @param g Graph to prefilter
+       * @throws std::invalid_argument if the length or node count of g differs from the indexed graph
+       */
+      void check(const CompiledGraph &g) const;
+
+      /**
+       * @return K-mer length
+       */
+      unsigned k() const { return _k; }
+
+      /**
+       * @return Number of indexed (k-mer, position) pairs
+       */
+      size_t size() const { return _end - _begin; }
+
+      /**
+       * @param kmer Packed k-mer
+       * @return Range of entries for the k-mer, sorted by position
+       */
+      std::pair<const Entry *, const Entry *> find(uint64_t kmer) const;
+
+      /**
+       * @brief
+       * Find windows a read could align to from its seed hits.
+       * @details
+       * Each hit predicts where the read ends. Predictions within one read length of each other are
+       * clustered, and each cluster is padded by a read length for gaps. The best cluster is always kept if
+       * there is any hit, others need at least min_hits. K-mers with more than max_occ positions are
+       * ignored as repeats.
+       * @param seq Read bases
+       * @param len Read length
+       * @param revcomp Also seed the reverse complement
+       * @param out Windows, best supported first. Empty if there are no hits.
+       */
+      void windows(const rg::Base *seq, size_t len, bool revcomp, std::vector<KmerWindow> &out) const;
+
+      /**
+       * @param n Skip k-mers with more than n positions, default 64
+       */
+      void set_max_occ(unsigned n) { _max_occ = n; }
+
+      /**
+       * @param n Hits needed to keep a window other than the best, default 2
+       */
+      void set_min_hits(unsigned n) { _min_hits = n; }
+
+      /**
+       * @param n Max windows per read, default 8
+       */
+      void set_max_windows(unsigned n) { _max_windows = n; }
+
+    private:
+      /**
+       * @brief
+       * Add the predicted read end position of each seed hit on one strand.
+       */
+      void _seed(const rg::Base *seq, size_t len, std::vector<pos_t> &ends) const;
+
+      unsigned _k = 0;
+      uint64_t _length = 0;
+      uint32_t _nodes = 0;
+      unsigned _max_occ = 64, _min_hits = 2, _max_windows = 8;
+      std::vector<Entry> _entries; // Built in memory
+      std::shared_ptr<MappedFile> _map; // Or opened from a file
+      const Entry *_begin = nullptr, *_end = nullptr;
+  };
+
+}
+
+#endif //VARGAS_KMER_INDEX_H
@@ -0,0 +1,164 @@
+/**
+ * @brief
+ * Compressed, immutable sets of individuals, and a store that deduplicates them.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_POPULATION_H
+#define VARGAS_POPULATION_H
+
+#include "dyn_bitset.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+
+namespace vargas {
+
+  /**
+   * @brief
+   * Immutable set of individuals, stored in the smallest of several encodings.
+   * @details
+   * Sets with no or all individuals take no storage. Sets with few members are stored as sorted indices,
+   * and sets missing few individuals (such as REF alleles) as the sorted indices of the missing ones.
+   * Anything else is stored as 64 bit words. Copies share the storage, see PopulationStore to share it
+   * between equal sets.\n
+   * Usage: \n
+   * @code{.cpp}
+   * vargas::PackedPopulation p(std::vector<bool>{0, 1, 0, 0});
+   * p.at(1); // true
+   * p.intersects(std::vector<bool>{1, 1, 0, 0}); // true
+   * p.encoding() == vargas::PackedPopulation::Encoding::SPARSE; // true
+   * @endcode
+   */
+  class PackedPopulation {
+    public:
+      using Population = dyn_bitset<64>;
+
+      enum class Encoding : uint8_t {
+          EMPTY, /**< No individuals */
+          FULL, /**< Every individual */
+          SPARSE, /**< Indices of the individuals in the set */
+          EXCLUDED, /**< Indices of the individuals not in the set */
+          DENSE /**< One bit per individual */
+      };
+
+      /**
+       * @brief
+       * Empty set of size 0.
+       */
+      PackedPopulation() = default;
+
+      /**
+       * @param pop Set to encode
+       */
+      explicit PackedPopulation(const Population &pop);
+
+      /**
+       * @param len Number of individuals
+       * @param val true for every individual, false for none
+       */
+      PackedPopulation(size_t len, bool val) :
+      _size(len), _count(val ? len : 0), _enc(val && len ? Encoding::FULL : Encoding::EMPTY) {}
+
+      /**
+       * @return number of individuals
+       */
+      size_t size() const { return _size; }
+
+      /**
+       * @return number of individuals in the set
+       */
+      size_t count() const { return _count; }
+
+      Encoding encoding() const { return _enc; }
+
+      /**
+       * @param idx Individual
+       * @return true if idx is in the set
+       * @throws std::range_error if idx is out of range
+       */
+      bool at(size_t idx) const;
+
+      /**
+       * @param filter Population of the same size
+       * @return true if any individual in the filter is in the set
+       * @throws std::invalid_argument if the sizes differ
+       */
+      bool intersects(const Population &filter) const;
+
+      /**
+       * @return The set as a bitset
+       */
+      Population unpack() const;
+
+      /**
+       * @return Bytes of storage, shared by all copies
+       */
+      size_t bytes() const;
+
+      bool operator==(const PackedPopulation &o) const;
+
+      bool operator!=(const PackedPopulation &o) const { return !operator==(o); }
+
+    private:
+      friend class PopulationStore;
+
+      struct Data {
+          std::vector<uint32_t> idx; // SPARSE and EXCLUDED
+          std::vector<uint64_t> words; // DENSE
+      };
+
+      std::shared_ptr<const Data> _data; // Null for EMPTY and FULL
+      uint32_t _size = 0, _count = 0;
+      Encoding _enc = Encoding::EMPTY;
+
+      uint64_t _hash() const;
+  };
+
+  /**
+   * @brief
+   * Interns PackedPopulations so that equal sets share their storage.
+   * @details
+   * Large panels repeat the same carrier sets at many sites, for example singletons of one sample. Not
+   * thread safe.
+   */
+  class PopulationStore {
+    public:
+      using Population = PackedPopulation::Population;
+
+      /**
+       * @param pop Set to encode
+       * @return Encoded set, sharing storage with a previously interned equal set.
+       */
+      PackedPopulation intern(const Population &pop);
+
+      /**
+       * @return Number of distinct stored sets, excluding ones that need no storage
+       */
+      size_t size() const { return _size; }
+
+      /**
+       * @return Bytes of storage of the distinct sets
+       */
+      size_t bytes() const { return _bytes; }
+
+      void clear() {
+          _sets.clear();
+          _size = _bytes = 0;
+      }
+
+    private:
+      std::unordered_map<uint64_t, std::vector<PackedPopulation>> _sets;
+      size_t _size = 0, _bytes = 0;
+  };
+
+}
+
+#endif //VARGAS_POPULATION_H
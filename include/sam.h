@@ -16,12 +16,17 @@
 #define VARGAS_SAM_H
 
 #include "utils.h"
+#include "htslib/sam.h"
 #include <unordered_map>
 #include <utility>
 #include <vector>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define CIGAR_OPERATORS "MIDNSHPX" // Possible modifications in a CIGAR string
 
@@ -67,6 +72,10 @@ namespace vargas {
 
       size_t size() const { return _cigar.size(); }
 
+      void push_back(size_t len, char op) { _cigar.emplace_back(len, op); }
+
+      void clear() { _cigar.clear(); }
+
       typename std::vector<std::pair<size_t, char>>::const_iterator begin() const {
           return _cigar.cbegin();
       }
@@ -125,6 +134,25 @@ namespace vargas {
   class SAM {
     public:
 
+      /**
+       * @brief
+       * File formats. BAM and CRAM are read and written through htslib.
+       */
+      enum class Format {SAM, BAM, CRAM};
+
+      /**
+       * @param file_name File name
+       * @return BAM or CRAM for .bam or .cram files, SAM otherwise
+       */
+      static Format format(const std::string &file_name);
+
+      /**
+       * @param fmt "sam", "bam", or "cram"
+       * @return Format
+       * @throws std::invalid_argument if fmt is not a format
+       */
+      static Format parse_format(const std::string &fmt);
+
       /**
        * @brief
        * Represents optional data fields for any Header or Record type row.
@@ -167,6 +195,15 @@ namespace vargas {
               return true;
           }
 
+          /**
+           * @param tag Tag to remove
+           * @return true if the tag was present
+           */
+          bool erase(const std::string &tag) {
+              aux_fmt.erase(tag);
+              return aux.erase(tag) > 0;
+          }
+
 
           /**
            * @brief
@@ -677,6 +714,19 @@ namespace vargas {
     protected:
       bool _use_stdio = false;
       SAM::Header _hdr;
+
+      // BAM and CRAM handles
+      htsFile *_hts = nullptr;
+      bam_hdr_t *_bhdr = nullptr;
+      bam1_t *_b = nullptr;
+      int _threads = 0;
+
+      /**
+       * @brief
+       * Close the htslib handles, if any.
+       * @return negative if closing the file failed
+       */
+      int _close_hts();
   };
 
 
@@ -702,6 +752,10 @@ namespace vargas {
           _pprec = std::move(o._pprec);
           _hdr = std::move(o._hdr);
           _use_stdio = o._use_stdio;
+          _threads = o._threads;
+          std::swap(_hts, o._hts);
+          std::swap(_bhdr, o._bhdr);
+          std::swap(_b, o._b);
       }
 
       ~isam() {
@@ -718,7 +772,9 @@ namespace vargas {
       /**
        * @brief
        * Close any open file and open the given file.
-       * @param file_name SAM file to open
+       * @details
+       * .bam and .cram files are read with htslib, and records are decoded directly into SAM::Record.
+       * @param file_name SAM, BAM, or CRAM file to open
        * @throws std::invalid_argument if file cannot be opened
        */
       void open(std::string file_name);
@@ -729,6 +785,7 @@ namespace vargas {
        */
       void close() {
           in.close();
+          _close_hts();
           _hdr = SAM::Header();
           _pprec = SAM::Record();
       }
@@ -737,7 +794,18 @@ namespace vargas {
        * @return true if file is open.
        */
       bool good() const {
-          return in.good() || _use_stdio || !_buff.empty();
+          return in.good() || _use_stdio || !_buff.empty() || _hts;
+      }
+
+      /**
+       * @brief
+       * Decompress BAM and CRAM files with n threads, applies to the open file and later ones.
+       * No effect on SAM files.
+       * @param n number of threads, 0 for none
+       */
+      void set_threads(int n) {
+          _threads = n;
+          if (_hts && n > 0) hts_set_threads(_hts, n);
       }
 
       /**
@@ -761,7 +829,10 @@ namespace vargas {
 
       /**
        * @brief
-       * Load the rest of the records in the file and keep a subset of them.
+       * Load the rest of the records in the file and keep a random subset of them.
+       * @details
+       * Reservoir sampling is used, so at most n records are held. If n is 0, all records
+       * are kept and continue to be read from the file.
        * @param n Number of records to keep.
        */
       void subset(size_t n);
@@ -789,6 +860,12 @@ namespace vargas {
       std::vector<Record> _buff;
 
       SAM::Record _pprec;
+
+      /**
+       * @brief
+       * Decode the current htslib record into rec.
+       */
+      void _decode(SAM::Record &rec) const;
   };
 
   /**
@@ -825,49 +902,101 @@ namespace vargas {
           open(std::move(file_name));
       }
 
+      /**
+       * @param file_name file to write, empty for stdout
+       * @param hdr SAM::Header of the file
+       * @param fmt Output format, regardless of the extension
+       */
+      osam(std::string file_name, const SAM::Header &hdr, Format fmt) {
+          _hdr = hdr;
+          open(std::move(file_name), fmt);
+      }
+
       ~osam() {
-          close();
+          try {
+              close();
+          } catch (std::exception &e) {
+              std::cerr << e.what() << std::endl;
+          }
       }
 
+      /**
+       * @brief
+       * Flush any data, and close the output file.
+       * @throws std::runtime_error if the background writer failed
+       */
+      void close();
+
       /**
        * @brief
        * Open a new file.
        * @details
        * Any added alignments are flushed to the previous file (if any). The header
        * is written to the new file.
-       * @param file_name file to open
+       * @param file_name file to open, format from the extension
        * @throws std::invalid_argument if file cannot be opened
        */
-      void open(std::string file_name);
+      void open(std::string file_name) {
+          const Format fmt = format(file_name);
+          open(std::move(file_name), fmt);
+      }
 
       /**
        * @brief
-       * Flush any data, and close the output file.
+       * Open a new file.
+       * @details
+       * BAM and CRAM are written through htslib. Reference names of records must be in the header
+       * sequences, others are written as unmapped to "*". CRAM stores the sequences without a reference.
+       * @param file_name file to open, empty for stdout
+       * @param fmt Output format
+       * @throws std::invalid_argument if file cannot be opened
        */
-      void close() {
-          if (out.is_open()) {
-              out.close();
-          }
-      }
+      void open(std::string file_name, Format fmt);
 
       /**
        * @return true of output open.
        */
       bool good() const {
-          return out.good() || _use_stdio;
+          return out.good() || _use_stdio || _hts;
+      }
+
+      /**
+       * @return Output format
+       */
+      Format format() const {
+          return _fmt;
+      }
+
+      using SAM::format;
+
+      /**
+       * @brief
+       * Compress BAM and CRAM output with n threads, applies to the open file and later ones.
+       * No effect on SAM output.
+       * @param n number of threads, 0 for none
+       */
+      void set_threads(int n) {
+          _threads = n;
+          if (_hts && n > 0) hts_set_threads(_hts, n);
       }
 
       /**
        * @brief
        * Writes a record.
+       * @details
+       * Not synchronized, and should not be mixed with write_chunk() while a background writer is running.
        * @param r record to add
        * @throws std::invalid_argument if no output file open
+       * @throws std::runtime_error if the write failed
        */
       void add_record(const SAM::Record &r) {
           if (!good()) throw std::invalid_argument("No valid file open.");
-          (_use_stdio ? std::cout : out) << r.to_string() << '\n' << std::flush;
+          std::string buff;
+          serialize({r}, buff);
+          if (!_write(buff)) throw std::runtime_error("Error writing SAM output.");
       }
 
+
       /**
        * @param rec write record to output
        * @return SAM::osam
@@ -877,8 +1006,82 @@ namespace vargas {
           return *this;
       }
 
+      /**
+       * @brief
+       * Serialize records into a buffer to be passed to write_chunk(). Thread safe.
+       * @details
+       * SAM output is formatted as text. For BAM and CRAM the records are encoded
+       * into htslib records, so that the writer only compresses them.
+       * @param records
+       * @param buff appended to
+       */
+      void serialize(const std::vector<SAM::Record> &records, std::string &buff) const {
+          for (const auto &r : records) {
+              if (_fmt == Format::SAM) {
+                  buff += r.to_string();
+                  buff += '\n';
+              } else _encode(r, buff);
+          }
+      }
+
+      /**
+       * @brief
+       * Start a background thread that performs all writes for write_chunk().
+       * @details
+       * Pending chunks are coalesced into single large writes. Producers block while more than
+       * buffer_size bytes are pending. In ordered mode, chunks are written in order of their index,
+       * starting from 0. The chunk with the next index is always accepted, so producers cannot deadlock.
+       * @param buffer_size max pending bytes
+       * @param ordered Write chunks in order of index
+       */
+      void start_writer(size_t buffer_size, bool ordered);
+
+      /**
+       * @brief
+       * Write all pending chunks and join the background writer.
+       * @throws std::runtime_error if a write failed
+       */
+      void stop_writer();
+
+      /**
+       * @brief
+       * Write a buffer of serialized records. Thread safe.
+       * @details
+       * Written from the background writer if one is running, otherwise written immediately.
+       * @param buff Serialized records, see serialize()
+       * @param index Order of the chunk, used with an ordered writer
+       * @throws std::invalid_argument if no output file open
+       * @throws std::runtime_error if a write failed
+       */
+      void write_chunk(std::string buff, size_t index = 0);
+
     private:
       std::ofstream out;
+      Format _fmt = Format::SAM;
+      std::unordered_map<std::string, int> _tids; // Header sequence IDs for BAM and CRAM
+
+      // Background writer
+      std::thread _writer;
+      std::mutex _wmut;
+      std::condition_variable _wcv, _fcv; // Writer has work, producers may add
+      std::map<size_t, std::string> _pending;
+      size_t _pending_bytes = 0, _buffer_size = 0, _next_index = 0, _seq = 0;
+      bool _ordered = false, _stop = false, _failed = false;
+
+      void _write_loop();
+
+      /**
+       * @brief
+       * Append r to buff as an htslib record core, data length, and data.
+       */
+      void _encode(const SAM::Record &r, std::string &buff) const;
+
+      /**
+       * @brief
+       * Write a serialized buffer.
+       * @return false on a write error
+       */
+      bool _write(const std::string &buff);
   };
 
 }
@@ -123,6 +123,95 @@ namespace vargas {
   };
 
 
+  /**
+   * @brief
+   * Reads encoded for alignment, stored back to back.
+   * @details
+   * Bases are stored as rg::Base and qualities as Phred scores, so reads are encoded once when they are
+   * loaded instead of for every read group and strand. clear() keeps the storage for the next batch.
+   */
+  class EncodedReads {
+    public:
+
+      /**
+       * @brief
+       * Remove all reads, keeping the storage.
+       */
+      void clear() {
+          _seq.clear();
+          _qual.clear();
+          _offset.resize(1);
+          _has_qual.clear();
+      }
+
+      /**
+       * @param seq Read sequence
+       * @param qual Qualities, ignored unless the same length as seq
+       * @param phred_offset Offset of qual
+       */
+      void push_back(const std::string &seq, const std::string &qual, char phred_offset) {
+          const bool has_qual = qual.size() == seq.size();
+          for (size_t i = 0; i < seq.size(); ++i) {
+              _seq.push_back(rg::base_to_num(seq[i]));
+              _qual.push_back(has_qual ? qual[i] - phred_offset : 0);
+          }
+          _end(has_qual);
+      }
+
+      /**
+       * @param seq Read sequence
+       * @param phred Phred qualities, ignored unless the same length as seq
+       */
+      void push_back(const std::string &seq, const std::vector<char> &phred) {
+          const bool has_qual = phred.size() == seq.size();
+          for (size_t i = 0; i < seq.size(); ++i) {
+              _seq.push_back(rg::base_to_num(seq[i]));
+              _qual.push_back(has_qual ? phred[i] : 0);
+          }
+          _end(has_qual);
+      }
+
+      /**
+       * @brief
+       * Copy read i of o.
+       */
+      void push_back(const EncodedReads &o, size_t i) {
+          _seq.insert(_seq.end(), o.seq(i), o.seq(i) + o.length(i));
+          _qual.insert(_qual.end(), o._qual.begin() + o._offset[i], o._qual.begin() + o._offset[i + 1]);
+          _end(o._has_qual[i]);
+      }
+
+      size_t size() const { return _has_qual.size(); }
+
+      bool empty() const { return _has_qual.empty(); }
+
+      /**
+       * @return Length of read i
+       */
+      size_t length(size_t i) const { return _offset[i + 1] - _offset[i]; }
+
+      /**
+       * @return Bases of read i
+       */
+      const rg::Base *seq(size_t i) const { return _seq.data() + _offset[i]; }
+
+      /**
+       * @return Phred qualities of read i, nullptr if it has none
+       */
+      const char *qual(size_t i) const { return _has_qual[i] ? _qual.data() + _offset[i] : nullptr; }
+
+    private:
+      void _end(bool has_qual) {
+          _offset.push_back(_seq.size());
+          _has_qual.push_back(has_qual);
+      }
+
+      std::vector<rg::Base> _seq;
+      std::vector<char> _qual; // Phred, zero for reads without qualities
+      std::vector<size_t> _offset = std::vector<size_t>(1, 0); // Start of each read, and end of the last
+      std::vector<uint8_t> _has_qual;
+  };
+
   const std::vector<std::string> supported_pgid = {"bowtie2", "bwa", "hisat2"};
 
   std::vector<std::string> tokenize_cl(std::string cl);
@@ -0,0 +1,71 @@
+/**
+ * @brief
+ * Alignment server that keeps graphs and aligners resident across jobs, and its client.
+ *
+ * @details
+ * Jobs are framed messages over a Unix socket. A frame is a 32 bit big endian payload length followed by the
+ * payload. A request is the client's working directory followed by the align arguments, separated by NUL,
+ * with the client's stdin, stdout, and stderr attached as SCM_RIGHTS. The job reads and writes through them,
+ * so output streams directly to the client. The reply is the exit code and error message, separated by NUL.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_SERVE_H
+#define VARGAS_SERVE_H
+
+#include "cxxopts.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief
+ * Serve alignment jobs on a Unix socket until interrupted.
+ * @details
+ * Jobs run one at a time, each with the threads it asks for. Graphs are loaded on first use, or up front
+ * with -g, and stay loaded along with the aligners of recent parameters, see AlignCache.
+ * @param argc command line argument count
+ * @param argv command line arguments
+ */
+int serve_main(int argc, char *argv[]);
+
+void serve_help(const cxxopts::Options &opts);
+
+/**
+ * @brief
+ * Run an align job on a server, see align --server.
+ * @param socket Server socket path
+ * @param args align arguments, starting with the mode name
+ * @return Exit code of the job
+ * @throws std::invalid_argument if the server cannot be reached
+ * @throws std::runtime_error with the job's error message if it failed
+ */
+int align_client(const std::string &socket, const std::vector<std::string> &args);
+
+/**
+ * @brief
+ * Write a frame.
+ * @param fd Socket
+ * @param payload
+ * @param fds File descriptors to pass along with the frame
+ * @throws std::runtime_error on a write error
+ */
+void send_frame(int fd, const std::string &payload, const std::vector<int> &fds = {});
+
+/**
+ * @brief
+ * Read a frame.
+ * @param fd Socket
+ * @param payload Populated payload
+ * @param fds Received file descriptors are appended, or closed if nullptr
+ * @return false if the peer closed the connection before a frame
+ * @throws std::runtime_error on a read error, truncated, or oversized frame
+ */
+bool recv_frame(int fd, std::string &payload, std::vector<int> *fds = nullptr);
+
+#endif //VARGAS_SERVE_H
@@ -0,0 +1,211 @@
+/**
+ * @brief
+ * Sharding alignment jobs across nodes, by reads or by graph, and merging graph shards.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_SHARD_H
+#define VARGAS_SHARD_H
+
+#include "align_main.h"
+#include "scoring.h"
+#include "cxxopts.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Input order of a read, only held by records of graph shards
+#define ALIGN_SAM_ORDINAL_TAG "xo"
+
+/**
+ * @brief
+ * One shard of an alignment job split over several nodes.
+ * @details
+ * Read shards split the reads by a hash of their name, and their SAM outputs are concatenated. Graph shards
+ * align every read to a range of whole contigs, and write partial results that merge_main() combines into
+ * the SAM of a single run.
+ */
+struct Shard {
+    enum class By {READS, GRAPH};
+
+    unsigned index = 0, count = 1;
+    By by = By::READS;
+
+    /**
+     * @param spec Shard as i/N, 0 <= i < N
+     * @param by "reads" or "graph"
+     * @return Shard
+     * @throws std::invalid_argument on a malformed spec
+     */
+    static Shard parse(const std::string &spec, const std::string &by);
+
+    /**
+     * @return true if the job is split
+     */
+    bool split() const { return count > 1; }
+
+    /**
+     * @param query_name Read name
+     * @return true if this shard aligns the read
+     */
+    bool keep(const std::string &query_name) const {
+        return by == By::GRAPH || count < 2 || hash(query_name) % count == index;
+    }
+
+    /**
+     * @brief
+     * Base graph positions of a graph shard.
+     * @details
+     * Contigs are assigned to shards in order by the position of their midpoint, so each shard holds
+     * consecutive whole contigs and about 1/N of the bases. Contigs share no edges, so a read's scores in
+     * a shard are the scores of a single pass over those contigs.
+     * @param gm Graphs
+     * @return First and last position, 0 based as in Graph::Node::end_pos(). Empty if first > last.
+     */
+    std::pair<rg::pos_t, rg::pos_t> window(vargas::GraphMan &gm) const;
+
+    /**
+     * @return 64 bit FNV-1a hash, stable across platforms and runs
+     */
+    static uint64_t hash(const std::string &s) {
+        uint64_t h = 14695981039346656037ULL;
+        for (const char c : s) {
+            h ^= uint8_t(c);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+};
+
+namespace vargas {
+
+  /**
+   * @brief
+   * Binary partial results of a graph shard.
+   * @details
+   * @code
+   * Header
+   * strings     command line, graph definition, reads file, alignment targets. uint32_t length then chars.
+   * labels      uint32_t count, then strings
+   * records     uint64_t count, then Record[count], sorted by ordinal then label
+   * @endcode
+   * Each record holds the results of one read and target on each strand, from separate passes.
+   */
+  namespace vap {
+      const char MAGIC[8] = {'V', 'A', 'P', 'A', 'R', 'T', '\0', '\0'};
+      const uint32_t VERSION = 1;
+
+      // Header flags
+      const uint32_t FWDONLY = 1;
+      const uint32_t MSONLY = 2;
+      const uint32_t MAXONLY = 4;
+      const uint32_t NOTRACEBACK = 8;
+      const uint32_t PHRED64 = 16;
+      const uint32_t END_TO_END = 32;
+
+      struct Header {
+          char magic[8];
+          uint32_t version;
+          uint32_t shard, shards;
+          uint32_t flags;
+          uint32_t match, mismatch_min, mismatch_max, read_gopen, read_gext, ref_gopen, ref_gext, ambig;
+          uint32_t pad[2];
+      };
+
+      struct Strand {
+          int32_t score;
+          pos_t pos, last, count; /**< Max position, last max position, and count, as in Results */
+      };
+
+      struct Record {
+          uint64_t ordinal; /**< Input order of the read */
+          uint32_t label; /**< Index of the target subgraph */
+          uint32_t read_len; /**< Length of the aligner, counts within a read length are not repeated */
+          Strand strand[2]; /**< Forward, reverse */
+      };
+
+      static_assert(sizeof(Header) == 64, "Unexpected partial header size.");
+      static_assert(sizeof(Record) == 48, "Unexpected partial record size.");
+  }
+
+  /**
+   * @brief
+   * Partial results of a graph shard and the parameters of its job.
+   */
+  struct Partials {
+      unsigned shard = 0, shards = 1;
+      bool fwdonly = false, msonly = false, maxonly = false, notraceback = false, p64 = false;
+      ScoreProfile prof;
+      std::string command_line, gdf, reads, targets;
+      std::vector<std::string> labels;
+      std::vector<vap::Record> records;
+
+      /**
+       * @param filename Output file
+       * @throws std::invalid_argument if the file cannot be opened
+       * @throws std::runtime_error on a write error
+       */
+      void write(const std::string &filename) const;
+
+      /**
+       * @param filename Partial results file
+       * @throws std::invalid_argument if the file is not a partial results file
+       */
+      void read(const std::string &filename);
+
+      /**
+       * @param o Partials of another shard
+       * @return true if both shards are of the same job
+       */
+      bool same_job(const Partials &o) const;
+  };
+
+  /**
+   * @brief
+   * Combine the partial results of a read over shards, in shard order.
+   * @details
+   * Shards are combined per strand as if they were one pass: a higher score replaces the max, and an equal
+   * score adds the shard's count, less its first occurrence if within a read length of the last one.
+   * @param parts Partials of one read, sorted by shard
+   * @param strands 1 for forward only, else 2
+   * @param res Results, read i is populated
+   * @param i Read index in res
+   */
+  void merge_partials(const std::vector<const vap::Record *> &parts, unsigned strands, Results &res, size_t i);
+}
+
+/**
+ * @brief
+ * Align tasks to the shard's window of their graphs, as partial results.
+ * @param gm Graphs
+ * @param task_list Tasks, records carry ALIGN_SAM_ORDINAL_TAG
+ * @param aligners One pool per thread
+ * @param shard Graph shard
+ * @param partials Job parameters, records are populated
+ * @param phred_offset
+ * @param progress Progress to update after each task, or nullptr
+ * @param verbose Report the shard window and alignment time to std::cerr
+ * @return Stats of all threads
+ */
+AlignStats align_partials(vargas::GraphMan &gm,
+                          std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                          std::vector<AlignerPool> &aligners, const Shard &shard, vargas::Partials &partials,
+                          char phred_offset, ProgressMeter *progress = nullptr, bool verbose = true);
+
+/**
+ * @brief
+ * Merge the partial results of every graph shard of a job into SAM.
+ * @param argc command line argument count
+ * @param argv command line arguments
+ */
+int merge_main(int argc, char *argv[]);
+
+void merge_help(const cxxopts::Options &opts);
+
+#endif //VARGAS_SHARD_H
@@ -37,11 +37,13 @@ namespace vargas {
 
   /**
    * @brief
-   * Generate reads from a graph using a given profile. srand() should be called externally.
+   * Generate reads from a graph using a given profile.
    * @details
    * Given a Graph, reads are generated by randomly picking a location in the graph, and extracting
    * a subsequence. Errors (either a fixed number, or at a specified rate) are introduced into the
    * read. The read is packed in a Read struct, containing the sequence and origin information.
+   * Each Sim owns its generator, so instances can be used from separate threads. Reads are
+   * reproducible for a given seed and stream.
    * Usage:\n
    * @code{.cpp}
    * #include "sim.h"
@@ -101,12 +103,62 @@ namespace vargas {
           std::string to_string() const;
       };
 
+      /**
+       * @brief
+       * Counter based random generator. Output i is a hash of the key and i, so a stream is
+       * determined only by its (seed, stream) pair.
+       */
+      class Rng {
+        public:
+          using result_type = uint64_t;
+
+          /**
+           * @param seed Seed
+           * @param stream Independent stream for the seed, e.g. a task index
+           */
+          Rng(uint64_t seed = 0, uint64_t stream = 0) { reset(seed, stream); }
+
+          void reset(uint64_t seed, uint64_t stream) {
+              _key = _mix(seed ^ _mix(stream + 0x9E3779B97F4A7C15ULL));
+              _ctr = 0;
+          }
+
+          result_type operator()() { return _mix(_key + 0x9E3779B97F4A7C15ULL * ++_ctr); }
+
+          /**
+           * @param n Upper bound, > 0
+           * @return Uniform value in [0, n)
+           */
+          uint64_t below(uint64_t n) { return _mulhi((*this)(), n); }
+
+          static constexpr result_type min() { return 0; }
+          static constexpr result_type max() { return ~result_type(0); }
+
+        private:
+          uint64_t _key, _ctr;
+
+          // High 64 bits of a * b, from 32 bit halves
+          static uint64_t _mulhi(uint64_t a, uint64_t b) {
+              const uint64_t al = a & 0xFFFFFFFFULL, ah = a >> 32, bl = b & 0xFFFFFFFFULL, bh = b >> 32;
+              const uint64_t ll = al * bl, lh = al * bh, hl = ah * bl;
+              const uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFULL) + (hl & 0xFFFFFFFFULL);
+              return ah * bh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+          }
+
+          // splitmix64 finalizer
+          static uint64_t _mix(uint64_t z) {
+              z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+              z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+              return z ^ (z >> 31);
+          }
+      };
+
       /**
        * @param g Graph to simulate from
        */
       Sim(const Graph &g) : _graph(g),
                             _nodes(*(_graph.node_map())),
-                            _next(_graph.next_map()) { _init(); }
+                            _next(_graph.source().next_map()) { _init(); }
 
       /**
        * @param _graph Graph to simulate from
@@ -116,7 +168,34 @@ namespace vargas {
           const Profile &prof) : _graph(_graph),
                                  _prof(prof),
                                  _nodes(*(_graph.node_map())),
-                                 _next(_graph.next_map()) { _init(); }
+                                 _next(_graph.source().next_map()) { _init(); }
+
+      /**
+       * @param _graph Graph to simulate from
+       * @param prof accept reads following this profile
+       * @param seed Random seed
+       * @param stream Stream of the seed to draw from
+       */
+      Sim(const Graph &_graph,
+          const Profile &prof,
+          uint64_t seed,
+          uint64_t stream = 0) : _graph(_graph),
+                                 _prof(prof),
+                                 _nodes(*(_graph.node_map())),
+                                 _next(_graph.source().next_map()) {
+          _init();
+          this->seed(seed, stream);
+      }
+
+      /**
+       * @brief
+       * Restart the generator. Reads that follow are identical for the same seed, stream and profile.
+       * @param seed Random seed
+       * @param stream Stream of the seed to draw from
+       */
+      void seed(uint64_t seed, uint64_t stream = 0) {
+          _rng.reset(seed, stream);
+      }
 
       /**
        * @brief
@@ -196,11 +275,13 @@ namespace vargas {
       std::vector<unsigned> _node_ids;
       std::vector<uint64_t> _node_weights;
 
+      // Individuals that pass the graph filter
+      std::vector<uint32_t> _indivs;
+
       std::vector<SAM::Record> _batch;
       SAM::Record _read;
 
-      std::uniform_int_distribution<uint64_t> _node_weight_dist;
-      std::mt19937 _rand_generator;
+      Rng _rng;
 
       // Abort trying to update the read after N tries
       const unsigned _abort_after = 1000000;
@@ -213,7 +294,11 @@ namespace vargas {
 
       unsigned _random_node_id() {
           return _node_ids[std::lower_bound(_node_weights.begin(), _node_weights.end(),
-                                            _node_weight_dist(_rand_generator)) - _node_weights.begin()];
+                                            _rng.below(_node_weights.back()) + 1) - _node_weights.begin()];
+      }
+
+      char _rand_base() {
+          return "ACGTN"[_rng.below(5)];
       }
 
       bool _update_read(const coordinate_resolver& resolver);
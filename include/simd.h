@@ -21,9 +21,9 @@
  * }
  * @endcode
  *
- * @warning
- * Template specializations are in header to enable force inlining. As a result simd.h should only be included in
- * one file of a project to prevent multiple definion errors.
+ * @note
+ * Template specializations are in header to enable force inlining. Each instruction set has its own namespace
+ * (VA_SIMD_NAMESPACE) so builds for several instruction sets can be linked together, see src/aligner.cpp.
  *
  * @copyright
  * Distributed under the MIT Software License.
@@ -44,6 +44,7 @@
 #include <memory>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
 
 #include "x86intrin.h"
 
@@ -63,6 +64,14 @@
 AVX512F for AVX-512, KNCNI
 */
 
+#if defined(VA_SIMD_USE_AVX512)
+#  define VA_SIMD_NAMESPACE avx512
+#elif defined(VA_SIMD_USE_AVX2)
+#  define VA_SIMD_NAMESPACE avx2
+#else
+#  define VA_SIMD_NAMESPACE sse
+#endif
+
 #ifdef VA_SIMD_USE_AVX512
 #  define VA_MAX_INT8 64
 #  define VA_MAX_INT16 32
@@ -86,18 +95,35 @@ AVX512F for AVX-512, KNCNI
 #  endif
 #endif
 
-namespace vargas {
+/*
+Kernels for a wider instruction set than the translation unit enable it only between VA_SIMD_TARGET_BEGIN and
+VA_SIMD_TARGET_END, around code in VA_SIMD_NAMESPACE. Inline functions and templates defined elsewhere are then
+compiled for the baseline, so whichever copy the linker keeps runs on any CPU.
+*/
+#if defined(VA_SIMD_USE_AVX512) && !defined(__AVX512BW__)
+#  define VA_SIMD_TARGET "avx512bw"
+#elif defined(VA_SIMD_USE_AVX2) && !defined(VA_SIMD_USE_AVX512) && !defined(__AVX2__)
+#  define VA_SIMD_TARGET "avx2"
+#endif
 
-  #if VA_SIMD_USE_AVX512
-  struct MaskType {
-      uint64_t v;
-      MaskType(uint64_t _v): v(_v) {}
-      MaskType() {}
-      operator uint64_t &() {return v;}
-      operator const uint64_t &() const {return v;}
-      bool operator[](size_t i) const {return (size_t(1) << i) & v;}
-  };
-  #endif
+#define VA_SIMD_PRAGMA_STR(x) _Pragma(#x)
+#define VA_SIMD_PRAGMA(x) VA_SIMD_PRAGMA_STR(x)
+
+#if !defined(VA_SIMD_TARGET)
+#  define VA_SIMD_TARGET_BEGIN
+#  define VA_SIMD_TARGET_END
+#elif defined(__clang__)
+#  define VA_SIMD_TARGET_BEGIN \
+    VA_SIMD_PRAGMA(clang attribute push(__attribute__((target(VA_SIMD_TARGET))), apply_to = function))
+#  define VA_SIMD_TARGET_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#  define VA_SIMD_TARGET_BEGIN _Pragma("GCC push_options") VA_SIMD_PRAGMA(GCC target(VA_SIMD_TARGET))
+#  define VA_SIMD_TARGET_END _Pragma("GCC pop_options")
+#else
+#  error("Compiler cannot enable the SIMD instruction set for kernels only, build with the -m flags.")
+#endif
+
+namespace vargas {
 
   /**
    * @brief
@@ -148,11 +174,9 @@ namespace vargas {
 #endif
           if (n > max_size()) throw std::length_error("aligned_allocator<T,A>::allocate() - Integer overflow.");
 
-          void *p;
-          int err = posix_memalign(&p, al, n * sizeof(T)); // aligned_alloc isn't implemented in most compilers even though it's part of C11/C++17
-          if (err) throw std::bad_alloc();
-
-          return static_cast<T *>(p);
+          // posix_memalign, as aligned_alloc isn't implemented in most compilers even though it's part of C11/C++17.
+          // Large blocks may use huge pages, see rg::set_huge_pages().
+          return static_cast<T *>(rg::alloc_aligned(n * sizeof(T), al));
       }
 
       void deallocate(T *p, std::size_t) const {
@@ -162,6 +186,30 @@ namespace vargas {
   };
 
 
+  /**
+   * std::vector with an aligned allocator
+   */
+  template<typename T>
+  using SIMDVector = std::vector<T, aligned_allocator<T, T::size>>;
+
+  /**
+   * SIMD types and operations are scoped by instruction set, so kernels built for different instruction sets
+   * can be linked into one binary without their definitions colliding.
+   */
+  VA_SIMD_TARGET_BEGIN
+  namespace VA_SIMD_NAMESPACE {
+
+  #if VA_SIMD_USE_AVX512
+  struct MaskType {
+      uint64_t v;
+      MaskType(uint64_t _v): v(_v) {}
+      MaskType() {}
+      operator uint64_t &() {return v;}
+      operator const uint64_t &() const {return v;}
+      bool operator[](size_t i) const {return (size_t(1) << i) & v;}
+  };
+  #endif
+
   template<typename T, unsigned N>
   struct SIMD {
       using signed_type = typename std::make_signed<T>::type;
@@ -185,7 +233,7 @@ namespace vargas {
       static constexpr unsigned length = N;
       static constexpr unsigned size = sizeof(native_t) * N;
       static_assert(size % 16 ==0, "size must be divisible by 16. (Sanity check: SSE[42], AVX, or AVX512)");
-      SIMD(const SIMD &o): v(o.v) {}
+      SIMD(const SIMD &o) = default;
 
       SIMD() = default;
       SIMD(const native_t o) {
@@ -224,11 +272,8 @@ namespace vargas {
 #endif
       };
 
-      __RG_STRONG_INLINE__
-      SIMD<T, N> &operator=(const SIMD<T, N> &o) {
-          v = o.v;
-          return *this;
-      };
+      // Trivial, so std algorithms compiled for the baseline can copy vectors without calling kernel code
+      SIMD<T, N> &operator=(const SIMD<T, N> &o) = default;
 
       __RG_STRONG_INLINE__
       SIMD<T, N> operator>=(const SIMD<T, N> &o) const {
@@ -268,62 +313,56 @@ namespace vargas {
   using int8_fast = SIMD<char, VA_MAX_INT8>;
   using int16_fast = SIMD<int16_t, VA_MAX_INT16>;
 
-  /**
-   * std::vector with an aligned allocator
-   */
-  template<typename T>
-  using SIMDVector = std::vector<T, aligned_allocator<T, T::size>>;
-
   /************************************ 128b ************************************/
 
 #define  COMPARISON_OPERATORS 1
   #ifdef VA_SIMD_USE_SSE
 
-  template<>
+  template<> inline
   int8x16 int8x16::operator^(const int8x16 &o) const {
       // XOR with all ones
       return _mm_xor_si128(v, o.v);
   }
-  template<>
+  template<> inline
   int8x16 &int8x16::operator=(const int8x16::native_t o) {
       v = _mm_set1_epi8(o);
       return *this;
   }
-  template<>
+  template<> inline
   int8x16 int8x16::operator+(const int8x16 &o) const {
       return _mm_adds_epi8(v, o.v);
   }
-  template<>
+  template<> inline
   int8x16 int8x16::operator-(const int8x16 &o) const {
       return _mm_subs_epi8(v, o.v);
   }
-  template<>
+  template<> inline
   int8x16 int8x16::operator&(const int8x16 &o) const {
       return _mm_and_si128(v, o.v);
   }
-  template<>
+  template<> inline
   int8x16 int8x16::operator|(const int8x16 &o) const {
       return _mm_or_si128(v, o.v);
   }
 #if COMPARISON_OPERATORS
-  template<>
+  template<> inline
   typename int8x16::cmp_t int8x16::operator==(const int8x16 &o) const {
       return _mm_cmpeq_epi8(v, o.v);
   }
-  template<>
+  template<> inline
   typename int8x16::cmp_t int8x16::operator>(const int8x16 &o) const {
       return _mm_cmpgt_epi8(v, o.v);
   }
-  template<>
+  template<> inline
   typename int8x16::cmp_t int8x16::operator<(const int8x16 &o) const {
       return _mm_cmplt_epi8(v, o.v);
   }
 #endif
-  template<>
+  template<> inline
   bool int8x16::any() const {
       return _mm_movemask_epi8(v);
   }
-  template<>
+  template<> inline
   int8x16 int8x16::and_not(const int8x16 &o) const {
       return _mm_andnot_si128(o.v, v);
   }
@@ -339,52 +378,52 @@ namespace vargas {
 
 
 #if COMPARISON_OPERATORS
-  template<>
+  template<> inline
   typename int16x8::cmp_t
   int16x8::operator==(const int16x8 &o) const {
       return _mm_cmpeq_epi16(v, o.v);
   }
-  template<>
+  template<> inline
   typename int16x8::cmp_t
   int16x8::operator>(const int16x8 &o) const {
       return _mm_cmpgt_epi16(v, o.v);
   }
-  template<>
+  template<> inline
   typename int16x8::cmp_t
   int16x8::operator<(const int16x8 &o) const {
       return _mm_cmplt_epi16(v, o.v);
   }
 #endif
-  template<>
+  template<> inline
   int16x8 int16x8::operator^(const int16x8 &o) const {
       return _mm_xor_si128(v, o.v);
   }
-  template<>
+  template<> inline
   int16x8 &int16x8::operator=(const int16x8::native_t o) {
       v = _mm_set1_epi16(o);
       return *this;
   }
-  template<>
+  template<> inline
   int16x8 int16x8::operator+(const int16x8 &o) const {
       return _mm_adds_epi16(v, o.v);
   }
-  template<>
+  template<> inline
   int16x8 int16x8::operator-(const int16x8 &o) const {
       return _mm_subs_epi16(v, o.v);
   }
-  template<>
+  template<> inline
   int16x8 int16x8::operator&(const int16x8 &o) const {
       return _mm_and_si128(v, o.v);
   }
-  template<>
+  template<> inline
   int16x8 int16x8::operator|(const int16x8 &o) const {
       return _mm_or_si128(v, o.v);
   }
-  template<>
+  template<> inline
   bool int16x8::any() const {
       return _mm_movemask_epi8(v);
   }
-  template<>
+  template<> inline
   int16x8 int16x8::and_not(const int16x8 &o) const {
       return _mm_andnot_si128(o.v, v);
   }
@@ -404,39 +443,39 @@ namespace vargas {
 
   #ifdef VA_SIMD_USE_AVX2
 
-  template<> int8x32 int8x32::operator^(const int8x32 &o) const {
+  template<> inline int8x32 int8x32::operator^(const int8x32 &o) const {
       return _mm256_xor_si256(v, o.v);
   }
-  template<> int8x32 &int8x32::operator=(const int8x32::native_t o) {
+  template<> inline int8x32 &int8x32::operator=(const int8x32::native_t o) {
       v = _mm256_set1_epi8(o);
       return *this;
   }
-  template<> int8x32 int8x32::operator+(const int8x32 &o) const {
+  template<> inline int8x32 int8x32::operator+(const int8x32 &o) const {
       return _mm256_adds_epi8(v, o.v);
   }
-  template<> int8x32 int8x32::operator-(const int8x32 &o) const {
+  template<> inline int8x32 int8x32::operator-(const int8x32 &o) const {
       assert(reinterpret_cast<uint64_t>(&o) % sizeof(o) == 0); 
       assert(reinterpret_cast<uint64_t>(this) % sizeof(*this) == 0); 
       return _mm256_subs_epi8(v, o.v);
   }
 #if COMPARISON_OPERATORS
-  template<> typename int8x32::cmp_t int8x32::operator==(const int8x32 &o) const {
+  template<> inline typename int8x32::cmp_t int8x32::operator==(const int8x32 &o) const {
       return _mm256_cmpeq_epi8(v, o.v);
   }
-  template<> typename int8x32::cmp_t int8x32::operator>(const int8x32 &o) const {
+  template<> inline typename int8x32::cmp_t int8x32::operator>(const int8x32 &o) const {
       return _mm256_cmpgt_epi8(v, o.v);
   }
-  template<> typename int8x32::cmp_t int8x32::operator<(const int8x32 &o) const {
+  template<> inline typename int8x32::cmp_t int8x32::operator<(const int8x32 &o) const {
       return _mm256_cmpgt_epi8(o.v, v);
   }
 #endif
-  template<> int8x32 int8x32::operator&(const int8x32 &o) const {
+  template<> inline int8x32 int8x32::operator&(const int8x32 &o) const {
       return _mm256_and_si256(v, o.v);
   }
-  template<> int8x32 int8x32::operator|(const int8x32 &o) const {
+  template<> inline int8x32 int8x32::operator|(const int8x32 &o) const {
       return _mm256_or_si256(v, o.v);
   }
-  template<> bool int8x32::any() const {
+  template<> inline bool int8x32::any() const {
       return _mm256_movemask_epi8(v);
   }
     template <>
@@ -454,36 +493,36 @@ namespace vargas {
 
 
 #if COMPARISON_OPERATORS
-  template<> typename int16x16::cmp_t int16x16::operator==(const int16x16 &o) const {
+  template<> inline typename int16x16::cmp_t int16x16::operator==(const int16x16 &o) const {
       return _mm256_cmpeq_epi16(v, o.v);
   }
-  template<> typename int16x16::cmp_t int16x16::operator>(const int16x16 &o) const {
+  template<> inline typename int16x16::cmp_t int16x16::operator>(const int16x16 &o) const {
       return _mm256_cmpgt_epi16(v, o.v);
   }
-  template<> typename int16x16::cmp_t int16x16::operator<(const int16x16 &o) const {
+  template<> inline typename int16x16::cmp_t int16x16::operator<(const int16x16 &o) const {
       return _mm256_cmpgt_epi16(o.v, v);
   }
 #endif
-  template<> int16x16 int16x16::operator^(const int16x16 &o) const {
+  template<> inline int16x16 int16x16::operator^(const int16x16 &o) const {
       return _mm256_xor_si256(v, o.v);
   }
-  template<> int16x16 &int16x16::operator=(const int16x16::native_t o) {
+  template<> inline int16x16 &int16x16::operator=(const int16x16::native_t o) {
       v = _mm256_set1_epi16(o);
       return *this;
   }
-  template<> int16x16 int16x16::operator+(const int16x16 &o) const {
+  template<> inline int16x16 int16x16::operator+(const int16x16 &o) const {
       return _mm256_adds_epi16(v, o.v);
   }
-  template<> int16x16 int16x16::operator-(const int16x16 &o) const {
+  template<> inline int16x16 int16x16::operator-(const int16x16 &o) const {
       return _mm256_subs_epi16(v, o.v);
   }
-  template<> int16x16 int16x16::operator&(const int16x16 &o) const {
+  template<> inline int16x16 int16x16::operator&(const int16x16 &o) const {
       return _mm256_and_si256(v, o.v);
   }
-  template<> int16x16 int16x16::operator|(const int16x16 &o) const {
+  template<> inline int16x16 int16x16::operator|(const int16x16 &o) const {
       return _mm256_or_si256(v, o.v);
   }
-  template<> bool int16x16::any() const {
+  template<> inline bool int16x16::any() const {
       return _mm256_movemask_epi8(v);
   }
   template <>
@@ -494,44 +533,44 @@ namespace vargas {
   int16x16 max(const int16x16 &a, const int16x16 &b) {
       return _mm256_max_epi16(a.v, b.v);
   }
-//  __RG_STRONG_INLINE__
-//  int16x16 blend(const int16x16 &mask, const int16x16 &t, const int16x16 &f) {
-//      return _mm256_blendv_epi16(f.v, t.v, mask.v);
-//  }
+  __RG_STRONG_INLINE__
+  int16x16 blend(const int16x16 &mask, const int16x16 &t, const int16x16 &f) {
+      return _mm256_blendv_epi8(f.v, t.v, mask.v);
+  }
 
   #endif // VA_SIMD_USE_AVX2
 
   #ifdef VA_SIMD_USE_AVX512
 
-  template<> typename int8x64::cmp_t int8x64::operator==(const int8x64 &o) const {
+  template<> inline typename int8x64::cmp_t int8x64::operator==(const int8x64 &o) const {
       return _mm512_cmpeq_epi8_mask(v, o.v);
   }
-  template<> typename int8x64::cmp_t int8x64::operator>(const int8x64 &o) const {
+  template<> inline typename int8x64::cmp_t int8x64::operator>(const int8x64 &o) const {
       return _mm512_cmpgt_epi8_mask(v, o.v);
   }
-  template<> typename int8x64::cmp_t int8x64::operator<(const int8x64 &o) const {
+  template<> inline typename int8x64::cmp_t int8x64::operator<(const int8x64 &o) const {
       return _mm512_cmpgt_epi8_mask(o.v, v);
   }
-  template<> int8x64 int8x64::operator^(const int8x64 &o) const {
+  template<> inline int8x64 int8x64::operator^(const int8x64 &o) const {
       return _mm512_xor_si512(v, o.v);
   }
-  template<> int8x64 &int8x64::operator=(const int8x64::native_t o) {
+  template<> inline int8x64 &int8x64::operator=(const int8x64::native_t o) {
     v =  _mm512_set1_epi8(o);
     return *this;
   }
-  template<> int8x64 int8x64::operator+(const int8x64 &o) const {
+  template<> inline int8x64 int8x64::operator+(const int8x64 &o) const {
       return _mm512_adds_epi8(v, o.v);
   }
-  template<> int8x64 int8x64::operator-(const int8x64 &o) const {
+  template<> inline int8x64 int8x64::operator-(const int8x64 &o) const {
       return _mm512_subs_epi8(v, o.v);
   }
-  template<> int8x64 int8x64::operator&(const int8x64 &o) const {
+  template<> inline int8x64 int8x64::operator&(const int8x64 &o) const {
       return _mm512_and_si512(v, o.v);
   }
-  template<> int8x64 int8x64::operator|(const int8x64 &o) const {
+  template<> inline int8x64 int8x64::operator|(const int8x64 &o) const {
       return _mm512_or_si512(v, o.v);
   }
-  template<> bool int8x64::any() const {
+  template<> inline bool int8x64::any() const {
       return _mm512_movepi8_mask(v);
   }
     template <>
@@ -542,41 +581,41 @@ namespace vargas {
   int8x64 max(const int8x64 &a, const int8x64 &b) {
       return _mm512_max_epi8(a.v, b.v);
   }
-//  __RG_STRONG_INLINE__
-//  int8x64 blend(const int8x64 &mask, const int8x64 &t, const int8x64 &f) {
-//      return _mm512_blendv_epi8(f.v, t.v, mask.v);
-//  }
+  __RG_STRONG_INLINE__
+  int8x64 blend(const MaskType &mask, const int8x64 &t, const int8x64 &f) {
+      return _mm512_mask_blend_epi8(mask, f.v, t.v);
+  }
 
 
-  template<> typename int16x32::cmp_t int16x32::operator==(const int16x32 &o) const {
+  template<> inline typename int16x32::cmp_t int16x32::operator==(const int16x32 &o) const {
       return _mm512_cmpeq_epi16_mask(v, o.v);
   }
-  template<> typename int16x32::cmp_t int16x32::operator>(const int16x32 &o) const {
+  template<> inline typename int16x32::cmp_t int16x32::operator>(const int16x32 &o) const {
       return _mm512_cmpgt_epi16_mask(v, o.v);
   }
-  template<> typename int16x32::cmp_t int16x32::operator<(const int16x32 &o) const {
+  template<> inline typename int16x32::cmp_t int16x32::operator<(const int16x32 &o) const {
       return _mm512_cmpgt_epi16_mask(o.v, v);
   }
-  template<> int16x32 int16x32::operator^(const int16x32 &o) const {
+  template<> inline int16x32 int16x32::operator^(const int16x32 &o) const {
       return _mm512_xor_si512(v, o.v);
   }
-  template<> int16x32 &int16x32::operator=(const int16x32::native_t o) {
+  template<> inline int16x32 &int16x32::operator=(const int16x32::native_t o) {
       v = _mm512_set1_epi16(o);
       return *this;
   }
-  template<> int16x32 int16x32::operator+(const int16x32 &o) const {
+  template<> inline int16x32 int16x32::operator+(const int16x32 &o) const {
       return _mm512_adds_epi16(v, o.v);
   }
-  template<> int16x32 int16x32::operator-(const int16x32 &o) const {
+  template<> inline int16x32 int16x32::operator-(const int16x32 &o) const {
       return _mm512_subs_epi16(v, o.v);
   }
-  template<> int16x32 int16x32::operator&(const int16x32 &o) const {
+  template<> inline int16x32 int16x32::operator&(const int16x32 &o) const {
       return _mm512_and_si512(v, o.v);
   }
-  template<> int16x32 int16x32::operator|(const int16x32 &o) const {
+  template<> inline int16x32 int16x32::operator|(const int16x32 &o) const {
       return _mm512_or_si512(v, o.v);
   }
-  template<> bool int16x32::any() const {
+  template<> inline bool int16x32::any() const {
       return _mm512_movepi16_mask(v);
   }
   template <>
@@ -587,13 +626,313 @@ namespace vargas {
   int16x32 max(const int16x32 &a, const int16x32 &b) {
       return _mm512_max_epi16(a.v, b.v);
   }
-//  __RG_STRONG_INLINE__
-//  int16x32 blend(const int16x32 &mask, const int16x32 &t, const int16x32 &f) {
-//      return _mm512_blendv_epi16(f.v, t.v, mask.v);
-//  }
+  __RG_STRONG_INLINE__
+  int16x32 blend(const MaskType &mask, const int16x32 &t, const int16x32 &f) {
+      return _mm512_mask_blend_epi16(mask, f.v, t.v);
+  }
 
   #endif // VA_SIMD_USE_AVX512
 
+  /********************************** 32b lanes **********************************/
+
+  /**
+   * @brief
+   * One unsigned 32 bit value for each lane of SIMD<T, N>, split over several registers.
+   * @details
+   * Holds the positions and counts of the aligner so they are updated with masks instead of a scalar loop
+   * over the lanes. A comparison of SIMD<T, N> is widened to a mask_t with widen(), and a mask_t is narrowed
+   * back with narrow() for blending scores. Arithmetic wraps like uint32_t and comparisons are unsigned.
+   */
+  template<typename T, unsigned N>
+  struct Lanes32 {
+      using cmp_t = typename SIMD<T, N>::cmp_t;
+      using reg_t = typename SIMD<T, N>::simd_t;
+      #ifdef VA_SIMD_USE_AVX512
+      using reg_mask_t = __mmask16;
+      #else
+      using reg_mask_t = reg_t;
+      #endif
+
+      static constexpr unsigned width = sizeof(reg_t) / sizeof(uint32_t); // Lanes per register
+      static constexpr unsigned regs = N / width;
+      static_assert(regs * width == N, "Lane count must fill whole registers.");
+
+      struct mask_t {
+          reg_mask_t m[regs];
+
+          __RG_STRONG_INLINE__
+          mask_t operator&(const mask_t &o) const {
+              mask_t r;
+              for (unsigned k = 0; k < regs; ++k) r.m[k] = _and(m[k], o.m[k]);
+              return r;
+          }
+
+          __RG_STRONG_INLINE__
+          mask_t operator|(const mask_t &o) const {
+              mask_t r;
+              for (unsigned k = 0; k < regs; ++k) r.m[k] = _or(m[k], o.m[k]);
+              return r;
+          }
+
+          /**
+           * @return Lanes set in this mask but not in o
+           */
+          __RG_STRONG_INLINE__
+          mask_t and_not(const mask_t &o) const {
+              mask_t r;
+              for (unsigned k = 0; k < regs; ++k) r.m[k] = _and_not(m[k], o.m[k]);
+              return r;
+          }
+      };
+
+      Lanes32() = default;
+
+      explicit Lanes32(const uint32_t x) {
+          for (unsigned k = 0; k < regs; ++k) v[k] = _set1(x);
+      }
+
+      /**
+       * @param m comparison of SIMD<T, N>
+       * @return the same lanes as a mask_t
+       */
+      __RG_STRONG_INLINE__
+      static mask_t widen(const cmp_t &m);
+
+      /**
+       * @param m mask of 32 bit lanes
+       * @return the same lanes as a comparison of SIMD<T, N>
+       */
+      __RG_STRONG_INLINE__
+      static cmp_t narrow(const mask_t &m);
+
+      /**
+       * @param x values of SIMD<T, N>
+       * @return the same lanes sign extended to 32 bits
+       */
+      __RG_STRONG_INLINE__
+      static Lanes32 extend(const SIMD<T, N> &x);
+
+      /**
+       * @return the lanes narrowed to SIMD<T, N> with signed saturation
+       */
+      __RG_STRONG_INLINE__
+      SIMD<T, N> pack() const;
+
+      /**
+       * @return Lanes equal to those of o
+       */
+      __RG_STRONG_INLINE__
+      mask_t operator==(const Lanes32 &o) const {
+          mask_t r;
+          for (unsigned k = 0; k < regs; ++k) r.m[k] = _eq(v[k], o.v[k]);
+          return r;
+      }
+
+      /**
+       * @return Lanes greater than those of o
+       */
+      __RG_STRONG_INLINE__
+      mask_t operator>(const Lanes32 &o) const {
+          mask_t r;
+          for (unsigned k = 0; k < regs; ++k) r.m[k] = _gt(v[k], o.v[k]);
+          return r;
+      }
+
+      __RG_STRONG_INLINE__
+      Lanes32 operator+(const uint32_t x) const {
+          Lanes32 r;
+          for (unsigned k = 0; k < regs; ++k) r.v[k] = _add(v[k], _set1(x));
+          return r;
+      }
+
+      __RG_STRONG_INLINE__
+      Lanes32 operator+(const Lanes32 &o) const {
+          Lanes32 r;
+          for (unsigned k = 0; k < regs; ++k) r.v[k] = _add(v[k], o.v[k]);
+          return r;
+      }
+
+      __RG_STRONG_INLINE__
+      Lanes32 operator-(const Lanes32 &o) const {
+          Lanes32 r;
+          for (unsigned k = 0; k < regs; ++k) r.v[k] = _sub(v[k], o.v[k]);
+          return r;
+      }
+
+      /**
+       * @return Lanes equal to zero
+       */
+      __RG_STRONG_INLINE__
+      mask_t zero() const {
+          mask_t r;
+          for (unsigned k = 0; k < regs; ++k) r.m[k] = _eq(v[k], _set1(0));
+          return r;
+      }
+
+      /**
+       * @brief
+       * Copy the lanes of o selected by m.
+       */
+      __RG_STRONG_INLINE__
+      void set(const mask_t &m, const Lanes32 &o) {
+          for (unsigned k = 0; k < regs; ++k) v[k] = _blend(m.m[k], o.v[k], v[k]);
+      }
+
+      /**
+       * @brief
+       * Increment the lanes selected by m.
+       */
+      __RG_STRONG_INLINE__
+      void inc(const mask_t &m) {
+          for (unsigned k = 0; k < regs; ++k) v[k] = _inc(m.m[k], v[k]);
+      }
+
+      void store(uint32_t *dest) const {
+          std::memcpy(dest, v, sizeof(v));
+      }
+
+      uint32_t operator[](const unsigned i) const {
+          uint32_t x;
+          std::memcpy(&x, reinterpret_cast<const char *>(v) + i * sizeof(uint32_t), sizeof(uint32_t));
+          return x;
+      }
+
+      reg_t v[regs];
+
+    private:
+      #ifdef VA_SIMD_USE_AVX512
+      __RG_STRONG_INLINE__ static reg_t _set1(uint32_t x) { return _mm512_set1_epi32(x); }
+      __RG_STRONG_INLINE__ static reg_t _add(reg_t a, reg_t b) { return _mm512_add_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _sub(reg_t a, reg_t b) { return _mm512_sub_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _gt(reg_t a, reg_t b) { return _mm512_cmpgt_epu32_mask(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _eq(reg_t a, reg_t b) { return _mm512_cmpeq_epi32_mask(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _blend(reg_mask_t m, reg_t t, reg_t f) { return _mm512_mask_blend_epi32(m, f, t); }
+      __RG_STRONG_INLINE__ static reg_t _inc(reg_mask_t m, reg_t a) { return _mm512_mask_add_epi32(a, m, a, _set1(1)); }
+      __RG_STRONG_INLINE__ static reg_mask_t _and(reg_mask_t a, reg_mask_t b) { return a & b; }
+      __RG_STRONG_INLINE__ static reg_mask_t _or(reg_mask_t a, reg_mask_t b) { return a | b; }
+      __RG_STRONG_INLINE__ static reg_mask_t _and_not(reg_mask_t a, reg_mask_t b) { return a & ~b; }
+      #elif defined(VA_SIMD_USE_AVX2)
+      __RG_STRONG_INLINE__ static reg_t _set1(uint32_t x) { return _mm256_set1_epi32(x); }
+      __RG_STRONG_INLINE__ static reg_t _add(reg_t a, reg_t b) { return _mm256_add_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _sub(reg_t a, reg_t b) { return _mm256_sub_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _gt(reg_t a, reg_t b) {
+          const reg_t sign = _set1(0x80000000u);
+          return _mm256_cmpgt_epi32(_mm256_xor_si256(a, sign), _mm256_xor_si256(b, sign));
+      }
+      __RG_STRONG_INLINE__ static reg_mask_t _eq(reg_t a, reg_t b) { return _mm256_cmpeq_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _blend(reg_mask_t m, reg_t t, reg_t f) { return _mm256_blendv_epi8(f, t, m); }
+      __RG_STRONG_INLINE__ static reg_t _inc(reg_mask_t m, reg_t a) { return _mm256_sub_epi32(a, m); }
+      __RG_STRONG_INLINE__ static reg_mask_t _and(reg_mask_t a, reg_mask_t b) { return _mm256_and_si256(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _or(reg_mask_t a, reg_mask_t b) { return _mm256_or_si256(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _and_not(reg_mask_t a, reg_mask_t b) { return _mm256_andnot_si256(b, a); }
+      #else
+      __RG_STRONG_INLINE__ static reg_t _set1(uint32_t x) { return _mm_set1_epi32(x); }
+      __RG_STRONG_INLINE__ static reg_t _add(reg_t a, reg_t b) { return _mm_add_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _sub(reg_t a, reg_t b) { return _mm_sub_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _gt(reg_t a, reg_t b) {
+          const reg_t sign = _set1(0x80000000u);
+          return _mm_cmpgt_epi32(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+      }
+      __RG_STRONG_INLINE__ static reg_mask_t _eq(reg_t a, reg_t b) { return _mm_cmpeq_epi32(a, b); }
+      __RG_STRONG_INLINE__ static reg_t _blend(reg_mask_t m, reg_t t, reg_t f) { return _mm_blendv_epi8(f, t, m); }
+      __RG_STRONG_INLINE__ static reg_t _inc(reg_mask_t m, reg_t a) { return _mm_sub_epi32(a, m); }
+      __RG_STRONG_INLINE__ static reg_mask_t _and(reg_mask_t a, reg_mask_t b) { return _mm_and_si128(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _or(reg_mask_t a, reg_mask_t b) { return _mm_or_si128(a, b); }
+      __RG_STRONG_INLINE__ static reg_mask_t _and_not(reg_mask_t a, reg_mask_t b) { return _mm_andnot_si128(b, a); }
+      #endif
+  };
+
+  #ifdef VA_SIMD_USE_AVX512
+
+  template<> inline typename Lanes32<char, 64>::mask_t Lanes32<char, 64>::widen(const cmp_t &m) {
+      return {{__mmask16(m.v), __mmask16(m.v >> 16), __mmask16(m.v >> 32), __mmask16(m.v >> 48)}};
+  }
+  template<> inline typename Lanes32<char, 64>::cmp_t Lanes32<char, 64>::narrow(const mask_t &m) {
+      return uint64_t(m.m[0]) | uint64_t(m.m[1]) << 16 | uint64_t(m.m[2]) << 32 | uint64_t(m.m[3]) << 48;
+  }
+  template<> inline Lanes32<char, 64> Lanes32<char, 64>::extend(const SIMD<char, 64> &x) {
+      Lanes32 r;
+      r.v[0] = _mm512_cvtepi8_epi32(_mm512_extracti32x4_epi32(x.v, 0));
+      r.v[1] = _mm512_cvtepi8_epi32(_mm512_extracti32x4_epi32(x.v, 1));
+      r.v[2] = _mm512_cvtepi8_epi32(_mm512_extracti32x4_epi32(x.v, 2));
+      r.v[3] = _mm512_cvtepi8_epi32(_mm512_extracti32x4_epi32(x.v, 3));
+      return r;
+  }
+  template<> inline SIMD<char, 64> Lanes32<char, 64>::pack() const {
+      __m512i r = _mm512_castsi128_si512(_mm512_cvtsepi32_epi8(v[0]));
+      r = _mm512_inserti32x4(r, _mm512_cvtsepi32_epi8(v[1]), 1);
+      r = _mm512_inserti32x4(r, _mm512_cvtsepi32_epi8(v[2]), 2);
+      return _mm512_inserti32x4(r, _mm512_cvtsepi32_epi8(v[3]), 3);
+  }
+  template<> inline typename Lanes32<int16_t, 32>::mask_t Lanes32<int16_t, 32>::widen(const cmp_t &m) {
+      return {{__mmask16(m.v), __mmask16(m.v >> 16)}};
+  }
+  template<> inline typename Lanes32<int16_t, 32>::cmp_t Lanes32<int16_t, 32>::narrow(const mask_t &m) {
+      return uint64_t(m.m[0]) | uint64_t(m.m[1]) << 16;
+  }
+
+  #elif defined(VA_SIMD_USE_AVX2)
+
+  template<> inline typename Lanes32<char, 32>::mask_t Lanes32<char, 32>::widen(const cmp_t &m) {
+      const __m128i lo = _mm256_castsi256_si128(m.v), hi = _mm256_extracti128_si256(m.v, 1);
+      return {{_mm256_cvtepi8_epi32(lo), _mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8)),
+               _mm256_cvtepi8_epi32(hi), _mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8))}};
+  }
+  template<> inline typename Lanes32<char, 32>::cmp_t Lanes32<char, 32>::narrow(const mask_t &m) {
+      // Packs interleave the 128 bit halves, the permutes put them back in order
+      const __m256i a = _mm256_permute4x64_epi64(_mm256_packs_epi32(m.m[0], m.m[1]), 0xD8);
+      const __m256i b = _mm256_permute4x64_epi64(_mm256_packs_epi32(m.m[2], m.m[3]), 0xD8);
+      return _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+  }
+  template<> inline Lanes32<char, 32> Lanes32<char, 32>::extend(const SIMD<char, 32> &x) {
+      Lanes32 r;
+      const auto m = widen(x); // Sign extends any value, not only masks
+      for (unsigned k = 0; k < regs; ++k) r.v[k] = m.m[k];
+      return r;
+  }
+  template<> inline SIMD<char, 32> Lanes32<char, 32>::pack() const {
+      return narrow({{v[0], v[1], v[2], v[3]}});
+  }
+  template<> inline typename Lanes32<int16_t, 16>::mask_t Lanes32<int16_t, 16>::widen(const cmp_t &m) {
+      return {{_mm256_cvtepi16_epi32(_mm256_castsi256_si128(m.v)),
+               _mm256_cvtepi16_epi32(_mm256_extracti128_si256(m.v, 1))}};
+  }
+  template<> inline typename Lanes32<int16_t, 16>::cmp_t Lanes32<int16_t, 16>::narrow(const mask_t &m) {
+      return _mm256_permute4x64_epi64(_mm256_packs_epi32(m.m[0], m.m[1]), 0xD8);
+  }
+
+  #else
+
+  template<> inline typename Lanes32<char, 16>::mask_t Lanes32<char, 16>::widen(const cmp_t &m) {
+      return {{_mm_cvtepi8_epi32(m.v), _mm_cvtepi8_epi32(_mm_srli_si128(m.v, 4)),
+               _mm_cvtepi8_epi32(_mm_srli_si128(m.v, 8)), _mm_cvtepi8_epi32(_mm_srli_si128(m.v, 12))}};
+  }
+  template<> inline typename Lanes32<char, 16>::cmp_t Lanes32<char, 16>::narrow(const mask_t &m) {
+      return _mm_packs_epi16(_mm_packs_epi32(m.m[0], m.m[1]), _mm_packs_epi32(m.m[2], m.m[3]));
+  }
+  template<> inline Lanes32<char, 16> Lanes32<char, 16>::extend(const SIMD<char, 16> &x) {
+      Lanes32 r;
+      const auto m = widen(x); // Sign extends any value, not only masks
+      for (unsigned k = 0; k < regs; ++k) r.v[k] = m.m[k];
+      return r;
+  }
+  template<> inline SIMD<char, 16> Lanes32<char, 16>::pack() const {
+      return narrow({{v[0], v[1], v[2], v[3]}});
+  }
+  template<> inline typename Lanes32<int16_t, 8>::mask_t Lanes32<int16_t, 8>::widen(const cmp_t &m) {
+      return {{_mm_cvtepi16_epi32(m.v), _mm_cvtepi16_epi32(_mm_srli_si128(m.v, 8))}};
+  }
+  template<> inline typename Lanes32<int16_t, 8>::cmp_t Lanes32<int16_t, 8>::narrow(const mask_t &m) {
+      return _mm_packs_epi32(m.m[0], m.m[1]);
+  }
+
+  #endif
+
+  } // namespace VA_SIMD_NAMESPACE
+  VA_SIMD_TARGET_END
+
+  using namespace VA_SIMD_NAMESPACE;
+
 }
 
 
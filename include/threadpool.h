@@ -2,6 +2,9 @@
 #define KTHREAD_STORAGE static inline
 #include "./kthread.h"
 #include "./kthread.c"
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
 
 namespace rg {
 struct ForPool {
@@ -12,6 +15,18 @@ struct ForPool {
     void forpool(void (*func)(void*,long,int), void *data, long n) {
         kt_forpool(fp_, func, data, n);
     }
+    // Pin worker i to the CPUs cpus[i], returns the number of workers pinned. With one thread, work runs on the caller.
+    int pin(const std::vector<std::vector<int>> &cpus) {
+        kt_forpool_t *fp = (kt_forpool_t *)fp_;
+        int pinned = 0;
+        for (int i = 0; i < fp->n_threads && i < (int)cpus.size(); ++i) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (const int c : cpus[i]) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+            if (pthread_setaffinity_np(fp->tid[i], sizeof(set), &set) == 0) ++pinned;
+        }
+        return pinned;
+    }
     ~ForPool() {
         kt_forpool_destroy(fp_);
     }
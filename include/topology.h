@@ -0,0 +1,132 @@
+/**
+ * @brief
+ * NUMA placement of aligner threads and per-node copies of compiled graphs.
+ *
+ * @details
+ * Aligners stream the sequence of every node for each read vector, so on a multi-socket host a graph held in
+ * one node's memory is read remotely by the threads of the others. With placement on, worker threads are pinned
+ * to the CPUs of a node and align to a copy of the graph made by the first of them to need it, which places
+ * its pages on that node. Aligners are created by the worker that uses them, so their buffers are local too.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_TOPOLOGY_H
+#define VARGAS_TOPOLOGY_H
+
+#include "graphman.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+
+namespace vargas {
+
+  /**
+   * @brief
+   * CPUs of each NUMA node available to the process.
+   */
+  class Topology {
+    public:
+      /**
+       * @param cpus CPUs of each node, nodes without CPUs are dropped
+       * @throws std::invalid_argument if no node has a CPU
+       */
+      explicit Topology(std::vector<std::vector<int>> cpus);
+
+      /**
+       * @brief
+       * Read the nodes from sysfs, keeping the CPUs in the affinity mask of the process.
+       * @param sysfs Node directory
+       * @return Topology, a single node of the allowed CPUs if there is no NUMA information
+       */
+      static Topology detect(const std::string &sysfs = "/sys/devices/system/node");
+
+      /**
+       * @return Number of nodes
+       */
+      size_t nodes() const { return _cpus.size(); }
+
+      /**
+       * @param node
+       * @return CPUs of node
+       */
+      const std::vector<int> &cpus(size_t node) const { return _cpus.at(node); }
+
+      /**
+       * @brief
+       * Threads are assigned to nodes in contiguous blocks, so neighbouring thread indices share a node.
+       * @param tid Thread index
+       * @param threads Number of threads
+       * @return Node of thread tid
+       */
+      size_t node_of(size_t tid, size_t threads) const;
+
+      /**
+       * @param threads Number of threads
+       * @return CPUs of the node of each thread
+       */
+      std::vector<std::vector<int>> thread_cpus(size_t threads) const;
+
+    private:
+      std::vector<std::vector<int>> _cpus;
+  };
+
+  /**
+   * @param list Kernel CPU list, e.g. "0-3,8,10-11"
+   * @return CPUs in the list
+   * @throws std::invalid_argument on a malformed list
+   */
+  std::vector<int> parse_cpulist(const std::string &list);
+
+  /**
+   * @brief
+   * Copies of compiled graphs in the memory of each node.
+   */
+  class GraphReplicas {
+    public:
+      /**
+       * @param gm Graphs to copy
+       * @param topology Nodes
+       * @param threads Worker threads, assigned to nodes by Topology::node_of()
+       */
+      GraphReplicas(const GraphMan &gm, const Topology &topology, size_t threads);
+
+      /**
+       * @param label Graph label
+       * @param tid Worker index
+       * @return Copy of the compiled graph on the node of tid, made by the first worker of the node to ask
+       */
+      std::shared_ptr<const CompiledGraph> compiled(const std::string &label, size_t tid);
+
+      /**
+       * @return CPUs of each worker, see rg::ForPool::pin()
+       */
+      const std::vector<std::vector<int>> &thread_cpus() const { return _thread_cpus; }
+
+      /**
+       * @return Number of copies made
+       */
+      size_t size() const;
+
+    private:
+      struct _node {
+          std::mutex mut;
+          std::map<std::string, std::shared_ptr<const CompiledGraph>> graphs;
+      };
+
+      const GraphMan &_gm;
+      std::vector<size_t> _thread_node;
+      std::vector<std::vector<int>> _thread_cpus;
+      std::vector<std::unique_ptr<_node>> _nodes;
+  };
+
+}
+
+#endif //VARGAS_TOPOLOGY_H
@@ -0,0 +1,98 @@
+/**
+ * @brief
+ * Banded traceback of alignments to linear references.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#ifndef VARGAS_TRACEBACK_H
+#define VARGAS_TRACEBACK_H
+
+#include "scoring.h"
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace vargas {
+
+  /**
+   * @brief
+   * Recovers the CIGAR string and start position of an alignment once the aligner has found its
+   * score and end position.
+   * @details
+   * The DP is only filled for the diagonals that an alignment reaching the known score can use,
+   * since every gap costs at least its extension penalty. Matrices are stored one band per row and
+   * kept between calls, so one Traceback per thread avoids allocating for each read.
+   * If the band does not reproduce the known score (e.g. qualities were scored differently) the
+   * full matrix is filled instead, so the result never depends on the band.
+   */
+  class Traceback {
+    public:
+
+      /**
+       * @brief
+       * Trace back an alignment ending at the last base of ref.
+       * @param prof Score profile used by the aligner
+       * @param read Read sequence, on the aligned strand
+       * @param qual Read qualities, ignored unless the same length as read
+       * @param phred_offset Offset of qual
+       * @param ref Reference bases, ending at the alignment end position
+       * @param ref_len Number of reference bases
+       * @param max_score Score reported by the aligner
+       * @param cigar Output CIGAR string
+       * @param offset Output offset of the alignment start within ref
+       * @return Optimal DP score
+       */
+      int trace(const ScoreProfile &prof, const std::string &read, const std::string &qual, char phred_offset,
+                const rg::Base *ref, size_t ref_len, int max_score, std::string &cigar, size_t &offset);
+
+      /**
+       * @param banded Restrict the DP to a band around the alignment, true by default
+       */
+      void set_banded(bool banded) { _banded = banded; }
+
+      /**
+       * @return Cells filled per matrix by the last trace
+       */
+      size_t cells() const { return _M.size(); }
+
+    private:
+      /**
+       * @brief
+       * Fill the matrices for diagonals (col - row) in [glo, ghi].
+       */
+      void _fill(const ScoreProfile &prof, const std::string &read, const std::string &qual, char phred_offset,
+                 const rg::Base *ref, int ref_len, int glo, int ghi);
+
+      /**
+       * @return Index of a cell in the banded matrices, or -1 if outside the band
+       */
+      int _cell(int row, int col) const {
+          const int k = col - row - _glo;
+          return k < 0 || k > _ghi - _glo ? -1 : row * _width + k + 1;
+      }
+
+      /**
+       * @brief
+       * Traceback from the end of the alignment.
+       * @return False if a cell outside the band is needed
+       */
+      bool _trace(const ScoreProfile &prof, int rows, int ref_len, int max_score, int &score,
+                  std::string &cigar, size_t &offset);
+
+      bool _banded = true;
+      int _glo = 0, _ghi = 0, _width = 0; // Diagonal band, and row stride including one pad on each side
+      std::vector<int> _M, _D, _I; // match, deletion, insertion scores
+      std::vector<uint8_t> _t; // Traceback matrix of each cell, 2 bits each for M, D, I
+      std::vector<char> _ref, _aln;
+  };
+
+}
+
+#endif //VARGAS_TRACEBACK_H
@@ -54,6 +54,9 @@
 #include <memory>
 #include <iostream>
 #include <stdexcept>
+#include <cmath>
+#include <iomanip>
+#include <limits>
 
 namespace rg {
 
@@ -434,6 +437,33 @@ print(", ".join(map(str, map(ord, lut))))
       os << vec_to_str(v);
   }
 
+  /**
+   * @brief
+   * Uniformly sample k items in a single pass (Algorithm R).
+   * @details
+   * Only k items are held at a time, regardless of the number of items produced by next.
+   * @param next Loads the next item into its argument, returns false when exhausted
+   * @param k Number of items to keep
+   * @param gen Random generator
+   * @return Sampled items, at most k
+   */
+  template<typename T, typename Fn, typename Gen>
+  std::vector<T> reservoir_sample(Fn next, size_t k, Gen &gen) {
+      std::vector<T> ret;
+      ret.reserve(k);
+      T item;
+      size_t seen = 0;
+      while (next(item)) {
+          if (ret.size() < k) ret.push_back(std::move(item));
+          else {
+              const size_t j = std::uniform_int_distribution<size_t>(0, seen)(gen);
+              if (j < k) ret[j] = std::move(item);
+          }
+          ++seen;
+      }
+      return ret;
+  }
+
   template<typename Object, typename R, typename ...Args>
   struct smart_fun {
       Object & obj;
@@ -494,6 +524,143 @@ print(", ".join(map(str, map(ord, lut))))
   typename _Unique_if<T>::_Known_bound
   make_unique(Args &&...) = delete;
 
+  /**
+   * @brief
+   * Minimal streaming JSON writer. Keys are ignored inside arrays.
+   */
+  class JsonWriter {
+    public:
+      explicit JsonWriter(std::ostream &os) : _os(os) {}
+
+      JsonWriter &begin(const std::string &key = "") { return _open(key, '{'); }
+      JsonWriter &begin_array(const std::string &key = "") { return _open(key, '['); }
+
+      JsonWriter &end() {
+          if (_stack.empty()) throw std::logic_error("No open JSON object.");
+          _os << (_stack.back() == '{' ? '}' : ']');
+          _stack.pop_back();
+          _first = false;
+          return *this;
+      }
+
+      JsonWriter &value(const std::string &key, const std::string &v) {
+          _key(key);
+          _string(v);
+          return *this;
+      }
+      JsonWriter &value(const std::string &key, const char *v) { return value(key, std::string(v)); }
+
+      JsonWriter &value(const std::string &key, bool v) {
+          _key(key);
+          _os << (v ? "true" : "false");
+          return *this;
+      }
+
+      JsonWriter &value(const std::string &key, double v) {
+          _key(key);
+          if (std::isfinite(v)) _os << std::setprecision(6) << v;
+          else _os << "null";
+          return *this;
+      }
+
+      template<typename T>
+      typename std::enable_if<std::is_integral<T>::value, JsonWriter &>::type
+      value(const std::string &key, T v) {
+          _key(key);
+          _os << v;
+          return *this;
+      }
+
+    private:
+      std::ostream &_os;
+      std::vector<char> _stack;
+      bool _first = true;
+
+      JsonWriter &_open(const std::string &key, char c) {
+          _key(key);
+          _os << c;
+          _stack.push_back(c);
+          _first = true;
+          return *this;
+      }
+
+      void _key(const std::string &key) {
+          if (!_first) _os << ',';
+          _first = false;
+          if (!_stack.empty() && _stack.back() == '{') {
+              _string(key);
+              _os << ':';
+          }
+      }
+
+      void _string(const std::string &s) {
+          _os << '"';
+          for (const char c : s) {
+              switch (c) {
+                  case '"': _os << "\\\""; break;
+                  case '\\': _os << "\\\\"; break;
+                  case '\n': _os << "\\n"; break;
+                  case '\t': _os << "\\t"; break;
+                  default:
+                      if (uint8_t(c) < 0x20) _os << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xf];
+                      else _os << c;
+              }
+          }
+          _os << '"';
+      }
+  };
+
+  constexpr size_t huge_page_bytes = size_t(2) << 20;
+
+  /**
+   * @brief
+   * Back aligned allocations of at least huge_page_bytes with transparent huge pages. Process wide, off by default.
+   * @param enable
+   */
+  void set_huge_pages(bool enable);
+
+  /**
+   * @return true if large aligned allocations are advised to use huge pages
+   */
+  bool huge_pages();
+
+  /**
+   * @brief
+   * Allocate aligned memory, released with free().
+   * @details
+   * With huge pages on, blocks of at least huge_page_bytes are aligned to a huge page and advised with
+   * MADV_HUGEPAGE. Pages are placed on the NUMA node of the thread that first writes them.
+   * @param bytes
+   * @param alignment Power of two, at least sizeof(void *)
+   * @throws std::bad_alloc
+   */
+  void *alloc_aligned(size_t bytes, size_t alignment);
+
+  /**
+   * @brief
+   * Allocator for large arrays through alloc_aligned(), so they may use huge pages.
+   */
+  template<typename T>
+  struct page_allocator {
+      using value_type = T;
+
+      page_allocator() = default;
+      template<typename U>
+      page_allocator(const page_allocator<U> &) {}
+
+      T *allocate(std::size_t n) const {
+          if (n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_alloc();
+          return static_cast<T *>(alloc_aligned(n * sizeof(T), alignof(T) < sizeof(void *) ? sizeof(void *) : alignof(T)));
+      }
+
+      void deallocate(T *p, std::size_t) const { ::std::free(p); }
+
+      template<typename U>
+      bool operator==(const page_allocator<U> &) const { return true; }
+      template<typename U>
+      bool operator!=(const page_allocator<U> &) const { return false; }
+  };
+
   struct Deleter {
       void operator()(const void *p) const {
           ::std::free(const_cast<void *>(p));
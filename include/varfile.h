@@ -36,6 +36,10 @@
 #include <set>
 #include <unordered_map>
 #include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace vargas {
 
@@ -295,10 +299,36 @@ namespace vargas {
           return _samples;
       }
 
+      /**
+       * @brief
+       * Decompress BGZF compressed files with n additional threads. No effect on uncompressed files.
+       * @param n Number of decompression threads
+       */
+      void set_threads(int n) {
+          if (_bcf && n > 0) hts_set_threads(_bcf, n);
+      }
+
+      /**
+       * @brief
+       * Read and unpack up to n records ahead of next() in a background thread, so that reading
+       * overlaps with processing of the current record. 0 disables prefetching.
+       * @details
+       * The reader starts on the first next(), so the region, ingroup
+       * and variant limit should be set before then. Only BCF input is prefetched: htslib adds
+       * undeclared contigs and tags to the header while parsing text VCF, and the accessors of the
+       * current record read the header.
+       * @param n Maximum number of records to read ahead
+       */
+      void set_prefetch(size_t n) {
+          _prefetch = n;
+      }
+
       /**
        * @brief
        * Load the next VCF record. All information is unpacked,
        * subject to sample set restrictions.
+       * @details
+       * Allele populations are decoded directly from the GT values. Missing genotypes are in no population.
        * @return false on read error or if outside restriction range.
        */
       bool next();
@@ -350,7 +380,8 @@ namespace vargas {
        * Consecutive alleles represent phasing, e.g. all odd indexes are one phase,
        * all even indexes are the other. Call will unpack the full record.
        * Explicit copy number variations are replaced, other ambiguous types are replaced.
-       * A map is also built, mapping each allele to the subpopulation that has it.
+       * Missing genotypes are ".". Built from the GT values decoded by next(), which
+       * does not need the strings.
        * @return Vector of alleles, ordered by sample.
        */
       const std::vector<std::string> &gen_genotypes();
@@ -485,6 +516,30 @@ namespace vargas {
        */
       void _apply_ingroup_filter();
 
+      /**
+       * @brief
+       * Read the next record within the region into rec, and unpack it.
+       * @return false at the end of the file or region
+       */
+      bool _read_record(bcf1_t *rec);
+
+      /**
+       * @brief
+       * Swap the next prefetched record into _curr_rec, starting the reader if needed.
+       * @return false if no records are left
+       */
+      bool _next_prefetched();
+
+      void _prefetch_loop();
+
+      void _stop_prefetch();
+
+      /**
+       * @brief
+       * Decode the GT values of the current record and build the population of each allele.
+       */
+      void _decode_genotypes();
+
 
     private:
       std::string _file_name; // VCF/BCF file name
@@ -494,8 +549,12 @@ namespace vargas {
       bcf_hdr_t *_header = nullptr;
       bcf1_t *_curr_rec = bcf_init();
 
-      std::vector<std::string> _genotypes; // restricted to _ingroup
+      std::vector<std::string> _genotypes; // restricted to _ingroup, filled by gen_genotypes()
+      int32_t *_gt = nullptr; // GT values of the current record, reused between records
+      int _gt_cap = 0, _gt_len = 0;
+      std::vector<Population> _allele_indivs; // Population of each allele index
       std::unordered_map<std::string, Population> _genotype_indivs;
+      mutable std::vector<float> _allele_freqs; // Filled by frequencies()
       std::vector<std::string> _alleles;
       std::vector<std::string> _samples;
       std::vector<std::string> _ingroup; // subset of _samples
@@ -505,6 +564,15 @@ namespace vargas {
 
       bool _assume_contig, _entered_contig;
 
+      // Prefetched records, and consumed records for the reader to reuse
+      size_t _prefetch = 0;
+      bool _is_bcf = false; // Reading BCF leaves the header unchanged, so it may be prefetched
+      std::deque<bcf1_t *> _ready, _spare;
+      std::thread _reader;
+      std::mutex _pf_mut;
+      std::condition_variable _pf_cv;
+      bool _pf_stop = false, _pf_done = false;
+
   };
 
   inline std::ostream &operator<<(std::ostream &os, const VCF &vcf) {
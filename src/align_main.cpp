@@ -15,13 +15,40 @@
 
 #include "align_main.h"
 #include "alignment.h"
+#include "kmer_index.h"
 #include "sim.h"
 #include "threadpool.h"
+#include "serve.h"
+#include "shard.h"
+#include "gpu.h"
+#include "topology.h"
 #include <mutex>
+#include <map>
+#include <fstream>
+#include <set>
+#include <numeric>
+#include <cmath>
+#include <cpuid.h>
+#include <climits>
+#include <unistd.h>
+
+
+int align_main(int argc, char *argv[], AlignCache *cache) {
+    const auto run_start = std::chrono::steady_clock::now();
+
+    // Forward the job to a server before parsing, which consumes the arguments
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg.compare(0, 8, "--server") != 0) continue;
+        std::string socket;
+        if (arg.size() > 9 && arg[8] == '=') socket = arg.substr(9);
+        else if (arg.size() == 8 && i + 1 < argc) socket = argv[i + 1];
+        else throw std::invalid_argument("--server requires a socket path.");
+        std::vector<std::string> args(argv, argv + argc);
+        args.erase(args.begin() + i, args.begin() + i + (arg.size() == 8 ? 2 : 1));
+        return align_client(socket, args);
+    }
 
-using rg::Deleter;
-
-int align_main(int argc, char *argv[]) {
     std::string cl = "vargas ";
     {
         std::ostringstream ss;
@@ -30,18 +57,23 @@ int align_main(int argc, char *argv[]) {
     }
 
     // Load parameters
-    unsigned match, npenalty, threads, chunk_size, subsample;
-    std::string read_file, gdf, align_targets, out_file, pgid, mismatch, rdg, rfg;
-    bool end_to_end = false, fwdonly = false, p64=false, msonly=false, maxonly=false, notraceback=false;
+    unsigned match, npenalty, threads, chunk_size, subsample, ring_size, max_len, writer_threads, writer_buffer, groups,
+    bucket, io_threads, gpus;
+    double progress_s;
+    std::string read_file, gdf, align_targets, out_file, out_fmt, pgid, mismatch, rdg, rfg, isa_str, stats_file,
+    shard_spec, shard_by;
+    bool end_to_end = false, fwdonly = false, p64=false, msonly=false, maxonly=false, notraceback=false, stream=false, ordered=false,
+    prefilter = false, multi = false, numa = false, hugepages = false;
 
     cxxopts::Options opts("vargas align", "Align reads to a graph.");
     try {
         opts.add_options("Input")
         ("g,gdef", "<str> *Graph definition file.", cxxopts::value(gdf))
-        ("U,reads", "<str> *Unpaired reads in SAM, FASTQ, or FASTA format.", cxxopts::value(read_file));
+        ("U,reads", "<str> *Unpaired reads in SAM, BAM, CRAM, FASTQ, or FASTA format.", cxxopts::value(read_file));
 
         opts.add_options("Optional")
         ("S,sam", "<str> Output file.", cxxopts::value(out_file))
+        ("out-fmt", "<str> Output format: sam, bam, or cram. (default: from -S extension, else sam)", cxxopts::value(out_fmt))
         ("msonly", "Only report max score. Improves speed.", cxxopts::value(msonly)->implicit_value("1"))
         ("maxonly", "Only report max score, location, and count. Improves speed.", cxxopts::value(maxonly)->implicit_value("1"))
         ("phred64", "Qualities are Phred+64, not Phred+33.", cxxopts::value(p64)->implicit_value("1"))
@@ -49,7 +81,16 @@ int align_main(int argc, char *argv[]) {
         ("a,alignto", "<str> Target graph, or SAM Read Group -> graph mapping.\"(RG:ID:<group>,<target_graph>;)+|<graph>\"", cxxopts::value(align_targets))
         ("s,assess", "[ID] Use score profile from a previous alignment.", cxxopts::value(pgid)->implicit_value("."))
         ("f,forward", "Only align to forward strand.", cxxopts::value(fwdonly))
-        ("notraceback", "If graph contains no variants, do not compute traceback", cxxopts::value(notraceback)->implicit_value("1"));
+        ("notraceback", "If graph contains no variants, do not compute traceback", cxxopts::value(notraceback)->implicit_value("1"))
+        ("prefilter", "Only align to windows hit by k-mer seeds, see define -k. Reads without hits align everywhere.", cxxopts::value(prefilter)->implicit_value("1"))
+        ("multi", "Align read groups targeting several graphs to all of them in one pass, tagging each copy with gr:Z:<graph>.", cxxopts::value(multi)->implicit_value("1"))
+        ("maxlen", "<N> Expected max read length with --stream. (default: longest in first batch)", cxxopts::value(max_len)->default_value("0"))
+        ("isa", "<str> Aligner instruction set: sse4.1, avx2, avx512bw. (default: widest supported)", cxxopts::value(isa_str))
+        ("stats", "<str> Write counters and stage timings as JSON to file when done.", cxxopts::value(stats_file))
+        ("progress", "<N> Report aligned reads and reads/s every N seconds, 0 to not report.", cxxopts::value(progress_s)->default_value("0"))
+        ("server", "<str> Run the job on a vargas serve instance listening on this socket.", cxxopts::value<std::string>())
+        ("shard", "<i/N> Only run shard i of N, from 0.", cxxopts::value(shard_spec))
+        ("shard-by", "<str> Shard by reads, or by graph into partial results for vargas merge.", cxxopts::value(shard_by)->default_value("reads"));
 
         opts.add_options("Scoring")
         ("ete", "End to end alignment.", cxxopts::value(end_to_end))
@@ -61,7 +102,18 @@ int align_main(int argc, char *argv[]) {
 
         opts.add_options("Threading")
         ("j,threads", "<N> Number of threads.", cxxopts::value(threads)->default_value("1"))
-        ("u,chunk", "<N> Partition into tasks of max size N.", cxxopts::value(chunk_size)->default_value("64"));
+        ("gpus", "<N> Experimental: threads of -j driving CUDA aligners, spread over the devices.", cxxopts::value(gpus)->default_value("0"))
+        ("numa", "Pin threads to NUMA nodes, each aligning to a copy of the graph in its node's memory.", cxxopts::value(numa)->implicit_value("1"))
+        ("hugepages", "Back graph sequences and large aligner buffers with transparent huge pages.", cxxopts::value(hugepages)->implicit_value("1"))
+        ("u,chunk", "<N> Partition into tasks of max size N. 0 to size tasks by estimated cost.", cxxopts::value(chunk_size)->default_value("0"))
+        ("groups", "<N> Read vectors aligned together in each pass over the graph.", cxxopts::value(groups)->default_value("4"))
+        ("bucket", "<N> Group reads into tasks by length, in buckets of N bp. 0 to pad all reads to the longest.", cxxopts::value(bucket)->default_value("16"))
+        ("stream", "Stream reads with bounded memory instead of loading all reads.", cxxopts::value(stream)->implicit_value("1"))
+        ("ring", "<N> Tasks per batch with --stream. (default: 4 * threads)", cxxopts::value(ring_size)->default_value("0"))
+        ("writer-threads", "<N> Background output writers, 0 to write from aligner threads.", cxxopts::value(writer_threads)->default_value("1"))
+        ("writer-buffer", "<N> Max pending output in MB before aligners wait on the writer.", cxxopts::value(writer_buffer)->default_value("64"))
+        ("io-threads", "<N> Threads compressing BAM/CRAM output and decompressing BAM/CRAM reads.", cxxopts::value(io_threads)->default_value("0"))
+        ("ordered", "Write alignments in task order, keeping the input order of the reads of each read group and target.", cxxopts::value(ordered)->implicit_value("1"));
 
         opts.add_options()("h,help", "Display this message.");
 
@@ -85,10 +137,17 @@ int align_main(int argc, char *argv[]) {
         throw std::invalid_argument("No read file provided.");
     }
     ReadFmt format = read_fmt(read_file);
+    const vargas::SAM::Format sam_fmt = out_fmt.empty() ? vargas::SAM::format(out_file) : vargas::SAM::parse_format(out_fmt);
+
+    const vargas::ISA isa = isa_str.empty() ? best_isa() : parse_isa(isa_str);
+    if (gpus) {
+        if (!vargas::gpu::built()) throw std::invalid_argument("GPU aligner not built, see BUILD_CUDA.");
+        if (vargas::gpu::devices() == 0) throw std::invalid_argument("No CUDA devices found.");
+    }
 
-    if (chunk_size < vargas::Aligner::read_capacity() || chunk_size % vargas::Aligner::read_capacity() != 0) {
+    if (chunk_size && (chunk_size < isa_read_capacity(isa, false) || chunk_size % isa_read_capacity(isa, false) != 0)) {
         std::cerr << "[warn] Chunk size is not a multiple of SIMD vector length: "
-                  << vargas::Aligner::read_capacity() << std::endl;
+                  << isa_read_capacity(isa, false) << std::endl;
     }
 
     if (opts.count("assess") && format != ReadFmt::SAM) {
@@ -98,20 +157,83 @@ int align_main(int argc, char *argv[]) {
         throw std::invalid_argument("Alignment targets only available for SAM inputs.");
     }
 
+    if (writer_threads > 1) {
+        throw std::invalid_argument("At most one writer thread is supported, output is a single stream.");
+    }
+    if (ordered && writer_threads == 0) {
+        throw std::invalid_argument("--ordered needs the background writer, --writer-threads 1.");
+    }
+
     if(opts.count("msonly") && opts.count("maxonly")) {
         throw std::invalid_argument("At most one of msonly and maxonly can be specified.");
     }
 
+    if (multi && (stream || prefilter)) {
+        throw std::invalid_argument("--multi cannot be combined with --stream or --prefilter.");
+    }
+
+    const Shard shard = shard_spec.empty() ? Shard() : Shard::parse(shard_spec, shard_by);
+    const bool graph_shard = !shard_spec.empty() && shard.by == Shard::By::GRAPH;
+    if (shard.split() && subsample) {
+        throw std::invalid_argument("--subsample cannot be combined with --shard, shards would sample differently.");
+    }
+    if (graph_shard) {
+        if (stream || prefilter || multi) {
+            throw std::invalid_argument("Graph shards cannot be combined with --stream, --prefilter, or --multi.");
+        }
+        if (!msonly && !maxonly) throw std::invalid_argument("Graph shards require --msonly or --maxonly.");
+        if (out_file.empty()) throw std::invalid_argument("Graph shards require a partial results file, -S.");
+    }
+
     vargas::isam reads;
-    if (format == ReadFmt::FASTQ) {
-        load_fast(read_file, true, reads, p64);
-    } else if (format == ReadFmt::FASTA) {
-        load_fast(read_file, false, reads, p64);
-    } else {
+    reads.set_threads(io_threads);
+    std::unique_ptr<FastReader> fast_in;
+    std::function<bool(vargas::SAM::Record &)> read_source;
+    bool first_rec = true;
+    auto isam_source = [&](vargas::SAM::Record &r) {
+        if (!first_rec && !reads.next()) return false;
+        first_rec = false;
+        r = reads.record();
+        return true;
+    };
+
+    AlignStats run_stats;
+    auto load_start = std::chrono::steady_clock::now();
+    if (!stream) {
+        if (format == ReadFmt::FASTQ) {
+            load_fast(read_file, true, reads, p64, io_threads);
+        } else if (format == ReadFmt::FASTA) {
+            load_fast(read_file, false, reads, p64, io_threads);
+        } else {
+            reads.open(read_file);
+        }
+        reads.subset(subsample);
+    } else if (format == ReadFmt::SAM) {
         reads.open(read_file);
+        reads.subset(subsample);
+        read_source = isam_source;
+    } else {
+        fast_in.reset(new FastReader(read_file, format == ReadFmt::FASTQ, p64, io_threads));
+        auto fast_source = [&fast_in](vargas::SAM::Record &r) { return fast_in->next(r); };
+        if (subsample) {
+            // Only the reservoir is held in memory
+            std::mt19937 gen(rand());
+            for (const auto &r : rg::reservoir_sample<vargas::SAM::Record>(fast_source, subsample, gen)) reads.push(r);
+            reads.next();
+            read_source = isam_source;
+        } else {
+            read_source = fast_source;
+        }
+    }
+    if (stream && shard.split()) {
+        auto all_reads = read_source;
+        read_source = [all_reads, shard](vargas::SAM::Record &r) {
+            while (all_reads(r)) if (shard.keep(r.query_name)) return true;
+            return false;
+        };
     }
-    reads.subset(subsample);
     auto &reads_hdr = reads.header();
+    run_stats.load_s += rg::chrono_duration(load_start);
 
     vargas::ScoreProfile prof;
     {
@@ -180,95 +302,368 @@ int align_main(int argc, char *argv[]) {
     std::replace_if(pg.version.begin(), pg.version.end(), isspace, ' '); // rm tabs
     const auto assigned_pgid = reads_hdr.add(pg);
 
+    std::cerr << "Loading \"" << gdf << "\"" << (cache ? " (cached)" : "") << "...\n";
+    auto start_time = std::chrono::steady_clock::now();
+    // Before any graph is compiled
+    rg::set_huge_pages(hugepages);
+    const auto gm_ptr = cache ? cache->graph(gdf) : std::make_shared<vargas::GraphMan>(gdf);
+    vargas::GraphMan &gm = *gm_ptr;
+    if (gm.labels().size() != 1 && maxonly) {
+        std::cerr << "[warn] With --maxonly, max score position and count may be incorrect because the genome is a graph." << std::endl;
+    }
+    if (gm.labels().size() != 1 && !maxonly && !msonly) {
+        throw std::invalid_argument("Cannot calculate 2nd-max score when the genome is a graph. Use --msonly or --maxonly.");
+    }
+    std::shared_ptr<vargas::KmerIndex> index;
+    if (prefilter) {
+        const std::string index_file = vargas::KmerIndex::filename(gdf);
+        try {
+            index = cache ? cache->index(gdf) : std::make_shared<vargas::KmerIndex>(index_file);
+        } catch (std::invalid_argument &e) {
+            throw std::invalid_argument(std::string(e.what()) + ". Build the index with vargas define -k.");
+        }
+        try {
+            index->check(*gm.compiled("base"));
+        } catch (std::invalid_argument &e) {
+            throw std::invalid_argument(index_file + ": " + e.what() + ". Rebuild the index with vargas define -k.");
+        }
+        std::cerr << index->size() << "\t" << index->k() << "-mers indexed.\n";
+    }
+    const double graph_load_s = rg::chrono_duration(start_time);
+    std::cerr << graph_load_s << "s.\n";
+
+    // Tasks are sized by estimated cost, in whole passes of the aligner
+    const size_t grain = isa_read_capacity(isa, false) * (groups ? groups : 1);
+    // Graphs of a joined target share the columns of the base
+    auto graph_len = [&gm](const std::string &label) {
+        return gm.compiled(label.find(',') == std::string::npos ? label : "base")->length();
+    };
+
     size_t read_len;
-    auto task_list = create_tasks(reads, align_targets, chunk_size, read_len);
+    unsigned segment_threads = 1;
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> task_list;
+    std::unique_ptr<TaskStream> task_stream;
+    TaskStream::batch_t first_batch;
+    if (stream) {
+        if (ring_size == 0) ring_size = 4 * (threads ? threads : 1);
+        task_stream.reset(new TaskStream(read_source, reads_hdr, align_targets, chunk_size ? chunk_size : grain,
+                                         ring_size, bucket));
+        task_stream->set_graph_lengths(graph_len, grain);
+        if (max_len) task_stream->set_max_read_len(max_len);
+        // First batch determines the read length when not given
+        std::cerr << "Loading first batch... " << std::flush;
+        auto start_time = std::chrono::steady_clock::now();
+        task_stream->next(first_batch);
+        read_len = task_stream->max_read_len();
+        if (read_len == 0) {
+            if (!shard.split()) throw std::invalid_argument("No reads to align.");
+            read_len = 1; // An empty shard still writes its output
+        }
+        run_stats.load_s += rg::chrono_duration(start_time);
+        std::cerr << rg::chrono_duration(start_time) << "s.\n"
+                  << read_len << "\tMax read length.\n";
+        threads = threads ? threads : 1;
+    } else {
+        load_start = std::chrono::steady_clock::now();
+        task_list = create_tasks(reads, align_targets, chunk_size, read_len, bucket, multi,
+                                 shard_spec.empty() ? nullptr : &shard);
+        if (read_len == 0 && shard.split()) read_len = 1; // An empty shard still writes its output
+        // Ordered output keeps the reads of each target in input order, at the cost of largest first scheduling
+        balance_tasks(task_list, graph_len, threads ? threads : 1, grain, 8, !ordered);
+        run_stats.load_s += rg::chrono_duration(load_start);
+        std::cerr << task_list.size() << "\tTask(s) after balancing by cost.\n";
+
+        const size_t num_tasks = task_list.size();
+        if (num_tasks < threads) {
+            if (msonly || maxonly) {
+                // Spare threads split the graphs instead
+                segment_threads = threads / std::max<size_t>(1, num_tasks);
+                std::cerr << segment_threads << "\tThread(s) per graph.\n";
+            } else {
+                std::cerr << "[warn] Number of threads is greater than number of tasks. Try decreasing -u.\n";
+            }
+        }
 
-    const size_t num_tasks = task_list.size();
-    if (num_tasks < threads) {
-        std::cerr << "[warn] Number of threads is greater than number of tasks. Try decreasing -u.\n";
+        threads = threads ? std::max<size_t>(1, std::min<size_t>(threads, task_list.size()))
+                          : 1;
     }
 
-    threads = threads ? threads > task_list.size() ? task_list.size() : threads
-                      : 1;
-
     int bias = 255 - (read_len * match);
-    const bool use_wide = (bias < 0) or (end_to_end and (static_cast<signed long long>(prof.ref_gopen + (prof.ref_gext * (read_len - 1))) > bias || read_len * prof.mismatch_max > bias));
-    if (use_wide) {
+    const bool use_wide = use_wide_scores(prof, read_len);
+    if (!prof.end_to_end && bias < 0) {
+        std::cerr << "Score range: 0 to " << read_len * match << ". Reads scoring above "
+                  << 255 << " are realigned with the 16-bit aligner.\n";
+    }
+    if (use_wide || diff_scores(prof, read_len)) {
         std::cerr << "Score range: " << read_len * match << " to -" << std::min(prof.ref_gopen + (prof.ref_gext * (read_len - 1)), read_len * prof.mismatch_max) <<
-        ". Using 16-bit aligner (" << vargas::WordAligner::read_capacity() << " reads/vector).\n";
+        (use_wide ? ". Using 16-bit aligner (" : ". Using 8-bit difference aligner (") << isa_read_capacity(isa, use_wide)
+        << " reads/vector)" << (bucket ? " for long reads" : "") << ".\n";
     }
+    std::cerr << "Using " << isa_name(isa) << " aligner kernel.\n";
     std::cerr << "Scoring profile: " << prof.to_string() << "\n";
 
-    std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> aligners(threads);
-    for (size_t k = 0; k < threads; ++k) {
-        aligners[k] = make_aligner(prof, read_len, use_wide, msonly, maxonly);
+    // Aligners are created per length bucket as tasks need them, check the parameters once up front
+    make_aligner(prof, read_len, use_wide, msonly, maxonly, isa);
+    const size_t gpu_threads = std::min<size_t>(gpus, threads);
+    if (gpu_threads) {
+        vargas::gpu::config(prof, read_len, use_wide, msonly);
+        std::cerr << gpu_threads << "\tThread(s) driving CUDA streams on " << vargas::gpu::devices() << " device(s).\n"
+                  << "[warn] The CUDA aligner is experimental; check results against a CPU run.\n";
     }
-
-
-    std::cerr << "\nLoading \"" << gdf << "\"...\n";
-    auto start_time = std::chrono::steady_clock::now();
-    vargas::GraphMan gm(gdf);
-    if (gm.labels().size() != 1 && maxonly) {
-        std::cerr << "[warn] With --maxonly, max score position and count may be incorrect because the genome is a graph." << std::endl;
+    std::vector<AlignerPool> local_aligners;
+    std::vector<AlignerPool> *pools = &local_aligners;
+    if (cache) {
+        std::ostringstream key;
+        key << prof.to_string() << ' ' << read_len << ' ' << bucket << ' ' << msonly << maxonly << ' ' << isa_name(isa)
+            << ' ' << groups << ' ' << segment_threads << ' ' << threads << ' ' << gpu_threads << ' ' << numa;
+        pools = &cache->aligners(key.str());
     }
-    if (gm.labels().size() != 1 && !maxonly && !msonly) {
-        throw std::invalid_argument("Cannot calculate 2nd-max score when the genome is a graph. Use --msonly or --maxonly.");
+    std::vector<AlignerPool> &aligners = *pools;
+    for (size_t k = aligners.size(); k < threads; ++k) {
+        // The first threads drive GPU streams, round robin over the devices
+        const int device = k < gpu_threads ? int(k % vargas::gpu::devices()) : -1;
+        aligners.emplace_back(prof, read_len, bucket, msonly, maxonly, isa, groups ? groups : 1, segment_threads,
+                              device);
     }
-    std::cerr << rg::chrono_duration(start_time) << "s.\n";
+    // Cached pools carry the counters of earlier jobs
+    size_t realigned_before = 0;
+    vargas::AlignerStats kernel_before;
+    for (auto &a : aligners) {
+        a.stats() = AlignStats();
+        realigned_before += a.realigned();
+        kernel_before.merge(a.kernel_stats());
+    }
+
 
     if (out_file.length()) std::cerr << "Writing to \"" << (out_file.empty() ? "stdout" : out_file) << "\".\n";
     reads_hdr.programs[assigned_pgid].aux.set(ALIGN_SAM_PG_GDF, gdf);
-    vargas::osam aligns_out(out_file, reads_hdr);
+    if (sam_fmt != vargas::SAM::Format::SAM) add_contigs(reads_hdr, gm);
+    // Graph shards write partial results instead, see merge_main()
+    std::unique_ptr<vargas::osam> aligns_out;
+    if (!graph_shard) {
+        aligns_out.reset(new vargas::osam(out_file, reads_hdr, sam_fmt));
+        aligns_out->set_threads(io_threads);
+        if (writer_threads) aligns_out->start_writer(size_t(writer_buffer) << 20, ordered);
+    }
     char phred_offset = opts.count("phred64") ? 64 : 33;
-    align(gm, task_list, aligns_out, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset);
+
+    size_t total_reads = 0;
+    for (const auto &t : task_list) total_reads += t.second.size();
+    std::unique_ptr<ProgressMeter> progress;
+    if (progress_s > 0) progress.reset(new ProgressMeter(threads, progress_s, total_reads));
+    std::unique_ptr<vargas::GraphReplicas> replicas;
+    if (numa) {
+        const auto topology = vargas::Topology::detect();
+        replicas.reset(new vargas::GraphReplicas(gm, topology, threads));
+        std::cerr << topology.nodes() << "\tNUMA node(s), threads pinned to their node.\n";
+    }
+
+    const auto align_start = std::chrono::steady_clock::now();
+    if (graph_shard) {
+        vargas::Partials partials;
+        partials.shard = shard.index;
+        partials.shards = shard.count;
+        partials.fwdonly = fwdonly;
+        partials.msonly = msonly;
+        partials.maxonly = maxonly;
+        partials.notraceback = notraceback;
+        partials.p64 = p64;
+        partials.prof = prof;
+        partials.command_line = cl;
+        partials.gdf = gdf;
+        partials.reads = read_file;
+        partials.targets = align_targets;
+        run_stats.merge(align_partials(gm, task_list, aligners, shard, partials, phred_offset, progress.get()));
+        partials.write(out_file);
+    } else if (stream) {
+        run_stats.merge(align_stream(gm, *task_stream, first_batch, *aligns_out, aligners, index.get(), fwdonly, msonly,
+                                     maxonly, notraceback, phred_offset, progress.get(), replicas.get()));
+    } else {
+        run_stats.merge(align(gm, task_list, *aligns_out, aligners, index.get(), fwdonly, msonly, maxonly, notraceback,
+                              phred_offset, progress.get(), replicas.get()));
+    }
+    progress.reset();
+    if (aligns_out) aligns_out->close(); // Surface any write errors
+    const double align_s = rg::chrono_duration(align_start);
+
+    size_t realigned = 0;
+    vargas::AlignerStats kernel;
+    for (const auto &a : aligners) {
+        realigned += a.realigned();
+        kernel.merge(a.kernel_stats());
+    }
+    realigned -= realigned_before;
+    kernel.cells -= kernel_before.cells;
+    kernel.groups -= kernel_before.groups;
+    kernel.slow_path -= kernel_before.slow_path;
+    if (realigned) std::cerr << realigned << "\tRead(s) realigned with the 16-bit aligner.\n";
+
+    if (stats_file.length()) {
+        std::ofstream os(stats_file);
+        if (!os.good()) throw std::invalid_argument("Error opening stats file \"" + stats_file + "\".");
+        rg::JsonWriter json(os);
+        json.begin()
+            .value("command", cl)
+            .value("isa", isa_name(isa))
+            .value("threads", threads)
+            .begin("seconds")
+            .value("total", rg::chrono_duration(run_start))
+            .value("load_reads", run_stats.load_s)
+            .value("load_graph", graph_load_s)
+            .value("align", align_s)
+            .end()
+            // Summed over aligner threads
+            .begin("thread_seconds")
+            .value("fill", run_stats.fill_s)
+            .value("traceback", run_stats.traceback_s)
+            .value("serialize", run_stats.serialize_s)
+            .value("write_wait", run_stats.write_wait_s)
+            .end()
+            .begin("counts")
+            .value("tasks", run_stats.tasks)
+            .value("reads", run_stats.reads)
+            .value("tracebacks", run_stats.tracebacks)
+            .value("realigned", realigned)
+            .value("cells", kernel.cells)
+            .value("groups", kernel.groups)
+            .value("slow_path", kernel.slow_path)
+            .value("seed_slots", kernel.seed_slots)
+            .end()
+            .value("gcups", align_s > 0 ? kernel.cells / align_s / 1e9 : 0.0)
+            .value("reads_per_s", align_s > 0 ? run_stats.reads / align_s : 0.0)
+            .end();
+        os << '\n';
+        if (!os.good()) throw std::runtime_error("Error writing stats file \"" + stats_file + "\".");
+    }
 
     return 0;
 }
 
-struct align_helper {
-    vargas::GraphMan &gm;
-    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list;
-    vargas::osam &out;
-    const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners;
-    bool fwdonly, msonly, maxonly, notraceback;
-    char phred_offset;
-    std::mutex &mut;
-};
+namespace {
+  /**
+   * @brief
+   * Fold read j of from into read i of into. Alignments from different windows at the same position
+   * are not counted twice.
+   */
+  void merge_result(vargas::Results &into, size_t i, const vargas::Results &from, size_t j) {
+      auto take_sub = [&](int score, rg::pos_t pos, unsigned count, vargas::Strand strand) {
+          if (score > into.sub_score[i]) {
+              into.sub_score[i] = score;
+              into.sub_pos[i] = pos;
+              into.sub_count[i] = count;
+              into.sub_strand[i] = strand;
+          } else if (score == into.sub_score[i] && pos != into.sub_pos[i]) {
+              into.sub_count[i] += count;
+          }
+      };
+
+      if (from.max_score[j] > into.max_score[i]) {
+          const int score = into.max_score[i];
+          const rg::pos_t pos = into.max_pos[i];
+          const unsigned count = into.max_count[i];
+          const vargas::Strand strand = into.max_strand[i];
+          into.max_score[i] = from.max_score[j];
+          into.max_pos[i] = from.max_pos[j];
+          into.max_count[i] = from.max_count[j];
+          into.max_strand[i] = from.max_strand[j];
+          take_sub(score, pos, count, strand);
+      } else if (from.max_score[j] == into.max_score[i]) {
+          if (from.max_pos[j] != into.max_pos[i]) into.max_count[i] += from.max_count[j];
+      } else {
+          take_sub(from.max_score[j], from.max_pos[j], from.max_count[j], from.max_strand[j]);
+      }
+      take_sub(from.sub_score[j], from.sub_pos[j], from.sub_count[j], from.sub_strand[j]);
+  }
+
+  /**
+   * @brief
+   * Copy read j of from into read i of into.
+   */
+  void copy_result(vargas::Results &into, size_t i, const vargas::Results &from, size_t j) {
+      into.max_score[i] = from.max_score[j];
+      into.max_pos[i] = from.max_pos[j];
+      into.max_count[i] = from.max_count[j];
+      into.max_strand[i] = from.max_strand[j];
+      into.sub_score[i] = from.sub_score[j];
+      into.sub_pos[i] = from.sub_pos[j];
+      into.sub_count[i] = from.sub_count[j];
+      into.sub_strand[i] = from.sub_strand[j];
+  }
+}
 
-void align_helper_func(void *data, long index, int tid) {
-    align_helper &help(*(align_helper *)data);
-    auto &aligners = help.aligners;
-    auto &out = help.out;
-    auto &task_list = help.task_list;
-    auto &gm = help.gm;
-    auto fwdonly = help.fwdonly;
-    auto msonly = help.msonly;
-    auto maxonly = help.maxonly;
-    auto notraceback = help.notraceback;
-    char phred_offset = help.phred_offset;
-
-    const size_t num_reads = task_list.at(index).second.size();
-    std::vector<std::string> read_seqs(num_reads);
-    std::vector<std::vector<char>> quals(num_reads);
-    for (size_t i = 0; i < num_reads; ++i) {
-        const auto &r = task_list.at(index).second.at(i);
-        read_seqs[i] = r.seq;
-        if (r.qual.size() == r.seq.size()) {
-            std::transform(r.qual.begin(),
-                           r.qual.end(),
-                           std::back_inserter(quals[i]),
-                           [](char c){ return c - 33; }); //TODO needs to be offset variable
-        }
-    }
-    auto subgraph = gm.at(task_list.at(index).first);
-    vargas::Results aligns;
-    aligners[tid]->align_into(read_seqs, quals, subgraph->begin(), subgraph->end(), aligns, fwdonly);
+void align_prefiltered(vargas::AlignerBase &aligner, const vargas::KmerIndex &index,
+                       const vargas::CompiledGraph &graph, const vargas::EncodedReads &reads,
+                       vargas::Results &aligns, bool fwdonly) {
+    const size_t n = reads.size();
+    aligns.resize(n);
+    std::vector<uint8_t> seen(n, 0);
+    auto fold = [&](const std::vector<size_t> &ids, const vargas::Results &res) {
+        aligns.profile = res.profile;
+        for (size_t k = 0; k < ids.size(); ++k) {
+            if (seen[ids[k]]) merge_result(aligns, ids[k], res, k);
+            else copy_result(aligns, ids[k], res, k);
+            seen[ids[k]] = 1;
+        }
+    };
+
+    std::vector<std::pair<vargas::KmerWindow, size_t>> cand;
+    std::vector<vargas::KmerWindow> win;
+    size_t max_len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        index.windows(reads.seq(i), reads.length(i), !fwdonly, win);
+        for (const auto &w : win) cand.emplace_back(w, i);
+        max_len = std::max(max_len, reads.length(i));
+    }
+    std::sort(cand.begin(), cand.end(), [](const std::pair<vargas::KmerWindow, size_t> &a,
+                                           const std::pair<vargas::KmerWindow, size_t> &b) {
+        return a.first.min < b.first.min;
+    });
+
+    // Each tile costs its length for every read vector, so runs of overlapping windows are split
+    const size_t tile_len = std::max<size_t>(4096, 16 * max_len);
+    vargas::EncodedReads tile_reads;
+    vargas::Results res;
+    std::vector<size_t> ids;
+    for (size_t c = 0; c < cand.size();) {
+        const rg::pos_t lo = cand[c].first.min;
+        rg::pos_t hi = cand[c].first.max;
+        ids.clear();
+        do {
+            hi = std::max(hi, cand[c].first.max);
+            ids.push_back(cand[c].second);
+            ++c;
+        } while (c < cand.size() && cand[c].first.min <= hi && cand[c].first.max - lo <= tile_len);
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        const vargas::CompiledGraph tile(graph, lo, hi);
+        if (tile.length() == 0) continue;
+        tile_reads.clear();
+        for (const size_t i : ids) tile_reads.push_back(reads, i);
+        aligner.align_into(tile_reads, tile, res, fwdonly);
+        fold(ids, res);
+    }
+
+    // Reads without hits on the target are aligned to the whole graph
+    ids.clear();
+    for (size_t i = 0; i < n; ++i) if (!seen[i]) ids.push_back(i);
+    if (ids.empty()) return;
+    tile_reads.clear();
+    for (const size_t i : ids) tile_reads.push_back(reads, i);
+    aligner.align_into(tile_reads, graph, res, fwdonly);
+    fold(ids, res);
+}
+
+void tag_records(vargas::GraphMan &gm, const std::string &label, std::vector<vargas::SAM::Record> &records,
+                 const vargas::Results &aligns, vargas::Traceback &traceback, AlignStats &stats,
+                 bool msonly, bool maxonly, bool notraceback, char phred_offset) {
+    auto subgraph = gm.at(label);
 
     //If no variants (# nodes == # contigs) compute the alignment traceback
     bool not_graph = subgraph->node_map()->size() == gm.resolver()._contig_hdr_order.size();
 
-    for (size_t j = 0; j < task_list.at(index).second.size(); ++j) {
-        vargas::SAM::Record &rec = task_list.at(index).second.at(j);
+    for (size_t j = 0; j < records.size(); ++j) {
+        vargas::SAM::Record &rec = records.at(j);
         auto abs = gm.absolute_position(aligns.max_pos[j]);
         rec.aux.set("AS", aligns.max_score[j]);
         if (!msonly) {
@@ -285,243 +680,21 @@ void align_helper_func(void *data, long index, int tid) {
             rec.aux.set(ALIGN_SAM_MAX_COUNT_TAG, aligns.max_count[j]);
 
             if (not_graph & !notraceback) {
-                int nodeID = gm.nodeID_from_contig(rec.ref_name);
-                vargas::Graph::nodemap_t _node_map = *(subgraph->node_map());
+                const auto &node = subgraph->node_map()->at(gm.nodeID_from_contig(rec.ref_name));
                 //TODO upper-bound the length of reference slice needed based on the score or scoring function
-                int ref_len = 2*rec.seq.length() < abs.second ? 2*rec.seq.length() : abs.second ;
-                int ref_start = abs.second-ref_len;
-                auto ref_iter = std::next(_node_map[nodeID].begin(),ref_start); //TODO this is linear time I think?
-
-                // Allocate the three DP score matrixes: M (match) D (deletion) I (insertion), initialize with zero
-                std::vector<std::vector<int>> M;
-                M.resize(rec.seq.length()+1);
-                for (auto &&r : M) r.resize(ref_len+1,0);
-                std::vector<std::vector<int>> D;
-                D.resize(rec.seq.length()+1);
-                for (auto &&r : D) r.resize(ref_len+1,0);
-                std::vector<std::vector<int>> I;
-                I.resize(rec.seq.length()+1);
-                for (auto &&r : I) r.resize(ref_len+1,0);
-
-                // Allocate the three DP traceback matrixes: tM (match) tD (deletion) tI (insertion), initialize with zero
-                std::vector<std::vector<int>> tM;
-                tM.resize(rec.seq.length()+1);
-                for (auto &&r : tM) r.resize(ref_len+1,0);
-                std::vector<std::vector<int>> tD;
-                tD.resize(rec.seq.length()+1);
-                for (auto &&r : tD) r.resize(ref_len+1,0);
-                std::vector<std::vector<int>> tI;
-                tI.resize(rec.seq.length()+1);
-                for (auto &&r : tI) r.resize(ref_len+1,0);
-
-                // TODO check initializations
-                // initialize first row and first column of each score matrix as appropriate
-                // gaps in beginning of reference (first row) ending in match doesn't make sense
-                std::fill(M[0].begin(),M[0].end(),-aligns.profile.ref_gext*ref_len);
-                M[0][0] = 0; //except zero characters of each is free
-                // gaps in beginning of reference (first row) ending in gap in query doesn't make sense
-                std::fill(I[0].begin(),I[0].end(),-aligns.profile.ref_gext*ref_len);
-                // gaps in beginning of query (first col) ending in gap in reference doesn't make sense
-                // gaps in beginning of query (first col) ending in match doesn't make sense
-                for (unsigned row = 1; row <= rec.seq.length(); ++row) {
-                    D[row][0] = -aligns.profile.ref_gext*ref_len;
-                    M[row][0] = -aligns.profile.ref_gext*ref_len;
-                }
-                if (aligns.profile.end_to_end) { //semiglobal
-                    // gaps in beginning of query (first col) ending in gap in query accumulate
-                    for (unsigned row = 1; row <= rec.seq.length(); ++row) {
-                        I[row][0] = 0 - row * aligns.profile.read_gext - aligns.profile.read_gopen;
-                    }
-                }
-
-                // Fill the matrixes
-                bool has_quality = rec.seq.size() == quals[j].size();
-                for (unsigned col = 1; col <= ref_len; ++col) {
-                    char ref_char = rg::num_to_base(*ref_iter);
-                    for (unsigned row = 1; row <= rec.seq.length(); ++row) {
-                        char query_char = rec.seq[row-1];
-                        char query_qual = has_quality ? rec.qual[row-1] - phred_offset : 40;
-                        // Compute the M matrix entry. Force a match or a mismatch between the last characters
-                        // Traceback always goes "diagonally" but to which other matrix?
-                        int possibleM = M[row-1][col-1];
-                        int possibleD = D[row-1][col-1];
-                        int possibleI = I[row-1][col-1];
-                        if (ref_char == 'N' or query_char == 'N') { //ambiguous query and/or reference
-                            possibleM -= aligns.profile.ambig;
-                            possibleD -= aligns.profile.ambig;
-                            possibleI -= aligns.profile.ambig;
-                        }
-                        else if (ref_char != query_char) { //mismatch
-                            possibleM -= aligns.profile.penalty(query_qual);
-                            possibleD -= aligns.profile.penalty(query_qual);
-                            possibleI -= aligns.profile.penalty(query_qual);
-                        } else { //match
-                            possibleM += aligns.profile.match;
-                            possibleD += aligns.profile.match;
-                            possibleI += aligns.profile.match;
-                        }
-                        int best = std::max({possibleM, possibleD, possibleI});
-                        if (aligns.profile.end_to_end or best > 0) { //local mode nothing happens if it's <= 0
-                            if (possibleM == best) {
-                                M[row][col] = possibleM;
-                                tM[row][col] = 0;
-                            } else if (possibleD == best) {
-                                M[row][col] = possibleD;
-                                tM[row][col] = 1;
-                            } else {
-                                M[row][col] = possibleI;
-                                tM[row][col] = 2;
-                            }
-                        }
-
-                        // Compute the D matrix entry. Force a gap in end of reference.
-                        // Traceback always goes "left" but to which other matrix?
-                        //TODO check read ref gap
-                        possibleM = M[row][col-1] - aligns.profile.read_gopen - aligns.profile.read_gext;
-                        possibleD = D[row][col-1] - aligns.profile.read_gext;
-                        possibleI = I[row][col-1] - aligns.profile.read_gopen - aligns.profile.read_gext;
-                        best = std::max({possibleM, possibleD, possibleI});
-                        if (aligns.profile.end_to_end or best > 0) { //local mode nothing happens if it's <= 0
-                            if (possibleM == best) {
-                                D[row][col] = possibleM;
-                                tD[row][col] = 0;
-                            } else if (possibleD == best) {
-                                D[row][col] = possibleD;
-                                tD[row][col] = 1;
-                            } else {
-                                D[row][col] = possibleI;
-                                tD[row][col] = 2;
-                            }
-                        }
-
-                        // Compute the I entry. Force a gap in end of reference.
-                        // Traceback always goes "up" but to which other matrix?
-                        //TODO check read ref gap
-                        possibleM = M[row-1][col] - aligns.profile.ref_gopen - aligns.profile.ref_gext;
-                        possibleD = D[row-1][col] - aligns.profile.ref_gopen - aligns.profile.ref_gext;
-                        possibleI = I[row-1][col] - aligns.profile.ref_gext;
-                        best = std::max({possibleM, possibleD, possibleI});
-                        if (aligns.profile.end_to_end or best > 0) { //local mode nothing happens if it's <= 0
-                            if (possibleM == best) {
-                                I[row][col] = possibleM;
-                                tI[row][col] = 0;
-                            } else if (possibleD == best) {
-                                I[row][col] = possibleD;
-                                tI[row][col] = 1;
-                            } else {
-                                I[row][col] = possibleI;
-                                tI[row][col] = 2;
-                            }
-                        }
-                    }
-                    ref_iter++;
-                }
-                // Compute traceback: CIGAR string and start position
-                std::vector<char> aln; //reverse order of operations
-                if (aligns.profile.end_to_end) { //semiglobal
-                    //best score is in last row and last column because we ended the reference at the max-scoring position
-                    int currCol = ref_len;
-                    int currRow = rec.seq.length();
-                    int bestMatrix = 0;
-                    int best = M[currRow][currCol];
-                    if (D[currRow][currCol] > best) {
-                        bestMatrix = 1;
-                        best = D[currRow][currCol];
-                    }
-                    if (I[currRow][currCol] > best) {
-                        bestMatrix = 2;
-                        best = I[currRow][currCol];
-                    }
-                    if (best != aligns.max_score[j]) {
-                        std::cerr << "[WARNING] " << rec.query_name << " DP optimal score " << best << " and SIMD optimal score " << aligns.max_score[j] << " not equal\n";
-                    }
-                    while(currRow > 0 and currCol > 0) {
-                        if (bestMatrix == 0) {
-                            aln.push_back('M');
-                            bestMatrix = tM[currRow][currCol];
-                            --currCol;
-                            --currRow;
-                        } else if (bestMatrix == 1) {
-                            aln.push_back('D');
-                            bestMatrix = tD[currRow][currCol];
-                            --currCol;
-                        } else {
-                            aln.push_back('I');
-                            bestMatrix = tI[currRow][currCol];
-                            --currRow;
-                        }
-                    }
-                    rec.pos = abs.second - ref_len + currCol;
-                    for (int row = 0; row < currRow; ++row) {
-                        aln.push_back('I'); //unaligned bases in beginning of query
-                    }
-                } else { //local
-                    //best score is somewhere in last column because we ended the reference at the max-scoring position
-                    int bestRow = -1;
-                    int best = -1;
-                    int bestMatrix = -1;
-                    for (int row = 0; row <= rec.seq.length(); ++row) {
-                        if (M[row][ref_len] > best) {
-                            best = M[row][ref_len];
-                            bestRow = row;
-                            bestMatrix = 0;
-                        }
-                        if (D[row][ref_len] > best) {
-                            best = D[row][ref_len];
-                            bestRow = row;
-                            bestMatrix = 1;
-                        }
-                        if (I[row][ref_len] > best) {
-                            best = I[row][ref_len];
-                            bestRow = row;
-                            bestMatrix = 2;
-                        }
-                    }
-                    if (best != aligns.max_score[j]) {
-                        std::cerr << "[WARNING] " << rec.query_name << " DP optimal score " << best << " and SIMD optimal score " << aligns.max_score[j] << " not equal\n";
-                    }
-                    int currCol = ref_len;
-                    int currRow = bestRow;
-                    for (unsigned row = bestRow; row < rec.seq.length(); ++row) {
-                        aln.push_back('S'); //unaligned bases in end of query
-                    }
-                    while(currRow > 0 and currCol > 0) {
-                        if (bestMatrix == 0 and M[currRow][currCol] > 0) {
-                            aln.push_back('M');
-                            bestMatrix = tM[currRow][currCol];
-                            --currCol;
-                            --currRow;
-                        } else if (bestMatrix == 1 and D[currRow][currCol] > 0) {
-                            aln.push_back('D');
-                            bestMatrix = tD[currRow][currCol];
-                            --currCol;
-                        } else if (I[currRow][currCol] > 0){
-                            aln.push_back('I');
-                            bestMatrix = tI[currRow][currCol];
-                            --currRow;
-                        } else { break; } //if score goes to or below zero
-                    }
-                    rec.pos = abs.second - ref_len + currCol;
-                    for (int row = 0; row < currRow; ++row) {
-                        aln.push_back('S'); //unaligned bases in beginning of query
-                    }
-
-                }
-                // Reverse and run-length-collapse the sequence of operations
-                char last_seen = aln.back();
-                unsigned count = 1;
+                size_t ref_len = 2*rec.seq.length() < abs.second ? 2*rec.seq.length() : abs.second;
                 std::string cigar;
-                auto rit = std::next(aln.rbegin(),1);
-                for (; rit != aln.rend(); ++rit) {
-                    if (*rit != last_seen) {
-                        cigar.append(std::to_string(count));
-                        cigar.push_back(last_seen);
-                        count = 1;
-                        last_seen = *rit;
-                    } else {count += 1;}
+                size_t offset;
+                const auto trace_start = std::chrono::steady_clock::now();
+                const int best = traceback.trace(aligns.profile, rec.seq, rec.qual, phred_offset,
+                                                 node.seq().data() + abs.second - ref_len, ref_len,
+                                                 aligns.max_score[j], cigar, offset);
+                stats.traceback_s += rg::chrono_duration(trace_start);
+                ++stats.tracebacks;
+                if (best != aligns.max_score[j]) {
+                    std::cerr << "[WARNING] " << rec.query_name << " DP optimal score " << best << " and SIMD optimal score " << aligns.max_score[j] << " not equal\n";
                 }
-                cigar.append(std::to_string(count));
-                cigar.push_back(last_seen);
+                rec.pos = abs.second - ref_len + offset;
                 rec.cigar = cigar;
             }
 
@@ -536,10 +709,170 @@ void align_helper_func(void *data, long index, int tid) {
             }
         }
     }
+}
 
-    {
-        std::lock_guard<std::mutex> lock(help.mut);
-        for (const auto & j : task_list.at(index).second) out.add_record(j);
+/**
+ * @brief
+ * Align a chunk of reads to a subgraph, populating the alignment fields of each record.
+ * @details
+ * A target of several labels joined by ',' (see join_targets()) aligns the reads to all of them in one
+ * pass, and replaces the records with a copy per target graph, tagged with its label.
+ * @param gm GraphMan hosting target graphs
+ * @param label target subgraph
+ * @param records reads to align, updated in place
+ * @param aligner
+ * @param traceback CIGAR recovery for linear targets
+ * @param reads Buffer for the encoded reads
+ * @param index K-mer index to prefilter with, or nullptr to align to the whole graph
+ * @param stats Counters and timers of the calling thread
+ * @param replicas Per NUMA node graph copies, or nullptr to align to the graphs of gm
+ * @param tid Index of the calling worker
+ */
+void align_records(vargas::GraphMan &gm, const std::string &label, std::vector<vargas::SAM::Record> &records,
+                   vargas::AlignerBase &aligner, vargas::Traceback &traceback, vargas::EncodedReads &reads,
+                   const vargas::KmerIndex *index, AlignStats &stats,
+                   bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                   vargas::GraphReplicas *replicas, int tid) {
+    ++stats.tasks;
+    stats.reads += records.size();
+    reads.clear();
+    for (const auto &r : records) reads.push_back(r.seq, r.qual, phred_offset);
+    const auto labels = rg::split(label, ',');
+    const auto fill_start = std::chrono::steady_clock::now();
+    if (labels.size() < 2) {
+        vargas::Results aligns;
+        const auto graph = replicas ? replicas->compiled(label, tid) : gm.compiled(label);
+        if (index) align_prefiltered(aligner, *index, *graph, reads, aligns, fwdonly);
+        else aligner.align_into(reads, *graph, aligns, fwdonly);
+        stats.fill_s += rg::chrono_duration(fill_start);
+        tag_records(gm, label, records, aligns, traceback, stats, msonly, maxonly, notraceback, phred_offset);
+        return;
+    }
+
+    std::vector<vargas::Results> aligns;
+    try {
+        aligner.align_into(reads, *gm.compiled_set(labels), aligns, fwdonly);
+    } catch (std::domain_error &) {
+        // Graphs not derived from the base are aligned one at a time
+        aligns.resize(labels.size());
+        for (size_t t = 0; t < labels.size(); ++t) aligner.align_into(reads, *gm.compiled(labels[t]), aligns[t], fwdonly);
+    }
+    stats.fill_s += rg::chrono_duration(fill_start);
+    std::vector<vargas::SAM::Record> out;
+    out.reserve(records.size() * labels.size());
+    for (size_t t = 0; t < labels.size(); ++t) {
+        auto copy = records;
+        tag_records(gm, labels[t], copy, aligns[t], traceback, stats, msonly, maxonly, notraceback, phred_offset);
+        for (auto &r : copy) {
+            r.aux.set(ALIGN_SAM_GRAPH_TAG, labels[t]);
+            out.push_back(std::move(r));
+        }
+    }
+    records.swap(out);
+}
+
+struct align_helper {
+    vargas::GraphMan &gm;
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list;
+    vargas::osam &out;
+    std::vector<AlignerPool> &aligners;
+    const vargas::KmerIndex *index;
+    bool fwdonly, msonly, maxonly, notraceback;
+    char phred_offset;
+    ProgressMeter *progress;
+    vargas::GraphReplicas *replicas;
+};
+
+void align_helper_func(void *data, long index, int tid) {
+    align_helper &help(*(align_helper *)data);
+    auto &task = help.task_list.at(index);
+    auto &pool = help.aligners[tid];
+    auto &stats = pool.stats();
+    align_records(help.gm, task.first, task.second, pool.get(task.second), pool.traceback(), pool.reads(), help.index,
+                  stats, help.fwdonly, help.msonly, help.maxonly, help.notraceback, help.phred_offset, help.replicas, tid);
+    std::string buff;
+    auto start = std::chrono::steady_clock::now();
+    help.out.serialize(task.second, buff);
+    stats.serialize_s += rg::chrono_duration(start);
+    task.second.clear();
+    start = std::chrono::steady_clock::now();
+    help.out.write_chunk(std::move(buff), index);
+    stats.write_wait_s += rg::chrono_duration(start);
+    if (help.progress) help.progress->update(tid, stats.reads);
+}
+
+struct stream_helper {
+    vargas::GraphMan &gm;
+    TaskStream &tasks;
+    TaskStream::batch_t &first;
+    vargas::osam &out;
+    std::vector<AlignerPool> &aligners;
+    rg::ForPool &fp;
+    const vargas::KmerIndex *index;
+    bool fwdonly, msonly, maxonly, notraceback;
+    char phred_offset;
+    ProgressMeter *progress;
+    vargas::GraphReplicas *replicas;
+    bool first_taken;
+    size_t written;
+    std::exception_ptr err;
+    AlignStats pipeline; // Load and write steps, each only run by one worker at a time
+};
+
+struct stream_batch {
+    stream_helper &help;
+    TaskStream::batch_t tasks;
+    std::vector<std::string> buffs; // Serialized tasks
+};
+
+void stream_helper_func(void *data, long index, int tid) {
+    stream_batch &batch(*(stream_batch *)data);
+    stream_helper &help = batch.help;
+    auto &task = batch.tasks.at(index);
+    auto &pool = help.aligners[tid];
+    auto &stats = pool.stats();
+    align_records(help.gm, task.first, task.second, pool.get(task.second), pool.traceback(), pool.reads(), help.index,
+                  stats, help.fwdonly, help.msonly, help.maxonly, help.notraceback, help.phred_offset, help.replicas, tid);
+    const auto start = std::chrono::steady_clock::now();
+    help.out.serialize(task.second, batch.buffs.at(index));
+    stats.serialize_s += rg::chrono_duration(start);
+    task.second.clear();
+    if (help.progress) help.progress->update(tid, stats.reads);
+}
+
+void *stream_pipeline_func(void *data, int step, void *in) {
+    stream_helper &help(*(stream_helper *)data);
+    if (step == 0) {
+        // Load, only one worker is in this step at a time
+        std::unique_ptr<stream_batch> batch(new stream_batch{help, TaskStream::batch_t(), {}});
+        if (!help.first_taken) {
+            batch->tasks = std::move(help.first);
+            help.first_taken = true;
+            if (!batch->tasks.empty()) return batch.release();
+        }
+        if (help.err) return nullptr;
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            const bool more = help.tasks.next(batch->tasks);
+            help.pipeline.load_s += rg::chrono_duration(start);
+            if (more) return batch.release();
+        } catch (...) {
+            help.err = std::current_exception(); // Rethrown once the pipeline drains
+        }
+        return nullptr;
+    } else if (step == 1) {
+        // Align the full batch across the thread pool
+        stream_batch *batch = (stream_batch *) in;
+        batch->buffs.resize(batch->tasks.size());
+        help.fp.forpool(&stream_helper_func, in, batch->tasks.size());
+        return in;
+    } else {
+        // Hand off in batch order
+        std::unique_ptr<stream_batch> batch((stream_batch *) in);
+        const auto start = std::chrono::steady_clock::now();
+        for (auto &b : batch->buffs) help.out.write_chunk(std::move(b), help.written++);
+        help.pipeline.write_wait_s += rg::chrono_duration(start);
+        return nullptr;
     }
 }
 
@@ -548,59 +881,143 @@ void align_helper_func(void *data, long index, int tid) {
 #define at operator[]
 #endif
 
-void align(vargas::GraphMan &gm,
-           std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
-           vargas::osam &out,
-           const std::vector<std::unique_ptr<vargas::AlignerBase, rg::Deleter>> &aligners,
-           bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset) {
+AlignStats align(vargas::GraphMan &gm,
+                 std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                 vargas::osam &out,
+                 std::vector<AlignerPool> &aligners, const vargas::KmerIndex *index,
+                 bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                 ProgressMeter *progress, vargas::GraphReplicas *replicas) {
     std::cerr << "Aligning... " << std::flush;
     rg::ForPool fp(aligners.size());
+    if (replicas && size_t(fp.pin(replicas->thread_cpus())) < aligners.size()) {
+        std::cerr << "[warn] Unable to pin every thread to its NUMA node. " << std::flush;
+    }
     auto start_time = std::chrono::steady_clock::now();
 
     const auto num_tasks = task_list.size();
-    std::mutex mut;
-    align_helper help{gm, task_list, out, aligners, fwdonly, msonly, maxonly, notraceback, phred_offset, mut};
+    align_helper help{gm, task_list, out, aligners, index, fwdonly, msonly, maxonly, notraceback, phred_offset,
+                      progress, replicas};
     fp.forpool(&align_helper_func, (void *)&help, num_tasks);
 
     std::cerr << rg::chrono_duration(start_time) << "s.\n";
 
+    AlignStats ret;
+    for (const auto &a : aligners) ret.merge(a.stats());
+    return ret;
 }
 
-std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>>
-create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_size, size_t &read_len) {
-    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> task_list;
-    std::unordered_map<std::string, std::vector<vargas::SAM::Record>> read_groups;
+AlignStats align_stream(vargas::GraphMan &gm,
+                        TaskStream &tasks,
+                        TaskStream::batch_t &first,
+                        vargas::osam &out,
+                        std::vector<AlignerPool> &aligners, const vargas::KmerIndex *index,
+                        bool fwdonly, bool msonly, bool maxonly, bool notraceback, char phred_offset,
+                        ProgressMeter *progress, vargas::GraphReplicas *replicas) {
+    std::cerr << "Aligning (streaming)... " << std::flush;
+    rg::ForPool fp(aligners.size());
+    if (replicas && size_t(fp.pin(replicas->thread_cpus())) < aligners.size()) {
+        std::cerr << "[warn] Unable to pin every thread to its NUMA node. " << std::flush;
+    }
+    auto start_time = std::chrono::steady_clock::now();
 
-    std::vector<std::string> alignment_pairs;
-    if (align_targets.length() != 0) {
-        std::replace(align_targets.begin(), align_targets.end(), '\n', ';');
-        alignment_pairs = rg::split(align_targets, ';');
+    stream_helper help{gm, tasks, first, out, aligners, fp, index, fwdonly, msonly, maxonly, notraceback, phred_offset,
+                       progress, replicas, false, 0, nullptr, AlignStats()};
+    // One batch loading, one aligning, one writing
+    kt_pipeline(3, &stream_pipeline_func, (void *)&help, 3);
+    if (help.err) std::rethrow_exception(help.err);
+
+    std::cerr << rg::chrono_duration(start_time) << "s.\n"
+              << tasks.num_targets() << "\tSubgraph(s).\n"
+              << tasks.num_tasks() << "\tTask(s).\n"
+              << tasks.total() << "\tTotal alignments.\n";
+
+    AlignStats ret = help.pipeline;
+    for (const auto &a : aligners) ret.merge(a.stats());
+    return ret;
+}
+
+TaskStream::TaskStream(std::function<bool(vargas::SAM::Record &)> source, vargas::SAM::Header &reads_hdr,
+                       std::string align_targets, size_t chunk_size, size_t ring_size, size_t bucket) :
+_source(std::move(source)), _chunk_size(chunk_size ? chunk_size : 1), _ring_size(ring_size ? ring_size : 1),
+_bucket(bucket) {
+    // Ungrouped reads may appear anywhere in the stream, so the group is declared before the header is written
+    if (!reads_hdr.read_groups.count(UNGROUPED_READGROUP)) {
+        reads_hdr.add(vargas::SAM::Header::ReadGroup("@RG\tID:" + std::string(UNGROUPED_READGROUP)));
     }
+    std::vector<std::string> rgids;
+    for (const auto &p : reads_hdr.read_groups) rgids.push_back(p.first);
 
-    std::cerr << "Loading reads... " << std::flush;
-    auto start_time = std::chrono::steady_clock::now();
+    for (const auto &sub_rg_pair : map_targets(reads_hdr, align_targets, rgids)) {
+        for (const std::string &rgid : sub_rg_pair.second) _rg_targets[rgid].push_back(_targets.size());
+        _targets.push_back(sub_rg_pair.first);
+    }
+}
 
-    size_t total = 0;
-    auto &reads_hdr = reads.header();
+bool TaskStream::next(batch_t &batch) {
+    batch.clear();
     std::string read_group;
     vargas::SAM::Record rec;
-    read_len = reads.record().seq.length();
-    do {
-        rec = reads.record();
-        if (rec.seq.length() > read_len) read_len = rec.seq.length();
+    while (!_done && batch.size() < _ring_size) {
+        if (!_source(rec)) {
+            _done = true;
+            break;
+        }
         if (!rec.aux.get("RG", read_group)) {
             read_group = UNGROUPED_READGROUP;
             rec.aux.set("RG", UNGROUPED_READGROUP);
-            if (!reads_hdr.read_groups.count(UNGROUPED_READGROUP)) {
-                reads_hdr.add(vargas::SAM::Header::ReadGroup("@RG\tID:" + std::string(UNGROUPED_READGROUP)));
+        }
+        const auto targets = _rg_targets.find(read_group);
+        if (targets == _rg_targets.end()) continue;
+
+        _read_len = std::max(_read_len, rec.seq.length());
+
+        const size_t bucket = length_bucket(rec.seq.length(), _bucket);
+        for (const size_t t : targets->second) {
+            auto &chunk = _open[std::make_pair(t, bucket)];
+            chunk.push_back(rec);
+            ++_total;
+            if (chunk.size() >= (_chunk_limit.empty() ? _chunk_size : _chunk_limit[t])) {
+                batch.emplace_back(_targets[t], std::move(chunk));
+                chunk.clear();
             }
         }
-        read_groups[read_group].push_back(rec);
-    } while (reads.next());
+    }
+
+    if (_done) {
+        for (auto &chunk : _open) {
+            if (chunk.second.empty()) continue;
+            batch.emplace_back(_targets[chunk.first.first], std::move(chunk.second));
+            chunk.second.clear();
+        }
+    }
+
+    _num_tasks += batch.size();
+    return !batch.empty();
+}
+
+void TaskStream::set_graph_lengths(const std::function<size_t(const std::string &)> &graph_len, size_t grain) {
+    grain = grain ? grain : 1;
+    std::vector<size_t> lens;
+    for (const auto &t : _targets) lens.push_back(std::max<size_t>(graph_len(t), 1));
+    const size_t max_len = lens.empty() ? 1 : *std::max_element(lens.begin(), lens.end());
+    _chunk_limit.clear();
+    for (const size_t len : lens) {
+        const size_t reads = (_chunk_size * (max_len / double(len))) + grain - 1;
+        _chunk_limit.push_back(std::max(grain, reads - reads % grain));
+    }
+}
+
+std::unordered_map<std::string, std::vector<std::string>>
+map_targets(const vargas::SAM::Header &reads_hdr, std::string align_targets, const std::vector<std::string> &rgids) {
+    std::vector<std::string> alignment_pairs;
+    if (align_targets.length() != 0) {
+        std::replace(align_targets.begin(), align_targets.end(), '\n', ';');
+        alignment_pairs = rg::split(align_targets, ';');
+    }
 
     if (alignment_pairs.empty()) {
-        for (const auto &p : read_groups) {
-            alignment_pairs.push_back("RG:ID:" + p.first + ",base");
+        for (const auto &id : rgids) {
+            alignment_pairs.push_back("RG:ID:" + id + ",base");
         }
     }
 
@@ -609,8 +1026,8 @@ create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_si
         auto target = rg::split(alignment_pairs[0], ',');
         if (target.size() == 1) {
             alignment_pairs.clear();
-            for (const auto &p : read_groups) {
-                alignment_pairs.push_back("RG:ID:" + p.first + "," + target[0]);
+            for (const auto &id : rgids) {
+                alignment_pairs.push_back("RG:ID:" + id + "," + target[0]);
             }
         }
     }
@@ -640,6 +1057,60 @@ create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_si
         }
 
     }
+    return alignment_rg_map;
+}
+
+std::unordered_map<std::string, std::vector<std::string>>
+join_targets(const std::unordered_map<std::string, std::vector<std::string>> &targets) {
+    std::map<std::string, std::set<std::string>> rg_labels;
+    for (const auto &t : targets) {
+        for (const auto &rgid : t.second) rg_labels[rgid].insert(t.first);
+    }
+    std::unordered_map<std::string, std::vector<std::string>> joined;
+    for (const auto &r : rg_labels) {
+        std::string label;
+        for (const auto &l : r.second) label += (label.empty() ? "" : ",") + l;
+        joined[label].push_back(r.first);
+    }
+    return joined;
+}
+
+std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>>
+create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_size, size_t &read_len,
+             size_t bucket, bool multi, const Shard *shard) {
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> task_list;
+    std::unordered_map<std::string, std::vector<vargas::SAM::Record>> read_groups;
+
+    std::cerr << "Loading reads... " << std::flush;
+    auto start_time = std::chrono::steady_clock::now();
+
+    size_t total = 0;
+    auto &reads_hdr = reads.header();
+    std::string read_group;
+    vargas::SAM::Record rec;
+    read_len = 0;
+    uint64_t ordinal = 0;
+    do {
+        rec = reads.record();
+        // Every shard counts all input records, so ordinals agree across graph shards
+        if (shard && shard->by == Shard::By::GRAPH) rec.aux.set(ALIGN_SAM_ORDINAL_TAG, ordinal);
+        ++ordinal;
+        if (shard && !shard->keep(rec.query_name)) continue;
+        if (rec.seq.length() > read_len) read_len = rec.seq.length();
+        if (!rec.aux.get("RG", read_group)) {
+            read_group = UNGROUPED_READGROUP;
+            rec.aux.set("RG", UNGROUPED_READGROUP);
+            if (!reads_hdr.read_groups.count(UNGROUPED_READGROUP)) {
+                reads_hdr.add(vargas::SAM::Header::ReadGroup("@RG\tID:" + std::string(UNGROUPED_READGROUP)));
+            }
+        }
+        read_groups[read_group].push_back(rec);
+    } while (reads.next());
+
+    std::vector<std::string> rgids;
+    for (const auto &p : read_groups) rgids.push_back(p.first);
+    auto alignment_rg_map = map_targets(reads_hdr, align_targets, rgids);
+    if (multi) alignment_rg_map = join_targets(alignment_rg_map);
 
     std::cerr << rg::chrono_duration(start_time) << "s." << std::endl;
 
@@ -649,17 +1120,26 @@ create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_si
             // If there is a header line that there are no reads associated with, skip
             if (read_groups.count(rgid) == 0) continue;
 
-            const auto beg = std::begin(read_groups.at(rgid));
-            const auto end = std::end(read_groups.at(rgid));
-            const size_t nrecords = read_groups.at(rgid).size();
-            const size_t n_chunks = (nrecords / chunk_size) + 1;
-            total += read_groups.at(rgid).size();
-
-            for (size_t i = 0; i < n_chunks; ++i) {
-                const auto safe_beg = beg + (i * chunk_size);
-                const auto safe_end = (i + 1) * chunk_size > nrecords ? end : safe_beg + chunk_size;
-                if (safe_beg != safe_end) {
-                    task_list.emplace_back(sub_rg_pair.first, std::vector<vargas::SAM::Record>(safe_beg, safe_end));
+            auto &records = read_groups.at(rgid);
+            total += records.size();
+            if (bucket) {
+                std::stable_sort(records.begin(), records.end(),
+                                 [bucket](const vargas::SAM::Record &a, const vargas::SAM::Record &b) {
+                                     return length_bucket(a.seq.length(), bucket) < length_bucket(b.seq.length(), bucket);
+                                 });
+            }
+
+            // Chunk each run of one length bucket
+            auto beg = records.begin();
+            while (beg != records.end()) {
+                const size_t b = length_bucket(beg->seq.length(), bucket);
+                const auto run_end = std::find_if(beg, records.end(), [b, bucket](const vargas::SAM::Record &r) {
+                    return length_bucket(r.seq.length(), bucket) != b;
+                });
+                while (beg != run_end) {
+                    const auto chunk_end = chunk_size > 0 && run_end - beg > chunk_size ? beg + chunk_size : run_end;
+                    task_list.emplace_back(sub_rg_pair.first, std::vector<vargas::SAM::Record>(beg, chunk_end));
+                    beg = chunk_end;
                 }
             }
         }
@@ -674,69 +1154,296 @@ create_tasks(vargas::isam &reads, std::string &align_targets, const int chunk_si
     return task_list;
 }
 
+void balance_tasks(std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                   const std::function<size_t(const std::string &)> &graph_len,
+                   size_t threads, size_t grain, size_t tasks_per_thread, bool largest_first) {
+    grain = grain ? grain : 1;
+    std::unordered_map<std::string, size_t> lens;
+    std::vector<double> costs;
+    double total = 0;
+    for (const auto &task : task_list) {
+        if (!lens.count(task.first)) lens[task.first] = graph_len(task.first);
+        size_t read_bases = 0;
+        for (const auto &r : task.second) read_bases += r.seq.length();
+        costs.push_back(double(read_bases) * lens[task.first]);
+        total += costs.back();
+    }
+    const double target = total / std::max<size_t>(1, threads * tasks_per_thread);
+
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> split;
+    std::vector<double> split_costs;
+    for (size_t i = 0; i < task_list.size(); ++i) {
+        auto &task = task_list[i];
+        const size_t n = task.second.size();
+        size_t pieces = target > 0 ? std::ceil(costs[i] / target) : 1;
+        pieces = std::max<size_t>(1, std::min(pieces, (n + grain - 1) / grain));
+        size_t per = (n + pieces - 1) / pieces;
+        per += (grain - per % grain) % grain;
+        const auto recs = task.second.begin();
+        for (size_t beg = 0; beg < n; beg += per) {
+            const size_t end = std::min(n, beg + per);
+            split.emplace_back(task.first, std::vector<vargas::SAM::Record>(std::make_move_iterator(recs + beg),
+                                                                            std::make_move_iterator(recs + end)));
+            split_costs.push_back(costs[i] * (end - beg) / n);
+        }
+    }
 
-template<typename T, typename...Args>
-T *construct_aligned(Args &&...args) {
-    static constexpr size_t alignment = 64; // AVX512
-    T *ptr;
-    if(posix_memalign(reinterpret_cast<void **>(&ptr), alignment, sizeof(T))) throw std::bad_alloc();
-    return new(ptr) T(std::forward<Args>(args)...);
+    std::vector<size_t> order(split.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (largest_first) {
+        std::stable_sort(order.begin(), order.end(), [&split_costs](size_t a, size_t b) {
+            return split_costs[a] > split_costs[b];
+        });
+    }
+    task_list.clear();
+    for (const size_t i : order) task_list.push_back(std::move(split[i]));
 }
 
+static bool narrow_saturates(const vargas::ScoreProfile &prof, size_t read_len) {
+    // Local alignments that saturate 8 bit scores are realigned individually, see vargas::AdaptiveAlignerT
+    const int bias = 255 - (read_len * prof.match);
+    return prof.end_to_end and (bias < 0 ||
+                                static_cast<signed long long>(prof.ref_gopen + (prof.ref_gext * (read_len - 1))) > bias ||
+                                static_cast<signed long long>(read_len * prof.mismatch_max) > bias);
+}
 
-std::unique_ptr<vargas::AlignerBase, Deleter>
-make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly) {
-    std::unique_ptr<vargas::AlignerBase, Deleter> ret;
-    if (msonly) {
-        if (prof.end_to_end) {
-            if(use_wide) ret.reset(construct_aligned<vargas::MSWordAlignerETE>(read_len, prof));
-            else ret.reset(construct_aligned<vargas::MSAlignerETE>(read_len, prof));
-        } else {
-            if(use_wide) ret.reset(construct_aligned<vargas::MSWordAligner>(read_len, prof));
-            else ret.reset(construct_aligned<vargas::MSAligner>(read_len, prof));
-        }
+bool use_wide_scores(const vargas::ScoreProfile &prof, size_t read_len) {
+    return narrow_saturates(prof, read_len) && !vargas::DiffAlignerETE::fits(prof);
+}
+
+bool diff_scores(const vargas::ScoreProfile &prof, size_t read_len) {
+    return narrow_saturates(prof, read_len) && vargas::DiffAlignerETE::fits(prof);
+}
+
+AlignerPool::AlignerPool(const vargas::ScoreProfile &prof, size_t max_len, size_t bucket, bool msonly, bool maxonly,
+                         vargas::ISA isa, unsigned groups, unsigned threads, int device) :
+_prof(prof), _max_len(max_len), _bucket(bucket), _msonly(msonly), _maxonly(maxonly), _isa(isa), _groups(groups),
+_threads(threads), _device(device) {}
+
+vargas::AlignerBase &AlignerPool::get(const std::vector<vargas::SAM::Record> &records) {
+    // Streamed reads can be longer than the first batch
+    for (const auto &r : records) _max_len = std::max(_max_len, r.seq.length());
+    const size_t aligner_len = length(records);
+    auto &ret = _aligners[aligner_len];
+    if (!ret) {
+        const bool wide = use_wide_scores(_prof, aligner_len);
+        if (_device >= 0) ret = vargas::gpu::make_aligner(_prof, aligner_len, wide, _msonly, _device);
+        else ret = make_aligner(_prof, aligner_len, wide, _msonly, _maxonly, _isa);
+        ret->set_groups_per_pass(_groups);
+        ret->set_threads(_threads);
     }
-    else {
-        if (prof.end_to_end) {
-            if(use_wide) ret.reset(construct_aligned<vargas::WordAlignerETE>(read_len, prof));
-            else ret.reset(construct_aligned<vargas::AlignerETE>(read_len, prof));
-        } else {
-            if(use_wide) ret.reset(construct_aligned<vargas::WordAligner>(read_len, prof));
-            else ret.reset(construct_aligned<vargas::Aligner>(read_len, prof));
+    return *ret;
+}
+
+size_t AlignerPool::length(const std::vector<vargas::SAM::Record> &records) const {
+    size_t len = 0;
+    for (const auto &r : records) len = std::max(len, r.seq.length());
+    const size_t b = length_bucket(len, _bucket);
+    return b == 0 ? std::max(_max_len, len) : std::min(b, std::max(_max_len, len));
+}
+
+size_t AlignerPool::realigned() const {
+    size_t ret = 0;
+    for (const auto &a : _aligners) ret += a.second->realigned();
+    return ret;
+}
+
+vargas::AlignerStats AlignerPool::kernel_stats() const {
+    vargas::AlignerStats ret;
+    for (const auto &a : _aligners) ret.merge(a.second->stats());
+    return ret;
+}
+
+std::shared_ptr<vargas::GraphMan> AlignCache::graph(const std::string &gdf) {
+    auto &ret = _graphs[_absolute(gdf)];
+    if (!ret) ret = std::make_shared<vargas::GraphMan>(gdf);
+    return ret;
+}
+
+std::shared_ptr<vargas::KmerIndex> AlignCache::index(const std::string &gdf) {
+    auto &ret = _indices[_absolute(gdf)];
+    if (!ret) ret = std::make_shared<vargas::KmerIndex>(vargas::KmerIndex::filename(gdf));
+    return ret;
+}
+
+std::vector<AlignerPool> &AlignCache::aligners(const std::string &key) {
+    if (_pools.size() >= max_pools && !_pools.count(key)) _pools.clear();
+    return _pools[key];
+}
+
+std::string AlignCache::_absolute(const std::string &path) {
+    if (path.empty() || path[0] == '/') return path;
+    char buf[PATH_MAX];
+    if (!getcwd(buf, sizeof(buf))) throw std::runtime_error("Unable to get working directory.");
+    return std::string(buf) + "/" + path;
+}
+
+ProgressMeter::ProgressMeter(size_t threads, double interval, size_t total, std::ostream &os) :
+_slots(new _slot[threads]), _threads(threads), _total(total), _os(os) {
+    if (interval <= 0) return;
+    _reporter = std::thread([this, interval] {
+        const auto start = std::chrono::steady_clock::now();
+        const auto period = std::chrono::duration<double>(interval);
+        uint64_t last = 0;
+        std::unique_lock<std::mutex> lock(_mut);
+        while (!_cv.wait_for(lock, period, [this] { return _stop; })) {
+            const uint64_t n = count();
+            _os << "[progress] " << n << " reads";
+            if (_total) _os << " (" << std::fixed << std::setprecision(1) << 100.0 * n / _total << "%)";
+            _os << ", " << std::fixed << std::setprecision(0) << (n - last) / interval << " reads/s, "
+                << n / rg::chrono_duration(start) << " overall.\n" << std::defaultfloat << std::flush;
+            last = n;
         }
-    }
+    });
+}
+
+uint64_t ProgressMeter::count() const {
+    uint64_t ret = 0;
+    for (size_t i = 0; i < _threads; ++i) ret += _slots[i].reads.load(std::memory_order_relaxed);
     return ret;
 }
 
-void load_fast(std::string &file, const bool fastq, vargas::isam &ret, bool p64) {
-    std::string input;
-    if (file.empty()) {
-        std::stringstream ss;
-        ss << std::cin.rdbuf();
-        input = ss.str();
-    } else {
-        std::ifstream in(file);
-        if (!in.good()) throw std::invalid_argument("Unable to open file \"" + file + "\"");
-        std::stringstream ss;
-        ss << in.rdbuf();
-        input = ss.str();
+void ProgressMeter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mut);
+        _stop = true;
     }
-    const auto lines = rg::split(input, '\n');
+    _cv.notify_all();
+    if (_reporter.joinable()) _reporter.join();
+}
 
-    try {
-        for (unsigned i = 0; i < lines.size(); i += (fastq ? 4 : 2)) {
-            vargas::SAM::Record rec;
-            rec.query_name = std::string(lines.at(i).begin() + 1,
-                                         std::find_if(lines.at(i).begin() + 1, lines.at(i).end(), isspace));
-            rec.seq = lines.at(i + 1);
-            if (fastq) rec.qual = lines.at(i + 3);
-            if (p64) std::transform(rec.qual.begin(), rec.qual.end(), rec.qual.begin(), [](char c){return c-31;});
+std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>
+make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, bool maxonly,
+             vargas::ISA isa) {
+    if (!isa_built(isa)) throw std::invalid_argument("Aligner was not built for " + isa_name(isa) + ".");
+    if (isa > host_isa()) throw std::invalid_argument(isa_name(isa) + " is not supported by this CPU.");
+    switch (isa) {
+        #ifdef VA_KERNEL_AVX512BW
+        case vargas::ISA::AVX512BW:
+            return vargas::avx512::make_aligner(prof, read_len, use_wide, msonly, maxonly);
+        #endif
+        #ifdef VA_KERNEL_AVX2
+        case vargas::ISA::AVX2:
+            return vargas::avx2::make_aligner(prof, read_len, use_wide, msonly, maxonly);
+        #endif
+        default:
+            return vargas::sse::make_aligner(prof, read_len, use_wide, msonly, maxonly);
+    }
+}
 
-            ret.push(rec);
-        }
-    } catch (std::exception &e) {
-        throw std::runtime_error("Invalid FASTA/Q file.");
+vargas::ISA host_isa() {
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, nullptr) < 7) return vargas::ISA::SSE41;
+    __cpuid(1, eax, ebx, ecx, edx);
+    // The OS must save the vector registers, checked through XCR0
+    if (!(ecx & bit_OSXSAVE)) return vargas::ISA::SSE41;
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    const uint64_t xcr0 = (uint64_t(xcr0_hi) << 32) | xcr0_lo;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    const bool avx2 = (ebx & (1u << 5)) && (xcr0 & 0x6) == 0x6; // XMM, YMM
+    const bool avx512bw = (ebx & (1u << 16)) && (ebx & (1u << 30)) && (xcr0 & 0xe6) == 0xe6; // + opmask, ZMM
+    if (avx512bw) return vargas::ISA::AVX512BW;
+    if (avx2) return vargas::ISA::AVX2;
+    return vargas::ISA::SSE41;
+}
+
+vargas::ISA best_isa() {
+    vargas::ISA isa = host_isa();
+    while (!isa_built(isa)) isa = static_cast<vargas::ISA>(static_cast<int>(isa) - 1);
+    return isa;
+}
+
+bool isa_built(vargas::ISA isa) {
+    switch (isa) {
+        case vargas::ISA::AVX512BW:
+            #ifdef VA_KERNEL_AVX512BW
+            return true;
+            #else
+            return false;
+            #endif
+        case vargas::ISA::AVX2:
+            #ifdef VA_KERNEL_AVX2
+            return true;
+            #else
+            return false;
+            #endif
+        default:
+            return true;
+    }
+}
+
+vargas::ISA parse_isa(const std::string &name) {
+    std::string n = name;
+    std::transform(n.begin(), n.end(), n.begin(), ::tolower);
+    if (n == "sse4.1" || n == "sse") return vargas::ISA::SSE41;
+    if (n == "avx2") return vargas::ISA::AVX2;
+    if (n == "avx512bw" || n == "avx512") return vargas::ISA::AVX512BW;
+    throw std::invalid_argument("Unknown instruction set \"" + name + "\", expected sse4.1, avx2, or avx512bw.");
+}
+
+std::string isa_name(vargas::ISA isa) {
+    switch (isa) {
+        case vargas::ISA::AVX512BW: return "avx512bw";
+        case vargas::ISA::AVX2: return "avx2";
+        default: return "sse4.1";
+    }
+}
+
+unsigned isa_read_capacity(vargas::ISA isa, bool use_wide) {
+    unsigned bytes;
+    switch (isa) {
+        case vargas::ISA::AVX512BW: bytes = 64; break;
+        case vargas::ISA::AVX2: bytes = 32; break;
+        default: bytes = 16;
     }
+    return use_wide ? bytes / 2 : bytes;
+}
+
+FastReader::FastReader(const std::string &file, bool fastq, bool p64, int threads) : _fastq(fastq), _p64(p64) {
+    _fp = file.empty() ? bgzf_dopen(fileno(stdin), "r") : bgzf_open(file.c_str(), "r");
+    if (!_fp) throw std::invalid_argument("Unable to open file \"" + file + "\"");
+    if (threads > 0) bgzf_mt(_fp, threads, 256);
+}
+
+FastReader::~FastReader() {
+    if (_fp) bgzf_close(_fp);
+    free(_line.s);
+}
+
+bool FastReader::_getline() {
+    const int ret = bgzf_getline(_fp, '\n', &_line);
+    if (ret < -1) throw std::runtime_error("Error reading FASTA/Q file.");
+    return ret >= 0;
+}
+
+bool FastReader::getline(std::string &line) {
+    if (!_getline()) return false;
+    line.assign(_line.s, _line.l);
+    return true;
+}
+
+bool FastReader::next(vargas::SAM::Record &rec) {
+    bool got;
+    while ((got = _getline()) && _line.l == 0); // Skip blank lines between records
+    if (!got) return false;
+
+    rec = vargas::SAM::Record();
+    const char *name = _line.s + 1, *end = _line.s + _line.l;
+    rec.query_name.assign(name, std::find_if(name, end, isspace));
+    if (!getline(rec.seq)) throw std::runtime_error("Invalid FASTA/Q file.");
+    if (_fastq) {
+        if (!_getline() || !getline(rec.qual)) throw std::runtime_error("Invalid FASTA/Q file.");
+        if (_p64) std::transform(rec.qual.begin(), rec.qual.end(), rec.qual.begin(), [](char c){return c-31;});
+    }
+    return true;
+}
+
+void load_fast(std::string &file, const bool fastq, vargas::isam &ret, bool p64, int threads) {
+    FastReader in(file, fastq, p64, threads);
+    vargas::SAM::Record rec;
+    while (in.next(rec)) ret.push(rec);
     ret.next();
 }
 
@@ -745,18 +1452,41 @@ void align_help(const cxxopts::Options &opts) {
     using std::endl;
 
     cerr << opts.help(opts.groups()) << "\n" << endl;
-    cerr << "Elements per SIMD vector: " << vargas::Aligner::read_capacity() << endl;
+    cerr << "Elements per SIMD vector: " << isa_read_capacity(best_isa(), false) << " (" << isa_name(best_isa()) << ")" << endl;
+}
+
+void add_contigs(vargas::SAM::Header &hdr, vargas::GraphMan &gm) {
+    const auto offsets = gm.resolver()._contig_offsets;
+    if (offsets.empty()) return;
+    // Contigs are laid out consecutively, the last ends with the base graph
+    const unsigned end = gm.at("base")->rbegin()->end_pos() + 1;
+    for (auto o = offsets.begin(); o != offsets.end(); ++o) {
+        if (hdr.sequences.count(o->second)) continue;
+        const auto next = std::next(o);
+        vargas::SAM::Header::Sequence seq;
+        seq.name = o->second;
+        seq.len = (next == offsets.end() ? end : next->first) - o->first;
+        hdr.add(seq);
+    }
 }
 
 ReadFmt read_fmt(const std::string& filename) {
-    std::ifstream in(filename);
-    if (!in.good()) throw std::invalid_argument("Invalid read file: " + filename);
+    if (vargas::SAM::format(filename) != vargas::SAM::Format::SAM) {
+        if (!std::ifstream(filename).good()) throw std::invalid_argument("Invalid read file: " + filename);
+        return ReadFmt::SAM; // Binary, read by htslib
+    }
+    std::unique_ptr<FastReader> in;
+    try {
+        in.reset(new FastReader(filename, false)); // Reads through any compression
+    } catch (std::invalid_argument &e) {
+        throw std::invalid_argument("Invalid read file: " + filename);
+    }
 
     std::string line;
-    if (!std::getline(in, line)) throw std::invalid_argument("Empty Read File."); // @SAM or fasta/q name
+    if (!in->getline(line)) throw std::invalid_argument("Empty Read File."); // @SAM or fasta/q name
     if (line.substr(0,3) == "@HD") return ReadFmt::SAM;
-    if (!std::getline(in, line)) throw std::invalid_argument("Invalid Read File."); // SAM comment/header, or read
-    if (!std::getline(in, line)) return ReadFmt::FASTA; // Single record fasta, or SAM line, or +, or name
+    if (!in->getline(line)) throw std::invalid_argument("Invalid Read File."); // SAM comment/header, or read
+    if (!in->getline(line)) return ReadFmt::FASTA; // Single record fasta, or SAM line, or +, or name
     if (!line.empty() && line[0] == '+') return ReadFmt::FASTQ;
     if (!line.empty() && (line[0] == '>' || line[0] == '@')) return ReadFmt::FASTA;
     return ReadFmt::SAM;
@@ -798,3 +1528,335 @@ TEST_CASE ("Load FASTA") {
     CHECK_FALSE(ss.next());
     remove(tmpfq.c_str());
 }
+TEST_CASE ("Load compressed FASTQ") {
+    std::string tmpfq = "tmp_fastq.va.gz";
+    {
+        const std::string fq = "@a\nACGT\n+\nhhhh\n\n@b x\nTTTT\n+b\nJJJJ\n";
+        BGZF *o = bgzf_open(tmpfq.c_str(), "w");
+        REQUIRE(o);
+        bgzf_write(o, fq.data(), fq.size());
+        bgzf_close(o);
+    }
+    CHECK(read_fmt(tmpfq) == ReadFmt::FASTQ);
+    FastReader in(tmpfq, true, true);
+    vargas::SAM::Record rec;
+    REQUIRE(in.next(rec));
+    CHECK(rec.query_name == "a");
+    CHECK(rec.seq == "ACGT");
+    CHECK(rec.qual == "IIII"); // Phred+64 h is Phred+33 I
+    REQUIRE(in.next(rec));
+    CHECK(rec.query_name == "b");
+    CHECK(rec.qual == "++++");
+    CHECK_FALSE(in.next(rec));
+    remove(tmpfq.c_str());
+}
+
+TEST_CASE ("Task stream") {
+    std::vector<vargas::SAM::Record> recs(10);
+    for (size_t i = 0; i < recs.size(); ++i) {
+        recs[i].query_name = std::to_string(i);
+        recs[i].seq = std::string(i < 5 ? 10 : 12, 'A');
+    }
+    size_t idx = 0;
+    auto source = [&](vargas::SAM::Record &r) {
+        if (idx == recs.size()) return false;
+        r = recs[idx++];
+        return true;
+    };
+
+    vargas::SAM::Header hdr;
+    TaskStream ts(source, hdr, "", 3, 2);
+    CHECK(hdr.read_groups.count(UNGROUPED_READGROUP) == 1);
+
+    TaskStream::batch_t batch;
+    REQUIRE(ts.next(batch));
+    REQUIRE(batch.size() == 2);
+    CHECK(batch[0].first == "base");
+    CHECK(batch[0].second.size() == 3);
+    CHECK(batch[1].second.size() == 3);
+    CHECK(ts.max_read_len() == 12);
+
+    // Later reads can be longer than the first batch
+    recs.emplace_back();
+    recs.back().seq = std::string(20, 'A');
+    size_t n = 0;
+    while (ts.next(batch)) for (const auto &t : batch) n += t.second.size();
+    CHECK(n == 5);
+    CHECK(ts.max_read_len() == 20);
+}
+
+TEST_CASE ("Aligner dispatch") {
+    for (auto isa : {vargas::ISA::SSE41, vargas::ISA::AVX2, vargas::ISA::AVX512BW}) {
+        CHECK(parse_isa(isa_name(isa)) == isa);
+    }
+    CHECK(parse_isa("AVX2") == vargas::ISA::AVX2);
+    CHECK_THROWS(parse_isa("neon"));
+    CHECK(isa_built(vargas::ISA::SSE41));
+    CHECK(isa_built(best_isa()));
+    CHECK(best_isa() <= host_isa());
+
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(39);
+        n.set_seq("ACGTTGCAAGGCTTACGATCGGATCCAGTTAGCATCGAGA");
+        g.add_node(n);
+    }
+    std::vector<std::string> reads;
+    for (size_t i = 0; i + 8 <= 40; ++i) reads.push_back(g.begin()->seq_str().substr(i, 8));
+    reads.push_back("NNNNNNNN");
+
+    vargas::ScoreProfile prof;
+    vargas::Results expected;
+    make_aligner(prof, 8, false, false, false, vargas::ISA::SSE41)->align_into(reads, {}, g.begin(), g.end(), expected, false);
+    for (bool wide : {false, true}) {
+        auto a = make_aligner(prof, 8, wide, false, false, best_isa());
+        CHECK(a->capacity() == isa_read_capacity(best_isa(), wide));
+        vargas::Results res;
+        a->align_into(reads, {}, g.begin(), g.end(), res, false);
+        REQUIRE(res.size() == reads.size());
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(res.max_score[i] == expected.max_score[i]);
+            CHECK(res.max_pos[i] == expected.max_pos[i]);
+            CHECK(res.max_strand[i] == expected.max_strand[i]);
+        }
+    }
+    {
+        // Max only aligners report the same max as full ones
+        vargas::Results res;
+        make_aligner(prof, 8, false, false, true, best_isa())->align_into(reads, {}, g.begin(), g.end(), res, false);
+        REQUIRE(res.size() == reads.size());
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(res.max_score[i] == expected.max_score[i]);
+            CHECK(res.max_pos[i] == expected.max_pos[i]);
+            CHECK(res.max_count[i] == expected.max_count[i]);
+        }
+    }
+
+    // Long end to end reads keep 8 bit lanes with score differences
+    vargas::ScoreProfile ete;
+    ete.end_to_end = true;
+    CHECK(diff_scores(ete, 200));
+    CHECK(!use_wide_scores(ete, 200));
+    CHECK(!diff_scores(ete, 8));
+    CHECK(make_aligner(ete, 200, false, false, false, best_isa())->capacity() == isa_read_capacity(best_isa(), false));
+    CHECK(make_aligner(ete, 200, true, false, false, best_isa())->capacity() == isa_read_capacity(best_isa(), true));
+    vargas::ScoreProfile steep(60, 40, 30, 10);
+    steep.end_to_end = true;
+    CHECK(use_wide_scores(steep, 200));
+    CHECK(!diff_scores(steep, 200));
+}
+
+TEST_CASE ("Progress meter") {
+    std::ostringstream ss;
+    {
+        ProgressMeter p(3, 0.01, 60, ss);
+        p.update(0, 10);
+        p.update(2, 20);
+        CHECK(p.count() == 30);
+        p.update(0, 15);
+        CHECK(p.count() == 35);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    CHECK(ss.str().find("[progress] 35 reads (58.3%)") == 0);
+
+    ProgressMeter quiet(1, 0, 0, ss);
+    quiet.update(0, 1);
+    CHECK(quiet.count() == 1);
+    quiet.stop();
+}
+
+TEST_CASE ("Prefiltered alignment") {
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<int> base(0, 3);
+    std::string ref;
+    for (int i = 0; i < 5000; ++i) ref.push_back("ACGT"[base(gen)]);
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(ref.size());
+        n.set_seq(ref);
+        g.add_node(n);
+    }
+    const vargas::CompiledGraph cg(g);
+    const vargas::KmerIndex index(cg, 12);
+
+    vargas::EncodedReads reads;
+    for (size_t i = 0; i + 50 <= ref.size(); i += 173) {
+        std::string r = ref.substr(i, 50);
+        r[25] = r[25] == 'A' ? 'C' : 'A';
+        if (i % 2) r = rg::reverse_complement(r);
+        reads.push_back(r, "", 33);
+    }
+    std::string random;
+    for (int i = 0; i < 50; ++i) random.push_back("ACGT"[base(gen)]);
+    reads.push_back(random, "", 33);
+
+    vargas::ScoreProfile prof;
+    auto aligner = make_aligner(prof, 50, false, false, false, vargas::ISA::SSE41);
+    vargas::Results full, pre;
+    aligner->align_into(reads, cg, full, false);
+    align_prefiltered(*aligner, index, cg, reads, pre, false);
+    REQUIRE(pre.size() == reads.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+        CHECK(pre.max_score[i] == full.max_score[i]);
+        CHECK(pre.max_pos[i] == full.max_pos[i]);
+        CHECK(pre.max_strand[i] == full.max_strand[i]);
+    }
+}
+
+TEST_CASE ("Joined targets") {
+    const std::unordered_map<std::string, std::vector<std::string>> targets = {
+    {"ref", {"a", "b"}}, {"base", {"a"}}, {"maxaf", {"c", "a"}}};
+    auto joined = join_targets(targets);
+    REQUIRE(joined.size() == 3);
+    CHECK(joined.at("base,maxaf,ref") == std::vector<std::string>{"a"});
+    CHECK(joined.at("ref") == std::vector<std::string>{"b"});
+    CHECK(joined.at("maxaf") == std::vector<std::string>{"c"});
+}
+
+TEST_CASE ("Length buckets") {
+    CHECK(length_bucket(5, 0) == 0);
+    CHECK(length_bucket(5, 16) == 16);
+    CHECK(length_bucket(16, 16) == 16);
+    CHECK(length_bucket(17, 16) == 32);
+
+    const std::string ref = "ACGTTGCAAGGCTTACGATCGGATCCAGTTAGCATCGAGACGTAGCTAGGCATTACGACTAGCATCG";
+    std::vector<vargas::SAM::Record> recs(12);
+    for (size_t i = 0; i < recs.size(); ++i) {
+        recs[i].query_name = std::to_string(i);
+        recs[i].seq = ref.substr(i, i % 2 ? 40 : 10);
+    }
+    size_t idx = 0;
+    auto source = [&](vargas::SAM::Record &r) {
+        if (idx == recs.size()) return false;
+        r = recs[idx++];
+        return true;
+    };
+
+    vargas::SAM::Header hdr;
+    TaskStream ts(source, hdr, "", 4, 10, 16);
+    TaskStream::batch_t batch;
+    REQUIRE(ts.next(batch));
+    REQUIRE(batch.size() == 4);
+    for (const auto &task : batch) {
+        for (const auto &r : task.second) {
+            CHECK(length_bucket(r.seq.length(), 16) == length_bucket(task.second.front().seq.length(), 16));
+        }
+    }
+    CHECK(ts.total() == recs.size());
+
+    // Aligners sized per bucket give the same results as one sized for the longest read
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    {
+        vargas::Graph::Node n;
+        n.set_endpos(ref.size() - 1);
+        n.set_seq(ref);
+        g.add_node(n);
+    }
+    vargas::ScoreProfile prof;
+    AlignerPool pool(prof, 40, 16, false, false, vargas::ISA::SSE41, 1);
+    auto single = make_aligner(prof, 40, false, false, false, vargas::ISA::SSE41);
+    for (const auto &task : batch) {
+        std::vector<std::string> reads;
+        for (const auto &r : task.second) reads.push_back(r.seq);
+        auto res = pool.get(task.second).align(reads, g.begin(), g.end(), false);
+        auto expected = single->align(reads, g.begin(), g.end(), false);
+        for (size_t i = 0; i < reads.size(); ++i) {
+            CHECK(res.max_score[i] == expected.max_score[i]);
+            CHECK(res.max_pos[i] == expected.max_pos[i]);
+            CHECK(res.max_strand[i] == expected.max_strand[i]);
+        }
+    }
+    CHECK(pool.size() == 2);
+
+    // A read longer than max_len gets an aligner of its own length
+    std::vector<vargas::SAM::Record> longer(1);
+    longer[0].seq = ref.substr(0, 45);
+    CHECK(pool.length(longer) == 45);
+    {
+        const std::vector<std::string> reads = {longer[0].seq};
+        auto res = pool.get(longer).align(reads, g.begin(), g.end(), false);
+        auto expected = make_aligner(prof, 45, false, false, false, vargas::ISA::SSE41)->align(reads, g.begin(), g.end(), false);
+        CHECK(res.max_score[0] == expected.max_score[0]);
+        CHECK(res.max_pos[0] == expected.max_pos[0]);
+    }
+    CHECK(pool.size() == 3);
+    CHECK(pool.length(batch[0].second) <= 45);
+}
+
+TEST_CASE ("Cost balanced tasks") {
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> tasks(2);
+    tasks[0].first = "small";
+    tasks[1].first = "big";
+    for (auto &t : tasks) {
+        t.second.resize(100);
+        for (auto &r : t.second) r.seq = std::string(10, 'A');
+    }
+    auto graph_len = [](const std::string &label) -> size_t { return label == "big" ? 1000 : 10; };
+
+    balance_tasks(tasks, graph_len, 2, 8);
+    REQUIRE(tasks.size() > 2);
+    size_t big = 0, small = 0;
+    for (const auto &t : tasks) {
+        if (t.first == "big") big += t.second.size();
+        else {
+            small += t.second.size();
+            CHECK(t.second.size() == 100); // cheaper than a share of the work
+        }
+    }
+    CHECK(big == 100);
+    CHECK(small == 100);
+    // Whole aligner passes, largest first
+    CHECK(tasks.front().first == "big");
+    CHECK(tasks.back().first == "small");
+    for (size_t i = 0; i + 2 < tasks.size(); ++i) CHECK(tasks[i].second.size() % 8 == 0);
+
+    // Pieces stay in place, so concatenated tasks keep input order
+    std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> in_order(2);
+    in_order[0].first = "small";
+    in_order[1].first = "big";
+    for (auto &t : in_order) {
+        t.second.resize(100);
+        for (size_t i = 0; i < t.second.size(); ++i) {
+            t.second[i].seq = std::string(10, 'A');
+            t.second[i].query_name = t.first + std::to_string(i);
+        }
+    }
+    balance_tasks(in_order, graph_len, 2, 8, 8, false);
+    REQUIRE(in_order.size() > 2);
+    CHECK(in_order.front().first == "small");
+    std::vector<std::string> names;
+    for (const auto &t : in_order) for (const auto &r : t.second) names.push_back(r.query_name);
+    REQUIRE(names.size() == 200);
+    for (size_t i = 0; i < 100; ++i) {
+        CHECK(names[i] == "small" + std::to_string(i));
+        CHECK(names[100 + i] == "big" + std::to_string(i));
+    }
+
+    // Streamed chunks of smaller targets hold more reads
+    std::vector<vargas::SAM::Record> recs(40);
+    for (auto &r : recs) {
+        r.seq = std::string(10, 'A');
+        r.aux.set("RG", "1");
+    }
+    size_t idx = 0;
+    auto source = [&](vargas::SAM::Record &r) {
+        if (idx == recs.size()) return false;
+        r = recs[idx++];
+        return true;
+    };
+    vargas::SAM::Header hdr;
+    hdr.add(vargas::SAM::Header::ReadGroup("@RG\tID:1"));
+    TaskStream ts(source, hdr, "RG:ID:1,big;RG:ID:1,small", 4, 100);
+    ts.set_graph_lengths(graph_len, 4);
+    TaskStream::batch_t batch;
+    REQUIRE(ts.next(batch));
+    for (const auto &t : batch) {
+        if (t.first == "big") CHECK(t.second.size() == 4);
+        else CHECK(t.second.size() == 40);
+    }
+}
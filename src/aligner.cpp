@@ -0,0 +1,69 @@
+/**
+ * @brief
+ * Aligner kernels for one instruction set.
+ *
+ * @details
+ * This file is compiled once per instruction set, with the baseline -m flags and a VA_SIMD_USE_* definition.
+ * Each build defines make_aligner in its own namespace (vargas::sse, vargas::avx2, vargas::avx512), and
+ * ::make_aligner in align_main.cpp picks one at runtime. The wider instruction sets are only enabled for the
+ * kernels in VA_SIMD_NAMESPACE (see VA_SIMD_TARGET_BEGIN in simd.h), so inline functions shared with the
+ * rest of the program are baseline code in every object and the link order does not matter.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+// Kernel tests are compiled into align_main.cpp, only for the baseline instruction set.
+#define DOCTEST_CONFIG_DISABLE
+
+#include "align_main.h"
+#include "alignment.h"
+
+namespace {
+  template<typename T, typename...Args>
+  T *construct_aligned(Args &&...args) {
+      static constexpr size_t alignment = 64; // AVX512
+      T *ptr;
+      if(posix_memalign(reinterpret_cast<void **>(&ptr), alignment, sizeof(T))) throw std::bad_alloc();
+      return new(ptr) T(std::forward<Args>(args)...);
+  }
+
+  /**
+   * @brief
+   * Aligner of one report mode, see make_aligner.
+   */
+  template<bool MSONLY, bool MAXONLY>
+  vargas::AlignerBase *construct_mode(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide,
+                                      bool adaptive, bool diff) {
+      using vargas::int8_fast;
+      using vargas::int16_fast;
+      if (diff) return construct_aligned<vargas::DiffAlignerT<MSONLY, MAXONLY>>(read_len, prof);
+      if (adaptive) return construct_aligned<vargas::AdaptiveAlignerT<MSONLY, MAXONLY>>(read_len, prof);
+      if (prof.end_to_end) {
+          if (use_wide) return construct_aligned<vargas::AlignerT<int16_fast, true, MSONLY, MAXONLY>>(read_len, prof);
+          return construct_aligned<vargas::AlignerT<int8_fast, true, MSONLY, MAXONLY>>(read_len, prof);
+      }
+      if (use_wide) return construct_aligned<vargas::AlignerT<int16_fast, false, MSONLY, MAXONLY>>(read_len, prof);
+      return construct_aligned<vargas::AlignerT<int8_fast, false, MSONLY, MAXONLY>>(read_len, prof);
+  }
+}
+
+std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>
+vargas::VA_SIMD_NAMESPACE::make_aligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide,
+                                        bool msonly, bool maxonly) {
+    std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter> ret;
+    // Local scores that may not fit in 8 bits are realigned with 16 bits only when they saturate
+    using narrow_t = vargas::int8_fast::native_t;
+    const bool adaptive = !use_wide && !prof.end_to_end && read_len * prof.match >
+                          unsigned(std::numeric_limits<narrow_t>::max() - std::numeric_limits<narrow_t>::min());
+    // End to end scores that may not fit in 8 bits are aligned as 8 bit differences when the profile allows
+    const bool diff = !use_wide && diff_scores(prof, read_len);
+    // Max only aligners skip the 2nd-max bookkeeping and split graphs into segments, see AlignerT::set_threads()
+    if (msonly) ret.reset(construct_mode<true, false>(prof, read_len, use_wide, adaptive, diff));
+    else if (maxonly) ret.reset(construct_mode<false, true>(prof, read_len, use_wide, adaptive, diff));
+    else ret.reset(construct_mode<false, false>(prof, read_len, use_wide, adaptive, diff));
+    return ret;
+}
@@ -0,0 +1,179 @@
+/**
+ * @brief
+ * CUDA launcher of the GPU aligner backend, built with -DBUILD_CUDA=ON.
+ *
+ * @details
+ * Each thread aligns one read with align_read() from include/gpu.h. Graphs are uploaded once per device and
+ * shared by the streams on it. Read and result buffers are per stream and grow as needed.
+ * Experimental: the kernel is tested on the host in src/gpu.cpp. With a device, the same test also checks this
+ * launcher against the SIMD aligners, see "GPU kernel reference". CI only compiles it, having no device.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "gpu.h"
+#include <cuda_runtime.h>
+#include <stdexcept>
+#include <string>
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+#define VA_CUDA_CHECK(x) vargas::gpu::cuda_check((x), #x)
+
+namespace vargas {
+  namespace gpu {
+
+      inline void cuda_check(const cudaError_t err, const char *what) {
+          if (err != cudaSuccess) throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(err));
+      }
+
+      __global__ void align_kernel(const Config c, const Job job) {
+          const uint32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+          if (i < job.n) align_read(c, job, i);
+      }
+
+      /**
+       * @brief
+       * Device buffer that only grows.
+       */
+      struct DeviceBuffer {
+          void *ptr = nullptr;
+          size_t bytes = 0;
+
+          void reserve(const size_t n) {
+              if (n <= bytes) return;
+              if (ptr) VA_CUDA_CHECK(cudaFree(ptr));
+              ptr = nullptr;
+              bytes = 0;
+              VA_CUDA_CHECK(cudaMalloc(&ptr, n));
+              bytes = n;
+          }
+
+          ~DeviceBuffer() { if (ptr) cudaFree(ptr); }
+      };
+
+      /**
+       * @brief
+       * Flattened graph on a device.
+       */
+      struct DeviceGraph {
+          DeviceBuffer seq, seq_off, end_pos, pred_off, pred_slot, slot;
+          GraphView view;
+      };
+
+      namespace {
+        // Graphs are shared by every stream of a device, keyed by device and fingerprint
+        std::mutex graph_mut;
+        std::map<std::pair<int, uint64_t>, std::shared_ptr<DeviceGraph>> graphs;
+        constexpr size_t max_graphs = 64;
+
+        template<typename T>
+        const T *copy_to(DeviceBuffer &buf, const std::vector<T> &v) {
+            buf.reserve(std::max<size_t>(1, v.size() * sizeof(T)));
+            if (v.size()) VA_CUDA_CHECK(cudaMemcpy(buf.ptr, v.data(), v.size() * sizeof(T), cudaMemcpyHostToDevice));
+            return static_cast<const T *>(buf.ptr);
+        }
+      }
+  }
+}
+
+struct vargas::gpu::Stream::Impl {
+    int device;
+    cudaStream_t stream;
+    DeviceBuffer base, mismatch, work, out;
+    std::map<uint64_t, std::shared_ptr<DeviceGraph>> graphs; // Keeps graphs alive while in use here
+};
+
+vargas::gpu::Stream::Stream(int device) : _impl(new Impl) {
+    if (device < 0 || device >= devices()) throw std::invalid_argument("No CUDA device " + std::to_string(device) + ".");
+    _impl->device = device;
+    VA_CUDA_CHECK(cudaSetDevice(device));
+    VA_CUDA_CHECK(cudaStreamCreateWithFlags(&_impl->stream, cudaStreamNonBlocking));
+}
+
+vargas::gpu::Stream::~Stream() {
+    if (!_impl) return;
+    cudaSetDevice(_impl->device);
+    // Buffers are freed by their destructors after the stream is done with them
+    cudaStreamSynchronize(_impl->stream);
+    cudaStreamDestroy(_impl->stream);
+}
+
+bool vargas::gpu::Stream::cached(uint64_t key) const {
+    if (_impl->graphs.count(key)) return true;
+    std::lock_guard<std::mutex> lock(graph_mut);
+    return graphs.count({_impl->device, key}) != 0;
+}
+
+void vargas::gpu::Stream::upload(uint64_t key, const FlatGraph &g) {
+    std::lock_guard<std::mutex> lock(graph_mut);
+    auto &dg = graphs[{_impl->device, key}];
+    if (!dg) {
+        VA_CUDA_CHECK(cudaSetDevice(_impl->device));
+        std::shared_ptr<DeviceGraph> ng = std::make_shared<DeviceGraph>();
+        ng->view = g.view();
+        ng->view.seq = copy_to(ng->seq, g.seq);
+        ng->view.seq_off = copy_to(ng->seq_off, g.seq_off);
+        ng->view.end_pos = copy_to(ng->end_pos, g.end_pos);
+        ng->view.pred_off = copy_to(ng->pred_off, g.pred_off);
+        ng->view.pred_slot = copy_to(ng->pred_slot, g.pred_slot);
+        ng->view.slot = copy_to(ng->slot, g.slot);
+        dg = ng;
+    }
+    if (_impl->graphs.size() >= max_graphs) _impl->graphs.clear();
+    _impl->graphs[key] = dg;
+    if (graphs.size() > max_graphs) {
+        // Streams still holding an evicted graph keep it until they move on
+        auto keep = *graphs.find({_impl->device, key});
+        graphs.clear();
+        graphs.insert(keep);
+    }
+}
+
+void vargas::gpu::Stream::run(const Config &c, uint64_t key, const Job &job) {
+    auto it = _impl->graphs.find(key);
+    if (it == _impl->graphs.end()) {
+        std::lock_guard<std::mutex> lock(graph_mut);
+        auto shared = graphs.find({_impl->device, key});
+        if (shared == graphs.end()) throw std::invalid_argument("Graph not uploaded to CUDA device.");
+        it = _impl->graphs.insert({key, shared->second}).first;
+    }
+    if (job.n == 0) return;
+
+    VA_CUDA_CHECK(cudaSetDevice(_impl->device));
+    const GraphView &g = it->second->view;
+    const size_t rows = 2 * size_t(job.p.read_len) * job.n;
+    _impl->base.reserve(rows);
+    _impl->mismatch.reserve(rows);
+    _impl->work.reserve(std::max<size_t>(1, work_bytes(c, job.p.read_len, g.slots, job.n)));
+    _impl->out.reserve(job.n * sizeof(Out));
+
+    Job dev = job;
+    dev.g = g;
+    dev.base = static_cast<const uint8_t *>(_impl->base.ptr);
+    dev.mismatch = static_cast<const uint8_t *>(_impl->mismatch.ptr);
+    dev.work = _impl->work.ptr;
+    dev.out = static_cast<Out *>(_impl->out.ptr);
+
+    cudaStream_t s = _impl->stream;
+    VA_CUDA_CHECK(cudaMemcpyAsync(_impl->base.ptr, job.base, rows, cudaMemcpyHostToDevice, s));
+    VA_CUDA_CHECK(cudaMemcpyAsync(_impl->mismatch.ptr, job.mismatch, rows, cudaMemcpyHostToDevice, s));
+    constexpr unsigned block = 128;
+    align_kernel<<<(job.n + block - 1) / block, block, 0, s>>>(c, dev);
+    VA_CUDA_CHECK(cudaGetLastError());
+    VA_CUDA_CHECK(cudaMemcpyAsync(job.out, _impl->out.ptr, job.n * sizeof(Out), cudaMemcpyDeviceToHost, s));
+    VA_CUDA_CHECK(cudaStreamSynchronize(s));
+}
+
+bool vargas::gpu::built() { return true; }
+
+int vargas::gpu::devices() {
+    int n = 0;
+    if (cudaGetDeviceCount(&n) != cudaSuccess) return 0;
+    return n;
+}
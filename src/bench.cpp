@@ -0,0 +1,526 @@
+/**
+ * @brief
+ * Benchmarks of the aligner kernels, graph construction, simulation, and SAM I/O on synthetic data.
+ *
+ * @details
+ * Suites:\n
+ * kernel: cell updates per second of every aligner kernel, over each thread count.\n
+ * graph: GraphMan::create_base (GraphFactory::build) from a FASTA and VCF, and writing and opening text
+ * and binary graph definitions.\n
+ * sim: reads simulated per second.\n
+ * sam, bam: records written and read per second.\n
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "bench.h"
+#include "main.h"
+#include "align_main.h"
+#include "alignment.h"
+#include "graphman.h"
+#include "sim.h"
+#include "threadpool.h"
+#include "doctest.h"
+
+#include <sys/resource.h>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
+namespace {
+
+  /**
+   * @brief
+   * Random reference with SNPs. SNPs are never adjacent, each haplotype carries the alternate allele
+   * with the SNP's allele frequency.
+   */
+  struct Synthetic {
+      struct Snp {
+          size_t pos; /**< 0 based position */
+          char alt;
+          double af;
+          std::vector<bool> gt; /**< true for the alternate allele, one per haplotype */
+      };
+
+      static constexpr const char *CONTIG = "bench";
+
+      std::string ref;
+      std::vector<Snp> snps;
+      unsigned haplotypes = 0;
+
+      Synthetic(size_t length, double density, unsigned samples, uint64_t seed) : haplotypes(2 * samples) {
+          vargas::Sim::Rng rng(seed, 1);
+          ref.reserve(length);
+          for (size_t i = 0; i < length; ++i) ref += "ACGT"[rng.below(4)];
+          const uint64_t threshold = uint64_t(density * (1 << 20));
+          for (size_t i = 1; i < length; ++i) {
+              if (rng.below(1 << 20) >= threshold || (!snps.empty() && snps.back().pos + 1 >= i)) continue;
+              Snp s;
+              s.pos = i;
+              do s.alt = "ACGT"[rng.below(4)]; while (s.alt == ref[i]);
+              s.af = (rng.below(99) + 1) / 100.0;
+              for (unsigned h = 0; h < haplotypes; ++h) s.gt.push_back(rng.below(100) < s.af * 100);
+              snps.push_back(std::move(s));
+          }
+      }
+
+      /**
+       * @return Graph of the reference and SNPs, each SNP is a ref and an alt node.
+       */
+      vargas::Graph graph() const {
+          vargas::Graph g;
+          g.set_popsize(haplotypes);
+          g.set_filter(vargas::Graph::Population(haplotypes, true));
+          std::vector<unsigned> prev;
+          size_t begin = 0;
+          auto link = [&](const vargas::Graph::Node &n) {
+              const unsigned id = g.add_node(n);
+              for (const unsigned p : prev) g.add_edge(p, id);
+              return id;
+          };
+          auto add_ref = [&](size_t end) {
+              if (end == begin) return;
+              vargas::Graph::Node n;
+              n.set_endpos(end);
+              n.set_as_ref();
+              n.set_population(haplotypes, true);
+              n.set_seq(ref.substr(begin, end - begin));
+              prev = {link(n)};
+              begin = end;
+          };
+
+          for (const auto &s : snps) {
+              add_ref(s.pos);
+              std::vector<bool> refpop(s.gt.size());
+              for (size_t h = 0; h < s.gt.size(); ++h) refpop[h] = !s.gt[h];
+              vargas::Graph::Node r, a;
+              r.set_endpos(s.pos + 1);
+              r.set_as_ref();
+              r.set_af(1 - s.af);
+              r.set_population(refpop);
+              r.set_seq(ref.substr(s.pos, 1));
+              a.set_endpos(s.pos + 1);
+              a.set_not_ref();
+              a.set_af(s.af);
+              a.set_population(s.gt);
+              a.set_seq(std::string(1, s.alt));
+              prev = {link(r), link(a)};
+              begin = s.pos + 1;
+          }
+          add_ref(ref.size());
+          return g;
+      }
+
+      void write_fasta(const std::string &file) const {
+          std::ofstream o(file);
+          if (!o.good()) throw std::invalid_argument("Error opening file \"" + file + "\"");
+          o << '>' << CONTIG << '\n';
+          for (size_t i = 0; i < ref.size(); i += 80) o << ref.substr(i, 80) << '\n';
+      }
+
+      void write_vcf(const std::string &file) const {
+          std::ofstream o(file);
+          if (!o.good()) throw std::invalid_argument("Error opening file \"" + file + "\"");
+          o << "##fileformat=VCFv4.1\n"
+            << "##contig=<ID=" << CONTIG << ",length=" << ref.size() << ">\n"
+            << "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele Freq\">\n"
+            << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+            << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+          for (unsigned i = 0; i < haplotypes / 2; ++i) o << "\ts" << i;
+          o << '\n';
+          for (const auto &s : snps) {
+              o << CONTIG << '\t' << s.pos + 1 << "\t.\t" << ref[s.pos] << '\t' << s.alt << "\t99\t.\tAF=" << s.af << "\tGT";
+              for (size_t h = 0; h < s.gt.size(); h += 2) o << '\t' << s.gt[h] << '|' << s.gt[h + 1];
+              o << '\n';
+          }
+      }
+  };
+
+  constexpr const char *Synthetic::CONTIG;
+
+  struct Params {
+      size_t length = 100000, reads = 1024;
+      double density = 0.01;
+      unsigned rlen = 100, samples = 8;
+      uint64_t seed = 1;
+      std::vector<unsigned> threads{1};
+      std::vector<vargas::ISA> isas;
+      std::string tmp = "vargas_bench";
+      std::ostream *log = &std::cerr; // Progress lines
+  };
+
+  /**
+   * @return Peak resident set size of the process in KiB
+   */
+  long peak_rss_kb() {
+      rusage ru;
+      getrusage(RUSAGE_SELF, &ru);
+      return ru.ru_maxrss;
+  }
+
+  template<typename F>
+  double timed(F &&f) {
+      const auto start = std::chrono::steady_clock::now();
+      f();
+      return rg::chrono_duration(start);
+  }
+
+  template<typename F>
+  void for_each_call(void *data, long i, int tid) {
+      (*(F *) data)(i, tid);
+  }
+
+  /**
+   * @brief
+   * Run f(i, tid) for i in [0, n) over the pool.
+   */
+  template<typename F>
+  void parallel_for(rg::ForPool &fp, long n, F &f) {
+      fp.forpool(&for_each_call<F>, (void *) &f, n);
+  }
+
+  /**
+   * @brief
+   * Simulate reads over threads, each batch from its own stream so the reads do not depend on the thread count.
+   */
+  std::vector<vargas::SAM::Record>
+  simulate(const vargas::Graph &g, const Params &p, unsigned threads) {
+      static constexpr size_t BATCH = 256;
+      vargas::Sim::Profile prof;
+      prof.len = p.rlen;
+      prof.mut = 2;
+      prof.indel = 1;
+      const long nbatch = (p.reads + BATCH - 1) / BATCH;
+      std::vector<std::vector<vargas::SAM::Record>> batches(nbatch);
+      std::vector<std::unique_ptr<vargas::Sim>> sims(threads);
+      auto f = [&](long i, int tid) {
+          if (!sims[tid]) sims[tid].reset(new vargas::Sim(g, prof, p.seed));
+          sims[tid]->seed(p.seed, i);
+          batches[i] = sims[tid]->get_batch(std::min(BATCH, p.reads - i * BATCH), vargas::coordinate_resolver());
+      };
+      rg::ForPool fp(threads);
+      parallel_for(fp, nbatch, f);
+      std::vector<vargas::SAM::Record> ret;
+      for (auto &b : batches) {
+          for (auto &r : b) {
+              r.ref_name = Synthetic::CONTIG;
+              r.query_name = "r" + std::to_string(ret.size());
+              ret.push_back(std::move(r));
+          }
+      }
+      return ret;
+  }
+
+  void bench_kernels(rg::JsonWriter &json, const vargas::Graph &g, const std::vector<vargas::SAM::Record> &reads,
+                     const Params &p) {
+      const vargas::CompiledGraph cg(g);
+      uint64_t graph_len = 0;
+      for (auto it = g.begin(); it != g.end(); ++it) graph_len += it->length();
+      const unsigned max_threads = *std::max_element(p.threads.begin(), p.threads.end());
+      // Insertion errors can make reads longer than rlen
+      size_t max_len = 0, bases = 0;
+      for (const auto &r : reads) {
+          max_len = std::max(max_len, r.seq.size());
+          bases += r.seq.size();
+      }
+
+      json.begin_array("kernels");
+      for (const auto isa : p.isas) {
+          for (const bool ete : {false, true}) {
+              for (const bool wide : {false, true}) {
+                  for (const int mode : {0, 1, 2}) {
+                      const bool msonly = mode == 1, maxonly = mode == 2;
+                      vargas::ScoreProfile prof;
+                      prof.end_to_end = ete;
+                      std::vector<std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>> aligners;
+                      for (unsigned t = 0; t < max_threads; ++t) {
+                          aligners.push_back(make_aligner(prof, max_len, wide, msonly, maxonly, isa));
+                      }
+                      const unsigned cap = aligners[0]->capacity();
+                      std::vector<std::vector<std::string>> batches;
+                      for (size_t i = 0; i < reads.size(); ++i) {
+                          if (i % cap == 0) batches.emplace_back();
+                          batches.back().push_back(reads[i].seq);
+                      }
+                      const double cells = double(bases) * graph_len;
+
+                      *p.log << isa_name(isa) << (wide ? " 16" : " 8") << "-bit " << (ete ? "ete" : "local")
+                                << (msonly ? " msonly" : maxonly ? " maxonly" : "") << ":" << std::flush;
+                      json.begin()
+                      .value("isa", isa_name(isa))
+                      .value("bits", wide ? 16 : 8)
+                      .value("mode", ete ? "ete" : "local")
+                      .value("report", msonly ? "msonly" : maxonly ? "maxonly" : "full")
+                      .value("capacity", cap)
+                      .value("adaptive", !wide && !ete && max_len * prof.match > 255)
+                      .value("saturates", !wide && ete && use_wide_scores(prof, max_len))
+                      .value("cells", cells)
+                      .begin_array("scaling");
+                      double base = 0;
+                      for (const unsigned threads : p.threads) {
+                          std::vector<vargas::Results> results(threads);
+                          auto f = [&](long i, int tid) {
+                              aligners[tid]->align_into(batches[i], {}, cg, results[tid], true);
+                          };
+                          rg::ForPool fp(threads);
+                          const double s = timed([&] { parallel_for(fp, batches.size(), f); });
+                          if (base == 0) base = s;
+                          *p.log << ' ' << threads << "t " << cells / s / 1e9 << " GCUPS" << std::flush;
+                          json.begin()
+                          .value("threads", threads)
+                          .value("seconds", s)
+                          .value("gcups", cells / s / 1e9)
+                          .value("reads_per_s", reads.size() / s)
+                          .value("speedup", base / s)
+                          .end();
+                      }
+                      *p.log << '\n';
+                      json.end().value("peak_rss_kb", peak_rss_kb()).end();
+                  }
+              }
+          }
+      }
+      json.end();
+  }
+
+  void bench_graph(rg::JsonWriter &json, const Synthetic &syn, const Params &p) {
+      const std::string fasta = p.tmp + ".fa", vcf = p.tmp + ".vcf", text = p.tmp + ".gdef", binary = p.tmp + ".gdf";
+      syn.write_fasta(fasta);
+      syn.write_vcf(vcf);
+
+      vargas::GraphMan gm;
+      gm.set_threads(*std::max_element(p.threads.begin(), p.threads.end()));
+      *p.log << "Graph build..." << std::flush;
+      const double build = timed([&] { gm.create_base(fasta, vcf); });
+      const auto stat = gm.at("base")->statistics();
+      const double write_text = timed([&] { gm.write(text, false); });
+      const double write_binary = timed([&] { gm.write(binary, true); });
+      auto open = [&](const std::string &file) {
+          return timed([&] {
+              vargas::GraphMan in(file);
+              in.at("base");
+          });
+      };
+      const double open_text = open(text), open_binary = open(binary);
+      *p.log << ' ' << build << " s\n";
+
+      json.begin("graph")
+      .value("nodes", stat.num_nodes)
+      .value("bases", stat.total_length)
+      .value("build_s", build)
+      .value("write_text_s", write_text)
+      .value("open_text_s", open_text)
+      .value("write_binary_s", write_binary)
+      .value("open_binary_s", open_binary)
+      .value("peak_rss_kb", peak_rss_kb())
+      .end();
+
+      for (const auto &f : {fasta, fasta + ".fai", vcf, text, binary}) remove(f.c_str());
+  }
+
+  void bench_sim(rg::JsonWriter &json, const vargas::Graph &g, const Params &p) {
+      json.begin("sim").value("reads", p.reads).begin_array("scaling");
+      double base = 0;
+      for (const unsigned threads : p.threads) {
+          size_t n = 0;
+          const double s = timed([&] { n = simulate(g, p, threads).size(); });
+          if (base == 0) base = s;
+          json.begin()
+          .value("threads", threads)
+          .value("seconds", s)
+          .value("reads_per_s", n / s)
+          .value("speedup", base / s)
+          .end();
+      }
+      json.end().value("peak_rss_kb", peak_rss_kb()).end();
+  }
+
+  void bench_sam(rg::JsonWriter &json, const std::vector<vargas::SAM::Record> &reads, const Params &p,
+                 vargas::SAM::Format fmt) {
+      const bool text = fmt == vargas::SAM::Format::SAM;
+      const std::string file = p.tmp + (text ? ".sam" : ".bam");
+      vargas::SAM::Header hdr;
+      vargas::SAM::Header::Sequence sq;
+      sq.name = Synthetic::CONTIG;
+      sq.len = p.length;
+      hdr.add(sq);
+
+      const double write = timed([&] {
+          vargas::osam out(file, hdr, fmt);
+          if (!out.good()) throw std::invalid_argument("Error opening output file \"" + file + "\"");
+          std::string buff;
+          out.serialize(reads, buff);
+          out.write_chunk(std::move(buff));
+          out.close();
+      });
+      size_t n = 0;
+      const double read = timed([&] {
+          vargas::isam in(file);
+          if (!in.good()) throw std::invalid_argument("Error opening file \"" + file + "\"");
+          do ++n; while (in.next());
+      });
+      remove(file.c_str());
+
+      json.begin(text ? "sam" : "bam")
+      .value("records", n)
+      .value("write_s", write)
+      .value("write_records_per_s", reads.size() / write)
+      .value("read_s", read)
+      .value("read_records_per_s", n / read)
+      .value("peak_rss_kb", peak_rss_kb())
+      .end();
+  }
+
+  void run(std::ostream &os, const Params &p, const std::vector<std::string> &suites) {
+      auto has = [&](const std::string &s) { return std::find(suites.begin(), suites.end(), s) != suites.end(); };
+      rg::JsonWriter json(os);
+      json.begin()
+      .value("version", VARGAS_VERSION)
+      .value("host_isa", isa_name(host_isa()))
+      .begin("params")
+      .value("length", p.length)
+      .value("density", p.density)
+      .value("rlen", p.rlen)
+      .value("reads", p.reads)
+      .value("samples", p.samples)
+      .value("seed", p.seed)
+      .end();
+
+      const Synthetic syn(p.length, p.density, p.samples, p.seed);
+      const vargas::Graph g = syn.graph();
+      std::vector<vargas::SAM::Record> reads;
+      if (has("kernel") || has("sam") || has("bam")) reads = simulate(g, p, p.threads.back());
+
+      if (has("kernel")) bench_kernels(json, g, reads, p);
+      if (has("graph")) bench_graph(json, syn, p);
+      if (has("sim")) bench_sim(json, g, p);
+      if (has("sam")) bench_sam(json, reads, p, vargas::SAM::Format::SAM);
+      if (has("bam")) bench_sam(json, reads, p, vargas::SAM::Format::BAM);
+      json.value("peak_rss_kb", peak_rss_kb()).end();
+      os << std::endl;
+  }
+}
+
+int bench_main(int argc, char *argv[]) {
+    Params p;
+    std::string threads, isas, suites, out_file;
+
+    cxxopts::Options opts("vargas bench", "Benchmark kernels, graph construction, simulation, and I/O.");
+    try {
+        opts.add_options("Synthetic data")
+        ("L,length", "<N> Reference length.", cxxopts::value(p.length)->default_value("100000"))
+        ("d,density", "<F> SNPs per base.", cxxopts::value(p.density)->default_value("0.01"))
+        ("p,samples", "<N> Number of samples.", cxxopts::value(p.samples)->default_value("8"))
+        ("l,rlen", "<N> Read length.", cxxopts::value(p.rlen)->default_value("100"))
+        ("n,numreads", "<N> Number of reads.", cxxopts::value(p.reads)->default_value("1024"))
+        ("r,seed", "<N> Random seed.", cxxopts::value(p.seed)->default_value("1"));
+
+        opts.add_options("Optional")
+        ("s,suite", "<S1,...> Suites to run: kernel, graph, sim, sam, bam. (default: all)", cxxopts::value(suites))
+        ("a,isa", "<I1,...> Kernels to run: sse4.1, avx2, avx512bw. (default: all supported)", cxxopts::value(isas))
+        ("j,threads", "<N1,...> Thread counts for scaling curves.", cxxopts::value(threads)->default_value("1"))
+        ("t,out", "<str> JSON output file. (default: stdout)", cxxopts::value(out_file))
+        ("tmp", "<str> Prefix of temporary files.", cxxopts::value(p.tmp)->default_value("vargas_bench"));
+
+        opts.add_options()("h,help", "Display this message.");
+        opts.parse(argc, argv);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << '\n';
+        throw std::invalid_argument("Error parsing options: " + std::string(e.what())); }
+    if (opts.count("h")) {
+        bench_help(opts);
+        return 0;
+    }
+
+    if (p.length == 0 || p.rlen == 0 || p.reads == 0) throw std::invalid_argument("Length, read length, and number of reads must be positive.");
+    if (p.samples == 0) throw std::invalid_argument("At least one sample is required.");
+    if (rg::split(threads, ',').empty()) throw std::invalid_argument("At least one thread count is required.");
+
+    p.threads.clear();
+    for (const auto &t : rg::split(threads, ',')) {
+        const int n = std::stoi(t);
+        if (n < 1) throw std::invalid_argument("Invalid thread count: " + t);
+        p.threads.push_back(n);
+    }
+    if (isas.empty()) {
+        for (const auto isa : {vargas::ISA::SSE41, vargas::ISA::AVX2, vargas::ISA::AVX512BW}) {
+            if (isa_built(isa) && isa <= host_isa()) p.isas.push_back(isa);
+        }
+    } else {
+        for (const auto &i : rg::split(isas, ',')) p.isas.push_back(parse_isa(i));
+    }
+    std::vector<std::string> suite_list = suites.empty() ?
+                                          std::vector<std::string>{"kernel", "graph", "sim", "sam", "bam"} :
+                                          rg::split(suites, ',');
+    for (const auto &s : suite_list) {
+        if (s != "kernel" && s != "graph" && s != "sim" && s != "sam" && s != "bam") {
+            throw std::invalid_argument("Unknown suite \"" + s + "\".");
+        }
+    }
+
+    if (out_file.empty()) run(std::cout, p, suite_list);
+    else {
+        std::ofstream out(out_file);
+        if (!out.good()) throw std::invalid_argument("Error opening output file \"" + out_file + "\"");
+        run(out, p, suite_list);
+    }
+    return 0;
+}
+
+void bench_help(const cxxopts::Options &opts) {
+    using std::cerr;
+    using std::endl;
+    cerr << opts.help(opts.groups()) << "\n\n"
+         << "GCUPS counts read length x graph bases cells per read, forward strand only.\n"
+         << "Peak RSS is the process maximum after each benchmark.\n" << endl;
+}
+
+TEST_SUITE("Bench");
+
+TEST_CASE ("Synthetic benchmark data") {
+    vargas::Graph::Node::_newID = 0;
+    const Synthetic syn(2000, 0.05, 2, 3);
+    CHECK(syn.ref.size() == 2000);
+    REQUIRE(!syn.snps.empty());
+    for (size_t i = 1; i < syn.snps.size(); ++i) CHECK(syn.snps[i].pos > syn.snps[i - 1].pos + 1);
+
+    const auto g = syn.graph();
+    CHECK(g.pop_size() == 4);
+    // A ref and alt node per SNP, and the reference between them
+    CHECK(g.node_map()->size() == 3 * syn.snps.size() + (syn.snps.back().pos + 1 < 2000));
+
+    // Same seed, same data
+    CHECK(Synthetic(2000, 0.05, 2, 3).ref == syn.ref);
+    CHECK(Synthetic(2000, 0.05, 2, 4).ref != syn.ref);
+
+    Params p;
+    p.length = 2000;
+    p.reads = 300;
+    p.rlen = 50;
+    p.seed = 3;
+    auto a = simulate(g, p, 1), b = simulate(g, p, 2);
+    REQUIRE(a.size() == 300);
+    REQUIRE(b.size() == 300);
+    for (size_t i = 0; i < a.size(); ++i) CHECK(a[i].seq == b[i].seq);
+
+    p.isas = {vargas::ISA::SSE41};
+    p.threads = {1, 2};
+    std::ostringstream ss, log;
+    p.tmp = "tmp_bench";
+    p.log = &log;
+    run(ss, p, {"kernel", "sim", "sam"});
+    const std::string out = ss.str();
+    CHECK(log.str().find("sse4.1 8-bit local: 1t ") == 0);
+    CHECK(out.find("\"gcups\":") != std::string::npos);
+    CHECK(out.find("\"report\":\"maxonly\"") != std::string::npos);
+    CHECK(out.find("\"sim\":{") != std::string::npos);
+    CHECK(out.find("\"sam\":{\"records\":300,") != std::string::npos);
+    CHECK(out.find("\"graph\"") == std::string::npos);
+}
+
+TEST_SUITE_END();
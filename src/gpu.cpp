@@ -0,0 +1,447 @@
+/**
+ * @brief
+ * Host side of the GPU aligner backend: graph flattening, read packing, and the aligner.
+ *
+ * @details
+ * The CUDA launcher, gpu::Stream, is in src/aligner_cuda.cu and only built with -DBUILD_CUDA=ON, which
+ * defines VA_KERNEL_CUDA. Without it the stream reports that the backend was not built.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "gpu.h"
+#include "align_main.h"
+#include "alignment.h"
+
+vargas::gpu::FlatGraph::FlatGraph(const CompiledGraph &g) :
+seq(g.length()), seq_off(g.size() + 1, 0), end_pos(g.size()), pred_off(g.size() + 1, 0), slot(g.size(), -1) {
+    if (g.size()) std::copy(g.seq(0), g.seq(0) + g.length(), seq.begin());
+    std::vector<uint32_t> free_slots, node_slot(g.size()), pending(g.size());
+    for (size_t n = 0; n < g.size(); ++n) {
+        seq_off[n + 1] = seq_off[n] + g.seq_len(n);
+        end_pos[n] = g.end_pos(n);
+        for (auto p = g.pred_begin(n); p != g.pred_end(n); ++p) pred_slot.push_back(node_slot[*p]);
+        pred_off[n + 1] = pred_slot.size();
+
+        // Slots are taken before the predecessors' are released, as in AlignerT::_fill_graph()
+        if (g.num_succ(n)) {
+            if (free_slots.empty()) free_slots.push_back(slots++);
+            slot[n] = free_slots.back();
+            free_slots.pop_back();
+        }
+        for (auto p = g.pred_begin(n); p != g.pred_end(n); ++p) {
+            if (--pending[*p] == 0) free_slots.push_back(node_slot[*p]);
+        }
+        if (slot[n] >= 0) {
+            node_slot[n] = slot[n];
+            pending[n] = g.num_succ(n);
+        }
+    }
+}
+
+vargas::gpu::GraphView vargas::gpu::FlatGraph::view() const {
+    GraphView ret;
+    ret.seq = seq.data();
+    ret.seq_off = seq_off.data();
+    ret.end_pos = end_pos.data();
+    ret.pred_off = pred_off.data();
+    ret.pred_slot = pred_slot.data();
+    ret.slot = slot.data();
+    ret.nodes = end_pos.size();
+    ret.slots = slots;
+    return ret;
+}
+
+uint64_t vargas::gpu::fingerprint(const CompiledGraph &g) {
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](uint64_t x) {
+        for (unsigned b = 0; b < 8; ++b, x >>= 8) {
+            h ^= x & 0xFF;
+            h *= 1099511628211ULL;
+        }
+    };
+    mix(g.size());
+    mix(g.length());
+    for (size_t i = 0; i < g.length(); ++i) {
+        h ^= g.seq(0)[i];
+        h *= 1099511628211ULL;
+    }
+    for (size_t n = 0; n < g.size(); ++n) {
+        mix(uint64_t(g.end_pos(n)) << 32 | g.seq_len(n));
+        mix(g.num_pred(n));
+        for (auto p = g.pred_begin(n); p != g.pred_end(n); ++p) mix(*p);
+    }
+    return h;
+}
+
+vargas::gpu::Config vargas::gpu::config(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly) {
+    Config ret;
+    ret.end_to_end = prof.end_to_end;
+    ret.msonly = msonly;
+    const size_t range = read_len * prof.match;
+    if (prof.end_to_end) {
+        if (!use_wide && diff_scores(prof, read_len)) ret.cells = Cells::EXACT;
+        else ret.cells = use_wide ? Cells::WIDE : Cells::NARROW;
+        if ((ret.cells == Cells::NARROW && range > unsigned(Cell<int8_t>::max - Cell<int8_t>::min)) ||
+            (ret.cells == Cells::WIDE && range > unsigned(Cell<int16_t>::max - Cell<int16_t>::min))) {
+            throw std::domain_error("Insufficient bit-width for given match score and read length.");
+        }
+    } else {
+        if (use_wide) ret.cells = Cells::WIDE;
+        else if (range > unsigned(Cell<int8_t>::max - Cell<int8_t>::min)) ret.cells = Cells::ADAPTIVE;
+        else ret.cells = Cells::NARROW;
+    }
+    return ret;
+}
+
+vargas::gpu::Params vargas::gpu::params(const ScoreProfile &prof, size_t read_len) {
+    Params ret;
+    ret.match = prof.match;
+    ret.ambig = prof.ambig;
+    ret.read_gext = prof.read_gext;
+    ret.read_goe = prof.read_gopen + prof.read_gext;
+    ret.ref_gopen = prof.ref_gopen;
+    ret.ref_gext = prof.ref_gext;
+    ret.ref_goe = prof.ref_gopen + prof.ref_gext;
+    ret.read_len = read_len;
+    return ret;
+}
+
+size_t vargas::gpu::work_bytes(const Config &c, size_t read_len, uint32_t slots, size_t n) {
+    size_t cell;
+    switch (c.cells) {
+        case Cells::NARROW: cell = 1; break;
+        case Cells::EXACT: cell = 4; break;
+        default: cell = 2; // Adaptive realigns in the same buffer
+    }
+    return (2 + 2 * size_t(slots)) * (read_len + 1) * n * cell;
+}
+
+void vargas::gpu::pack_reads(const EncodedReads &reads, const ScoreProfile &prof, size_t read_len,
+                             std::vector<uint8_t> &base, std::vector<uint8_t> &mismatch) {
+    const size_t n = reads.size();
+    base.assign(2 * read_len * n, VA_GPU_PAD);
+    mismatch.assign(2 * read_len * n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        const rg::Base *seq = reads.seq(i);
+        const char *qual = reads.qual(i);
+        const size_t len = reads.length(i), pad = read_len - len;
+        for (size_t p = 0; p < len; ++p) {
+            // Short reads are prepended with padding rows on both strands, as in AlignmentGroup
+            const size_t fwd = (pad + p) * n + i, rev = (read_len + pad + p) * n + i, q = len - 1 - p;
+            base[fwd] = seq[p];
+            mismatch[fwd] = qual ? prof.penalty(qual[p]) : prof.mismatch_max;
+            base[rev] = rg::complement_b(seq[q]);
+            mismatch[rev] = qual ? prof.penalty(qual[q]) : prof.mismatch_max;
+        }
+    }
+}
+
+void vargas::gpu::scatter(const std::vector<Out> &out, const Config &c, const ScoreProfile &prof, Results &aligns) {
+    aligns.resize(out.size());
+    for (size_t i = 0; i < out.size(); ++i) {
+        const Out &o = out[i];
+        aligns.max_score[i] = o.max_score;
+        aligns.max_strand[i] = o.max_strand ? Strand::REV : Strand::FWD;
+        aligns.sub_strand[i] = o.sub_strand ? Strand::REV : Strand::FWD;
+        if (c.msonly) continue;
+        aligns.sub_score[i] = o.sub_score;
+        aligns.max_pos[i] = o.max_pos;
+        aligns.sub_pos[i] = o.sub_pos;
+        aligns.max_last_pos[i] = o.max_last_pos;
+        aligns.sub_last_pos[i] = o.sub_last_pos;
+        aligns.waiting_pos[i] = o.waiting_pos;
+        aligns.waiting_last_pos[i] = o.waiting_last_pos;
+        aligns.max_count[i] = o.max_count;
+        aligns.sub_count[i] = o.sub_count;
+    }
+    aligns.profile = prof;
+}
+
+void vargas::gpu::align_reference(const Config &c, const ScoreProfile &prof, size_t read_len,
+                                  const EncodedReads &reads, const CompiledGraph &graph, Results &aligns,
+                                  bool fwdonly) {
+    const FlatGraph flat(graph);
+    std::vector<uint8_t> base, mismatch;
+    pack_reads(reads, prof, read_len, base, mismatch);
+    std::vector<uint32_t> work((work_bytes(c, read_len, flat.slots, reads.size()) + 3) / 4);
+    std::vector<Out> out(reads.size());
+
+    Job job;
+    job.g = flat.view();
+    job.base = base.data();
+    job.mismatch = mismatch.data();
+    job.work = work.data();
+    job.out = out.data();
+    job.p = params(prof, read_len);
+    job.n = reads.size();
+    job.fwdonly = fwdonly;
+    for (uint32_t i = 0; i < job.n; ++i) align_read(c, job, i);
+    scatter(out, c, prof, aligns);
+}
+
+namespace {
+  /**
+   * @brief
+   * Aligner that runs each batch as one kernel launch on a CUDA stream.
+   * @details
+   * Each thread of the launch aligns one read to the whole graph, with the cells of the SIMD aligner
+   * make_aligner() picks for the same parameters, so results are identical. Graph sets are aligned to
+   * each graph in turn, and graphs are uploaded to the device once.
+   */
+  class GpuAligner: public vargas::AlignerBase {
+    public:
+      GpuAligner(const vargas::ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, int device) :
+      _stream(device), _read_len(read_len), _use_wide(use_wide), _msonly(msonly) {
+          set_scores(prof); // May throw
+      }
+
+      void set_scores(const vargas::ScoreProfile &prof) override {
+          _cfg = vargas::gpu::config(prof, _read_len, _use_wide, _msonly);
+          _params = vargas::gpu::params(prof, _read_len);
+          _prof = prof;
+      }
+
+      using AlignerBase::align_into;
+
+      void align_into(const vargas::EncodedReads &reads, const vargas::CompiledGraph &graph, vargas::Results &aligns,
+                      bool fwdonly) override {
+          _out.resize(reads.size());
+          if (reads.size()) {
+              const uint64_t key = vargas::gpu::fingerprint(graph);
+              if (!_stream.cached(key)) _stream.upload(key, vargas::gpu::FlatGraph(graph));
+              vargas::gpu::pack_reads(reads, _prof, _read_len, _base, _mismatch);
+
+              vargas::gpu::Job job;
+              job.base = _base.data();
+              job.mismatch = _mismatch.data();
+              job.out = _out.data();
+              job.p = _params;
+              job.n = reads.size();
+              job.fwdonly = fwdonly;
+              _stream.run(_cfg, key, job);
+
+              const unsigned passes = fwdonly ? 1 : 2;
+              _stats.cells += uint64_t(graph.length()) * _read_len * reads.size() * passes;
+              _stats.groups += passes * ((reads.size() + capacity() - 1) / capacity());
+          }
+          vargas::gpu::scatter(_out, _cfg, _prof, aligns);
+      }
+
+      void align_into(const vargas::EncodedReads &reads, const vargas::CompiledGraphSet &set,
+                      std::vector<vargas::Results> &aligns, bool fwdonly) override {
+          aligns.resize(set.size());
+          for (size_t t = 0; t < set.size(); ++t) align_into(reads, set.graph(t), aligns[t], fwdonly);
+      }
+
+      /**
+       * @brief
+       * A launch holds every read of the batch, so k is only checked.
+       */
+      void set_groups_per_pass(unsigned k) override {
+          if (k == 0) throw std::invalid_argument("At least one read group per graph pass is required.");
+          _groups_per_pass = k;
+      }
+
+      unsigned groups_per_pass() const override { return _groups_per_pass; }
+
+      void set_threads(unsigned t) override {
+          if (t == 0) throw std::invalid_argument("At least one thread is required.");
+      }
+
+      /**
+       * @return Reads aligned per warp
+       */
+      unsigned capacity() const override { return 32; }
+
+      vargas::AlignerStats stats() const override { return _stats; }
+
+    private:
+      vargas::gpu::Stream _stream;
+      vargas::gpu::Config _cfg;
+      vargas::gpu::Params _params;
+      const size_t _read_len;
+      const bool _use_wide, _msonly;
+      unsigned _groups_per_pass = 1;
+      std::vector<uint8_t> _base, _mismatch;
+      std::vector<vargas::gpu::Out> _out;
+      vargas::AlignerStats _stats;
+  };
+}
+
+std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter>
+vargas::gpu::make_aligner(const ScoreProfile &prof, size_t read_len, bool use_wide, bool msonly, int device) {
+    void *ptr = std::malloc(sizeof(GpuAligner));
+    if (!ptr) throw std::bad_alloc();
+    try {
+        return std::unique_ptr<AlignerBase, AlignerDeleter>(new(ptr) GpuAligner(prof, read_len, use_wide, msonly, device));
+    } catch (...) {
+        std::free(ptr);
+        throw;
+    }
+}
+
+#ifndef VA_KERNEL_CUDA
+
+struct vargas::gpu::Stream::Impl {};
+
+vargas::gpu::Stream::Stream(int) {
+    throw std::invalid_argument("GPU aligner not built, see BUILD_CUDA.");
+}
+
+vargas::gpu::Stream::~Stream() = default;
+
+bool vargas::gpu::Stream::cached(uint64_t) const { return false; }
+
+void vargas::gpu::Stream::upload(uint64_t, const FlatGraph &) {}
+
+void vargas::gpu::Stream::run(const Config &, uint64_t, const Job &) {}
+
+bool vargas::gpu::built() { return false; }
+
+int vargas::gpu::devices() { return 0; }
+
+#endif
+
+TEST_SUITE("GPU");
+
+TEST_CASE("Flat graph") {
+    // AAA -> {CCC, GGG, deletion} -> TTTA
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    auto add = [&g](unsigned end_pos, const std::string &seq) {
+        vargas::Graph::Node n;
+        n.set_endpos(end_pos);
+        n.set_seq(seq);
+        g.add_node(n);
+    };
+    add(2, "AAA");
+    add(5, "CCC");
+    add(5, "GGG");
+    add(2, "");
+    add(9, "TTTA");
+    g.add_edge(0, 1);
+    g.add_edge(0, 2);
+    g.add_edge(0, 3);
+    g.add_edge(1, 4);
+    g.add_edge(2, 4);
+    g.add_edge(3, 4);
+
+    vargas::CompiledGraph cg(g.begin(), g.end());
+    vargas::gpu::FlatGraph flat(cg);
+    REQUIRE(flat.end_pos.size() == cg.size());
+    CHECK(flat.seq_off.back() == cg.length());
+    CHECK(flat.pred_off.back() == 6);
+    // The source holds a slot until its three successors are filled, each of which holds one
+    CHECK(flat.slots == 4);
+    CHECK(flat.slot[cg.size() - 1] == -1);
+    CHECK(vargas::gpu::fingerprint(cg) == vargas::gpu::fingerprint(vargas::CompiledGraph(g.begin(), g.end())));
+
+#ifdef VA_KERNEL_CUDA
+    CHECK(vargas::gpu::built());
+    CHECK_THROWS(vargas::gpu::make_aligner(vargas::ScoreProfile(), 10, false, false, vargas::gpu::devices()));
+#else
+    CHECK(!vargas::gpu::built());
+    CHECK(vargas::gpu::devices() == 0);
+    CHECK_THROWS(vargas::gpu::make_aligner(vargas::ScoreProfile(), 10, false, false, 0));
+#endif
+}
+
+TEST_CASE("GPU kernel reference") {
+    // Bubbles with a deletion and a repeat, aligned with every cell type the SIMD aligners use
+    vargas::Graph::Node::_newID = 0;
+    vargas::Graph g;
+    std::string ref;
+    unsigned x = 9;
+    while (ref.size() < 900) {
+        x = x * 1103515245 + 12345;
+        ref += "ACGT"[(x >> 16) % 4];
+        if (ref.size() == 500) ref += ref.substr(100, 120);
+    }
+    std::vector<unsigned> tails;
+    for (size_t pos = 0; pos + 100 <= ref.size(); pos += 100) {
+        vargas::Graph::Node n;
+        n.set_endpos(pos + 98);
+        n.set_seq(ref.substr(pos, 99));
+        g.add_node(n);
+        for (auto t : tails) g.add_edge(t, n.id());
+        tails.clear();
+        for (const int alt : {0, 1, 2}) {
+            vargas::Graph::Node b;
+            b.set_endpos(pos + 99);
+            if (alt == 0) b.set_seq(ref.substr(pos + 99, 1));
+            else if (alt == 1) b.set_seq(std::string(ref[pos + 99] == 'A' ? "C" : "A"));
+            else if (pos % 200 == 0) b.set_seq("");
+            else continue;
+            if (alt == 0) b.set_as_ref();
+            else b.set_not_ref();
+            g.add_node(b);
+            g.add_edge(n.id(), b.id());
+            tails.push_back(b.id());
+        }
+    }
+    vargas::CompiledGraph cg(g.begin(), g.end());
+
+    for (const size_t len : {40, 150}) {
+        vargas::EncodedReads reads;
+        for (size_t i = 0; i + len <= ref.size(); i += 29) {
+            std::string r = ref.substr(i, len);
+            if (i % 2) r[i % len] = r[i % len] == 'G' ? 'T' : 'G';
+            if (i % 3 == 0) r.erase(len / 3, 2);
+            if (i % 4 == 0) r = rg::reverse_complement(r);
+            std::vector<char> qual;
+            if (i % 5 == 0) for (size_t q = 0; q < r.size(); ++q) qual.push_back(char(q % 41));
+            reads.push_back(r, qual);
+        }
+        reads.push_back(ref.substr(120, len / 2), std::vector<char>());
+        reads.push_back(std::string(len, 'N'), std::vector<char>());
+
+        for (const bool ete : {false, true}) {
+            for (const bool wide : {false, true}) {
+                for (const bool msonly : {false, true}) {
+                    vargas::ScoreProfile prof(2, 6, 5, 3);
+                    prof.mismatch_min = 2;
+                    prof.ambig = 1;
+                    prof.end_to_end = ete;
+                    const auto cfg = vargas::gpu::config(prof, len, wide, msonly);
+                    auto cpu = make_aligner(prof, len, wide, msonly, false, vargas::ISA::SSE41);
+                    // CUDA builds with a device also check the device against the SIMD aligner
+                    std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter> gpu;
+                    if (vargas::gpu::devices() > 0) gpu = vargas::gpu::make_aligner(prof, len, wide, msonly, 0);
+                    for (const bool fwdonly : {true, false}) {
+                        vargas::Results expected, res;
+                        cpu->align_into(reads, cg, expected, fwdonly);
+                        auto check = [&]() {
+                            REQUIRE(res.size() == reads.size());
+                            for (size_t i = 0; i < reads.size(); ++i) {
+                                CHECK(res.max_score[i] == expected.max_score[i]);
+                                CHECK(res.max_strand[i] == expected.max_strand[i]);
+                                if (msonly) continue;
+                                CHECK(res.max_pos[i] == expected.max_pos[i]);
+                                CHECK(res.max_last_pos[i] == expected.max_last_pos[i]);
+                                CHECK(res.max_count[i] == expected.max_count[i]);
+                                CHECK(res.sub_count[i] == expected.sub_count[i]);
+                                CHECK(res.sub_pos[i] == expected.sub_pos[i]);
+                                CHECK(res.sub_strand[i] == expected.sub_strand[i]);
+                                CHECK(res.waiting_pos[i] == expected.waiting_pos[i]);
+                                if (cfg.cells != vargas::gpu::Cells::EXACT || expected.sub_count[i]) {
+                                    CHECK(res.sub_score[i] == expected.sub_score[i]);
+                                }
+                            }
+                        };
+                        vargas::gpu::align_reference(cfg, prof, len, reads, cg, res, fwdonly);
+                        check();
+                        if (gpu) {
+                            gpu->align_into(reads, cg, res, fwdonly);
+                            check();
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -20,7 +20,7 @@
 #include "graph.h"
 
 
-unsigned vargas::Graph::Node::_newID = 0;
+std::atomic<unsigned> vargas::Graph::Node::_newID(0);
 
 
 vargas::Graph::Graph(const std::string &ref_file, const std::string &vcf_file, const std::string &region) {
@@ -39,11 +39,10 @@ vargas::Graph::Graph(const vargas::Graph &g, const Population &filter) {
 
     // Add all nodes
     std::unordered_set<unsigned> includedNodes;
-    for (auto &nid : g._add_order) {
-        auto &n = (*_IDMap)[nid];
+    for (auto &n : g) {
         if (n.belongs(filter)) {
-            includedNodes.insert(nid);
-            _add_order.push_back(nid);
+            includedNodes.insert(n.id());
+            _add_order.push_back(n.id());
         }
     }
 
@@ -51,6 +50,15 @@ vargas::Graph::Graph(const vargas::Graph &g, const Population &filter) {
 }
 
 
+vargas::Graph::Graph(std::shared_ptr<const Graph> parent, const Population &filter) {
+    if (!parent) throw std::invalid_argument("Graph view needs a parent graph.");
+    _IDMap = parent->_IDMap;
+    _pop_size = parent->pop_size();
+    _filter = filter;
+    _parent = std::move(parent);
+}
+
+
 vargas::Graph::Graph(const Graph &g, Type type) {
     _IDMap = g._IDMap;
     _pop_size = g.pop_size();
@@ -59,34 +67,36 @@ vargas::Graph::Graph(const Graph &g, Type type) {
     std::unordered_set<unsigned> includedNodes;
 
     if (type == Type::REF) {
-        for (auto &nid : g._add_order) {
-            auto &n = (*_IDMap)[nid];
+        for (auto &n : g) {
             if (n.is_ref()) {
-                includedNodes.insert(nid);
-                _add_order.push_back(nid);
+                includedNodes.insert(n.id());
+                _add_order.push_back(n.id());
             }
         }
     } else if (type == Type::MAXAF) {
 
         std::vector<unsigned> graphstarts;
-        for (auto id : g._add_order) {
-            if (g._prev_map.count(id) == 0) graphstarts.push_back(id);
+        for (auto gi = g.begin(); gi != g.end(); ++gi) {
+            if (gi.incoming().empty()) graphstarts.push_back(gi->id());
         }
 
+        // Edges of views are those of the source between nodes in the view
+        const auto &next = g._source()._next_map;
         for (auto start : graphstarts) {
             unsigned curr = start;
-            unsigned maxid, size;
             while (true) {
                 includedNodes.insert(curr);
                 _add_order.push_back(curr);
-                if (g._next_map.count(curr) == 0) break; // end of graph
-                maxid = g._next_map.at(curr).at(0);
-                size = g._next_map.at(curr).size();
-                for (unsigned i = 1; i < size; ++i) {
-                    const unsigned &id = g._next_map.at(curr).at(i);
-                    if (g._IDMap->at(id).freq() > g._IDMap->at(maxid).freq())
-                        maxid = id;
+                auto e = next.find(curr);
+                if (e == next.end()) break; // end of graph
+                bool found = false;
+                unsigned maxid = 0;
+                for (const unsigned id : e->second) {
+                    if (!g.contains(id)) continue;
+                    if (!found || g._IDMap->at(id).freq() > g._IDMap->at(maxid).freq()) maxid = id;
+                    found = true;
                 }
+                if (!found) break;
                 curr = maxid;
             }
         }
@@ -99,9 +109,10 @@ vargas::Graph::Graph(const Graph &g, Type type) {
 
 void vargas::Graph::_build_derived_edges(const vargas::Graph &g, const std::unordered_set<unsigned> &includedNodes) {
     // Add all edges for included nodes
+    const auto &next = g._source()._next_map;
     for (auto &n : includedNodes) {
-        if (g._next_map.count(n) == 0) continue;
-        for (auto &e : g._next_map.at(n)) {
+        if (next.count(n) == 0) continue;
+        for (auto &e : next.at(n)) {
             if (includedNodes.count(e)) {
                 add_edge(n, e);
             }
@@ -112,6 +123,7 @@ void vargas::Graph::_build_derived_edges(const vargas::Graph &g, const std::unor
 
 
 unsigned vargas::Graph::add_node(const Node &n) {
+    _check_materialized();
     if (_IDMap->find(n.id()) != _IDMap->end()) {
         throw std::invalid_argument("Duplicate node insertion.");
     }
@@ -123,6 +135,7 @@ unsigned vargas::Graph::add_node(const Node &n) {
 
 
 bool vargas::Graph::add_edge(const unsigned n1, const unsigned n2) {
+    _check_materialized();
     // Check if the nodes exist
     if (_IDMap->count(n1) == 0 || _IDMap->count(n2) == 0) return false;
 
@@ -174,6 +187,7 @@ std::string vargas::Graph::to_DOT(std::string name) const {
 void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
     if (_vf == nullptr) throw std::invalid_argument("No VCF file opened.");
     g = vargas::Graph(g.node_map());
+    _next_id = _first_id;
     _fa.open(_fa_file);
 
     auto &vf = *_vf;
@@ -191,6 +205,9 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
         }
     }
 
+    vf.set_threads(_decode_threads);
+    vf.set_prefetch(PREFETCH);
+
     rg::pos_t curr = vf.region().min; // The Graph has been built up to this position, exclusive
     std::unordered_set<unsigned> prev_unconnected; // ID's of nodes at the end of the Graph left unconnected
     std::unordered_set<unsigned> curr_unconnected; // ID's of nodes added that are unconnected
@@ -218,9 +235,9 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
             n.set_endpos(curr - 1 + pos_offset);
             n.set_seq(vf.ref());
             n.set_as_ref();
-            n.set_population(vf.allele_pop(vf.ref()));
+            n.set_population(_pops.intern(vf.allele_pop(vf.ref())));
             n.set_af(af[0]);
-            curr_unconnected.insert(g.add_node(n));
+            curr_unconnected.insert(_add_node(g, n));
         }
 
         //alt nodes
@@ -231,11 +248,11 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
             if (g.pop_size() == 1 || (pop && all_pop)) { // Only add if someone has the allele. == 1 for KSNP
                 Graph::Node n;
                 n.set_endpos(curr - 1 + pos_offset);
-                n.set_population(pop);
+                n.set_population(_pops.intern(pop));
                 n.set_seq(allele);
                 if (af.size() > i) n.set_af(af[i]);
                 n.set_not_ref();
-                curr_unconnected.insert(g.add_node(n));
+                curr_unconnected.insert(_add_node(g, n));
 
             }
         }
@@ -247,6 +264,7 @@ void vargas::GraphFactory::build(vargas::Graph &g, pos_t pos_offset) {
 
     _fa.close();
     _vf.reset();
+    _pops.clear(); // Nodes keep their sets
 }
 
 
@@ -274,7 +292,7 @@ rg::pos_t vargas::GraphFactory::_build_linear_ref(Graph &g, std::unordered_set<u
     n.set_as_ref();
     n.set_seq(_fa.subseq(_vf->region().seq_name, pos, target - 1));
     n.set_endpos(target - 1 + pos_offset);
-    curr.insert(g.add_node(n));
+    curr.insert(_add_node(g, n));
     _build_edges(g, prev, curr);
     return target;
 }
@@ -353,12 +371,13 @@ vargas::Graph vargas::Graph::subgraph(const pos_t min, const pos_t max) const {
         }
     }
 
-    // Build Edges
+    // Build Edges, nodes outside of views have no new ID
+    const auto &next_map = _source()._next_map;
     for (const auto &ids : new_to_old) {
         const auto &nid = ids.first;
         const auto &oid = ids.second;
-        if (_next_map.count(oid)) {
-            for (const auto &next : _next_map.at(oid)) {
+        if (next_map.count(oid)) {
+            for (const auto &next : next_map.at(oid)) {
                 if (old_to_new.count(next)) ret.add_edge(nid, old_to_new[next]);
             }
         }
@@ -367,6 +386,225 @@ vargas::Graph vargas::Graph::subgraph(const pos_t min, const pos_t max) const {
     return ret;
 }
 
+vargas::CompiledGraph::CompiledGraph(Graph::const_iterator begin, Graph::const_iterator end) :
+_seq_offset(1, 0), _pred_offset(1, 0) {
+    std::unordered_map<unsigned, uint32_t> index;
+    size_t total = 0;
+    for (auto gi = begin; gi != end; ++gi) {
+        index.emplace(gi->id(), _id.size());
+        _id.push_back(gi->id());
+        total += gi->seq().size();
+    }
+
+    _seq.reserve(total);
+    _seq_offset.reserve(_id.size() + 1);
+    _pred_offset.reserve(_id.size() + 1);
+    _end_pos.reserve(_id.size());
+    _max_end.reserve(_id.size());
+    _pinch.reserve(_id.size());
+    _num_succ.assign(_id.size(), 0);
+
+    uint32_t curr = 0;
+    for (auto gi = begin; gi != end; ++gi, ++curr) {
+        _seq.insert(_seq.end(), gi->seq().begin(), gi->seq().end());
+        _seq_offset.push_back(_seq.size());
+        _end_pos.push_back(gi->end_pos());
+        _max_end.push_back(_max_end.empty() ? gi->end_pos() : std::max(_max_end.back(), gi->end_pos()));
+        _pinch.push_back(gi->is_pinched());
+        for (const unsigned p : gi.incoming()) {
+            auto f = index.find(p);
+            if (f == index.end() || f->second >= curr) {
+                throw std::domain_error("Node " + std::to_string(gi->id()) + " hit before previous node "
+                                        + std::to_string(p) + ", graph is not topologically sorted.");
+            }
+            _pred.push_back(f->second);
+            ++_num_succ[f->second];
+        }
+        _pred_offset.push_back(_pred.size());
+    }
+    _own();
+}
+
+vargas::CompiledGraph::CompiledGraph(const CompiledGraph &g, const pos_t min, const pos_t max) :
+_seq_offset(1, 0), _pred_offset(1, 0) {
+    // Every node before first ends before min
+    const size_t first = std::lower_bound(g._p.max_end, g._p.max_end + g.size(), min) - g._p.max_end;
+    std::vector<uint32_t> index;
+    for (size_t i = first; i < g.size(); ++i) {
+        const long len = g.seq_len(i), begin = long(g.end_pos(i)) - len + 1;
+        if (g.is_pinched(i) && begin > long(max)) break;
+        const bool keep = g.end_pos(i) >= min && begin <= long(max);
+        index.push_back(keep ? _id.size() : UINT32_MAX);
+        if (!keep) continue;
+
+        const long lo = std::max<long>(0, long(min) - begin), hi = std::min<long>(len, long(max) - begin + 1);
+        _id.push_back(g.id(i));
+        _seq.insert(_seq.end(), g.seq(i) + lo, g.seq(i) + std::max(lo, hi));
+        _seq_offset.push_back(_seq.size());
+        _end_pos.push_back(begin + hi - 1);
+        _max_end.push_back(_max_end.empty() ? _end_pos.back() : std::max(_max_end.back(), _end_pos.back()));
+        _pinch.push_back(g.is_pinched(i));
+        _num_succ.push_back(0);
+        for (auto p = g.pred_begin(i); p != g.pred_end(i); ++p) {
+            if (*p < first || index[*p - first] == UINT32_MAX) continue;
+            _pred.push_back(index[*p - first]);
+            ++_num_succ[index[*p - first]];
+        }
+        _pred_offset.push_back(_pred.size());
+    }
+    _own();
+}
+
+vargas::CompiledGraph::CompiledGraph(const CompiledGraph &g) {
+    *this = g;
+}
+
+vargas::CompiledGraph &vargas::CompiledGraph::operator=(const CompiledGraph &g) {
+    if (this == &g) return *this;
+    const Sections &s = g._p;
+    _id.assign(s.id, s.id + s.nodes);
+    _seq.assign(s.seq, s.seq + s.length);
+    _seq_offset.assign(s.seq_offset, s.seq_offset + s.nodes + 1);
+    _pred_offset.assign(s.pred_offset, s.pred_offset + s.nodes + 1);
+    _pred.assign(s.pred, s.pred + s.edges);
+    _num_succ.assign(s.num_succ, s.num_succ + s.nodes);
+    _end_pos.assign(s.end_pos, s.end_pos + s.nodes);
+    _max_end.assign(s.max_end, s.max_end + s.nodes);
+    _pinch.assign(s.pinch, s.pinch + s.nodes);
+    _owner.reset();
+    _view = false;
+    _own();
+    return *this;
+}
+
+vargas::CompiledGraph::CompiledGraph(const Sections &s, std::shared_ptr<const void> owner) :
+_p(s), _owner(std::move(owner)), _view(true) {
+    // Every offset and edge is checked once, so accessors can trust the arrays
+    if (s.seq_offset[0] != 0 || s.seq_offset[s.nodes] != s.length || s.pred_offset[0] != 0 ||
+        s.pred_offset[s.nodes] != s.edges) {
+        throw std::domain_error("Inconsistent compiled graph offsets.");
+    }
+    std::vector<uint32_t> succ(s.nodes, 0);
+    for (size_t i = 0; i < s.nodes; ++i) {
+        if (s.seq_offset[i] > s.seq_offset[i + 1] || s.pred_offset[i] > s.pred_offset[i + 1] ||
+            (i && s.max_end[i] < s.max_end[i - 1])) {
+            throw std::domain_error("Inconsistent compiled graph offsets.");
+        }
+        for (auto p = pred_begin(i); p != pred_end(i); ++p) {
+            if (*p >= i) throw std::domain_error("Compiled graph is not topologically sorted.");
+            ++succ[*p];
+        }
+    }
+    if (!std::equal(succ.begin(), succ.end(), s.num_succ)) {
+        throw std::domain_error("Inconsistent compiled graph edges.");
+    }
+    if (std::any_of(s.seq, s.seq + s.length, [](const rg::Base b) { return b > rg::Base::T; })) {
+        throw std::domain_error("Invalid base in compiled graph.");
+    }
+}
+
+void vargas::CompiledGraph::_own() {
+    _p.nodes = _id.size();
+    _p.length = _seq.size();
+    _p.edges = _pred.size();
+    _p.id = _id.data();
+    _p.seq = _seq.data();
+    _p.seq_offset = _seq_offset.data();
+    _p.pred_offset = _pred_offset.data();
+    _p.pred = _pred.data();
+    _p.num_succ = _num_succ.data();
+    _p.end_pos = _end_pos.data();
+    _p.max_end = _max_end.data();
+    _p.pinch = _pinch.data();
+}
+
+constexpr size_t vargas::CompiledGraphSet::max_graphs;
+
+vargas::CompiledGraphSet::CompiledGraphSet(std::shared_ptr<const CompiledGraph> base,
+                                           std::vector<std::shared_ptr<const CompiledGraph>> graphs) :
+_base(std::move(base)), _graphs(std::move(graphs)) {
+    if (_graphs.empty() || _graphs.size() > max_graphs) {
+        throw std::invalid_argument("A graph set holds 1 to " + std::to_string(max_graphs) + " graphs.");
+    }
+    std::unordered_map<unsigned, uint32_t> index;
+    for (size_t i = 0; i < _base->size(); ++i) index.emplace(_base->id(i), i);
+    _members.assign(_base->size(), 0);
+
+    std::vector<std::vector<uint32_t>> dense(_graphs.size());
+    for (size_t t = 0; t < _graphs.size(); ++t) {
+        const auto &g = *_graphs[t];
+        for (size_t i = 0; i < g.size(); ++i) {
+            auto f = index.find(g.id(i));
+            if (f == index.end() || (i && f->second <= dense[t].back())) {
+                throw std::domain_error("Node " + std::to_string(g.id(i)) + " is not in base order.");
+            }
+            dense[t].push_back(f->second);
+            _members[f->second] |= uint64_t(1) << t;
+        }
+    }
+
+    // Edges of each graph must be the base edges between its nodes
+    std::vector<uint32_t> a, b;
+    for (size_t t = 0; t < _graphs.size(); ++t) {
+        const auto &g = *_graphs[t];
+        for (size_t i = 0; i < g.size(); ++i) {
+            const uint32_t n = dense[t][i];
+            a.clear();
+            b.clear();
+            for (auto p = g.pred_begin(i); p != g.pred_end(i); ++p) a.push_back(dense[t][*p]);
+            for (auto p = _base->pred_begin(n); p != _base->pred_end(n); ++p) {
+                if ((_members[*p] >> t) & 1) b.push_back(*p);
+            }
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            if (a != b) throw std::domain_error("Edges into node " + std::to_string(g.id(i)) + " differ from the base.");
+        }
+    }
+}
+
+std::vector<vargas::GraphSegment> vargas::CompiledGraph::segments(size_t overlap, size_t min_len) const {
+    std::vector<GraphSegment> ret;
+    const size_t n = size();
+    if (n == 0) return ret;
+
+    // Shortest path in bases from a source to the start of each node, and the earliest predecessor
+    std::vector<size_t> dist(n, 0), first_pred(n, n);
+    for (size_t i = 0; i < n; ++i) {
+        for (auto p = pred_begin(i); p != pred_end(i); ++p) {
+            const size_t d = dist[*p] + seq_len(*p);
+            if (p == pred_begin(i) || d < dist[i]) dist[i] = d;
+            first_pred[i] = std::min<size_t>(first_pred[i], *p);
+        }
+    }
+
+    // Node i is a cut if no node after it has a predecessor before it
+    std::vector<size_t> cuts;
+    size_t reach = n;
+    for (size_t i = n - 1; i > 0; --i) {
+        if (reach >= i) cuts.push_back(i);
+        reach = std::min(reach, first_pred[i]);
+    }
+    std::reverse(cuts.begin(), cuts.end());
+
+    ret.push_back({0, 0, n});
+    for (size_t c = 0; c < cuts.size(); ++c) {
+        const size_t node = cuts[c];
+        if (_p.seq_offset[node] - _p.seq_offset[ret.back().begin] < min_len) continue;
+        if (_p.seq_offset[n] - _p.seq_offset[node] < min_len) break;
+        // dist[node] - dist[warm] bounds the shortest path between them from below
+        size_t warm = 0;
+        for (size_t k = c; k-- > 0;) {
+            if (dist[node] >= dist[cuts[k]] + overlap) {
+                warm = cuts[k];
+                break;
+            }
+        }
+        ret.back().end = node;
+        ret.push_back({warm, node, n});
+    }
+    return ret;
+}
+
 bool vargas::Graph::validate() const {
     std::unordered_set<unsigned> filled;
     for (auto gi = begin(); gi != end(); ++gi) {
@@ -505,6 +743,64 @@ TEST_CASE ("Graph class") {
         CHECK(num_to_seq(g.node(3).seq()) == "TTT");
     }
 
+    SUBCASE("Compiled view") {
+        vargas::CompiledGraph cg(g);
+        REQUIRE(cg.size() == 4);
+        CHECK(cg.length() == 12);
+        CHECK(cg.num_pred(0) == 0);
+        CHECK(cg.num_pred(1) == 1);
+        CHECK(cg.num_pred(3) == 2);
+        CHECK(*cg.pred_begin(1) == 0);
+        CHECK(cg.num_succ(0) == 2);
+        CHECK(cg.num_succ(2) == 1);
+        CHECK(cg.num_succ(3) == 0);
+        CHECK(cg.id(cg.pred_begin(3)[0]) == 1);
+        CHECK(cg.id(cg.pred_begin(3)[1]) == 2);
+        CHECK(cg.end_pos(2) == 6);
+        CHECK(cg.seq_len(2) == 3);
+        CHECK(cg.seq(2)[0] == rg::Base::G);
+        CHECK(cg.seq(3)[2] == rg::Base::T);
+
+        // Bases 2 to 8 crop AAA and TTT
+        vargas::CompiledGraph win(cg, 2, 8);
+        REQUIRE(win.size() == 4);
+        CHECK(win.length() == 10);
+        CHECK(win.seq_len(0) == 2);
+        CHECK(win.end_pos(0) == 3);
+        CHECK(win.seq_len(3) == 2);
+        CHECK(win.end_pos(3) == 8);
+        CHECK(win.num_pred(3) == 2);
+        CHECK(win.num_succ(0) == 2);
+
+        vargas::CompiledGraph tail(cg, 7, 9);
+        REQUIRE(tail.size() == 1);
+        CHECK(tail.id(0) == 3);
+        CHECK(tail.num_pred(0) == 0);
+        CHECK(tail.length() == 3);
+
+        auto base = std::make_shared<const vargas::CompiledGraph>(g);
+        auto ref = std::make_shared<const vargas::CompiledGraph>(vargas::Graph(g, vargas::Graph::Type::REF));
+        vargas::CompiledGraphSet set(base, {base, ref});
+        CHECK(set.size() == 2);
+        CHECK(set.members(0) == 3);
+        CHECK(set.members(1) == 3);
+        CHECK(set.members(2) == 1);
+        CHECK(set.members(3) == 3);
+        CHECK(&set.graph(1) == ref.get());
+        CHECK_THROWS(vargas::CompiledGraphSet(base, {}));
+        CHECK_THROWS(vargas::CompiledGraphSet(ref, {base}));
+        // Missing the base edge CCC -> TTT
+        vargas::Graph cut;
+        cut.add_node(g.node(0));
+        cut.add_node(g.node(1));
+        cut.add_node(g.node(3));
+        cut.add_edge(0, 1);
+        CHECK_THROWS(vargas::CompiledGraphSet(base, {std::make_shared<const vargas::CompiledGraph>(cut)}));
+
+        g.set_order({0, 3, 1, 2});
+        CHECK_THROWS(vargas::CompiledGraph{g});
+    }
+
     SUBCASE("Graph ops") {
         /**
          * Adding three nodes:
@@ -706,6 +1002,61 @@ TEST_CASE ("Graph class") {
         CHECK(g2.prev_map().at(3).size() == 1);
     }
 
+    SUBCASE("Graph view") {
+        auto base = std::make_shared<const vargas::Graph>(g);
+        std::vector<bool> f = {0, 1, 1}, f2 = {0, 0, 1};
+        auto ids = [](const vargas::Graph &x) {
+            std::vector<unsigned> ret;
+            for (const auto &n : x) ret.push_back(n.id());
+            return ret;
+        };
+        auto edges = [](const vargas::Graph &x) {
+            std::set<std::pair<unsigned, unsigned>> ret;
+            for (auto gi = x.begin(); gi != x.end(); ++gi) {
+                for (auto o : gi.outgoing()) ret.emplace(gi->id(), o);
+                for (auto i : gi.incoming()) CHECK(ret.count({i, gi->id()}));
+            }
+            return ret;
+        };
+
+        vargas::Graph view(base, f2), mat(g, f2);
+        CHECK(view.is_view());
+        CHECK(!mat.is_view());
+        CHECK(&view.source() == base.get());
+        CHECK(ids(view) == ids(mat));
+        CHECK(ids(view) == std::vector<unsigned>({0, 1, 3}));
+        CHECK(edges(view) == edges(mat));
+        CHECK(!view.contains(2));
+        CHECK(view.rbegin()->id() == 3);
+        CHECK(view.statistics().num_edges == mat.statistics().num_edges);
+        CHECK(view.statistics().total_length == 9);
+        CHECK_THROWS(view.order());
+        CHECK_THROWS(view.next_map());
+        CHECK_THROWS(view.add_node(vargas::Graph::Node()));
+        CHECK_THROWS(vargas::Graph(std::shared_ptr<const vargas::Graph>(), f));
+
+        // Views of views keep only nodes in both filters
+        auto outer = std::make_shared<const vargas::Graph>(base, f);
+        vargas::Graph inner(outer, f2);
+        CHECK(&inner.source() == base.get());
+        CHECK(ids(inner) == ids(vargas::Graph(vargas::Graph(g, f), f2)));
+        CHECK(edges(inner) == edges(mat));
+
+        // Graphs derived from views are materialized
+        vargas::Graph ref(view, vargas::Graph::Type::REF), maxaf(*outer, vargas::Graph::Type::MAXAF);
+        CHECK(!ref.is_view());
+        CHECK(ids(ref) == ids(mat));
+        CHECK(ids(maxaf) == ids(vargas::Graph(g, vargas::Graph::Type::MAXAF)));
+        CHECK(ids(vargas::Graph(*outer, f2)) == ids(mat));
+
+        vargas::CompiledGraph cv(view), cm(mat);
+        REQUIRE(cv.size() == cm.size());
+        for (size_t i = 0; i < cv.size(); ++i) {
+            CHECK(cv.id(i) == cm.id(i));
+            CHECK(cv.num_pred(i) == cm.num_pred(i));
+        }
+    }
+
     SUBCASE("REF graph") {
         vargas::Graph g2(g, vargas::Graph::Type::REF);
         auto iterator = g2.begin();
@@ -16,17 +16,116 @@
 
 #include <iomanip>
 #include <iterator>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <atomic>
 #include "graphman.h"
 
+vargas::MappedFile::MappedFile(const std::string &filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::invalid_argument("Error opening file: " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::invalid_argument("Error reading file: " + filename);
+    }
+    _size = st.st_size;
+    if (_size) {
+        void *m = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) {
+            ::close(fd);
+            throw std::invalid_argument("Error mapping file: " + filename);
+        }
+        _data = static_cast<const char *>(m);
+    }
+    ::close(fd);
+}
+
+vargas::MappedFile::~MappedFile() {
+    if (_data) munmap(const_cast<char *>(_data), _size);
+}
+
+namespace {
+  size_t pad8(size_t n) { return (n + 7) & ~size_t(7); }
+
+  /**
+   * @brief
+   * Append POD values to a byte buffer.
+   */
+  struct bin_writer {
+      std::ostream &os;
+      size_t pos = 0;
+
+      explicit bin_writer(std::ostream &o) : os(o) {}
+
+      void raw(const void *d, size_t n) {
+          os.write(static_cast<const char *>(d), n);
+          pos += n;
+      }
+      template<typename T>
+      void put(const T &v) { raw(&v, sizeof(T)); }
+      void str(const std::string &s) {
+          put(uint32_t(s.size()));
+          raw(s.data(), s.size());
+      }
+      void align() {
+          static const char zeros[8] = {0};
+          raw(zeros, pad8(pos) - pos);
+      }
+  };
+
+  /**
+   * @brief
+   * Bounds checked reads from a mapped file.
+   */
+  struct bin_reader {
+      const char *data;
+      size_t size, pos;
+
+      bin_reader(const char *d, size_t s, size_t p) : data(d), size(s), pos(p) {}
+
+      const char *take(size_t n) {
+          if (pos > size || n > size - pos) throw std::domain_error("Truncated or corrupt binary graph file.");
+          const char *ret = data + pos;
+          pos += n;
+          return ret;
+      }
+      // Array of n records of width bytes, checked before multiplying so a hostile count cannot wrap
+      const char *take(size_t n, size_t width) {
+          if (pos > size || n > (size - pos) / width) throw std::domain_error("Truncated or corrupt binary graph file.");
+          return take(n * width);
+      }
+      template<typename T>
+      T get() {
+          T v;
+          std::memcpy(&v, take(sizeof(T)), sizeof(T));
+          return v;
+      }
+      std::string str() {
+          const uint32_t len = get<uint32_t>();
+          return std::string(take(len), len);
+      }
+      void align() { pos = pad8(pos); }
+  };
+}
+
 
 std::shared_ptr<vargas::Graph>
 vargas::GraphMan::create_base(const std::string fasta, const std::string vcf, std::vector<vargas::Region> region,
                               std::string sample_filter, size_t limvar) {
 
-    if (_nodes == nullptr) _nodes = std::make_shared<Graph::nodemap_t>();
-    else _nodes->clear();
-
+    _nodes = std::make_shared<Graph::nodemap_t>();
     _graphs.clear();
+    _compiled.clear();
+    _compiled_sets.clear();
+    _graph_offsets.clear();
+    _map.reset();
+    _mapped_base = false;
+    _nodes_decoded = true;
 
     // Default regions
     if (region.size() == 0) {
@@ -56,21 +155,64 @@ vargas::GraphMan::create_base(const std::string fasta, const std::string vcf, st
 
     _graphs["base"] = std::make_shared<Graph>(_nodes);
 
-    unsigned offset = 0;
+    // Regions are built from position 0 with IDs from 0, and shifted into place when merged in order
+    unsigned id = Graph::Node::_newID;
+    std::vector<Graph> built(region.size());
+    std::vector<std::exception_ptr> errors(region.size());
+    std::atomic<size_t> next(0);
+    std::mutex print_mut;
+    // Threads not needed for a region decompress the VCF
+    const unsigned builders = std::min<size_t>(_threads, region.size());
+    const unsigned decode_threads = builders ? (_threads - builders) / builders : 0;
+    auto work = [&]() {
+        for (size_t r = next++; r < region.size(); r = next++) {
+            try {
+                if (_print) {
+                    std::lock_guard<std::mutex> lock(print_mut);
+                    std::cerr << "Building \"" << region[r].seq_name << "\"..." << std::endl;
+                }
+                GraphFactory gf(fasta, vcf);
+                gf.add_sample_filter(sample_filter);
+                gf.limit_variants(limvar);
+                gf.set_region(region[r]);
+                gf.set_first_id(0);
+                gf.set_threads(decode_threads);
+                if (_assume_contig) gf.assume_contig_chr();
+                built[r] = gf.build();
+            } catch (...) {
+                errors[r] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < builders; ++t) threads.emplace_back(work);
+    work();
+    for (auto &t : threads) t.join();
+    for (auto &e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
 
-    for (auto reg : region) {
-        if (_print) std::cerr << "Building \"" << reg.seq_name << "\" (offset: " << offset << ")..." << std::endl;
-        GraphFactory gf(fasta, vcf);
-        gf.add_sample_filter(sample_filter);
-        gf.limit_variants(limvar);
-        gf.set_region(reg);
-        if (_assume_contig) gf.assume_contig_chr();
-        auto g = gf.build(offset);
-        if (_print) std::cerr << g.statistics().to_string() << "\n";
-        _resolver._contig_offsets[offset] = reg.seq_name;
-        offset = g.rbegin()->end_pos() + 1;
-        _graphs["base"]->assimilate(g);
+    unsigned offset = 0;
+    for (size_t r = 0; r < region.size(); ++r) {
+        const Graph &g = built[r];
+        if (_print) {
+            std::cerr << "\"" << region[r].seq_name << "\" (offset: " << offset << ") "
+                      << g.statistics().to_string() << "\n";
+        }
+        _resolver._contig_offsets[offset] = region[r].seq_name;
+        const unsigned first = id;
+        for (auto gi = g.begin(); gi != g.end(); ++gi) {
+            Graph::Node n = *gi;
+            n.set_id(first + gi->id());
+            n.set_endpos(gi->end_pos() + offset);
+            _graphs["base"]->add_node(n);
+            for (const unsigned to : gi.outgoing()) _graphs["base"]->add_edge_unchecked(first + gi->id(), first + to);
+            id = std::max(id, n.id() + 1);
+        }
+        offset += g.rbegin()->end_pos() + 1;
+        built[r] = Graph();
     }
+    if (Graph::Node::_newID < id) Graph::Node::_newID = id;
 
     _graphs["base"]->set_filter(Graph::Population(nhaplo, true));
     _graphs["base"]->set_popsize(nhaplo);
@@ -82,7 +224,13 @@ vargas::GraphMan::create_base(const std::string fasta, const std::string vcf, st
     return _graphs["base"];
 }
 
-void vargas::GraphMan::write(const std::string &filename) {
+void vargas::GraphMan::write(const std::string &filename, bool binary) {
+    _decode_all();
+    if (binary) _write_binary(filename);
+    else _write_text(filename);
+}
+
+void vargas::GraphMan::_write_text(const std::string &filename) {
     std::ios::sync_with_stdio(false);
     std::ofstream of(filename);
     if (!of.good()) throw std::invalid_argument("Error opening file: " + filename);
@@ -103,10 +251,15 @@ void vargas::GraphMan::write(const std::string &filename) {
     // Label    [node_id_list]  [edge-list a:b,c;d:b,c;]
     of << "\n@graphs\n";
     if (_print) std::cerr << "Flushing " << _graphs.size() << " graphs...\n";
+    std::vector<unsigned> order;
     for (auto &g : _graphs) {
-        of << g.first << '\t' << rg::vec_to_str(g.second->order(), ",") << '\t';
-        for (auto &p : g.second->next_map()) {
-            of << p.first << ':' << rg::vec_to_str(p.second, ",") << ';';
+        // Iterate rather than use the edge maps, derived graphs are views of their ancestor
+        order.clear();
+        for (const auto &n : *g.second) order.push_back(n.id());
+        of << g.first << '\t' << rg::vec_to_str(order, ",") << '\t';
+        for (auto gi = g.second->begin(); gi != g.second->end(); ++gi) {
+            const auto &out = gi.outgoing();
+            if (out.size()) of << gi->id() << ':' << rg::vec_to_str(out, ",") << ';';
         }
         of << '\n';
     }
@@ -123,7 +276,352 @@ void vargas::GraphMan::write(const std::string &filename) {
     std::ios::sync_with_stdio(true);
 }
 
+void vargas::GraphMan::_write_binary(const std::string &filename) {
+    std::ofstream of(filename, std::ios::binary);
+    if (!of.good()) throw std::invalid_argument("Error opening file: " + filename);
+    bin_writer w(of);
+
+    // Node table indices, sequence offsets assigned in table order
+    std::unordered_map<unsigned, uint32_t> node_index;
+    std::vector<const Graph::Node *> nodes;
+    nodes.reserve(_nodes->size());
+    uint64_t seq_len = 0;
+    for (const auto &p : *_nodes) {
+        node_index[p.first] = nodes.size();
+        nodes.push_back(&p.second);
+        seq_len += p.second.seq().size();
+    }
+
+    gdf::Header hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    std::memcpy(hdr.magic, gdf::MAGIC, sizeof(hdr.magic));
+    hdr.version = gdf::VERSION;
+    hdr.endian = gdf::ENDIAN;
+    hdr.num_nodes = nodes.size();
+    hdr.seq_len = seq_len;
+    w.put(hdr); // Offsets are filled in after the sections are written
+
+    hdr.meta_off = w.pos;
+    w.put(uint32_t(_aux.size()));
+    for (const auto &pair : _aux) {
+        w.str(pair.first);
+        w.str(pair.second);
+    }
+    w.align();
+
+    hdr.contig_off = w.pos;
+    w.put(uint32_t(_resolver._contig_offsets.size()));
+    for (const auto &o : _resolver._contig_offsets) {
+        w.put(uint32_t(o.first));
+        w.str(o.second);
+    }
+    w.align();
+
+    if (_print) std::cerr << "Flushing " << nodes.size() << " nodes...\n";
+    hdr.node_off = w.pos;
+    uint64_t seq_off = 0;
+    for (const auto n : nodes) {
+        gdf::Node rec;
+        std::memset(&rec, 0, sizeof(rec));
+        rec.seq_off = seq_off;
+        rec.seq_len = n->seq().size();
+        rec.id = n->id();
+        rec.end_pos = n->end_pos();
+        rec.af = n->freq();
+        rec.pinch = n->is_pinched();
+        rec.ref = n->is_ref();
+        w.put(rec);
+        seq_off += rec.seq_len;
+    }
+
+    hdr.seq_off = w.pos;
+    for (const auto n : nodes) w.raw(n->seq().data(), n->seq().size());
+    w.align();
+
+    if (_print) std::cerr << "Flushing " << _graphs.size() << " graphs...\n";
+    hdr.graph_off = w.pos;
+    w.put(uint32_t(_graphs.size()));
+    w.align();
+    std::vector<uint32_t> order, out;
+    std::vector<uint64_t> out_offset;
+    for (const auto &g : _graphs) {
+        order.clear();
+        out.clear();
+        out_offset.assign(1, 0);
+        for (auto gi = g.second->begin(); gi != g.second->end(); ++gi) {
+            order.push_back(node_index.at(gi->id()));
+            for (const unsigned to : gi.outgoing()) out.push_back(node_index.at(to));
+            out_offset.push_back(out.size());
+        }
+
+        gdf::Graph rec;
+        std::memset(&rec, 0, sizeof(rec));
+        rec.order_len = order.size();
+        rec.num_edges = out.size();
+        rec.label_len = g.first.size();
+        w.put(rec);
+        w.raw(g.first.data(), g.first.size());
+        w.align();
+        w.raw(order.data(), order.size() * sizeof(uint32_t));
+        w.align();
+        w.raw(out_offset.data(), out_offset.size() * sizeof(uint64_t));
+        w.raw(out.data(), out.size() * sizeof(uint32_t));
+        w.align();
+    }
+
+    // Compiled base graph, aligned to in place when the file is opened
+    const auto base = _graphs.find("base");
+    if (base != _graphs.end() && base->second) {
+        if (_print) std::cerr << "Flushing compiled base graph...\n";
+        const CompiledGraph cg(*base->second);
+        const auto &c = cg.sections();
+        hdr.compiled_off = w.pos;
+        gdf::Compiled rec;
+        rec.num_nodes = c.nodes;
+        rec.seq_len = c.length;
+        rec.num_edges = c.edges;
+        w.put(rec);
+        auto section = [&w](const void *d, size_t n) {
+            w.raw(d, n);
+            w.align();
+        };
+        section(c.id, c.nodes * sizeof(unsigned));
+        section(c.seq_offset, (c.nodes + 1) * sizeof(size_t));
+        section(c.pred_offset, (c.nodes + 1) * sizeof(uint32_t));
+        section(c.pred, c.edges * sizeof(uint32_t));
+        section(c.num_succ, c.nodes * sizeof(uint32_t));
+        section(c.end_pos, c.nodes * sizeof(pos_t));
+        section(c.max_end, c.nodes * sizeof(pos_t));
+        section(c.pinch, c.nodes);
+        section(c.seq, c.length);
+    }
+
+    of.seekp(0);
+    of.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    if (!of.good()) throw std::runtime_error("Error writing file: " + filename);
+}
+
+bool vargas::GraphMan::is_binary(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    char magic[sizeof(gdf::MAGIC)];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, gdf::MAGIC, sizeof(magic)) == 0;
+}
+
 void vargas::GraphMan::open(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(_mut);
+    _compiled.clear();
+    _compiled_sets.clear();
+    _map.reset();
+    _graph_offsets.clear();
+    _mapped_base = false;
+    _nodes_decoded = true;
+    _resolver._contig_hdr_order.clear();
+    if (is_binary(filename)) _open_binary(filename);
+    else _open_text(filename);
+}
+
+void vargas::GraphMan::_open_binary(const std::string &filename) {
+    auto map = std::make_shared<MappedFile>(filename);
+    bin_reader r(map->data(), map->size(), 0);
+    const auto hdr = r.get<gdf::Header>();
+    if (hdr.version != gdf::VERSION) {
+        throw std::invalid_argument(filename + ": unsupported binary graph version " + std::to_string(hdr.version));
+    }
+    if (hdr.endian != gdf::ENDIAN) throw std::invalid_argument(filename + ": binary graph has wrong byte order.");
+
+    // Validate section bounds up front so decoding only needs per-record checks
+    bin_reader(map->data(), map->size(), hdr.node_off).take(hdr.num_nodes, sizeof(gdf::Node));
+    bin_reader(map->data(), map->size(), hdr.seq_off).take(hdr.seq_len);
+
+    _aux.clear();
+    _graphs.clear();
+    _resolver._contig_offsets.clear();
+    _nodes = std::make_shared<Graph::nodemap_t>();
+
+    r.pos = hdr.meta_off;
+    for (uint32_t i = 0, n = r.get<uint32_t>(); i < n; ++i) {
+        std::string key = r.str();
+        _aux[key] = r.str();
+    }
+
+    r.pos = hdr.contig_off;
+    for (uint32_t i = 0, n = r.get<uint32_t>(); i < n; ++i) {
+        const uint32_t offset = r.get<uint32_t>();
+        _resolver._contig_offsets[offset] = r.str();
+        _resolver._contig_hdr_order.push_back(_resolver._contig_offsets[offset]);
+    }
+
+    // Only index graph records here, they are decoded on first use
+    r.pos = hdr.graph_off;
+    const uint32_t num_graphs = r.get<uint32_t>();
+    r.align();
+    for (uint32_t i = 0; i < num_graphs; ++i) {
+        const size_t rec_pos = r.pos;
+        const auto rec = r.get<gdf::Graph>();
+        std::string label(r.take(rec.label_len), rec.label_len);
+        r.align();
+        r.take(rec.order_len, sizeof(uint32_t));
+        r.align();
+        if (rec.order_len == UINT64_MAX) throw std::domain_error("Corrupt binary graph file, graph " + label);
+        r.take(rec.order_len + 1, sizeof(uint64_t));
+        r.take(rec.num_edges, sizeof(uint32_t));
+        r.align();
+        _graph_offsets[label] = rec_pos;
+        _graphs[label] = nullptr;
+    }
+
+    if (hdr.compiled_off) {
+        r.pos = hdr.compiled_off;
+        const auto rec = r.get<gdf::Compiled>();
+        r.align();
+        auto section = [&r](size_t n, size_t width) {
+            const char *ret = r.take(n, width);
+            r.align();
+            return ret;
+        };
+        CompiledGraph::Sections &c = _base_sections;
+        c.nodes = rec.num_nodes;
+        c.length = rec.seq_len;
+        c.edges = rec.num_edges;
+        if (c.nodes >= UINT32_MAX || c.edges >= UINT32_MAX) throw std::domain_error("Corrupt binary graph file.");
+        c.id = reinterpret_cast<const unsigned *>(section(c.nodes, sizeof(unsigned)));
+        c.seq_offset = reinterpret_cast<const size_t *>(section(c.nodes + 1, sizeof(size_t)));
+        c.pred_offset = reinterpret_cast<const uint32_t *>(section(c.nodes + 1, sizeof(uint32_t)));
+        c.pred = reinterpret_cast<const uint32_t *>(section(c.edges, sizeof(uint32_t)));
+        c.num_succ = reinterpret_cast<const uint32_t *>(section(c.nodes, sizeof(uint32_t)));
+        c.end_pos = reinterpret_cast<const pos_t *>(section(c.nodes, sizeof(pos_t)));
+        c.max_end = reinterpret_cast<const pos_t *>(section(c.nodes, sizeof(pos_t)));
+        c.pinch = reinterpret_cast<const uint8_t *>(section(c.nodes, 1));
+        c.seq = reinterpret_cast<const rg::Base *>(section(c.length, 1));
+        if (!_graphs.count("base")) throw std::domain_error("Corrupt binary graph file, compiled graph without a base.");
+        // Aligners index the arrays without bounds checks, so their offsets and edges are checked before use
+        try {
+            _compiled["base"] = std::make_shared<const CompiledGraph>(_base_sections, map);
+        } catch (const std::domain_error &e) {
+            throw std::domain_error("Corrupt binary graph file, " + std::string(e.what()));
+        }
+        _mapped_base = true;
+    }
+
+    _map = map;
+    _nodes_decoded = false;
+}
+
+std::shared_ptr<vargas::Graph> vargas::GraphMan::_decode(const std::string &label) const {
+    const char *data = _map->data();
+    gdf::Header hdr;
+    std::memcpy(&hdr, data, sizeof(hdr));
+    const char *table = data + hdr.node_off;
+    auto node = [table](uint32_t i) {
+        gdf::Node n;
+        std::memcpy(&n, table + i * sizeof(gdf::Node), sizeof(gdf::Node));
+        return n;
+    };
+
+    if (!_nodes_decoded) {
+        // All nodes are decoded at once so that the shared node map is never modified while other graphs are in use
+        if (_print) std::cerr << "Loading " << hdr.num_nodes << " nodes...\n";
+        _nodes->reserve(hdr.num_nodes);
+        const rg::Base *seq = reinterpret_cast<const rg::Base *>(data + hdr.seq_off);
+        for (uint64_t i = 0; i < hdr.num_nodes; ++i) {
+            const gdf::Node rec = node(i);
+            if (rec.seq_off > hdr.seq_len || rec.seq_len > hdr.seq_len - rec.seq_off) {
+                throw std::domain_error("Corrupt binary graph file, node " + std::to_string(rec.id));
+            }
+            auto &n = (*_nodes)[rec.id];
+            n.set_id(rec.id);
+            n.set_endpos(rec.end_pos);
+            n.set_af(rec.af);
+            n.set_pinch(rec.pinch);
+            if (rec.ref) n.set_as_ref();
+            n.seq().assign(seq + rec.seq_off, seq + rec.seq_off + rec.seq_len);
+        }
+        _nodes_decoded = true;
+    }
+
+    bin_reader r(data, _map->size(), _graph_offsets.at(label));
+    const auto rec = r.get<gdf::Graph>();
+    r.take(rec.label_len);
+    r.align();
+    const char *order_p = r.take(rec.order_len * sizeof(uint32_t));
+    r.align();
+    const char *offset_p = r.take((rec.order_len + 1) * sizeof(uint64_t));
+    const char *out_p = r.take(rec.num_edges * sizeof(uint32_t));
+
+    std::vector<uint32_t> idx(rec.order_len), out(rec.num_edges);
+    std::vector<uint64_t> offsets(rec.order_len + 1);
+    std::memcpy(idx.data(), order_p, idx.size() * sizeof(uint32_t));
+    std::memcpy(offsets.data(), offset_p, offsets.size() * sizeof(uint64_t));
+    std::memcpy(out.data(), out_p, out.size() * sizeof(uint32_t));
+
+    auto g = std::make_shared<Graph>(_nodes);
+    std::vector<unsigned> order(rec.order_len);
+    for (size_t i = 0; i < idx.size(); ++i) {
+        if (idx[i] >= hdr.num_nodes) throw std::domain_error("Corrupt binary graph file, graph " + label);
+        order[i] = node(idx[i]).id;
+    }
+    g->set_order(order);
+    for (size_t i = 0; i < idx.size(); ++i) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > out.size()) {
+            throw std::domain_error("Corrupt binary graph file, graph " + label);
+        }
+        for (uint64_t e = offsets[i]; e < offsets[i + 1]; ++e) {
+            if (out[e] >= hdr.num_nodes) throw std::domain_error("Corrupt binary graph file, graph " + label);
+            g->add_edge_unchecked(order[i], node(out[e]).id);
+        }
+    }
+    return g;
+}
+
+void vargas::GraphMan::_decode_all() const {
+    std::lock_guard<std::mutex> lock(_mut);
+    for (auto &g : _graphs) {
+        if (!g.second && _graph_offsets.count(g.first)) g.second = _decode(g.first);
+    }
+}
+
+std::shared_ptr<vargas::Graph> vargas::GraphMan::at(std::string label) const {
+    std::transform(label.begin(), label.end(), label.begin(), tolower);
+    std::lock_guard<std::mutex> lock(_mut);
+    auto g = _graphs.find(label);
+    if (g == _graphs.end()) throw std::domain_error("No graph named \"" + label + "\"");
+    if (!g->second && _graph_offsets.count(label)) g->second = _decode(label);
+    return g->second;
+}
+
+std::shared_ptr<const vargas::CompiledGraph> vargas::GraphMan::compiled(std::string label) const {
+    std::transform(label.begin(), label.end(), label.begin(), tolower);
+    if (label == "base" && _mapped_base) {
+        // Viewed in place, without decoding any nodes
+        std::lock_guard<std::mutex> lock(_mut);
+        auto &c = _compiled[label];
+        if (!c) c = std::make_shared<const CompiledGraph>(_base_sections, _map);
+        return c;
+    }
+    auto g = at(label);
+    std::lock_guard<std::mutex> lock(_mut);
+    auto &c = _compiled[label];
+    if (!c) c = std::make_shared<const CompiledGraph>(*g);
+    return c;
+}
+
+std::shared_ptr<const vargas::CompiledGraphSet> vargas::GraphMan::compiled_set(std::vector<std::string> labels) const {
+    for (auto &l : labels) std::transform(l.begin(), l.end(), l.begin(), tolower);
+    {
+        std::lock_guard<std::mutex> lock(_mut);
+        auto s = _compiled_sets.find(labels);
+        if (s != _compiled_sets.end()) return s->second;
+    }
+    std::vector<std::shared_ptr<const CompiledGraph>> graphs;
+    for (const auto &l : labels) graphs.push_back(compiled(l));
+    auto set = std::make_shared<const CompiledGraphSet>(compiled("base"), graphs);
+    std::lock_guard<std::mutex> lock(_mut);
+    auto &s = _compiled_sets[labels];
+    if (!s) s = set;
+    return s;
+}
+
+void vargas::GraphMan::_open_text(const std::string &filename) {
     std::ifstream in(filename);
     if (!in.good()) throw std::invalid_argument("Error opening file: " + filename);
 
@@ -236,7 +734,7 @@ std::string vargas::GraphMan::derive(std::string def) {
 
     }
 
-    auto &&parent_population = _graphs.at(ancestor)->filter();
+    auto &&parent_population = at(ancestor)->filter();
     if (parent_population.size() < 2) throw std::domain_error("Cannot derive from \"" + ancestor + "\". Less than 2 samples available.");
     size_t avail = parent_population.count(), amount;
     if (assignment.back() == '%') {
@@ -258,7 +756,8 @@ std::string vargas::GraphMan::derive(std::string def) {
     Graph::Population newpop(parent_population.size());
     for (size_t i = 0; i < amount; ++i) newpop.set(idx[i], true);
 
-    _graphs[label] = std::make_shared<Graph>(*_graphs.at(ancestor), newpop);
+    // Views share the ancestor's node order and edges
+    _graphs[label] = std::make_shared<Graph>(std::shared_ptr<const Graph>(at(ancestor)), newpop);
     return label;
 }
 
@@ -347,6 +846,12 @@ ACGTACGAC
         p = gg.absolute_position(20);
         CHECK(p.first == "chr2");
         CHECK(p.second == 7);
+
+        auto set = gg.compiled_set({"BASE"});
+        CHECK(set->size() == 1);
+        CHECK(set->members(2) == 1);
+        CHECK(set == gg.compiled_set({"base"}));
+        CHECK_THROWS(gg.compiled_set({"none"}));
     }
     remove(jfile.c_str());
     gg.write(jfile);
@@ -403,6 +908,100 @@ ACGTACGAC
         CHECK(p.second == 1);
     }
     remove(jfile.c_str());
+    gg.write(jfile, true);
+    CHECK(vargas::GraphMan::is_binary(jfile));
+    gg.open(jfile);
+    {
+        REQUIRE(gg.count("base"));
+        CHECK(gg.labels().size() == 1);
+        CHECK(gg.nodeID_from_contig("chr2") == 1);
+
+        // The compiled base graph is read from the mapping in place
+        const auto cg = gg.compiled("base");
+        CHECK(cg->in_place());
+        CHECK(gg.compiled("base") == cg);
+
+        auto &g = *gg.at("base");
+        const vargas::CompiledGraph ref(g);
+        REQUIRE(cg->size() == ref.size());
+        CHECK(cg->length() == ref.length());
+        for (size_t i = 0; i < ref.size(); ++i) {
+            CHECK(cg->id(i) == ref.id(i));
+            CHECK(cg->end_pos(i) == ref.end_pos(i));
+            CHECK(cg->is_pinched(i) == ref.is_pinched(i));
+            CHECK(cg->num_succ(i) == ref.num_succ(i));
+            REQUIRE(cg->seq_len(i) == ref.seq_len(i));
+            CHECK(std::equal(ref.seq(i), ref.seq(i) + ref.seq_len(i), cg->seq(i)));
+            REQUIRE(cg->num_pred(i) == ref.num_pred(i));
+            CHECK(std::equal(ref.pred_begin(i), ref.pred_end(i), cg->pred_begin(i)));
+        }
+        // Copies and windows own their arrays
+        const vargas::CompiledGraph copy(*cg);
+        CHECK(!copy.in_place());
+        CHECK(copy.length() == cg->length());
+        CHECK(copy.seq(0) != cg->seq(0));
+        CHECK(vargas::CompiledGraph(*cg, 6, 12).length() == vargas::CompiledGraph(ref, 6, 12).length());
+
+        auto bad = ref.sections();
+        std::vector<uint32_t> pred(bad.pred, bad.pred + bad.edges);
+        pred.back() = bad.nodes - 1;
+        bad.pred = pred.data();
+        CHECK_THROWS(vargas::CompiledGraph(bad, nullptr));
+
+        // Corrupt compiled sections are refused when the file is opened
+        std::string bytes;
+        {
+            std::ifstream in(jfile, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        vargas::gdf::Header hdr;
+        vargas::gdf::Compiled rec;
+        std::memcpy(&hdr, bytes.data(), sizeof(hdr));
+        std::memcpy(&rec, bytes.data() + hdr.compiled_off, sizeof(rec));
+        const size_t seq_offset_pos = hdr.compiled_off + pad8(sizeof(rec)) + pad8(rec.num_nodes * sizeof(unsigned));
+        const size_t pred_pos = seq_offset_pos + pad8((rec.num_nodes + 1) * sizeof(size_t)) +
+                                pad8((rec.num_nodes + 1) * sizeof(uint32_t));
+        const std::string cfile = "tmp_corrupt.vgraph";
+        auto corrupt = [&](size_t pos, uint64_t v, size_t width) {
+            std::string b = bytes;
+            std::memcpy(&b[pos], &v, width);
+            std::ofstream(cfile, std::ios::binary) << b;
+            vargas::GraphMan c;
+            CHECK_THROWS(c.open(cfile));
+        };
+        corrupt(offsetof(vargas::gdf::Header, num_nodes), uint64_t(1) << 61, sizeof(uint64_t));
+        corrupt(pred_pos + (rec.num_edges - 1) * sizeof(uint32_t), rec.num_nodes - 1, sizeof(uint32_t));
+        corrupt(seq_offset_pos + rec.num_nodes * sizeof(size_t), rec.seq_len + 1, sizeof(size_t));
+        corrupt(pred_pos + pad8(rec.num_edges * sizeof(uint32_t)) + pad8(rec.num_nodes * sizeof(uint32_t)) +
+                2 * pad8(rec.num_nodes * sizeof(vargas::pos_t)) + pad8(rec.num_nodes), 9, 1);
+        remove(cfile.c_str());
+
+        const std::vector<std::string> seqs = {"AAAAA", "GGG", "C", "T", "GCGC", "ACGTACGAC"};
+        const std::vector<unsigned> ends = {5, 8, 9, 9, 13, 22};
+        size_t i = 0;
+        for (auto it = g.begin(); it != g.end(); ++it, ++i) {
+            REQUIRE(i < seqs.size());
+            CHECK(it->seq_str() == seqs[i]);
+            CHECK(it->end_pos() == ends[i]);
+            CHECK(it->is_pinched() == (ends[i] != 9));
+        }
+        CHECK(i == seqs.size());
+        CHECK(g.next_map().at(1).size() == 2);
+        CHECK(g.prev_map().at(4).size() == 2);
+        CHECK(g.node(2).freq() == 0.5);
+
+        auto p = gg.absolute_position(20);
+        CHECK(p.first == "chr2");
+        CHECK(p.second == 7);
+    }
+
+    // Binary to text conversion
+    remove(jfile.c_str());
+    gg.write(jfile);
+    CHECK(!vargas::GraphMan::is_binary(jfile));
+    gg.open(jfile);
+    CHECK(gg.at("base")->statistics().total_length == 23);
+    remove(jfile.c_str());
 }
 
 TEST_CASE("Write graph") {
@@ -459,6 +1058,26 @@ TEST_CASE("Write graph") {
         auto dev_s = gg.at(label)->statistics();
         CHECK(dev_s.total_length < base_s.total_length);
 
+        // Derived graphs are views, and are written out in full
+        CHECK(g.is_view());
+        auto sub = gg.derive("a:b=1");
+        CHECK(gg.at(sub)->parent() == gg.at(label));
+        std::vector<unsigned> ids;
+        for (const auto &n : *gg.at(sub)) ids.push_back(n.id());
+        const auto compiled = gg.compiled(sub);
+        for (const bool binary : {false, true}) {
+            gg.write("tmp_derive.gdf", binary);
+            vargas::GraphMan loaded("tmp_derive.gdf");
+            CHECK(!loaded.at(sub)->is_view());
+            std::vector<unsigned> loaded_ids;
+            for (const auto &n : *loaded.at(sub)) loaded_ids.push_back(n.id());
+            CHECK(loaded_ids == ids);
+            CHECK(loaded.at(label)->statistics().num_edges == dev_s.num_edges);
+            auto lc = loaded.compiled(sub);
+            REQUIRE(lc->size() == compiled->size());
+            for (size_t i = 0; i < lc->size(); ++i) CHECK(lc->num_pred(i) == compiled->num_pred(i));
+        }
+        remove("tmp_derive.gdf");
     }
 
     SUBCASE("All regions") {
@@ -533,6 +1152,23 @@ TEST_CASE("Write graph") {
         CHECK(p.first == "x");
         CHECK(p.second == 1);
 
+        // Regions built concurrently are numbered and placed as if built in order
+        vargas::Graph::Node::_newID = 0;
+        auto serial = vargas::GraphMan().create_base(tmpfa, tmpvcf, reg);
+        vargas::Graph::Node::_newID = 0;
+        vargas::GraphMan pg;
+        pg.set_threads(2);
+        auto parallel = pg.create_base(tmpfa, tmpvcf, reg);
+        auto si = serial->begin();
+        for (auto pi = parallel->begin(); pi != parallel->end(); ++pi, ++si) {
+            REQUIRE(si != serial->end());
+            CHECK(pi->id() == si->id());
+            CHECK(pi->end_pos() == si->end_pos());
+            CHECK(pi->seq_str() == si->seq_str());
+            CHECK(pi.outgoing().size() == si.outgoing().size());
+        }
+        CHECK(si == serial->end());
+        CHECK(pg.absolute_position(16) == gg.absolute_position(16));
     }
 
     remove(tmpfa.c_str());
@@ -0,0 +1,307 @@
+/**
+ * @brief
+ * Index of k-mers spelled along graph paths, used to find candidate windows for reads.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "kmer_index.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <random>
+
+namespace {
+  // Last bases of a path into a node, at most k - 1
+  struct Context {
+      uint64_t bits;
+      unsigned len;
+      bool operator<(const Context &o) const { return bits < o.bits || (bits == o.bits && len < o.len); }
+      bool operator==(const Context &o) const { return bits == o.bits && len == o.len; }
+  };
+
+  uint64_t kmer_mask(unsigned k) {
+      return k == 32 ? ~uint64_t(0) : (uint64_t(1) << (2 * k)) - 1;
+  }
+}
+
+vargas::KmerIndex::KmerIndex(const CompiledGraph &g, const unsigned k, const unsigned max_paths) :
+_k(k), _length(g.length()), _nodes(g.size()) {
+    if (k == 0 || k > 32) throw std::invalid_argument("K-mer length must be from 1 to 32.");
+    if (max_paths == 0) throw std::invalid_argument("At least one path per node is needed.");
+    const uint64_t mask = kmer_mask(k), ctx_mask = mask >> 2;
+
+    // Contexts leaving each node, released once every successor has used them
+    std::vector<std::vector<Context>> out(g.size());
+    std::vector<uint32_t> pending(g.size());
+    std::vector<Context> in;
+    for (size_t i = 0; i < g.size(); ++i) {
+        pending[i] = g.num_succ(i);
+        in.clear();
+        for (auto p = g.pred_begin(i); p != g.pred_end(i); ++p) {
+            in.insert(in.end(), out[*p].begin(), out[*p].end());
+            if (--pending[*p] == 0) std::vector<Context>().swap(out[*p]);
+        }
+        if (in.empty()) in.push_back({0, 0});
+        std::sort(in.begin(), in.end());
+        in.erase(std::unique(in.begin(), in.end()), in.end());
+        if (in.size() > max_paths) in.resize(max_paths);
+
+        const rg::Base *seq = g.seq(i);
+        const size_t len = g.seq_len(i);
+        const pos_t first = g.end_pos(i) - len + 1;
+        for (size_t c = 0; c < in.size(); ++c) {
+            uint64_t bits = in[c].bits;
+            unsigned have = in[c].len;
+            // K-mers within the node are the same along every path, add them with the first one
+            const size_t stop = c == 0 ? len : std::min<size_t>(len, k - 1);
+            for (size_t j = 0; j < stop; ++j) {
+                if (seq[j] == rg::Base::N) {
+                    bits = 0;
+                    have = 0;
+                    continue;
+                }
+                bits = ((bits << 2) | (seq[j] - 1)) & mask;
+                if (have < k) ++have;
+                if (have == k) _entries.push_back({bits, pos_t(first + j), 0});
+            }
+            // Nodes of at least k - 1 bases leave the same context along every path
+            if (c == 0 || len < k - 1) out[i].push_back({bits & ctx_mask, std::min(have, k - 1)});
+        }
+        if (g.num_succ(i) == 0) std::vector<Context>().swap(out[i]);
+    }
+
+    std::sort(_entries.begin(), _entries.end(), [](const Entry &a, const Entry &b) {
+        return a.kmer < b.kmer || (a.kmer == b.kmer && a.pos < b.pos);
+    });
+    _entries.erase(std::unique(_entries.begin(), _entries.end(), [](const Entry &a, const Entry &b) {
+        return a.kmer == b.kmer && a.pos == b.pos;
+    }), _entries.end());
+    _entries.shrink_to_fit();
+    _begin = _entries.data();
+    _end = _begin + _entries.size();
+}
+
+void vargas::KmerIndex::open(const std::string &filename) {
+    auto map = std::make_shared<MappedFile>(filename);
+    kmi::Header h;
+    if (map->size() < sizeof(h)) throw std::invalid_argument("Invalid k-mer index file: " + filename);
+    std::memcpy(&h, map->data(), sizeof(h));
+    if (std::memcmp(h.magic, kmi::MAGIC, sizeof(h.magic)) != 0 || h.k == 0 || h.k > 32
+        || map->size() != sizeof(h) + h.count * sizeof(Entry)) {
+        throw std::invalid_argument("Invalid k-mer index file: " + filename);
+    }
+    if (h.version != kmi::VERSION) {
+        throw std::invalid_argument("Unsupported k-mer index version " + std::to_string(h.version) + ": " + filename);
+    }
+    _entries.clear();
+    _map = map;
+    _k = h.k;
+    _length = h.length;
+    _nodes = h.nodes;
+    _begin = reinterpret_cast<const Entry *>(_map->data() + sizeof(h));
+    _end = _begin + h.count;
+}
+
+void vargas::KmerIndex::write(const std::string &filename) const {
+    std::ofstream of(filename, std::ios::binary);
+    if (!of.good()) throw std::invalid_argument("Error opening file: " + filename);
+    kmi::Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, kmi::MAGIC, sizeof(h.magic));
+    h.version = kmi::VERSION;
+    h.k = _k;
+    h.count = size();
+    h.length = _length;
+    h.nodes = _nodes;
+    of.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    of.write(reinterpret_cast<const char *>(_begin), size() * sizeof(Entry));
+    if (!of.good()) throw std::runtime_error("Error writing file: " + filename);
+}
+
+void vargas::KmerIndex::check(const CompiledGraph &g) const {
+    if (g.length() != _length || g.size() != _nodes) {
+        throw std::invalid_argument("K-mer index of a graph with " + std::to_string(_length) + " bases and " +
+                                    std::to_string(_nodes) + " nodes does not match the graph, with " +
+                                    std::to_string(g.length()) + " bases and " + std::to_string(g.size()) + " nodes");
+    }
+}
+
+std::pair<const vargas::KmerIndex::Entry *, const vargas::KmerIndex::Entry *>
+vargas::KmerIndex::find(const uint64_t kmer) const {
+    struct cmp {
+        bool operator()(const Entry &e, uint64_t k) const { return e.kmer < k; }
+        bool operator()(uint64_t k, const Entry &e) const { return k < e.kmer; }
+    };
+    return std::equal_range(_begin, _end, kmer, cmp());
+}
+
+void vargas::KmerIndex::_seed(const rg::Base *seq, const size_t len, std::vector<pos_t> &ends) const {
+    const uint64_t mask = kmer_mask(_k);
+    uint64_t bits = 0;
+    unsigned have = 0;
+    for (size_t j = 0; j < len; ++j) {
+        if (seq[j] == rg::Base::N) {
+            have = 0;
+            continue;
+        }
+        bits = ((bits << 2) | (seq[j] - 1)) & mask;
+        if (have < _k) ++have;
+        if (have < _k) continue;
+        const auto hits = find(bits);
+        if (hits.first == hits.second || size_t(hits.second - hits.first) > _max_occ) continue;
+        for (auto e = hits.first; e != hits.second; ++e) ends.push_back(e->pos + (len - 1 - j));
+    }
+}
+
+void vargas::KmerIndex::windows(const rg::Base *seq, const size_t len, const bool revcomp,
+                                std::vector<KmerWindow> &out) const {
+    out.clear();
+    if (_k == 0 || len < _k) return;
+    std::vector<pos_t> ends;
+    _seed(seq, len, ends);
+    if (revcomp) {
+        std::vector<rg::Base> rc(len);
+        for (size_t j = 0; j < len; ++j) {
+            rc[len - 1 - j] = seq[j] == rg::Base::N ? rg::Base::N : rg::Base(5 - seq[j]);
+        }
+        _seed(rc.data(), len, ends);
+    }
+    if (ends.empty()) return;
+
+    std::sort(ends.begin(), ends.end());
+    for (size_t i = 0, j; i < ends.size(); i = j) {
+        for (j = i + 1; j < ends.size() && ends[j] - ends[i] <= len; ++j);
+        const pos_t min = ends[i] > 2 * len ? ends[i] - 2 * len : 0;
+        out.push_back({min, pos_t(ends[j - 1] + len), unsigned(j - i)});
+    }
+    std::stable_sort(out.begin(), out.end(), [](const KmerWindow &a, const KmerWindow &b) {
+        return a.hits > b.hits;
+    });
+    size_t keep = 1;
+    while (keep < out.size() && keep < _max_windows && out[keep].hits >= _min_hits) ++keep;
+    out.resize(keep);
+}
+
+TEST_CASE ("K-mer index") {
+    auto pack = [](const std::string &s) {
+        uint64_t bits = 0;
+        for (const auto b : rg::seq_to_num(s)) bits = (bits << 2) | (b - 1);
+        return bits;
+    };
+
+    SUBCASE("Variant paths") {
+        vargas::Graph::Node::_newID = 0;
+        vargas::Graph g;
+        /**
+         *     GGG
+         *    /   \
+         * AAA     TTT
+         *    \   /
+         *     CCC
+         */
+        const std::vector<std::pair<std::string, unsigned>> nodes = {{"AAA", 3}, {"CCC", 6}, {"GGG", 6}, {"TTT", 9}};
+        for (const auto &n : nodes) {
+            vargas::Graph::Node node;
+            node.set_endpos(n.second);
+            node.set_seq(n.first);
+            g.add_node(node);
+        }
+        g.add_edge(0, 1);
+        g.add_edge(0, 2);
+        g.add_edge(1, 3);
+        g.add_edge(2, 3);
+        vargas::CompiledGraph cg(g);
+
+        vargas::KmerIndex idx(cg, 4);
+        CHECK(idx.k() == 4);
+        CHECK(idx.size() == 12);
+        auto hit = idx.find(pack("AGGG"));
+        REQUIRE(hit.second - hit.first == 1);
+        CHECK(hit.first->pos == 6);
+        hit = idx.find(pack("GGTT"));
+        REQUIRE(hit.second - hit.first == 1);
+        CHECK(hit.first->pos == 8);
+        hit = idx.find(pack("CGTT"));
+        CHECK(hit.first == hit.second);
+
+        // One path into each node drops the GGG k-mers reaching into TTT
+        vargas::KmerIndex capped(cg, 4, 1);
+        CHECK(capped.size() < idx.size());
+
+        CHECK_THROWS(vargas::KmerIndex(cg, 0));
+        CHECK_THROWS(vargas::KmerIndex(cg, 33));
+    }
+
+    SUBCASE("Windows") {
+        std::mt19937 gen(7);
+        std::uniform_int_distribution<int> base(0, 3);
+        std::string ref;
+        for (int i = 0; i < 2000; ++i) ref.push_back("ACGT"[base(gen)]);
+        ref[1500] = 'N';
+        vargas::Graph::Node::_newID = 0;
+        vargas::Graph g;
+        vargas::Graph::Node node;
+        node.set_endpos(ref.size());
+        node.set_seq(ref);
+        g.add_node(node);
+        vargas::CompiledGraph cg(g);
+        vargas::KmerIndex idx(cg, 12);
+        CHECK(idx.size() == 2000 - 11 - 12);
+
+        // Bases 1001 to 1100
+        const auto read = rg::seq_to_num(ref.substr(1000, 100));
+        std::vector<vargas::KmerWindow> win;
+        idx.windows(read.data(), read.size(), false, win);
+        REQUIRE(win.size() >= 1);
+        CHECK(win[0].min <= 1001);
+        CHECK(win[0].max >= 1100);
+        CHECK(win[0].hits == 100 - 11);
+
+        const auto rc = rg::seq_to_num(rg::reverse_complement(ref.substr(1000, 100)));
+        idx.windows(rc.data(), rc.size(), false, win);
+        CHECK(win.empty());
+        idx.windows(rc.data(), rc.size(), true, win);
+        REQUIRE(win.size() >= 1);
+        CHECK(win[0].min <= 1001);
+        CHECK(win[0].max >= 1100);
+
+        const std::string file = "tmp_kmer_index.kmi";
+        idx.write(file);
+        vargas::KmerIndex mapped(file);
+        CHECK(mapped.k() == 12);
+        CHECK(mapped.size() == idx.size());
+        mapped.check(cg);
+        mapped.windows(read.data(), read.size(), false, win);
+        REQUIRE(win.size() >= 1);
+        CHECK(win[0].min <= 1001);
+        CHECK(win[0].max >= 1100);
+
+        // An index of another graph is rejected
+        vargas::Graph::Node::_newID = 0;
+        vargas::Graph other;
+        vargas::Graph::Node shorter;
+        shorter.set_endpos(ref.size() - 1);
+        shorter.set_seq(ref.substr(1));
+        other.add_node(shorter);
+        CHECK_THROWS(mapped.check(vargas::CompiledGraph(other)));
+
+        // Older indices do not record the graph
+        {
+            std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+            const uint32_t v1 = 1;
+            f.seekp(offsetof(vargas::kmi::Header, version));
+            f.write(reinterpret_cast<const char *>(&v1), sizeof(v1));
+        }
+        vargas::KmerIndex old;
+        CHECK_THROWS(old.open(file));
+        remove(file.c_str());
+    }
+}
@@ -18,7 +18,11 @@
 
 #include "main.h"
 #include "align_main.h"
+#include "bench.h"
+#include "serve.h"
+#include "shard.h"
 #include "graphman.h"
+#include "kmer_index.h"
 #include "threadpool.h"
 
 #include <iostream>
@@ -27,7 +31,7 @@
 #include <mutex>
 
 int main(int argc, char *argv[]) {
-    srand(time(nullptr)); // Rand used in profiles and sim
+    srand(time(nullptr)); // Rand used in profiles
 
     try {
         if (argc > 1) {
@@ -49,6 +53,12 @@ int main(int argc, char *argv[]) {
                 return convert_main(argc - 1, argv + 1);
             } else if (!strcmp(argv[1], "query")) {
                 return query_main(argc - 1, argv + 1);
+            } else if (!strcmp(argv[1], "bench")) {
+                return bench_main(argc - 1, argv + 1);
+            } else if (!strcmp(argv[1], "serve")) {
+                return serve_main(argc - 1, argv + 1);
+            } else if (!strcmp(argv[1], "merge")) {
+                return merge_main(argc - 1, argv + 1);
             }
         }
     } catch (std::exception &e) {
@@ -66,8 +76,9 @@ int main(int argc, char *argv[]) {
 
 int define_main(int argc, char *argv[]) {
     std::string fasta_file, varfile, region, out_file, sample_filter, subdef;
-    bool not_contig = false;
+    bool not_contig = false, binary = false;
     size_t varlim = 0;
+    unsigned kmer = 0, threads = 1;
 
     cxxopts::Options opts("vargas define", "Define subgraphs deriving from a reference and VCF file.");
     try {
@@ -81,7 +92,10 @@ int define_main(int argc, char *argv[]) {
         ("s,subgraph", "<str> Subgraph definitions, see below.", cxxopts::value(subdef))
         ("p,filter", "<str> Filter by sample names in file.", cxxopts::value(sample_filter))
         ("n,limvar", "<N> Limit to the first N variant records", cxxopts::value(varlim))
-        ("c,notcontig", "VCF records for a given contig are not contiguous.", cxxopts::value(not_contig)->implicit_value("true"));
+        ("c,notcontig", "VCF records for a given contig are not contiguous.", cxxopts::value(not_contig)->implicit_value("true"))
+        ("b,binary", "Write a binary graph file.", cxxopts::value(binary)->implicit_value("true"))
+        ("k,kmer", "<N> Also write an index of base graph N-mers for align --prefilter, N <= 32.", cxxopts::value(kmer))
+        ("j,threads", "<N> Number of regions to build concurrently.", cxxopts::value(threads)->default_value("1"));
 
         opts.add_options()("h,help", "Display this message.");
         opts.parse(argc, argv);
@@ -96,6 +110,10 @@ int define_main(int argc, char *argv[]) {
         define_help(opts);
         throw std::invalid_argument("FASTA file required.");
     }
+    if (kmer && out_file.empty()) {
+        throw std::invalid_argument("An output file is required to write a k-mer index alongside it.");
+    }
+    if (kmer > 32) throw std::invalid_argument("K-mer length must be at most 32.");
 
     vargas::GraphMan gm;
     gm.print_progress();
@@ -116,6 +134,7 @@ int define_main(int argc, char *argv[]) {
     }
 
     if (!not_contig) gm.assume_contig_chr();
+    gm.set_threads(threads);
     gm.create_base(fasta_file, varfile, region_vec, sample_filter, varlim);
 
     if (!subdef.empty()) {
@@ -127,7 +146,15 @@ int define_main(int argc, char *argv[]) {
     }
 
     std::cerr << "Writing to \"" << out_file << "\"...\n";
-    gm.write(out_file);
+    gm.write(out_file, binary);
+
+    if (kmer) {
+        const std::string index_file = vargas::KmerIndex::filename(out_file);
+        std::cerr << "Indexing " << kmer << "-mers to \"" << index_file << "\"...\n";
+        vargas::KmerIndex index(*gm.compiled("base"), kmer);
+        std::cerr << index.size() << "\tK-mers.\n";
+        index.write(index_file);
+    }
     return 0;
 }
 
@@ -138,22 +165,35 @@ struct main_helper {
      &task_list;
     vargas::GraphMan &gm;
     int num_reads;
-    std::mutex &m;
     vargas::osam &out;
+    uint64_t seed;
+    // Last task and simulator used by each thread
+    std::vector<std::pair<size_t, std::unique_ptr<vargas::Sim>>> &sims;
 };
-void main_helper_func(void *data, long index, int) {
+
+// Reads per work item. Each chunk draws from its own stream so output does not depend on threads.
+static constexpr int SIM_CHUNK = 4096;
+
+void main_helper_func(void *data, long index, int tid) {
     main_helper &help = *(main_helper *)data;
     auto &task_list = help.task_list;
     auto &gm = help.gm;
-    const std::string &label = task_list.at(index).first;
-    auto subgraph_ptr = gm.at(label);
-    vargas::Sim sim(*subgraph_ptr, task_list[index].second.second);
-    auto results = sim.get_batch(help.num_reads, gm.resolver());
-    for(auto &r: results) r.aux.set("RG", task_list[index].second.first);
-    {
-        std::lock_guard<std::mutex> lock(help.m);
-        for(const auto &r: results) help.out.add_record(r);
-    }
+    const int chunks = (help.num_reads + SIM_CHUNK - 1) / SIM_CHUNK;
+    const size_t task = index / chunks;
+    const int chunk = index % chunks;
+    auto &sim = help.sims.at(tid);
+    if (!sim.second || sim.first != task) {
+        auto subgraph_ptr = gm.at(task_list.at(task).first);
+        sim.first = task;
+        sim.second.reset(new vargas::Sim(*subgraph_ptr, task_list[task].second.second));
+    }
+    sim.second->seed(help.seed, index);
+    const int n = std::min(SIM_CHUNK, help.num_reads - chunk * SIM_CHUNK);
+    auto results = sim.second->get_batch(n, gm.resolver());
+    for(auto &r: results) r.aux.set("RG", task_list[task].second.first);
+    std::string buff;
+    help.out.serialize(results, buff);
+    help.out.write_chunk(std::move(buff), index);
 }
 
 int sim_main(int argc, char *argv[]) {
@@ -165,6 +205,7 @@ int sim_main(int argc, char *argv[]) {
     }
 
     int read_len, num_reads, threads;
+    uint64_t seed;
     std::string mut, indel, vnodes, vbases, gdf_file, out_file, sim_src;
     bool use_rate = false, sim_src_isfile = false;
 
@@ -179,7 +220,8 @@ int sim_main(int argc, char *argv[]) {
         ("f,file", "-s specifies a filename.", cxxopts::value(sim_src_isfile))
         ("l,rlen", "<N> Read length.", cxxopts::value(read_len)->default_value("50"))
         ("n,numreads", "<N> Number of reads to generate.", cxxopts::value(num_reads)->default_value("1000"))
-        ("j,threads", "<N> Number of threads.", cxxopts::value(threads)->default_value("1"));
+        ("j,threads", "<N> Number of threads.", cxxopts::value(threads)->default_value("1"))
+        ("r,seed", "<N> Random seed, output is identical for a seed. (default: random)", cxxopts::value(seed));
 
         opts.add_options("Stratum")
         ("v,vnodes", "<N1,...> Variant nodes. \'*\' for any.", cxxopts::value(vnodes)->default_value("*"))
@@ -303,6 +345,7 @@ int sim_main(int argc, char *argv[]) {
               << sam_hdr.read_groups.size() << " read group(s) over "
               << subdef_split.size() << " subgraph(s). " << std::endl;
 
+    if (vargas::SAM::format(out_file) != vargas::SAM::Format::SAM) add_contigs(sam_hdr, gm);
     vargas::osam out(out_file, sam_hdr);
     if (!out.good()) throw std::invalid_argument("Error opening output file \"" + out_file + "\"");
 
@@ -322,11 +365,18 @@ int sim_main(int argc, char *argv[]) {
         }
     }
 
-    const size_t num_tasks = task_list.size();
+    if (!opts.count("r")) {
+        std::random_device rd;
+        seed = (uint64_t(rd()) << 32) | rd();
+    }
+    if (threads < 1) threads = 1;
+    const size_t num_tasks = num_reads > 0 ? task_list.size() * ((num_reads + SIM_CHUNK - 1) / SIM_CHUNK) : 0;
     rg::ForPool fp(threads);
-    std::mutex mutex;
-    main_helper data{task_list, gm, num_reads, mutex, out};
+    out.start_writer(size_t(64) << 20, true);
+    std::vector<std::pair<size_t, std::unique_ptr<vargas::Sim>>> sims(threads);
+    main_helper data{task_list, gm, num_reads, out, seed, sims};
     fp.forpool(&main_helper_func, (void *)&data, num_tasks);
+    out.close();
 
     std::cerr << rg::chrono_duration(start_time) << " seconds." << std::endl;
 
@@ -465,15 +515,17 @@ int profile(int argc, char *argv[]) {
 }
 
 int query_main(int argc, char *argv[]) {
-    std::string gdef, dot, stat, meta, out;
+    std::string gdef, dot, stat, meta, out, binary, text;
 
-    cxxopts::Options opts("vargas query", "Query a graph and export a DOT graph.");
+    cxxopts::Options opts("vargas query", "Query a graph, export a DOT graph, or convert the graph file.");
     try {
         opts.add_options()
         ("g,graph", "*<str> Graph file to query.", cxxopts::value(gdef))
         ("d,dot", "<str> Subgraph to export as a DOT graph.", cxxopts::value(dot))
         ("t,out", "<str> DOT output file.", cxxopts::value(out)->default_value("stdout"))
         ("a,stat", "<str> Print statistics about a subgraph \'-\' for all.", cxxopts::value(stat)->implicit_value("-"))
+        ("b,binary", "<str> Convert the graph file to a binary graph file.", cxxopts::value(binary))
+        ("x,text", "<str> Convert the graph file to a text graph file.", cxxopts::value(text))
         ("h,help", "Display this message.");
         opts.parse(argc, argv);
     } catch (std::exception &e) {
@@ -490,8 +542,17 @@ int query_main(int argc, char *argv[]) {
     }
 
     vargas::GraphMan gg;
-    if (!dot.empty() || stat.size()) gg.open(gdef);
-    else gg.open(gdef);
+    gg.open(gdef);
+
+    if (!binary.empty()) {
+        std::cerr << "Writing binary graph to \"" << binary << "\"...\n";
+        gg.write(binary, true);
+    }
+
+    if (!text.empty()) {
+        std::cerr << "Writing text graph to \"" << text << "\"...\n";
+        gg.write(text, false);
+    }
 
     if (!dot.empty()) {
         if (out == "stdout") std::cout << gg.at(dot)->to_DOT(dot);
@@ -521,7 +582,10 @@ void main_help() {
     cerr << "\tsim             Simulate reads from a set of graphs.\n";
     cerr << "\talign           Align reads to a set of graphs.\n";
     cerr << "\tconvert         Convert a SAM file to a CSV file.\n";
-    cerr << "\tquery           Convert a graph to DOT format.\n";
+    cerr << "\tquery           Convert a graph to DOT or binary format.\n";
+    cerr << "\tbench           Benchmark aligner kernels and I/O on synthetic data.\n";
+    cerr << "\tserve           Serve align jobs with graphs kept in memory.\n";
+    cerr << "\tmerge           Merge the partial results of graph shards into SAM.\n";
     cerr << "\ttest            Run unit tests.\n\n";
 
 }
@@ -632,10 +696,11 @@ chrB	80	rs796688738	C	AC,<CN0>	.	.	.	.)";
         CHECK(cnt == 8);
     }
 
-    {
-        // vargas align -g tmpgdef.vatmp -U tmpreads.vatmp -S tmpreads.vatmp -f
-        const int argc = 9;
-        const char *argv[] = {"vargas", "align", "-g", "tmpgdef.vatmp", "-U", "tmpreads.vatmp", "-S", "tmpsam.vatmp", "-f"};
+    for (const bool numa : {false, true}) {
+        // vargas align -g tmpgdef.vatmp -U tmpreads.vatmp -S tmpreads.vatmp -f [-j 2 --numa --hugepages]
+        const int argc = numa ? 13 : 9;
+        const char *argv[] = {"vargas", "align", "-g", "tmpgdef.vatmp", "-U", "tmpreads.vatmp", "-S", "tmpsam.vatmp", "-f",
+                              "-j", "2", "--numa", "--hugepages"};
         align_main(argc, (char **) argv);
         vargas::isam in("tmpsam.vatmp");
         REQUIRE(in.header().read_groups.size() == 8);
@@ -0,0 +1,231 @@
+/**
+ * @brief
+ * Compressed, immutable sets of individuals, and a store that deduplicates them.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "population.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <random>
+
+namespace {
+  // Bits of the last word that are inside a set of len bits
+  uint64_t tail_mask(size_t len) {
+      return len % 64 ? (uint64_t(1) << (len % 64)) - 1 : ~uint64_t(0);
+  }
+
+  uint64_t word(const vargas::PackedPopulation::Population &pop, size_t i) {
+      return pop.bitset()[i].to_ullong();
+  }
+}
+
+vargas::PackedPopulation::PackedPopulation(const Population &pop) : _size(pop.size()) {
+    const size_t nwords = (_size + 63) / 64;
+    std::vector<uint64_t> words(nwords);
+    uint64_t count = 0;
+    for (size_t i = 0; i < nwords; ++i) {
+        words[i] = word(pop, i);
+        if (i == nwords - 1) words[i] &= tail_mask(_size);
+        count += __builtin_popcountll(words[i]);
+    }
+    _count = count;
+
+    if (_count == 0) return;
+    if (_count == _size) {
+        _enc = Encoding::FULL;
+        return;
+    }
+
+    // Indices take 4 bytes each and words 8, pick the smaller
+    auto data = std::make_shared<Data>();
+    const bool sparse = _count < 2 * nwords, excluded = _size - _count < 2 * nwords;
+    if (sparse || excluded) {
+        _enc = sparse ? Encoding::SPARSE : Encoding::EXCLUDED;
+        data->idx.reserve(sparse ? _count : _size - _count);
+        for (size_t i = 0; i < nwords; ++i) {
+            uint64_t w = sparse ? words[i] : ~words[i] & (i == nwords - 1 ? tail_mask(_size) : ~uint64_t(0));
+            while (w) {
+                data->idx.push_back(i * 64 + __builtin_ctzll(w));
+                w &= w - 1;
+            }
+        }
+    } else {
+        _enc = Encoding::DENSE;
+        data->words = std::move(words);
+    }
+    _data = data;
+}
+
+bool vargas::PackedPopulation::at(const size_t idx) const {
+    if (idx >= _size) throw std::range_error("Index out of bounds.");
+    switch (_enc) {
+        case Encoding::EMPTY:
+            return false;
+        case Encoding::FULL:
+            return true;
+        case Encoding::SPARSE:
+            return std::binary_search(_data->idx.begin(), _data->idx.end(), idx);
+        case Encoding::EXCLUDED:
+            return !std::binary_search(_data->idx.begin(), _data->idx.end(), idx);
+        default:
+            return (_data->words[idx / 64] >> (idx % 64)) & 1;
+    }
+}
+
+bool vargas::PackedPopulation::intersects(const Population &filter) const {
+    if (filter.size() != _size) {
+        throw std::invalid_argument("Incompatible dimension :" + std::to_string(_size) + "," + std::to_string(filter.size()));
+    }
+    const size_t nwords = (_size + 63) / 64;
+    switch (_enc) {
+        case Encoding::EMPTY:
+            return false;
+        case Encoding::FULL:
+            for (size_t i = 0; i < nwords; ++i) {
+                if (word(filter, i) & (i == nwords - 1 ? tail_mask(_size) : ~uint64_t(0))) return true;
+            }
+            return false;
+        case Encoding::SPARSE:
+            for (const uint32_t i : _data->idx) {
+                if (filter.bitset()[i / 64][i % 64]) return true;
+            }
+            return false;
+        case Encoding::EXCLUDED: {
+            // Any filter bit left after clearing the excluded ones
+            auto e = _data->idx.begin();
+            for (size_t i = 0; i < nwords; ++i) {
+                uint64_t w = word(filter, i) & (i == nwords - 1 ? tail_mask(_size) : ~uint64_t(0));
+                for (; e != _data->idx.end() && *e / 64 == i; ++e) w &= ~(uint64_t(1) << (*e % 64));
+                if (w) return true;
+            }
+            return false;
+        }
+        default:
+            for (size_t i = 0; i < nwords; ++i) {
+                if (word(filter, i) & _data->words[i]) return true;
+            }
+            return false;
+    }
+}
+
+vargas::PackedPopulation::Population vargas::PackedPopulation::unpack() const {
+    // Bits past the end are left unset, unlike Population(len, true)
+    Population ret(_size, false);
+    if (_enc == Encoding::SPARSE) {
+        for (const uint32_t i : _data->idx) ret.set(i);
+    } else if (_enc != Encoding::EMPTY) {
+        for (size_t i = 0; i < _size; ++i) ret.set(i, at(i));
+    }
+    return ret;
+}
+
+size_t vargas::PackedPopulation::bytes() const {
+    if (!_data) return 0;
+    return _data->idx.size() * sizeof(uint32_t) + _data->words.size() * sizeof(uint64_t);
+}
+
+bool vargas::PackedPopulation::operator==(const PackedPopulation &o) const {
+    if (_size != o._size || _count != o._count || _enc != o._enc) return false;
+    if (_data == o._data) return true;
+    return _data->idx == o._data->idx && _data->words == o._data->words;
+}
+
+uint64_t vargas::PackedPopulation::_hash() const {
+    // FNV-1a over the stored values
+    uint64_t h = 14695981039346656037ULL ^ uint64_t(_enc);
+    if (_data) {
+        for (const uint32_t i : _data->idx) h = (h ^ i) * 1099511628211ULL;
+        for (const uint64_t w : _data->words) h = (h ^ w) * 1099511628211ULL;
+    }
+    return (h ^ _size) * 1099511628211ULL;
+}
+
+vargas::PackedPopulation vargas::PopulationStore::intern(const Population &pop) {
+    PackedPopulation p(pop);
+    if (!p._data) return p;
+    auto &bucket = _sets[p._hash()];
+    for (const auto &s : bucket) {
+        if (s == p) return s;
+    }
+    bucket.push_back(p);
+    ++_size;
+    _bytes += p.bytes();
+    return p;
+}
+
+TEST_CASE ("Packed population") {
+    using Population = vargas::PackedPopulation::Population;
+    using Encoding = vargas::PackedPopulation::Encoding;
+
+    SUBCASE("Encodings") {
+        Population pop(300, false);
+        CHECK(vargas::PackedPopulation(pop).encoding() == Encoding::EMPTY);
+        pop.set(5);
+        pop.set(299);
+        vargas::PackedPopulation sparse(pop);
+        CHECK(sparse.encoding() == Encoding::SPARSE);
+        CHECK(sparse.count() == 2);
+        CHECK(sparse.bytes() == 8);
+        CHECK(sparse.at(299));
+        CHECK(!sparse.at(6));
+        CHECK_THROWS(sparse.at(300));
+
+        vargas::PackedPopulation excluded(~pop);
+        CHECK(excluded.encoding() == Encoding::EXCLUDED);
+        CHECK(excluded.count() == 298);
+        CHECK(!excluded.at(5));
+        CHECK(excluded.at(6));
+
+        // Bits past the end of a full bitset are set, and are not counted
+        CHECK(vargas::PackedPopulation(Population(300, true)).encoding() == Encoding::FULL);
+        CHECK(vargas::PackedPopulation(300, true).intersects(pop));
+        CHECK(!vargas::PackedPopulation(300, false).intersects(pop));
+
+        for (size_t i = 0; i < 300; i += 3) pop.set(i);
+        vargas::PackedPopulation dense(pop);
+        CHECK(dense.encoding() == Encoding::DENSE);
+        CHECK(dense.bytes() == 40);
+        CHECK(dense.unpack() == pop);
+        CHECK(excluded.unpack() == ~sparse.unpack());
+        CHECK_THROWS(dense.intersects(Population(10, true)));
+    }
+
+    SUBCASE("Matches bitsets") {
+        std::mt19937 gen(3);
+        for (const double density : {0.001, 0.05, 0.5, 0.95, 0.999}) {
+            std::bernoulli_distribution bit(density);
+            for (const size_t len : {1, 63, 64, 65, 1000}) {
+                Population a(len), b(len);
+                for (size_t i = 0; i < len; ++i) {
+                    a.set(i, bit(gen));
+                    b.set(i, bit(gen));
+                }
+                vargas::PackedPopulation pa(a);
+                CHECK(pa.count() == a.count());
+                CHECK(pa.unpack() == a);
+                CHECK(pa.intersects(b) == (a && b));
+                for (size_t i = 0; i < len; ++i) CHECK(pa.at(i) == a.at(i));
+            }
+        }
+    }
+
+    SUBCASE("Store") {
+        vargas::PopulationStore store;
+        Population a(1000), b(1000);
+        a.set(10);
+        b.set(11);
+        auto p1 = store.intern(a), p2 = store.intern(a), p3 = store.intern(b);
+        store.intern(Population(1000, true));
+        CHECK(p1 == p2);
+        CHECK(p1 != p3);
+        CHECK(store.size() == 2);
+        CHECK(store.bytes() == 8);
+    }
+}
@@ -20,6 +20,8 @@
 #include "doctest.h"
 #include <assert.h>
 #include <numeric>
+#include <cstring>
+#include <limits>
 
 const std::string vargas::SAM::Record::REQUIRED_POS = "POS";
 const std::string vargas::SAM::Record::REQUIRED_QNAME = "QNAME";
@@ -33,6 +35,118 @@ const std::string vargas::SAM::Record::REQUIRED_MAPQ = "MAPQ";
 const std::string vargas::SAM::Record::REQUIRED_TLEN = "TLEN";
 const std::string vargas::SAM::Record::REQUIRED_QUAL = "QUAL";
 
+namespace {
+  // Little endian value of an htslib aux field, advances p
+  template<typename T>
+  T aux_value(const uint8_t *&p) {
+      T v;
+      std::memcpy(&v, p, sizeof(T));
+      p += sizeof(T);
+      return v;
+  }
+
+  // Value of an aux field of the given type as SAM text, advances p. BAM only types are converted.
+  std::string aux_string(char type, const uint8_t *&p) {
+      switch (type) {
+          case 'A': return std::string(1, char(*p++));
+          case 'c': return rg::to_string(int(aux_value<int8_t>(p)));
+          case 'C': return rg::to_string(int(aux_value<uint8_t>(p)));
+          case 's': return rg::to_string(aux_value<int16_t>(p));
+          case 'S': return rg::to_string(aux_value<uint16_t>(p));
+          case 'i': return rg::to_string(aux_value<int32_t>(p));
+          case 'I': return rg::to_string(aux_value<uint32_t>(p));
+          case 'f': return rg::to_string(aux_value<float>(p));
+          case 'd': return rg::to_string(aux_value<double>(p));
+          default: throw std::invalid_argument("Invalid aux type: " + std::string(1, type));
+      }
+  }
+
+  template<typename T>
+  void append_value(std::string &buff, T v) {
+      buff.append(reinterpret_cast<const char *>(&v), sizeof(T));
+  }
+
+  // Append a SAM aux value in htslib encoding, integers are stored as 32 bits
+  void append_aux(std::string &buff, const std::string &tag, char fmt, const std::string &val) {
+      if (tag.length() != 2) throw std::invalid_argument("Invalid aux tag: " + tag);
+      buff += tag;
+      switch (fmt) {
+          case 'A':
+              buff += 'A';
+              buff += val.empty() ? ' ' : val[0];
+              break;
+          case 'i': {
+              const long long v = std::stoll(val);
+              if (v > std::numeric_limits<int32_t>::max()) {
+                  buff += 'I';
+                  append_value<uint32_t>(buff, v);
+              } else {
+                  buff += 'i';
+                  append_value<int32_t>(buff, v);
+              }
+              break;
+          }
+          case 'f':
+              buff += 'f';
+              append_value<float>(buff, std::stof(val));
+              break;
+          case 'B': {
+              // Subtype followed by comma separated values
+              const std::vector<std::string> vals = rg::split(val, ',');
+              if (vals.empty() || vals[0].length() != 1) throw std::invalid_argument("Invalid B array: " + val);
+              const char sub = vals[0][0];
+              buff += 'B';
+              buff += sub;
+              append_value<uint32_t>(buff, vals.size() - 1);
+              for (size_t i = 1; i < vals.size(); ++i) {
+                  switch (sub) {
+                      case 'c': append_value<int8_t>(buff, std::stoi(vals[i])); break;
+                      case 'C': append_value<uint8_t>(buff, std::stoi(vals[i])); break;
+                      case 's': append_value<int16_t>(buff, std::stoi(vals[i])); break;
+                      case 'S': append_value<uint16_t>(buff, std::stoi(vals[i])); break;
+                      case 'i': append_value<int32_t>(buff, std::stol(vals[i])); break;
+                      case 'I': append_value<uint32_t>(buff, std::stoul(vals[i])); break;
+                      case 'f': append_value<float>(buff, std::stof(vals[i])); break;
+                      default: throw std::invalid_argument("Invalid B array type: " + val);
+                  }
+              }
+              break;
+          }
+          default:
+              buff += fmt == 'H' ? 'H' : 'Z';
+              buff.append(val.c_str(), val.size() + 1);
+      }
+  }
+}
+
+vargas::SAM::Format vargas::SAM::format(const std::string &file_name) {
+    auto ends_with = [&file_name](const std::string &ext) {
+        return file_name.length() >= ext.length() &&
+        file_name.compare(file_name.length() - ext.length(), ext.length(), ext) == 0;
+    };
+    if (ends_with(".bam")) return Format::BAM;
+    if (ends_with(".cram")) return Format::CRAM;
+    return Format::SAM;
+}
+
+vargas::SAM::Format vargas::SAM::parse_format(const std::string &fmt) {
+    if (fmt == "sam") return Format::SAM;
+    if (fmt == "bam") return Format::BAM;
+    if (fmt == "cram") return Format::CRAM;
+    throw std::invalid_argument("Invalid SAM format \"" + fmt + "\", expected sam, bam, or cram.");
+}
+
+int vargas::SAM::_close_hts() {
+    int ret = 0;
+    if (_hts) ret = sam_close(_hts);
+    if (_bhdr) bam_hdr_destroy(_bhdr);
+    if (_b) bam_destroy1(_b);
+    _hts = nullptr;
+    _bhdr = nullptr;
+    _b = nullptr;
+    return ret;
+}
+
 void vargas::SAM::Optional::add(std::string a) {
     const std::vector<std::string> s = rg::split(a, ':');
     assert(s[0].length() == 2);
@@ -384,6 +498,17 @@ void vargas::isam::open(std::string file_name) {
         _use_stdio = true;
         open(std::cin);
     }
+    else if (format(file_name) != Format::SAM) {
+        _use_stdio = false;
+        _hts = sam_open(file_name.c_str(), "r");
+        if (!_hts) throw std::invalid_argument("Error opening file \"" + file_name + "\"");
+        if (_threads > 0) hts_set_threads(_hts, _threads);
+        _bhdr = sam_hdr_read(_hts);
+        if (!_bhdr) throw std::invalid_argument("Error reading header of \"" + file_name + "\"");
+        if (_bhdr->l_text > 0) _hdr << std::string(_bhdr->text, _bhdr->l_text);
+        _b = bam_init1();
+        if (sam_read1(_hts, _bhdr, _b) >= 0) _decode(_pprec);
+    }
     else {
         _use_stdio = false;
         in.open(file_name);
@@ -394,21 +519,20 @@ void vargas::isam::open(std::string file_name) {
 
 void vargas::isam::subset(size_t n) {
     if (!good()) throw std::invalid_argument("No records available.");
-    std::vector<Record> pending;
-    do { pending.push_back(_pprec); } while (next());
-    if (pending.size() == 0) throw std::invalid_argument("No records available.");
+    if (n == 0) return; // Keep all, records continue to stream from the file
 
-    std::vector<size_t> idx(pending.size());
-    std::iota(idx.begin(), idx.end(), 0);
-    std::random_shuffle(idx.begin(), idx.begin());
+    // Reservoir sample includes the currently loaded record
+    bool first = true;
+    std::mt19937 gen(rand());
+    auto pending = rg::reservoir_sample<Record>([&](Record &r) {
+        if (!first && !next()) return false;
+        first = false;
+        r = _pprec;
+        return true;
+    }, n, gen);
+    if (pending.size() == 0) throw std::invalid_argument("No records available.");
 
-    if (n >= pending.size() || n == 0) {
-        _buff = pending;
-    } else {
-        for (size_t i = 0; i < n; ++i) {
-            _buff.push_back(pending[idx[i]]);
-        }
-    }
+    _buff = std::move(pending);
     next();
 }
 
@@ -419,20 +543,266 @@ bool vargas::isam::next() {
         return true;
     }
 
+    if (_hts) {
+        if (sam_read1(_hts, _bhdr, _b) < 0) return false;
+        _decode(_pprec);
+        return true;
+    }
+
     if (!std::getline((_use_stdio ? std::cin : in), _curr_line)) return false;
     _pprec.parse(_curr_line);
     return true;
 }
 
-void vargas::osam::open(std::string file_name) {
-    close();
-    if (file_name.length() == 0) _use_stdio = true;
+void vargas::isam::_decode(SAM::Record &rec) const {
+    const bam1_core_t &c = _b->core;
+    auto ref = [this](int32_t tid) { return tid < 0 ? std::string("*") : std::string(_bhdr->target_name[tid]); };
+
+    rec.query_name = bam_get_qname(_b);
+    rec.flag = c.flag;
+    rec.ref_name = ref(c.tid);
+    rec.pos = c.pos + 1;
+    rec.mapq = c.qual;
+    rec.ref_next = c.mtid >= 0 && c.mtid == c.tid ? "=" : ref(c.mtid);
+    rec.pos_next = c.mpos + 1;
+    rec.tlen = c.isize;
+
+    rec.cigar.clear();
+    const uint32_t *cigar = bam_get_cigar(_b);
+    for (uint32_t i = 0; i < c.n_cigar; ++i) rec.cigar.push_back(bam_cigar_oplen(cigar[i]), bam_cigar_opchr(cigar[i]));
+
+    const uint8_t *seq = bam_get_seq(_b), *qual = bam_get_qual(_b);
+    if (c.l_qseq == 0) rec.seq = "*";
     else {
-        _use_stdio = false;
-        out.open(file_name);
-        if (!out.good()) throw std::invalid_argument("Error opening output file \"" + file_name + "\"");
+        rec.seq.resize(c.l_qseq);
+        for (int32_t i = 0; i < c.l_qseq; ++i) rec.seq[i] = seq_nt16_str[bam_seqi(seq, i)];
+    }
+    if (c.l_qseq == 0 || qual[0] == 0xff) rec.qual = "*";
+    else {
+        rec.qual.resize(c.l_qseq);
+        for (int32_t i = 0; i < c.l_qseq; ++i) rec.qual[i] = char(qual[i] + 33);
+    }
+
+    // Each field is a two char tag, a type, and the value
+    rec.aux.clear();
+    const uint8_t *p = bam_get_aux(_b), *end = _b->data + _b->l_data;
+    while (end - p >= 4) {
+        const std::string tag(reinterpret_cast<const char *>(p), 2);
+        const char type = p[2];
+        p += 3;
+        if (type == 'Z' || type == 'H') {
+            const char *s = reinterpret_cast<const char *>(p);
+            rec.aux.aux[tag] = s;
+            rec.aux.aux_fmt[tag] = type;
+            p += std::strlen(s) + 1;
+        } else if (type == 'B') {
+            const char sub = *p++;
+            const uint32_t n = aux_value<uint32_t>(p);
+            std::string val(1, sub);
+            for (uint32_t i = 0; i < n; ++i) {
+                val += ',';
+                val += aux_string(sub, p);
+            }
+            rec.aux.aux[tag] = val;
+            rec.aux.aux_fmt[tag] = 'B';
+        } else {
+            rec.aux.aux[tag] = aux_string(type, p);
+            rec.aux.aux_fmt[tag] = type == 'A' ? 'A' : type == 'f' || type == 'd' ? 'f' : 'i';
+        }
+    }
+}
+
+void vargas::osam::open(std::string file_name, Format fmt) {
+    close();
+    _fmt = fmt;
+    _use_stdio = file_name.length() == 0;
+    if (fmt == Format::SAM) {
+        if (!_use_stdio) {
+            out.open(file_name);
+            if (!out.good()) throw std::invalid_argument("Error opening output file \"" + file_name + "\"");
+        }
+        (_use_stdio ? std::cout : out) << _hdr.to_string() << std::flush;
+        return;
+    }
+
+    _hts = sam_open(_use_stdio ? "-" : file_name.c_str(), fmt == Format::BAM ? "wb" : "wc");
+    if (!_hts) throw std::invalid_argument("Error opening output file \"" + file_name + "\"");
+    // Records of graph alignments need not match a linear reference
+    if (fmt == Format::CRAM) hts_set_opt(_hts, CRAM_OPT_NO_REF, 1);
+    if (_threads > 0) hts_set_threads(_hts, _threads);
+
+    const std::string text = _hdr.to_string();
+    _bhdr = sam_hdr_parse(text.length(), text.c_str());
+    if (!_bhdr) throw std::invalid_argument("Invalid SAM header.");
+    if (!_bhdr->text) {
+        _bhdr->l_text = text.length();
+        _bhdr->text = strdup(text.c_str());
+    }
+    if (sam_hdr_write(_hts, _bhdr) < 0) throw std::runtime_error("Error writing header to \"" + file_name + "\"");
+    _tids.clear();
+    for (int32_t i = 0; i < _bhdr->n_targets; ++i) _tids[_bhdr->target_name[i]] = i;
+    _b = bam_init1();
+}
+
+void vargas::osam::close() {
+    stop_writer();
+    if (_use_stdio && _fmt == Format::SAM) std::cout.flush();
+    if (out.is_open()) {
+        out.close();
+    }
+    if (_close_hts() < 0) throw std::runtime_error("Error closing SAM output.");
+}
+
+void vargas::osam::_encode(const SAM::Record &r, std::string &buff) const {
+    auto tid = [this](const std::string &name) {
+        const auto t = _tids.find(name);
+        return t == _tids.end() ? -1 : t->second;
+    };
+    const std::string qname = r.query_name.empty() ? "*" : r.query_name;
+    // htslib pads the name with NULs so the CIGAR that follows is 4 byte aligned
+    const size_t extranul = (4 - (qname.length() + 1) % 4) % 4;
+    if (qname.length() + 1 + extranul > 255) throw std::invalid_argument("Query name too long: " + qname);
+
+    bam1_core_t c;
+    std::memset(&c, 0, sizeof(c));
+    c.tid = tid(r.ref_name);
+    c.pos = r.pos - 1;
+    c.qual = r.mapq;
+    c.flag = r.flag.encode();
+    c.l_qname = qname.length() + 1 + extranul;
+    c.l_extranul = extranul;
+    c.n_cigar = r.cigar.size();
+    c.l_qseq = r.seq == "*" ? 0 : r.seq.length();
+    c.mtid = r.ref_next == "=" ? c.tid : tid(r.ref_next);
+    c.mpos = r.pos_next - 1;
+    c.isize = r.tlen;
+
+    // Core, then the length of the variable length data
+    const size_t core = buff.size();
+    append_value(buff, c);
+    append_value<int32_t>(buff, 0);
+    const size_t data = buff.size();
+
+    buff.append(qname);
+    buff.append(1 + extranul, '\0');
+    int64_t ref_len = 0;
+    for (const auto &op : r.cigar) {
+        const char *o = std::strchr(BAM_CIGAR_STR, op.second);
+        if (!o || !op.second) throw std::invalid_argument("Invalid CIGAR operation: " + std::string(1, op.second));
+        append_value<uint32_t>(buff, uint32_t(op.first) << BAM_CIGAR_SHIFT | uint32_t(o - BAM_CIGAR_STR));
+        if (std::strchr("MDN=X", op.second)) ref_len += op.first;
+    }
+    for (int32_t i = 0; i < c.l_qseq; i += 2) {
+        const uint8_t hi = seq_nt16_table[uint8_t(r.seq[i])];
+        const uint8_t lo = i + 1 < c.l_qseq ? seq_nt16_table[uint8_t(r.seq[i + 1])] : 0;
+        buff += char(hi << 4 | lo);
+    }
+    if (r.qual == "*" || r.qual.length() != size_t(c.l_qseq)) buff.append(c.l_qseq, char(0xff));
+    else for (const char q : r.qual) buff += char(q - 33);
+    for (const auto &a : r.aux.aux) append_aux(buff, a.first, r.aux.aux_fmt.at(a.first), a.second);
+
+    c.bin = hts_reg2bin(c.pos, c.pos + (ref_len ? ref_len : 1), 14, 5);
+    std::memcpy(&buff[core], &c, sizeof(c));
+    const int32_t l_data = buff.size() - data;
+    std::memcpy(&buff[data - sizeof(int32_t)], &l_data, sizeof(int32_t));
+}
+
+bool vargas::osam::_write(const std::string &buff) {
+    if (_fmt == Format::SAM) {
+        std::ostream &os = _use_stdio ? std::cout : out;
+        os.write(buff.data(), buff.size());
+        return os.good();
+    }
+    size_t off = 0;
+    while (off < buff.size()) {
+        int32_t l_data;
+        std::memcpy(&_b->core, buff.data() + off, sizeof(bam1_core_t));
+        std::memcpy(&l_data, buff.data() + off + sizeof(bam1_core_t), sizeof(int32_t));
+        off += sizeof(bam1_core_t) + sizeof(int32_t);
+        if (size_t(_b->m_data) < size_t(l_data)) {
+            uint8_t *d = (uint8_t *) realloc(_b->data, l_data);
+            if (!d) return false;
+            _b->data = d;
+            _b->m_data = l_data;
+        }
+        std::memcpy(_b->data, buff.data() + off, l_data);
+        _b->l_data = l_data;
+        off += l_data;
+        if (sam_write1(_hts, _bhdr, _b) < 0) return false;
+    }
+    return true;
+}
+
+void vargas::osam::start_writer(size_t buffer_size, bool ordered) {
+    if (!good()) throw std::invalid_argument("No valid file open.");
+    stop_writer();
+    _buffer_size = buffer_size;
+    _ordered = ordered;
+    _next_index = 0;
+    _seq = 0;
+    _stop = false;
+    _failed = false;
+    _writer = std::thread(&osam::_write_loop, this);
+}
+
+void vargas::osam::stop_writer() {
+    if (!_writer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(_wmut);
+        _stop = true;
+    }
+    _wcv.notify_one();
+    _writer.join();
+    if (_failed) throw std::runtime_error("Error writing SAM output.");
+}
+
+void vargas::osam::write_chunk(std::string buff, size_t index) {
+    std::unique_lock<std::mutex> lock(_wmut);
+    if (!_writer.joinable()) {
+        if (!good()) throw std::invalid_argument("No valid file open.");
+        if (!_write(buff)) throw std::runtime_error("Error writing SAM output.");
+        return;
+    }
+    if (_failed) throw std::runtime_error("Error writing SAM output.");
+    if (!_ordered) index = _seq++;
+    // Next chunk in order is never held back, otherwise the writer could stall
+    _fcv.wait(lock, [&] {
+        return _pending_bytes < _buffer_size || _pending.empty() || (_ordered && index == _next_index);
+    });
+    _pending_bytes += buff.size();
+    const bool ready = index == _next_index;
+    _pending.emplace(index, std::move(buff));
+    lock.unlock();
+    if (ready) _wcv.notify_one();
+}
+
+void vargas::osam::_write_loop() {
+    std::ostream &os = _use_stdio ? std::cout : out;
+    std::string buff;
+    std::unique_lock<std::mutex> lock(_wmut);
+    while (true) {
+        _wcv.wait(lock, [&] { return _stop || (!_pending.empty() && _pending.begin()->first == _next_index); });
+        const bool stop = _stop;
+
+        // Coalesce all chunks that can be written, any gaps are written in order once stopped
+        buff.clear();
+        while (!_pending.empty() && (stop || _pending.begin()->first == _next_index)) {
+            buff += _pending.begin()->second;
+            _pending_bytes -= _pending.begin()->second.size();
+            _next_index = _pending.begin()->first + 1;
+            _pending.erase(_pending.begin());
+        }
+        lock.unlock();
+        _fcv.notify_all();
+
+        bool failed = false;
+        if (!buff.empty()) failed = !_write(buff);
+        if (stop && _fmt == Format::SAM) os.flush();
+
+        lock.lock();
+        _failed = _failed || failed || (_fmt == Format::SAM && !os.good());
+        if (stop) return;
     }
-    (_use_stdio ? std::cout : out) << _hdr.to_string() << std::flush;
 }
 
 vargas::Cigar vargas::Cigar::operator=(const std::string &s) {
@@ -639,6 +1009,115 @@ TEST_CASE ("SAM File") {
     remove("osam.sam");
 }
 
+TEST_CASE ("SAM Writer") {
+    vargas::SAM::Header hdr;
+    {
+        vargas::osam os("tmp_w.sam", hdr);
+        os.start_writer(1 << 20, true); // One producer, so every chunk must fit in the buffer
+        for (int i = 9; i >= 0; --i) {
+            vargas::SAM::Record r;
+            r.query_name = std::to_string(i);
+            std::string buff;
+            os.serialize({r}, buff);
+            os.write_chunk(std::move(buff), i);
+        }
+        os.close();
+    }
+    vargas::isam in("tmp_w.sam");
+    int i = 0;
+    do {
+        CHECK(in.record().query_name == std::to_string(i++));
+    } while (in.next());
+    CHECK(i == 10);
+    remove("tmp_w.sam");
+}
+
+TEST_CASE ("SAM Format") {
+    CHECK(vargas::SAM::format("reads.sam") == vargas::SAM::Format::SAM);
+    CHECK(vargas::SAM::format("reads.bam") == vargas::SAM::Format::BAM);
+    CHECK(vargas::SAM::format("reads.cram") == vargas::SAM::Format::CRAM);
+    CHECK(vargas::SAM::format("bam") == vargas::SAM::Format::SAM);
+    CHECK(vargas::SAM::format("") == vargas::SAM::Format::SAM);
+    CHECK(vargas::SAM::parse_format("cram") == vargas::SAM::Format::CRAM);
+    CHECK_THROWS(vargas::SAM::parse_format("BAM"));
+}
+
+TEST_CASE ("BAM File") {
+    vargas::SAM::Header hdr;
+    vargas::SAM::Header::Sequence sq;
+    sq.name = "x";
+    sq.len = 1000;
+    hdr.add(sq);
+    vargas::SAM::Header::ReadGroup rg;
+    rg.id = "1";
+    hdr.add(rg);
+
+    std::vector<vargas::SAM::Record> recs(3);
+    recs[0] = std::string("r0\t0\tx\t10\t60\t3M1I2M\t*\t0\t0\tACGTNA\t!!#%?I"
+                          "\tRG:Z:1\tAS:i:-3\tmp:i:3000000000\tXA:A:q\tXF:f:0.5\tXB:B:c,-1,2");
+    recs[1] = std::string("r1\t16\tx\t20\t0\t5M\t=\t10\t-15\tACGTA\t*\tRG:Z:1");
+    recs[2] = std::string("r2\t4\t*\t0\t255\t*\t*\t0\t0\tACG\t###");
+
+    {
+        vargas::osam os("tmp_b.bam", hdr);
+        REQUIRE(os.format() == vargas::SAM::Format::BAM);
+        os.set_threads(2);
+        os.add_record(recs[0]);
+        os.start_writer(1 << 20, true);
+        std::string buff;
+        os.serialize({recs[1], recs[2]}, buff);
+        bam1_core_t c;
+        std::memcpy(&c, buff.data(), sizeof(c));
+        CHECK(c.l_qname == 4); // "r1" and a NUL, padded to 4 bytes
+        CHECK(c.l_extranul == 1);
+        os.write_chunk(std::move(buff), 0);
+        os.close();
+    }
+
+    vargas::isam in("tmp_b.bam");
+    CHECK(in.header().sequences.at("x").len == 1000);
+    CHECK(in.header().read_groups.count("1") == 1);
+    size_t i = 0;
+    do {
+        REQUIRE(i < recs.size());
+        const auto &a = recs[i++], &b = in.record();
+        CHECK(b.query_name == a.query_name);
+        CHECK(b.flag.encode() == a.flag.encode());
+        CHECK(b.ref_name == a.ref_name);
+        CHECK(b.pos == a.pos);
+        CHECK(b.mapq == a.mapq);
+        CHECK(b.cigar.to_string() == a.cigar.to_string());
+        CHECK(b.ref_next == a.ref_next);
+        CHECK(b.pos_next == a.pos_next);
+        CHECK(b.tlen == a.tlen);
+        CHECK(b.seq == a.seq);
+        CHECK(b.qual == a.qual);
+        CHECK(b.aux.aux.size() == a.aux.aux.size());
+    } while (in.next());
+    CHECK(i == recs.size());
+
+    in.open("tmp_b.bam");
+    const auto &r = in.record();
+    std::string rgid, xa, xb, mp;
+    int as;
+    float xf;
+    CHECK(r.aux.get("RG", rgid));
+    CHECK(rgid == "1");
+    CHECK(r.aux.get("AS", as));
+    CHECK(as == -3);
+    CHECK(r.aux.get("mp", mp));
+    CHECK(mp == "3000000000");
+    CHECK(r.aux.get("XA", xa));
+    CHECK(xa == "q");
+    CHECK(r.aux.get("XF", xf));
+    CHECK(xf == 0.5f);
+    CHECK(r.aux.get("XB", xb));
+    CHECK(xb == "c,-1,2");
+    CHECK(r.aux.aux_fmt.at("XB") == 'B');
+    in.close();
+    remove("tmp_b.bam");
+}
+
 TEST_CASE ("Cigar") {
     std::string s = "MI10M1D100M";
     vargas::Cigar c = s;
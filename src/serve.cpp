@@ -0,0 +1,472 @@
+/**
+ * @brief
+ * Alignment server that keeps graphs and aligners resident across jobs, and its client.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "serve.h"
+#include "align_main.h"
+#include "alignment.h"
+#include "kmer_index.h"
+#include "utils.h"
+#include "doctest.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <pthread.h>
+
+namespace {
+
+  constexpr size_t MAX_FRAME = size_t(1) << 26;
+  constexpr size_t MAX_FDS = 8;
+
+  volatile sig_atomic_t stop_serving = 0;
+
+  void on_stop(int) { stop_serving = 1; }
+
+  std::string sys_error(const std::string &what) {
+      return what + ": " + std::strerror(errno);
+  }
+
+  void write_all(int fd, const char *data, size_t len) {
+      while (len) {
+          const ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+          if (n < 0) {
+              if (errno == EINTR) continue;
+              throw std::runtime_error(sys_error("Error writing frame"));
+          }
+          data += n;
+          len -= n;
+      }
+  }
+
+  /**
+   * @return false on EOF before any byte
+   */
+  bool read_all(int fd, char *data, size_t len) {
+      const size_t total = len;
+      while (len) {
+          const ssize_t n = read(fd, data, len);
+          if (n < 0) {
+              if (errno == EINTR) continue;
+              throw std::runtime_error(sys_error("Error reading frame"));
+          }
+          if (n == 0) {
+              if (len == total) return false;
+              throw std::runtime_error("Truncated frame.");
+          }
+          data += n;
+          len -= n;
+      }
+      return true;
+  }
+
+  sockaddr_un socket_addr(const std::string &path) {
+      sockaddr_un addr;
+      std::memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+          throw std::invalid_argument("Invalid socket path: \"" + path + "\"");
+      }
+      std::strcpy(addr.sun_path, path.c_str());
+      return addr;
+  }
+
+  /**
+   * @brief
+   * Bind with the socket readable and writable only by the owner, since jobs run with the server's permissions.
+   * @return bind() result
+   */
+  int bind_private(int fd, const sockaddr_un &addr) {
+      const mode_t mask = umask(077);
+      const int ret = bind(fd, (const sockaddr *) &addr, sizeof(addr));
+      umask(mask);
+      if (ret == 0 && chmod(addr.sun_path, 0600)) throw std::runtime_error(sys_error("Unable to set socket mode"));
+      return ret;
+  }
+
+  /**
+   * @return true if the peer of a connected socket runs as the same user as the server
+   */
+  bool same_user(int fd) {
+      ucred cred;
+      socklen_t len = sizeof(cred);
+      if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred)) return false;
+      return cred.uid == geteuid();
+  }
+
+  std::string working_dir() {
+      char buf[PATH_MAX];
+      if (!getcwd(buf, sizeof(buf))) throw std::runtime_error(sys_error("Unable to get working directory"));
+      return buf;
+  }
+
+  /**
+   * @brief
+   * Run one request with the client's stdio and working directory.
+   * @return Payload of the reply
+   */
+  std::string run_job(const std::string &request, const std::vector<int> &fds, AlignCache &cache) {
+      if (fds.size() != 3) return "1" + std::string(1, '\0') + "Expected the client's stdin, stdout, and stderr.";
+      auto args = rg::split(request, std::string(1, '\0'), false);
+      if (args.size() < 2) return "1" + std::string(1, '\0') + "Empty request.";
+      const std::string cwd = args.front();
+      args.erase(args.begin());
+
+      const std::string server_cwd = working_dir();
+      int saved[3];
+      std::cout.flush();
+      fflush(stdout);
+      fflush(stderr);
+      for (int i = 0; i < 3; ++i) {
+          saved[i] = dup(i);
+          dup2(fds[i], i);
+      }
+
+      int rc = 1;
+      std::string err;
+      try {
+          if (chdir(cwd.c_str())) throw std::invalid_argument(sys_error("Unable to enter \"" + cwd + "\""));
+          std::vector<char *> argv;
+          for (auto &a : args) argv.push_back(&a[0]);
+          argv.push_back(nullptr);
+          rc = align_main(args.size(), argv.data(), &cache);
+      } catch (std::exception &e) {
+          rc = 1;
+          err = e.what();
+      }
+
+      std::cout.flush();
+      fflush(stdout);
+      fflush(stderr);
+      for (int i = 0; i < 3; ++i) {
+          dup2(saved[i], i);
+          close(saved[i]);
+      }
+      if (chdir(server_cwd.c_str())) throw std::runtime_error(sys_error("Unable to return to \"" + server_cwd + "\""));
+      return std::to_string(rc) + std::string(1, '\0') + err;
+  }
+}
+
+void send_frame(int fd, const std::string &payload, const std::vector<int> &fds) {
+    if (payload.size() > MAX_FRAME) throw std::invalid_argument("Frame exceeds " + std::to_string(MAX_FRAME) + " bytes.");
+    if (fds.size() > MAX_FDS) throw std::invalid_argument("Too many file descriptors for a frame.");
+    const uint32_t len = htonl(payload.size());
+    char hdr[sizeof(len)];
+    std::memcpy(hdr, &len, sizeof(len));
+
+    // Descriptors ride along with the length
+    iovec iov = {hdr, sizeof(hdr)};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char ctrl[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    if (fds.size()) {
+        std::memset(ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+    }
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0) throw std::runtime_error(sys_error("Error writing frame"));
+    if (size_t(n) < sizeof(hdr)) write_all(fd, hdr + n, sizeof(hdr) - n);
+    write_all(fd, payload.data(), payload.size());
+}
+
+bool recv_frame(int fd, std::string &payload, std::vector<int> *fds) {
+    char hdr[sizeof(uint32_t)];
+    iovec iov = {hdr, sizeof(hdr)};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char ctrl[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (n < 0) throw std::runtime_error(sys_error("Error reading frame"));
+
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        const size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int d;
+            std::memcpy(&d, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (fds) fds->push_back(d);
+            else close(d);
+        }
+    }
+    if (n == 0) return false;
+    if (size_t(n) < sizeof(hdr) && !read_all(fd, hdr + n, sizeof(hdr) - n)) throw std::runtime_error("Truncated frame.");
+
+    uint32_t len;
+    std::memcpy(&len, hdr, sizeof(len));
+    len = ntohl(len);
+    if (len > MAX_FRAME) throw std::runtime_error("Frame exceeds " + std::to_string(MAX_FRAME) + " bytes.");
+    payload.resize(len);
+    if (len && !read_all(fd, &payload[0], len)) throw std::runtime_error("Truncated frame.");
+    return true;
+}
+
+int align_client(const std::string &socket_path, const std::vector<std::string> &args) {
+    const sockaddr_un addr = socket_addr(socket_path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::runtime_error(sys_error("Unable to create socket"));
+    std::unique_ptr<int, void (*)(int *)> guard(new int(fd), [](int *p) { close(*p); delete p; });
+    if (connect(fd, (const sockaddr *) &addr, sizeof(addr))) {
+        throw std::invalid_argument(sys_error("Unable to reach server at \"" + socket_path + "\""));
+    }
+
+    std::string request = working_dir();
+    for (const auto &a : args) request += '\0' + a;
+    send_frame(fd, request, {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+
+    std::string reply;
+    if (!recv_frame(fd, reply)) throw std::runtime_error("Server closed the connection before the job finished.");
+    const size_t sep = reply.find('\0');
+    const int rc = std::stoi(reply.substr(0, sep));
+    if (sep != std::string::npos && sep + 1 < reply.size()) throw std::runtime_error(reply.substr(sep + 1));
+    return rc;
+}
+
+int serve_main(int argc, char *argv[]) {
+    std::string socket_path, gdfs;
+    bool load_index = false;
+
+    cxxopts::Options opts("vargas serve", "Serve align jobs with graphs kept in memory.");
+    try {
+        opts.add_options("Input")
+        ("S,socket", "<str> *Unix socket to listen on.", cxxopts::value(socket_path));
+
+        opts.add_options("Optional")
+        ("g,gdef", "<str,...> Graph definition files to load up front.", cxxopts::value(gdfs))
+        ("k,index", "Also load the k-mer index of each graph, for --prefilter.", cxxopts::value(load_index)->implicit_value("1"));
+
+        opts.add_options()("h,help", "Display this message.");
+        opts.parse(argc, argv);
+    } catch (std::exception &e) {
+        throw std::invalid_argument("Error parsing options: " + std::string(e.what()));
+    }
+    if (opts.count("h")) {
+        serve_help(opts);
+        return 0;
+    }
+    if (!opts.count("socket")) {
+        serve_help(opts);
+        throw std::invalid_argument("Socket path required.");
+    }
+
+    AlignCache cache;
+    for (const auto &gdf : rg::split(gdfs, ',')) {
+        std::cerr << "Loading \"" << gdf << "\"... " << std::flush;
+        auto start_time = std::chrono::steady_clock::now();
+        cache.graph(gdf);
+        if (load_index) cache.index(gdf);
+        std::cerr << rg::chrono_duration(start_time) << "s.\n";
+    }
+
+    const sockaddr_un addr = socket_addr(socket_path);
+    const int srv = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv < 0) throw std::runtime_error(sys_error("Unable to create socket"));
+    std::unique_ptr<int, void (*)(int *)> guard(new int(srv), [](int *p) { close(*p); delete p; });
+    if (bind_private(srv, addr)) {
+        // Replace a socket left by a server that is no longer running
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool live = probe >= 0 && connect(probe, (const sockaddr *) &addr, sizeof(addr)) == 0;
+        const bool stale = !live && errno == ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (!stale || unlink(socket_path.c_str()) || bind_private(srv, addr)) {
+            throw std::invalid_argument("Unable to listen on \"" + socket_path + "\"" +
+                                        (live ? ", a server is already running." : "."));
+        }
+    }
+    if (listen(srv, 64)) throw std::runtime_error(sys_error("Unable to listen on \"" + socket_path + "\""));
+
+    // Interrupt accept() on SIGINT and SIGTERM, and report closed clients as write errors
+    struct sigaction sa, old_int, old_term;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    signal(SIGPIPE, SIG_IGN);
+    stop_serving = 0;
+
+    std::cerr << "Serving on \"" << socket_path << "\", " << cache.num_graphs() << " graph(s) loaded.\n";
+    size_t jobs = 0;
+    while (!stop_serving) {
+        const int conn = accept(srv, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(sys_error("Error accepting connection"));
+        }
+        if (!same_user(conn)) {
+            std::cerr << "[warn] Refused a connection from another user.\n";
+            try {
+                // Read the request so the client sees the reply, closing any descriptors it passed
+                std::string request;
+                if (recv_frame(conn, request)) send_frame(conn, "1" + std::string(1, '\0') + "Server runs as another user.");
+            } catch (std::exception &) {}
+            close(conn);
+            continue;
+        }
+        std::vector<int> fds;
+        try {
+            std::string request;
+            if (recv_frame(conn, request, &fds)) {
+                auto start_time = std::chrono::steady_clock::now();
+                const std::string reply = run_job(request, fds, cache);
+                send_frame(conn, reply);
+                std::cerr << "Job " << ++jobs << ": exit " << reply.substr(0, reply.find('\0')) << ", "
+                          << rg::chrono_duration(start_time) << "s.\n";
+            }
+        } catch (std::exception &e) {
+            std::cerr << "[warn] Job " << ++jobs << ": " << e.what() << '\n';
+        }
+        for (int f : fds) close(f);
+        close(conn);
+    }
+
+    unlink(socket_path.c_str());
+    sigaction(SIGINT, &old_int, nullptr);
+    sigaction(SIGTERM, &old_term, nullptr);
+    std::cerr << "Stopped after " << jobs << " job(s).\n";
+    return 0;
+}
+
+void serve_help(const cxxopts::Options &opts) {
+    using std::cerr;
+    using std::endl;
+    cerr << opts.help(opts.groups()) << "\n\n"
+         << "Run jobs with vargas align --server <socket> and the usual align options.\n"
+         << "Jobs run one at a time. Graphs and the aligners of recent jobs stay loaded.\n" << endl;
+}
+
+TEST_SUITE("Server");
+
+TEST_CASE ("Frames") {
+    int sv[2], pipe_fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    REQUIRE(pipe(pipe_fds) == 0);
+
+    const std::string payload = std::string("cwd") + '\0' + "align" + '\0' + "-g";
+    send_frame(sv[0], payload, {pipe_fds[1]});
+    send_frame(sv[0], "");
+
+    std::string got;
+    std::vector<int> fds;
+    REQUIRE(recv_frame(sv[1], got, &fds));
+    CHECK(got == payload);
+    REQUIRE(fds.size() == 1);
+    // The received descriptor is the write end of the pipe
+    CHECK(write(fds[0], "x", 1) == 1);
+    char c = 0;
+    CHECK(read(pipe_fds[0], &c, 1) == 1);
+    CHECK(c == 'x');
+
+    REQUIRE(recv_frame(sv[1], got, &fds));
+    CHECK(got.empty());
+    CHECK(fds.size() == 1);
+
+    close(sv[0]);
+    CHECK(!recv_frame(sv[1], got));
+    close(sv[1]);
+
+    // A length beyond the limit is rejected
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    const uint32_t len = htonl(uint32_t(-1));
+    CHECK(write(sv[0], &len, sizeof(len)) == sizeof(len));
+    CHECK_THROWS(recv_frame(sv[1], got));
+
+    for (int f : {sv[0], sv[1], pipe_fds[0], pipe_fds[1], fds[0]}) close(f);
+}
+
+TEST_CASE ("Align cache") {
+    AlignCache cache;
+    vargas::ScoreProfile prof;
+    auto &pools = cache.aligners("a");
+    pools.emplace_back(prof, 16, 0, false, false, vargas::ISA::SSE41, 1);
+    CHECK(&cache.aligners("a") == &pools);
+    CHECK(cache.aligners("a").size() == 1);
+    CHECK(cache.aligners("b").empty());
+    CHECK(cache.num_graphs() == 0);
+    CHECK_THROWS(align_client("", {"align"}));
+}
+
+TEST_CASE ("Serve a job") {
+    const std::string sock = "tmp_serve.sock", gdf = "tmp_serve.gdf", reads = "tmp_serve.fa", out = "tmp_serve.sam";
+    {
+        std::ofstream o(gdf);
+        o << "@vgraph\naux\tnull\n\n@contigs\n0\tchr1\n\n@graphs\nbase\t0,1\t0:1;\n\n@nodes\n"
+             "0\t5\t1.0\t1\t5\t1\nAAAAA\n1\t8\t1\t1\t3\t1\nGGG\n";
+    }
+    {
+        std::ofstream o(reads);
+        o << ">r1\nAAAAAGGG\n";
+    }
+    remove(sock.c_str());
+
+    int rc = -1;
+    std::thread server([&]() {
+        const char *argv[] = {"serve", "-S", sock.c_str(), "-g", gdf.c_str()};
+        rc = serve_main(5, (char **) argv);
+    });
+    // Wait until the server accepts connections
+    const sockaddr_un addr = socket_addr(sock);
+    for (int tries = 0; tries < 1000; ++tries) {
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool up = connect(probe, (const sockaddr *) &addr, sizeof(addr)) == 0;
+        close(probe);
+        if (up) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    struct stat st;
+    REQUIRE(stat(sock.c_str(), &st) == 0);
+    CHECK((st.st_mode & 0777) == 0600);
+
+    const char *argv[] = {"align", "-g", gdf.c_str(), "-U", reads.c_str(), "-S", out.c_str(), "--server", sock.c_str()};
+    CHECK(align_main(9, (char **) argv) == 0);
+
+    // Stop the server, waking accept() in case the signal arrived before it blocked
+    pthread_kill(server.native_handle(), SIGTERM);
+    const int wake = socket(AF_UNIX, SOCK_STREAM, 0);
+    connect(wake, (const sockaddr *) &addr, sizeof(addr));
+    close(wake);
+    server.join();
+    CHECK(rc == 0);
+    CHECK(access(sock.c_str(), F_OK) != 0);
+
+    vargas::isam in(out);
+    const auto &rec = in.record();
+    CHECK(rec.query_name == "r1");
+    int score;
+    REQUIRE(rec.get(in.header(), "AS", score));
+    CHECK(score == 16);
+
+    for (const auto &f : {gdf, reads, out}) remove(f.c_str());
+}
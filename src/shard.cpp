@@ -0,0 +1,628 @@
+/**
+ * @brief
+ * Sharding alignment jobs across nodes, by reads or by graph, and merging graph shards.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "shard.h"
+#include "alignment.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <cstring>
+
+Shard Shard::parse(const std::string &spec, const std::string &by) {
+    Shard ret;
+    if (by == "reads") ret.by = By::READS;
+    else if (by == "graph") ret.by = By::GRAPH;
+    else throw std::invalid_argument("Unknown shard type \"" + by + "\", expected reads or graph.");
+
+    const auto sp = rg::split(spec, '/');
+    try {
+        if (sp.size() != 2 || sp[0].find_first_not_of("0123456789") != std::string::npos ||
+            sp[1].find_first_not_of("0123456789") != std::string::npos) throw std::invalid_argument(spec);
+        ret.index = std::stoul(sp[0]);
+        ret.count = std::stoul(sp[1]);
+    } catch (std::exception &) {
+        throw std::invalid_argument("Invalid shard \"" + spec + "\", expected i/N.");
+    }
+    if (ret.count == 0 || ret.index >= ret.count) {
+        throw std::invalid_argument("Invalid shard \"" + spec + "\", expected 0 <= i < N.");
+    }
+    return ret;
+}
+
+std::pair<rg::pos_t, rg::pos_t> Shard::window(vargas::GraphMan &gm) const {
+    const auto offsets = gm.resolver()._contig_offsets;
+    const auto base = gm.compiled("base");
+    if (base->size() == 0) return {1, 0};
+    const uint64_t total = base->end_pos(base->size() - 1) + 1;
+    if (offsets.empty()) return index == 0 ? std::make_pair(rg::pos_t(0), rg::pos_t(total - 1))
+                                           : std::make_pair(rg::pos_t(1), rg::pos_t(0));
+
+    uint64_t first = total, last = 0;
+    for (auto it = offsets.begin(); it != offsets.end(); ++it) {
+        const auto next = std::next(it);
+        const uint64_t beg = it->first, end = next == offsets.end() ? total : next->first;
+        if (end <= beg) continue;
+        const uint64_t owner = std::min<uint64_t>(count - 1, count * ((beg + end) / 2) / total);
+        if (owner != index) continue;
+        first = std::min(first, beg);
+        last = std::max(last, end - 1);
+    }
+    if (first > last) return {1, 0};
+    return {rg::pos_t(first), rg::pos_t(last)};
+}
+
+namespace {
+
+  void write_str(std::ostream &os, const std::string &s) {
+      const uint32_t len = s.size();
+      os.write(reinterpret_cast<const char *>(&len), sizeof(len));
+      os.write(s.data(), len);
+  }
+
+  std::string read_str(std::istream &is) {
+      uint32_t len = 0;
+      is.read(reinterpret_cast<char *>(&len), sizeof(len));
+      if (!is.good() || len > (1u << 24)) throw std::invalid_argument("Truncated string");
+      std::string ret(len, '\0');
+      is.read(&ret[0], len);
+      return ret;
+  }
+
+  bool record_less(const vargas::vap::Record &a, const vargas::vap::Record &b) {
+      return a.ordinal != b.ordinal ? a.ordinal < b.ordinal : a.label < b.label;
+  }
+
+}
+
+void vargas::Partials::write(const std::string &filename) const {
+    std::ofstream of(filename, std::ios::binary);
+    if (!of.good()) throw std::invalid_argument("Error opening file: " + filename);
+
+    vap::Header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, vap::MAGIC, sizeof(h.magic));
+    h.version = vap::VERSION;
+    h.shard = shard;
+    h.shards = shards;
+    h.flags = (fwdonly ? vap::FWDONLY : 0u) | (msonly ? vap::MSONLY : 0u) | (maxonly ? vap::MAXONLY : 0u) |
+              (notraceback ? vap::NOTRACEBACK : 0u) | (p64 ? vap::PHRED64 : 0u) |
+              (prof.end_to_end ? vap::END_TO_END : 0u);
+    h.match = prof.match;
+    h.mismatch_min = prof.mismatch_min;
+    h.mismatch_max = prof.mismatch_max;
+    h.read_gopen = prof.read_gopen;
+    h.read_gext = prof.read_gext;
+    h.ref_gopen = prof.ref_gopen;
+    h.ref_gext = prof.ref_gext;
+    h.ambig = prof.ambig;
+    of.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+    write_str(of, command_line);
+    write_str(of, gdf);
+    write_str(of, reads);
+    write_str(of, targets);
+    const uint32_t num_labels = labels.size();
+    of.write(reinterpret_cast<const char *>(&num_labels), sizeof(num_labels));
+    for (const auto &l : labels) write_str(of, l);
+
+    const uint64_t num_records = records.size();
+    of.write(reinterpret_cast<const char *>(&num_records), sizeof(num_records));
+    of.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(vap::Record));
+    if (!of.good()) throw std::runtime_error("Error writing file: " + filename);
+}
+
+void vargas::Partials::read(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good()) throw std::invalid_argument("Error opening file: " + filename);
+
+    vap::Header h;
+    in.read(reinterpret_cast<char *>(&h), sizeof(h));
+    if (!in.good() || std::memcmp(h.magic, vap::MAGIC, sizeof(h.magic)) != 0) {
+        throw std::invalid_argument("Invalid partial results file: " + filename);
+    }
+    if (h.version != vap::VERSION) {
+        throw std::invalid_argument("Unsupported partial results version " + std::to_string(h.version) + ": " + filename);
+    }
+    shard = h.shard;
+    shards = h.shards;
+    fwdonly = h.flags & vap::FWDONLY;
+    msonly = h.flags & vap::MSONLY;
+    maxonly = h.flags & vap::MAXONLY;
+    notraceback = h.flags & vap::NOTRACEBACK;
+    p64 = h.flags & vap::PHRED64;
+    prof.end_to_end = h.flags & vap::END_TO_END;
+    prof.match = h.match;
+    prof.mismatch_min = h.mismatch_min;
+    prof.mismatch_max = h.mismatch_max;
+    prof.read_gopen = h.read_gopen;
+    prof.read_gext = h.read_gext;
+    prof.ref_gopen = h.ref_gopen;
+    prof.ref_gext = h.ref_gext;
+    prof.ambig = h.ambig;
+
+    try {
+        command_line = read_str(in);
+        gdf = read_str(in);
+        reads = read_str(in);
+        targets = read_str(in);
+        uint32_t num_labels = 0;
+        in.read(reinterpret_cast<char *>(&num_labels), sizeof(num_labels));
+        labels.clear();
+        for (uint32_t i = 0; i < num_labels && in.good(); ++i) labels.push_back(read_str(in));
+
+        uint64_t num_records = 0;
+        in.read(reinterpret_cast<char *>(&num_records), sizeof(num_records));
+        if (!in.good()) throw std::invalid_argument("Truncated header");
+        records.resize(num_records);
+        in.read(reinterpret_cast<char *>(records.data()), num_records * sizeof(vap::Record));
+        if (size_t(in.gcount()) != num_records * sizeof(vap::Record)) throw std::invalid_argument("Truncated records");
+    } catch (std::exception &e) {
+        throw std::invalid_argument("Invalid partial results file (" + std::string(e.what()) + "): " + filename);
+    }
+    for (const auto &r : records) {
+        if (r.label >= labels.size()) throw std::invalid_argument("Invalid partial results file: " + filename);
+    }
+}
+
+bool vargas::Partials::same_job(const Partials &o) const {
+    return shards == o.shards && fwdonly == o.fwdonly && msonly == o.msonly && maxonly == o.maxonly &&
+           p64 == o.p64 && prof.to_string() == o.prof.to_string() && prof.end_to_end == o.prof.end_to_end &&
+           gdf == o.gdf && reads == o.reads && targets == o.targets && labels == o.labels;
+}
+
+void vargas::merge_partials(const std::vector<const vap::Record *> &parts, const unsigned strands, Results &res,
+                            const size_t i) {
+    // As in AlignerT::_align_segments, shards are segments of each strand
+    int score = std::numeric_limits<int>::min(), fwd = score;
+    pos_t pos = 0, last = 0;
+    unsigned count = 0;
+    for (unsigned s = 0; s < strands; ++s) {
+        if (s == 1) {
+            fwd = score;
+            last = 0;
+        }
+        for (const auto *p : parts) {
+            const vap::Strand &r = p->strand[s];
+            if (r.score > score) {
+                score = r.score;
+                pos = r.pos;
+                last = r.last;
+                count = r.count;
+            } else if (r.score == score) {
+                count += r.count - 1 + (r.pos > last + p->read_len);
+                last = r.last;
+            }
+        }
+    }
+    if (strands == 1) fwd = score;
+    res.max_score[i] = score;
+    res.max_pos[i] = pos;
+    res.max_last_pos[i] = last;
+    res.max_count[i] = count;
+    res.max_strand[i] = score > fwd ? Strand::REV : Strand::FWD;
+    res.sub_strand[i] = Strand::FWD;
+}
+
+namespace {
+
+  struct partial_helper {
+      std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list;
+      std::vector<AlignerPool> &aligners;
+      // Window of each label, nullptr if the shard holds none of it
+      const std::unordered_map<std::string, std::shared_ptr<const vargas::CompiledGraph>> &windows;
+      const std::unordered_map<std::string, uint32_t> &label_idx;
+      std::vector<std::vector<vargas::vap::Record>> &out;
+      bool fwdonly;
+      char phred_offset;
+      ProgressMeter *progress;
+  };
+
+  void partial_helper_func(void *data, long index, int tid) {
+      partial_helper &help(*(partial_helper *) data);
+      auto &task = help.task_list.at(index);
+      auto &pool = help.aligners[tid];
+      auto &stats = pool.stats();
+      ++stats.tasks;
+      stats.reads += task.second.size();
+
+      const auto &graph = help.windows.at(task.first);
+      if (graph) {
+          auto &aligner = pool.get(task.second);
+          const uint32_t read_len = pool.length(task.second);
+          auto &reads = pool.reads();
+          vargas::Results res[2];
+          const unsigned strands = help.fwdonly ? 1 : 2;
+          const auto fill_start = std::chrono::steady_clock::now();
+          for (unsigned s = 0; s < strands; ++s) {
+              // Each strand is its own pass, so merging can treat shards as segments of a strand
+              reads.clear();
+              for (const auto &r : task.second) {
+                  if (s == 0) reads.push_back(r.seq, r.qual, help.phred_offset);
+                  else reads.push_back(rg::reverse_complement(r.seq), std::string(r.qual.rbegin(), r.qual.rend()),
+                                       help.phred_offset);
+              }
+              aligner.align_into(reads, *graph, res[s], true);
+          }
+          stats.fill_s += rg::chrono_duration(fill_start);
+
+          auto &out = help.out[index];
+          out.resize(task.second.size());
+          const uint32_t label = help.label_idx.at(task.first);
+          for (size_t j = 0; j < task.second.size(); ++j) {
+              auto &rec = out[j];
+              std::memset(&rec, 0, sizeof(rec));
+              rec.ordinal = std::stoull(task.second[j].aux.aux.at(ALIGN_SAM_ORDINAL_TAG));
+              rec.label = label;
+              rec.read_len = read_len;
+              for (unsigned s = 0; s < strands; ++s) {
+                  rec.strand[s].score = res[s].max_score[j];
+                  rec.strand[s].pos = res[s].max_pos[j];
+                  rec.strand[s].last = res[s].max_last_pos[j];
+                  rec.strand[s].count = res[s].max_count[j];
+              }
+          }
+      }
+      task.second.clear();
+      if (help.progress) help.progress->update(tid, stats.reads);
+  }
+
+}
+
+AlignStats align_partials(vargas::GraphMan &gm,
+                          std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> &task_list,
+                          std::vector<AlignerPool> &aligners, const Shard &shard, vargas::Partials &partials,
+                          char phred_offset, ProgressMeter *progress, bool verbose) {
+    const auto win = shard.window(gm);
+    if (win.first > win.second) std::cerr << "[warn] Shard " << shard.index << " holds no contigs.\n";
+    else if (verbose) std::cerr << "Shard " << shard.index << "/" << shard.count << " spans " << win.first << " to " << win.second << ".\n";
+
+    std::unordered_map<std::string, std::shared_ptr<const vargas::CompiledGraph>> windows;
+    std::unordered_map<std::string, uint32_t> label_idx;
+    for (const auto &t : task_list) {
+        if (label_idx.count(t.first)) continue;
+        label_idx.emplace(t.first, 0);
+        std::shared_ptr<const vargas::CompiledGraph> g;
+        if (win.first <= win.second) {
+            g = std::make_shared<vargas::CompiledGraph>(*gm.compiled(t.first), win.first, win.second);
+            if (g->length() == 0) g.reset();
+        }
+        windows.emplace(t.first, g);
+    }
+    // Label indices in sorted order, so every shard of a job has the same table
+    partials.labels.clear();
+    for (const auto &l : label_idx) partials.labels.push_back(l.first);
+    std::sort(partials.labels.begin(), partials.labels.end());
+    for (size_t i = 0; i < partials.labels.size(); ++i) label_idx[partials.labels[i]] = i;
+
+    if (verbose) std::cerr << "Aligning... " << std::flush;
+    rg::ForPool fp(aligners.size());
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::vector<vargas::vap::Record>> out(task_list.size());
+    partial_helper help{task_list, aligners, windows, label_idx, out, partials.fwdonly, phred_offset, progress};
+    fp.forpool(&partial_helper_func, (void *) &help, task_list.size());
+    if (verbose) std::cerr << rg::chrono_duration(start_time) << "s.\n";
+
+    partials.records.clear();
+    for (auto &o : out) partials.records.insert(partials.records.end(), o.begin(), o.end());
+    std::sort(partials.records.begin(), partials.records.end(), record_less);
+
+    AlignStats ret;
+    for (const auto &a : aligners) ret.merge(a.stats());
+    return ret;
+}
+
+int merge_main(int argc, char *argv[]) {
+    std::string partial_files, out_file, out_fmt, gdf, read_file;
+    unsigned io_threads;
+
+    cxxopts::Options opts("vargas merge", "Merge the partial results of graph shards into SAM.");
+    try {
+        opts.add_options("Input")
+        ("i,partials", "<str,...> *Partial results of every shard of the job.", cxxopts::value(partial_files));
+
+        opts.add_options("Optional")
+        ("S,sam", "<str> Output file.", cxxopts::value(out_file))
+        ("out-fmt", "<str> Output format: sam, bam, or cram. (default: from -S extension, else sam)", cxxopts::value(out_fmt))
+        ("g,gdef", "<str> Graph definition file. (default: as aligned)", cxxopts::value(gdf))
+        ("U,reads", "<str> Reads file. (default: as aligned)", cxxopts::value(read_file))
+        ("io-threads", "<N> Threads compressing BAM/CRAM output and decompressing BAM/CRAM reads.", cxxopts::value(io_threads)->default_value("0"));
+
+        opts.add_options()("h,help", "Display this message.");
+        opts.parse(argc, argv);
+    } catch (std::exception &e) {
+        throw std::invalid_argument("Error parsing options: " + std::string(e.what()));
+    }
+    if (opts.count("h")) {
+        merge_help(opts);
+        return 0;
+    }
+    if (!opts.count("partials")) {
+        merge_help(opts);
+        throw std::invalid_argument("Partial results files required.");
+    }
+
+    const auto files = rg::split(partial_files, ',');
+    std::vector<vargas::Partials> parts(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        parts[i].read(files[i]);
+        if (!parts[i].same_job(parts[0])) {
+            throw std::invalid_argument("\"" + files[i] + "\" is not a shard of the same job as \"" + files[0] + "\".");
+        }
+    }
+    if (parts.empty() || parts[0].shards != parts.size()) {
+        throw std::invalid_argument("Expected the partial results of all " +
+                                    std::to_string(parts.empty() ? 0 : parts[0].shards) + " shards.");
+    }
+    std::sort(parts.begin(), parts.end(), [](const vargas::Partials &a, const vargas::Partials &b) {
+        return a.shard < b.shard;
+    });
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (parts[i].shard != i) throw std::invalid_argument("Missing or repeated shard " + std::to_string(i) + ".");
+    }
+    const vargas::Partials &job = parts[0];
+    if (gdf.empty()) gdf = job.gdf;
+    if (read_file.empty()) read_file = job.reads;
+
+    // Records of each read and target, in shard order
+    std::vector<const vargas::vap::Record *> all;
+    for (const auto &p : parts) for (const auto &r : p.records) all.push_back(&r);
+    std::stable_sort(all.begin(), all.end(), [](const vargas::vap::Record *a, const vargas::vap::Record *b) {
+        return record_less(*a, *b);
+    });
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    vargas::Results merged;
+    merged.resize(all.size());
+    std::vector<const vargas::vap::Record *> group;
+    for (size_t i = 0; i < all.size();) {
+        group.clear();
+        size_t j = i;
+        while (j < all.size() && !record_less(*all[i], *all[j])) group.push_back(all[j++]);
+        vargas::merge_partials(group, job.fwdonly ? 1 : 2, merged, keys.size());
+        keys.emplace_back(all[i]->ordinal, all[i]->label);
+        i = j;
+    }
+    std::cerr << keys.size() << "\tAlignment(s) merged from " << parts.size() << " shard(s).\n";
+
+    vargas::isam reads;
+    reads.set_threads(io_threads);
+    const ReadFmt format = read_fmt(read_file);
+    if (format == ReadFmt::SAM) reads.open(read_file);
+    else load_fast(read_file, format == ReadFmt::FASTQ, reads, job.p64, io_threads);
+    reads.subset(0);
+    auto &reads_hdr = reads.header();
+
+    // Same header as a single run
+    vargas::SAM::Header::Program pg;
+    pg.command_line = job.command_line;
+    pg.name = "vargas_align";
+    pg.id = "VA";
+    pg.version = __DATE__;
+    std::replace_if(pg.version.begin(), pg.version.end(), isspace, ' '); // rm tabs
+    const auto assigned_pgid = reads_hdr.add(pg);
+
+    Shard shard;
+    shard.count = job.shards;
+    shard.by = Shard::By::GRAPH;
+    std::string align_targets = job.targets;
+    size_t read_len;
+    auto task_list = create_tasks(reads, align_targets, 0, read_len, 0, false, &shard);
+
+    std::cerr << "Loading \"" << gdf << "\"...\n";
+    vargas::GraphMan gm(gdf);
+
+    const vargas::SAM::Format sam_fmt = out_fmt.empty() ? vargas::SAM::format(out_file) : vargas::SAM::parse_format(out_fmt);
+    reads_hdr.programs[assigned_pgid].aux.set(ALIGN_SAM_PG_GDF, job.gdf);
+    if (sam_fmt != vargas::SAM::Format::SAM) add_contigs(reads_hdr, gm);
+    vargas::osam aligns_out(out_file, reads_hdr, sam_fmt);
+    aligns_out.set_threads(io_threads);
+
+    const char phred_offset = job.p64 ? 64 : 33;
+    vargas::Traceback traceback;
+    AlignStats stats;
+    std::string buff;
+    for (size_t t = 0; t < task_list.size(); ++t) {
+        auto &task = task_list[t];
+        const auto label = std::find(job.labels.begin(), job.labels.end(), task.first);
+        if (label == job.labels.end()) throw std::invalid_argument("Target \"" + task.first + "\" was not aligned.");
+        const uint32_t label_idx = label - job.labels.begin();
+
+        vargas::Results res;
+        res.resize(task.second.size());
+        res.profile = job.prof;
+        for (size_t j = 0; j < task.second.size(); ++j) {
+            auto &rec = task.second[j];
+            const std::pair<uint64_t, uint32_t> key(std::stoull(rec.aux.aux.at(ALIGN_SAM_ORDINAL_TAG)), label_idx);
+            rec.aux.erase(ALIGN_SAM_ORDINAL_TAG);
+            const auto k = std::lower_bound(keys.begin(), keys.end(), key);
+            if (k == keys.end() || *k != key) {
+                throw std::invalid_argument("No partial results for read \"" + rec.query_name + "\".");
+            }
+            const size_t m = k - keys.begin();
+            res.max_score[j] = merged.max_score[m];
+            res.max_pos[j] = merged.max_pos[m];
+            res.max_last_pos[j] = merged.max_last_pos[m];
+            res.max_count[j] = merged.max_count[m];
+            res.max_strand[j] = merged.max_strand[m];
+            res.sub_strand[j] = merged.sub_strand[m];
+        }
+        tag_records(gm, task.first, task.second, res, traceback, stats, job.msonly, job.maxonly, job.notraceback,
+                    phred_offset);
+        buff.clear();
+        aligns_out.serialize(task.second, buff);
+        aligns_out.write_chunk(std::move(buff), t);
+        task.second.clear();
+    }
+    aligns_out.close(); // Surface any write errors
+    return 0;
+}
+
+void merge_help(const cxxopts::Options &opts) {
+    using std::cerr;
+    using std::endl;
+    cerr << opts.help(opts.groups()) << "\n\n"
+         << "Partial results are written by vargas align --shard i/N --shard-by graph -S <file>.\n"
+         << "The reads and graph must be the same as when aligning.\n" << endl;
+}
+
+TEST_SUITE("Shard");
+
+TEST_CASE ("Shard spec") {
+    auto s = Shard::parse("2/4", "reads");
+    CHECK(s.index == 2);
+    CHECK(s.count == 4);
+    CHECK(s.by == Shard::By::READS);
+    CHECK(s.split());
+    CHECK(Shard::parse("0/1", "graph").by == Shard::By::GRAPH);
+    CHECK(!Shard::parse("0/1", "graph").split());
+    CHECK_THROWS(Shard::parse("4/4", "reads"));
+    CHECK_THROWS(Shard::parse("1/0", "reads"));
+    CHECK_THROWS(Shard::parse("1", "reads"));
+    CHECK_THROWS(Shard::parse("-1/2", "reads"));
+    CHECK_THROWS(Shard::parse("a/2", "reads"));
+    CHECK_THROWS(Shard::parse("0/2", "contigs"));
+
+    SUBCASE("Read shards") {
+        // Hash is fixed, so shards agree across nodes
+        CHECK(Shard::hash("") == 14695981039346656037ULL);
+        CHECK(Shard::hash("a") == 0xaf63dc4c8601ec8cULL);
+        std::vector<Shard> shards;
+        for (unsigned i = 0; i < 4; ++i) shards.push_back(Shard::parse(std::to_string(i) + "/4", "reads"));
+        std::vector<size_t> kept(4, 0);
+        for (int r = 0; r < 4000; ++r) {
+            const std::string name = "read_" + std::to_string(r);
+            int owners = 0;
+            for (unsigned i = 0; i < 4; ++i) {
+                if (shards[i].keep(name)) {
+                    ++owners;
+                    ++kept[i];
+                }
+            }
+            CHECK(owners == 1);
+        }
+        for (auto k : kept) CHECK(k > 800);
+        CHECK(Shard::parse("1/4", "graph").keep("read_0"));
+    }
+}
+
+TEST_CASE ("Graph shards") {
+    const std::string x = "CAAATAAGGCTTGGAAATTTTCTGGAGTTCTATTATATTCCAACTCTCTGGTTCCTGGTGCTATGTGTAACTAGTAATGG";
+    const std::string y = "GGAGCCAGACAAATCTGGGTTCAAATCCTGGAGCCAGACAAATCTGGGTTCAAATCCTGG";
+    const std::string z = "TAATGGATATGTTGGGCTTTTTTCTTTGATTTATTTGAAGTGACGTTT";
+    const std::string gdf = "tmp_shard.gdf";
+    {
+        // One node per contig, without edges between them
+        std::ofstream o(gdf);
+        o << "@vgraph\naux\tnull\n\n@contigs\n"
+          << "0\tx\n" << x.size() << "\ty\n" << x.size() + y.size() << "\tz\n\n"
+          << "@graphs\nbase\t0,1,2\t\n\n@nodes\n"
+          << "0\t" << x.size() - 1 << "\t1\t1\t1\t" << x.size() << "\n" << x << "\n"
+          << "1\t" << x.size() + y.size() - 1 << "\t1\t1\t1\t" << y.size() << "\n" << y << "\n"
+          << "2\t" << x.size() + y.size() + z.size() - 1 << "\t1\t1\t1\t" << z.size() << "\n" << z << "\n";
+    }
+    vargas::GraphMan gm(gdf);
+
+    // Contigs are assigned by midpoint: x alone, then y and z
+    auto w0 = Shard::parse("0/2", "graph").window(gm), w1 = Shard::parse("1/2", "graph").window(gm);
+    CHECK(w0.first == 0);
+    CHECK(w0.second == x.size() - 1);
+    CHECK(w1.first == x.size());
+    CHECK(w1.second == x.size() + y.size() + z.size() - 1);
+    auto one = Shard::parse("0/1", "graph").window(gm);
+    CHECK(one.first == 0);
+    CHECK(one.second == w1.second);
+    // Midpoints of x, y, and z fall in shards 0, 2, and 3 of 4
+    auto empty = Shard::parse("1/4", "graph").window(gm);
+    CHECK(empty.first > empty.second);
+
+    // Shards aligned separately and merged match one pass over the whole graph
+    std::vector<vargas::SAM::Record> recs;
+    const std::vector<std::string> seqs = {x.substr(10, 20), y.substr(2, 20), rg::reverse_complement(z.substr(5, 20)),
+                                           x.substr(60, 20), y.substr(31, 20)};
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        vargas::SAM::Record r;
+        r.query_name = "r" + std::to_string(i);
+        r.seq = seqs[i];
+        r.aux.set(ALIGN_SAM_ORDINAL_TAG, i);
+        recs.push_back(r);
+    }
+    vargas::ScoreProfile prof;
+    std::unique_ptr<vargas::AlignerBase, vargas::AlignerDeleter> aligner(make_aligner(prof, 20, false, false, true,
+                                                                           vargas::ISA::SSE41));
+    vargas::EncodedReads enc;
+    for (const auto &r : recs) enc.push_back(r.seq, r.qual, 33);
+    vargas::Results whole;
+    aligner->align_into(enc, *gm.compiled("base"), whole, false);
+
+    std::vector<vargas::Partials> parts(3);
+    for (unsigned i = 0; i < parts.size(); ++i) {
+        std::vector<AlignerPool> pools;
+        pools.emplace_back(prof, 20, 0, false, true, vargas::ISA::SSE41, 1);
+        std::vector<std::pair<std::string, std::vector<vargas::SAM::Record>>> tasks = {{"base", recs}};
+        const auto shard = Shard::parse(std::to_string(i) + "/3", "graph");
+        parts[i].shard = i;
+        parts[i].shards = 3;
+        parts[i].maxonly = true;
+        auto stats = align_partials(gm, tasks, pools, shard, parts[i], 33, nullptr, false);
+        CHECK(stats.reads == recs.size());
+        CHECK(parts[i].labels == std::vector<std::string>{"base"});
+        CHECK(parts[i].records.size() == recs.size());
+    }
+
+    vargas::Results merged;
+    merged.resize(recs.size());
+    for (size_t j = 0; j < recs.size(); ++j) {
+        std::vector<const vargas::vap::Record *> group;
+        for (const auto &p : parts) group.push_back(&p.records[j]);
+        vargas::merge_partials(group, 2, merged, j);
+        CHECK(merged.max_score[j] == whole.max_score[j]);
+        CHECK(merged.max_pos[j] == whole.max_pos[j]);
+        CHECK(merged.max_count[j] == whole.max_count[j]);
+        CHECK(merged.max_strand[j] == whole.max_strand[j]);
+    }
+    CHECK(merged.max_strand[2] == vargas::Strand::REV);
+
+    SUBCASE("Partial results file") {
+        const std::string file = "tmp_shard.vap";
+        parts[1].command_line = "vargas align --shard 1/3";
+        parts[1].gdf = "g.gdf";
+        parts[1].prof.match = 3;
+        parts[1].p64 = true;
+        parts[1].write(file);
+        vargas::Partials in;
+        in.read(file);
+        CHECK(in.shard == 1);
+        CHECK(in.shards == 3);
+        CHECK(in.maxonly);
+        CHECK(!in.msonly);
+        CHECK(in.p64);
+        CHECK(in.prof.match == 3);
+        CHECK(in.command_line == parts[1].command_line);
+        CHECK(in.gdf == "g.gdf");
+        CHECK(in.labels == parts[1].labels);
+        REQUIRE(in.records.size() == parts[1].records.size());
+        for (size_t j = 0; j < in.records.size(); ++j) {
+            CHECK(std::memcmp(&in.records[j], &parts[1].records[j], sizeof(vargas::vap::Record)) == 0);
+        }
+        CHECK(in.same_job(parts[1]));
+        CHECK(!in.same_job(parts[0]));
+        {
+            std::ofstream o(file);
+            o << "not a partial file";
+        }
+        CHECK_THROWS(in.read(file));
+        remove(file.c_str());
+    }
+    remove(gdf.c_str());
+}
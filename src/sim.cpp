@@ -19,54 +19,68 @@ bool vargas::Sim::_update_read(const coordinate_resolver& resolver) {
 
     uint32_t curr_indiv = 0, curr_node;
     const bool has_pop = _graph.pop_size() != 0;
+    if (_node_weights.empty() || _node_weights.back() == 0) return false;
 
     // Pick an individual
-
     if (has_pop) {
-        do {
-            curr_indiv = rand() % _graph.pop_size();
-        } while (!_graph.filter()[curr_indiv]);
+        if (_indivs.empty()) return false;
+        curr_indiv = _indivs[_rng.below(_indivs.size())];
     }
 
+    int var_bases = 0;
+    int var_nodes = 0;
+
+    // Once the stratum is reached no further variant nodes can be accepted, so the walk
+    // is kept on the reference rather than rejecting the finished read.
+    auto saturated = [&]() {
+        return (_prof.var_nodes >= 0 && var_nodes >= _prof.var_nodes)
+        || (_prof.var_bases >= 0 && var_bases >= _prof.var_bases);
+    };
 
     // Pick random weighted node and position within the node
+    const Graph::Node *node;
     do {
         curr_node = _random_node_id();
-    } while (has_pop && !_nodes.at(curr_node).belongs(curr_indiv));
-    rg::pos_t curr_pos = rand() % _nodes.at(curr_node).length();
+        node = &_nodes.at(curr_node);
+    } while ((has_pop && !node->belongs(curr_indiv)) || (!node->is_ref() && saturated()));
+    rg::pos_t curr_pos = _rng.below(node->length());
 
-
-    int var_bases = 0;
-    int var_nodes = 0;
     std::string read_str;
+    read_str.reserve(_prof.len);
+    std::vector<uint32_t> valid_next;
 
     while (true) {
         // Extract len subseq
         unsigned len = _prof.len - read_str.length();
-        if (len > _nodes.at(curr_node).length() - curr_pos) len = _nodes.at(curr_node).length() - curr_pos;
-        read_str += _nodes.at(curr_node).seq_str().substr(curr_pos, len);
+        if (len > node->length() - curr_pos) len = node->length() - curr_pos;
+        const auto &seq = node->seq();
+        for (unsigned i = 0; i < len; ++i) read_str += rg::num_to_base(seq[curr_pos + i]);
         curr_pos += len;
 
-        if (!_nodes.at(curr_node).is_ref()) {
+        if (!node->is_ref()) {
             ++var_nodes;
             var_bases += len;
+            if (_prof.var_nodes >= 0 && var_nodes > _prof.var_nodes) return false;
+            if (_prof.var_bases >= 0 && var_bases > _prof.var_bases) return false;
         }
 
         assert(read_str.length() <= _prof.len);
         if (read_str.length() == _prof.len) break; // Done
 
         // Pick random next node.
-        if (_next.find(curr_node) == _next.end()) return false; // End of graph
-
-        std::vector<uint32_t> valid_next;
-        if (!has_pop) valid_next = _next.at(curr_node);
-        else {
-            for (const uint32_t n : _next.at(curr_node)) {
-                if (_nodes.at(n).belongs(curr_indiv)) valid_next.push_back(n);
-            }
+        const auto next = _next.find(curr_node);
+        if (next == _next.end()) return false; // End of graph
+
+        const bool ref_only = saturated();
+        valid_next.clear();
+        for (const uint32_t n : next->second) {
+            if (!_graph.contains(n)) continue;
+            const auto &nn = _nodes.at(n);
+            if ((!has_pop || nn.belongs(curr_indiv)) && (!ref_only || nn.is_ref())) valid_next.push_back(n);
         }
         if (valid_next.empty()) return false;
-        curr_node = valid_next[rand() % valid_next.size()];
+        curr_node = valid_next[_rng.below(valid_next.size())];
+        node = &_nodes.at(curr_node);
         curr_pos = 0;
     }
 
@@ -84,21 +98,21 @@ bool vargas::Sim::_update_read(const coordinate_resolver& resolver) {
         for (char i : read_str) {
             char m = i;
             // Mutation error
-            if (rand() % 10000 < 10000 * _prof.mut) {
+            if (_rng.below(10000) < 10000 * _prof.mut) {
                 do {
-                    m = rg::rand_base();
+                    m = _rand_base();
                 } while (m == i);
                 ++sub_err;
             }
 
                 // Insertion
-            else if (rand() % 10000 < 5000 * _prof.indel) {
-                read_mut += rg::rand_base();
+            else if (_rng.below(10000) < 5000 * _prof.indel) {
+                read_mut += _rand_base();
                 ++indel_err;
             }
 
                 // Deletion (if we don't enter)
-            else if (rand() % 10000 > 5000 * _prof.indel) {
+            else if (_rng.below(10000) > 5000 * _prof.indel) {
                 read_mut += m;
                 ++indel_err;
             }
@@ -115,13 +129,13 @@ bool vargas::Sim::_update_read(const coordinate_resolver& resolver) {
             unsigned loc;
             for (int j = 0; j < sub_err; ++j) {
                 do {
-                    loc = rand() % read_mut.length();
+                    loc = _rng.below(read_mut.length());
                 } while (mut_sites.count(loc));
                 mut_sites.insert(loc);
             }
             for (int i = 0; i < indel_err; ++i) {
                 do {
-                    loc = rand() % read_mut.length();
+                    loc = _rng.below(read_mut.length());
                 } while (indel_sites.count(loc) || mut_sites.count(loc));
                 indel_sites.insert(loc);
             }
@@ -129,14 +143,14 @@ bool vargas::Sim::_update_read(const coordinate_resolver& resolver) {
 
         for (unsigned m : mut_sites) {
             do {
-                read_mut[m] = rg::rand_base();
+                read_mut[m] = _rand_base();
             } while (read_mut[m] == read_str[m]);
         }
 
         for (unsigned i : indel_sites) {
-            if (rand() % 2) {
+            if (_rng.below(2)) {
                 // Insertion
-                read_mut.insert(i, 1, rg::rand_base());
+                read_mut.insert(i, 1, _rand_base());
             } else {
                 // Deletion
                 read_mut.erase(i, 1);
@@ -156,7 +170,7 @@ bool vargas::Sim::_update_read(const coordinate_resolver& resolver) {
     _read.aux.set(SIM_SAM_SUB_ERR_TAG, sub_err);
 
     // +1 from length being 1 indexed but end() being zero indexed, +1 since POS is 1 indexed.
-    auto resolved = resolver.resolve(_nodes.at(curr_node).end_pos() - _nodes.at(curr_node).length() + 2 + curr_pos - _prof.len);
+    auto resolved = resolver.resolve(node->end_pos() - node->length() + 2 + curr_pos - _prof.len);
     _read.pos = resolved.second;
     if (!resolved.first.empty()) _read.ref_name = resolved.first;
 
@@ -194,9 +208,11 @@ void vargas::Sim::_init() {
         _node_weights.push_back(total);
         _node_ids.push_back(giter->id());
     }
+    for (uint32_t i = 0; i < _graph.pop_size(); ++i) {
+        if (_graph.filter()[i]) _indivs.push_back(i);
+    }
     std::random_device rd;
-    _rand_generator = std::mt19937(rd());
-    _node_weight_dist = std::uniform_int_distribution<uint64_t>(0, total);
+    _rng.reset((uint64_t(rd()) << 32) | rd(), 0);
 }
 
 
@@ -278,6 +294,31 @@ TEST_CASE ("Read sim") {
             CHECK(r.seq.length() == 5);
         }
     }
+    {
+        // Same seed and stream give the same reads
+        vargas::Sim a(g, prof, 7, 1), b(g, prof, 7, 1), c(g, prof, 7, 2);
+        auto ra = a.get_batch(20, vargas::coordinate_resolver());
+        auto rb = b.get_batch(20, vargas::coordinate_resolver());
+        auto rc = c.get_batch(20, vargas::coordinate_resolver());
+        bool differs = false;
+        for (size_t i = 0; i < ra.size(); ++i) {
+            CHECK(ra[i].seq == rb[i].seq);
+            CHECK(ra[i].pos == rb[i].pos);
+            differs |= ra[i].pos != rc[i].pos;
+        }
+        CHECK(differs);
+        a.seed(7, 1);
+        CHECK(a.get_batch(20, vargas::coordinate_resolver())[0].seq == rb[0].seq);
+    }
+    {
+        prof.var_nodes = 0;
+        sim.set_prof(prof);
+        for (const auto &r : sim.get_batch(10, vargas::coordinate_resolver())) {
+            int vnodes = -1;
+            CHECK(r.aux.get(SIM_SAM_VAR_NODES_TAG, vnodes));
+            CHECK(vnodes == 0);
+        }
+    }
 
     remove(tmpfa.c_str());
     remove((tmpfa + ".fai").c_str());
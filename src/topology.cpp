@@ -0,0 +1,167 @@
+/**
+ * @brief
+ * NUMA placement of aligner threads and per-node copies of compiled graphs.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "topology.h"
+#include "doctest.h"
+#include <sched.h>
+#include <dirent.h>
+#include <algorithm>
+#include <fstream>
+
+vargas::Topology::Topology(std::vector<std::vector<int>> cpus) {
+    for (auto &c : cpus) {
+        if (c.empty()) continue;
+        std::sort(c.begin(), c.end());
+        _cpus.push_back(std::move(c));
+    }
+    if (_cpus.empty()) throw std::invalid_argument("No CPUs in NUMA topology.");
+}
+
+vargas::Topology vargas::Topology::detect(const std::string &sysfs) {
+    std::vector<int> allowed;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) if (CPU_ISSET(c, &mask)) allowed.push_back(c);
+    }
+
+    std::map<int, std::vector<int>> nodes;
+    if (DIR *dir = opendir(sysfs.c_str())) {
+        while (const dirent *e = readdir(dir)) {
+            const std::string name = e->d_name;
+            if (name.compare(0, 4, "node") || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos) continue;
+            std::ifstream in(sysfs + "/" + name + "/cpulist");
+            std::string list;
+            if (!std::getline(in, list)) continue;
+            auto &cpus = nodes[std::stoi(name.substr(4))];
+            for (const int c : parse_cpulist(list)) {
+                if (allowed.empty() || std::binary_search(allowed.begin(), allowed.end(), c)) cpus.push_back(c);
+            }
+        }
+        closedir(dir);
+    }
+
+    std::vector<std::vector<int>> cpus;
+    for (auto &n : nodes) if (!n.second.empty()) cpus.push_back(std::move(n.second));
+    if (cpus.empty()) {
+        // No NUMA information, one node of the allowed CPUs
+        if (allowed.empty()) allowed.push_back(0);
+        cpus.push_back(allowed);
+    }
+    return Topology(std::move(cpus));
+}
+
+size_t vargas::Topology::node_of(size_t tid, size_t threads) const {
+    if (threads == 0) return 0;
+    return std::min(nodes() - 1, (tid % threads) * nodes() / threads);
+}
+
+std::vector<std::vector<int>> vargas::Topology::thread_cpus(size_t threads) const {
+    std::vector<std::vector<int>> ret;
+    for (size_t t = 0; t < threads; ++t) ret.push_back(_cpus[node_of(t, threads)]);
+    return ret;
+}
+
+std::vector<int> vargas::parse_cpulist(const std::string &list) {
+    std::vector<int> ret;
+    for (const auto &range : rg::split(list, ",\n ")) {
+        const auto dash = range.find('-');
+        try {
+            size_t end;
+            const int lo = std::stoi(range.substr(0, dash), &end);
+            if (end != (dash == std::string::npos ? range.size() : dash)) throw std::invalid_argument(range);
+            const int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1), &end);
+            if (dash != std::string::npos && end != range.size() - dash - 1) throw std::invalid_argument(range);
+            if (lo < 0 || hi < lo) throw std::invalid_argument(range);
+            for (int c = lo; c <= hi; ++c) ret.push_back(c);
+        } catch (std::logic_error &) {
+            throw std::invalid_argument("Invalid CPU list: \"" + list + "\"");
+        }
+    }
+    return ret;
+}
+
+vargas::GraphReplicas::GraphReplicas(const GraphMan &gm, const Topology &topology, size_t threads) :
+_gm(gm), _thread_cpus(topology.thread_cpus(threads)) {
+    for (size_t t = 0; t < threads; ++t) _thread_node.push_back(topology.node_of(t, threads));
+    for (size_t n = 0; n < topology.nodes(); ++n) _nodes.emplace_back(new _node);
+}
+
+std::shared_ptr<const vargas::CompiledGraph> vargas::GraphReplicas::compiled(const std::string &label, size_t tid) {
+    // A single node reads the graph where it was loaded
+    if (_nodes.size() < 2) return _gm.compiled(label);
+    _node &n = *_nodes[_thread_node.at(tid)];
+    std::lock_guard<std::mutex> lock(n.mut);
+    auto &g = n.graphs[label];
+    // Copied by the calling thread, which first touches the pages on its node
+    if (!g) g = std::make_shared<const CompiledGraph>(*_gm.compiled(label));
+    return g;
+}
+
+size_t vargas::GraphReplicas::size() const {
+    size_t ret = 0;
+    for (const auto &n : _nodes) {
+        std::lock_guard<std::mutex> lock(n->mut);
+        ret += n->graphs.size();
+    }
+    return ret;
+}
+
+TEST_SUITE("Topology");
+
+TEST_CASE("NUMA topology") {
+    CHECK(vargas::parse_cpulist("0-3,8,10-11\n") == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    CHECK(vargas::parse_cpulist("5") == std::vector<int>({5}));
+    CHECK_THROWS(vargas::parse_cpulist("3-1"));
+    CHECK_THROWS(vargas::parse_cpulist("a-b"));
+    CHECK_THROWS(vargas::parse_cpulist("1x"));
+    CHECK_THROWS(vargas::Topology({{}, {}}));
+
+    vargas::Topology topo({{0, 1}, {}, {2, 3}});
+    REQUIRE(topo.nodes() == 2);
+    // Blocks of threads per node
+    CHECK(topo.node_of(0, 5) == 0);
+    CHECK(topo.node_of(2, 5) == 0);
+    CHECK(topo.node_of(3, 5) == 1);
+    CHECK(topo.node_of(4, 5) == 1);
+    CHECK(topo.node_of(0, 1) == 0);
+    const auto cpus = topo.thread_cpus(4);
+    REQUIRE(cpus.size() == 4);
+    CHECK(cpus[1] == std::vector<int>({0, 1}));
+    CHECK(cpus[3] == std::vector<int>({2, 3}));
+
+    const auto host = vargas::Topology::detect();
+    CHECK(host.nodes() >= 1);
+    CHECK(vargas::Topology::detect("/nonexistent").nodes() == 1);
+
+    const std::string gfile = "tmp_topology.gdf";
+    {
+        std::ofstream o(gfile);
+        o << "@vgraph\naux\tnull\n\n@contigs\n0\tchr1\n\n@graphs\nbase\t0,1\t0:1;\n\n@nodes\n"
+             "0\t5\t1.0\t1\t5\t1\nAAAAA\n1\t8\t1\t1\t3\t1\nGGG\n";
+    }
+    vargas::GraphMan gm(gfile);
+    vargas::GraphReplicas single(gm, vargas::Topology(std::vector<std::vector<int>>{{0}}), 2);
+    CHECK(single.compiled("base", 1) == gm.compiled("base"));
+    CHECK(single.size() == 0);
+
+    vargas::GraphReplicas replicas(gm, topo, 4);
+    const auto a = replicas.compiled("base", 0), b = replicas.compiled("base", 1), c = replicas.compiled("base", 3);
+    CHECK(a == b);
+    CHECK(a != c);
+    CHECK(a != gm.compiled("base"));
+    CHECK(replicas.size() == 2);
+    REQUIRE(c->length() == 8);
+    CHECK(std::equal(c->seq(0), c->seq(0) + 8, gm.compiled("base")->seq(0)));
+    CHECK(replicas.thread_cpus()[2] == std::vector<int>({2, 3}));
+    remove(gfile.c_str());
+}
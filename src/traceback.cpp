@@ -0,0 +1,271 @@
+/**
+ * @brief
+ * Banded traceback of alignments to linear references.
+ *
+ * @copyright
+ * Distributed under the MIT Software License.
+ * See accompanying LICENSE or https://opensource.org/licenses/MIT
+ *
+ * @file
+ */
+
+#include "traceback.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
+namespace {
+  // Score of cells outside the band, low enough to never be picked and to not overflow
+  constexpr int NEG_INF = std::numeric_limits<int>::min() / 2;
+}
+
+int vargas::Traceback::trace(const ScoreProfile &prof, const std::string &read, const std::string &qual,
+                             char phred_offset, const rg::Base *ref, size_t ref_len, int max_score,
+                             std::string &cigar, size_t &offset) {
+    const int rows = read.length();
+    const int cols = ref_len;
+    int glo = -rows, ghi = cols;
+    if (_banded) {
+        // Each read base adds at most a match, and each gap base costs at least its extension
+        const long slack = std::max<long>(0, long(rows) * prof.match - max_score);
+        const long dmax = prof.read_gext ? slack / prof.read_gext : cols;
+        const long imax = prof.match + prof.ref_gext ? slack / (prof.match + prof.ref_gext) : rows;
+        // End to end alignments end in the last row, local ones need enough rows to match max_score
+        long rmin = rows;
+        if (!prof.end_to_end) {
+            rmin = prof.match && max_score > 0 ? std::min<long>(rows, (max_score + prof.match - 1) / prof.match) : 0;
+        }
+        glo = std::max<long>(-rows, cols - rows - dmax);
+        ghi = std::min<long>(cols, cols - rmin + imax);
+    }
+
+    int score;
+    _fill(prof, read, qual, phred_offset, ref, cols, glo, ghi);
+    if (!_trace(prof, rows, cols, max_score, score, cigar, offset)) {
+        _fill(prof, read, qual, phred_offset, ref, cols, -rows, cols);
+        _trace(prof, rows, cols, max_score, score, cigar, offset);
+    }
+    return score;
+}
+
+void vargas::Traceback::_fill(const ScoreProfile &prof, const std::string &read, const std::string &qual,
+                              char phred_offset, const rg::Base *ref, int ref_len, int glo, int ghi) {
+    const int rows = read.length();
+    _glo = glo;
+    _ghi = ghi;
+    _width = ghi - glo + 3;
+    const size_t size = size_t(rows + 1) * _width;
+    _M.assign(size, NEG_INF);
+    _D.assign(size, NEG_INF);
+    _I.assign(size, NEG_INF);
+    _t.assign(size, 0);
+
+    _ref.resize(ref_len);
+    for (int col = 0; col < ref_len; ++col) _ref[col] = rg::num_to_base(ref[col]);
+
+    // Gaps in the beginning of the reference (first row) ending in a match or a query gap don't make sense,
+    // nor do gaps in the beginning of the query (first column) ending in a match or reference gap.
+    const int edge = -int(prof.ref_gext) * ref_len;
+    for (int col = std::max(0, glo); col <= std::min(ref_len, ghi); ++col) {
+        const int c = _cell(0, col);
+        _M[c] = col ? edge : 0; // zero characters of each is free
+        _I[c] = edge;
+        _D[c] = 0;
+    }
+    for (int row = std::max(1, -ghi); row <= std::min(rows, -glo); ++row) {
+        const int c = _cell(row, 0);
+        _M[c] = edge;
+        _D[c] = edge;
+        // Semiglobal gaps in the beginning of the query ending in a query gap accumulate
+        _I[c] = prof.end_to_end ? -int(row * prof.read_gext) - int(prof.read_gopen) : 0;
+    }
+
+    const int rd_open = prof.read_gopen + prof.read_gext, rf_open = prof.ref_gopen + prof.ref_gext;
+    const int rd_ext = prof.read_gext, rf_ext = prof.ref_gext;
+    const bool has_quality = qual.size() == read.size();
+    for (int row = 1; row <= rows; ++row) {
+        const char query_char = read[row - 1];
+        const int mismatch = prof.penalty(has_quality ? qual[row - 1] - phred_offset : 40);
+        const int end = std::min(ref_len, row + ghi);
+        for (int col = std::max(1, row + glo); col <= end; ++col) {
+            const int c = _cell(row, col);
+            const int diag = c - _width, left = c - 1, up = c - _width + 1;
+            const char ref_char = _ref[col - 1];
+            int delta;
+            if (ref_char == 'N' || query_char == 'N') delta = -int(prof.ambig);
+            else if (ref_char != query_char) delta = -mismatch;
+            else delta = prof.match;
+
+            // Local cells that would be <= 0 stay zero and trace back to M
+            uint8_t t = 0;
+
+            // M: match or mismatch between the last characters, traceback goes diagonally
+            int pm = _M[diag] + delta, pd = _D[diag] + delta, pi = _I[diag] + delta;
+            int best = std::max({pm, pd, pi});
+            if (prof.end_to_end || best > 0) {
+                _M[c] = best;
+                t |= pm == best ? 0 : pd == best ? 1 : 2;
+            } else _M[c] = 0;
+
+            // D: gap in the read, traceback goes left
+            pm = _M[left] - rd_open;
+            pd = _D[left] - rd_ext;
+            pi = _I[left] - rd_open;
+            best = std::max({pm, pd, pi});
+            if (prof.end_to_end || best > 0) {
+                _D[c] = best;
+                t |= (pm == best ? 0 : pd == best ? 1 : 2) << 2;
+            } else _D[c] = 0;
+
+            // I: gap in the reference, traceback goes up
+            pm = _M[up] - rf_open;
+            pd = _D[up] - rf_open;
+            pi = _I[up] - rf_ext;
+            best = std::max({pm, pd, pi});
+            if (prof.end_to_end || best > 0) {
+                _I[c] = best;
+                t |= (pm == best ? 0 : pd == best ? 1 : 2) << 4;
+            } else _I[c] = 0;
+
+            _t[c] = t;
+        }
+    }
+}
+
+bool vargas::Traceback::_trace(const ScoreProfile &prof, int rows, int ref_len, int max_score, int &score,
+                               std::string &cigar, size_t &offset) {
+    // Alignments scoring at least max_score are all inside the band, anything else needs the full matrix
+    const bool full = _glo == -rows && _ghi == ref_len;
+    const char clip = prof.end_to_end ? 'I' : 'S';
+    _aln.clear(); // Reverse order of operations
+
+    // The best score is in the last column because the reference ends at the max-scoring position,
+    // and in the last row for end to end alignments.
+    int curr_row = -1, best = -1, matrix = -1;
+    for (int row = prof.end_to_end ? rows : 0; row <= rows; ++row) {
+        const int c = _cell(row, ref_len);
+        if (c < 0) continue;
+        if (prof.end_to_end || _M[c] > best) {
+            best = _M[c];
+            curr_row = row;
+            matrix = 0;
+        }
+        if (_D[c] > best) {
+            best = _D[c];
+            curr_row = row;
+            matrix = 1;
+        }
+        if (_I[c] > best) {
+            best = _I[c];
+            curr_row = row;
+            matrix = 2;
+        }
+    }
+    score = best;
+    if (!full && (curr_row < 0 || best < max_score)) return false;
+
+    for (int row = curr_row; row < rows; ++row) _aln.push_back('S'); // Unaligned bases in end of query
+    int curr_col = ref_len;
+    while (curr_row > 0 && curr_col > 0) {
+        const int c = _cell(curr_row, curr_col);
+        if (c < 0) return false;
+        const uint8_t t = _t[c];
+        // Local alignments end when the score goes to or below zero
+        if (matrix == 0 && (prof.end_to_end || _M[c] > 0)) {
+            _aln.push_back('M');
+            matrix = t & 3;
+            --curr_col;
+            --curr_row;
+        } else if (matrix == 1 && (prof.end_to_end || _D[c] > 0)) {
+            _aln.push_back('D');
+            matrix = (t >> 2) & 3;
+            --curr_col;
+        } else if (prof.end_to_end || _I[c] > 0) {
+            _aln.push_back('I');
+            matrix = (t >> 4) & 3;
+            --curr_row;
+        } else break;
+    }
+    offset = curr_col;
+    for (int row = 0; row < curr_row; ++row) _aln.push_back(clip); // Unaligned bases in beginning of query
+
+    // Reverse and run-length-collapse the sequence of operations
+    cigar.clear();
+    if (_aln.empty()) return true;
+    char last_seen = _aln.back();
+    unsigned count = 1;
+    for (auto rit = std::next(_aln.rbegin(), 1); rit != _aln.rend(); ++rit) {
+        if (*rit != last_seen) {
+            cigar.append(std::to_string(count));
+            cigar.push_back(last_seen);
+            count = 1;
+            last_seen = *rit;
+        } else ++count;
+    }
+    cigar.append(std::to_string(count));
+    cigar.push_back(last_seen);
+    return true;
+}
+
+TEST_CASE ("Traceback") {
+    vargas::Traceback tb;
+    vargas::ScoreProfile prof(2, 2, 3, 1);
+    std::string cigar;
+    size_t offset;
+
+    SUBCASE("Local") {
+        const auto ref = rg::seq_to_num("GGGGGACGTTTACGTCA");
+        CHECK(tb.trace(prof, "ACGTTACGTCA", "", 33, ref.data(), ref.size(), 18, cigar, offset) == 18);
+        CHECK(cigar == "3M1D8M");
+        CHECK(offset == 5);
+        CHECK(tb.trace(prof, "CCACGTCA", "", 33, ref.data(), ref.size(), 12, cigar, offset) == 12);
+        CHECK(cigar == "2S6M");
+        CHECK(offset == 11);
+    }
+
+    SUBCASE("End to end") {
+        prof.end_to_end = true;
+        const auto ref = rg::seq_to_num("GGGGGACGTTTACGTCA");
+        CHECK(tb.trace(prof, "ACGTTACGTCA", "", 33, ref.data(), ref.size(), 18, cigar, offset) == 18);
+        CHECK(cigar == "3M1D8M");
+        CHECK(offset == 5);
+    }
+
+    SUBCASE("Band matches full matrix") {
+        std::mt19937 gen(1234);
+        std::uniform_int_distribution<int> base(0, 3), edit(0, 19);
+        const std::string bases = "ACGT";
+        vargas::Traceback full;
+        full.set_banded(false);
+        for (bool ete : {false, true}) {
+            prof.end_to_end = ete;
+            for (int i = 0; i < 200; ++i) {
+                std::string ref, read;
+                for (int j = 0; j < 100; ++j) ref.push_back(bases[base(gen)]);
+                for (int j = 50; j < 100; ++j) {
+                    const int e = edit(gen);
+                    if (e == 0) read.push_back(bases[base(gen)]); // mismatch or match
+                    else if (e == 1) continue; // deletion
+                    else if (e == 2) read.append({ref[j], bases[base(gen)]}); // insertion
+                    else read.push_back(ref[j]);
+                }
+                const auto num = rg::seq_to_num(ref);
+                std::string fcigar, bcigar;
+                size_t foffset, boffset;
+                const int s = full.trace(prof, read, "", 33, num.data(), num.size(), 0, fcigar, foffset);
+                const int bs = tb.trace(prof, read, "", 33, num.data(), num.size(), s, bcigar, boffset);
+                CHECK(bs == s);
+                CHECK(bcigar == fcigar);
+                CHECK(boffset == foffset);
+                CHECK(tb.cells() <= full.cells());
+            }
+        }
+        // An exact match only needs the diagonal it ends on
+        const auto ref = rg::seq_to_num("ACGTACGTACGTAAAAACCCCC");
+        tb.trace(prof, "AAAACCCCC", "", 33, ref.data(), ref.size(), 18, cigar, offset);
+        CHECK(cigar == "9M");
+        CHECK(tb.cells() == 10 * 3);
+    }
+}
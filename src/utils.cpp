@@ -14,6 +14,8 @@
  */
 
 #include "utils.h"
+#include <atomic>
+#include <sys/mman.h>
 
 std::string rg::current_date() {
     time_t t = time(0);
@@ -45,6 +47,30 @@ char rg::guess_delim(const std::string &line) {
     throw std::logic_error("Unable to determine delimiter in line: " + line);
 }
 
+namespace {
+  std::atomic<bool> use_huge_pages(false);
+}
+
+void rg::set_huge_pages(bool enable) {
+    use_huge_pages = enable;
+}
+
+bool rg::huge_pages() {
+    return use_huge_pages;
+}
+
+void *rg::alloc_aligned(size_t bytes, size_t alignment) {
+    const bool huge = use_huge_pages && bytes >= huge_page_bytes;
+    if (huge) alignment = std::max(alignment, huge_page_bytes);
+    void *p;
+    if (posix_memalign(&p, alignment, bytes ? bytes : 1)) throw std::bad_alloc();
+    // Only whole huge pages are advised, the advice is a hint and may fail without harm
+#ifdef MADV_HUGEPAGE
+    if (huge) madvise(p, bytes - bytes % huge_page_bytes, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
 #if RG_UTIL_INCLUDE_DOCTESET
 #include "doctest.h"
 
@@ -94,4 +120,29 @@ TEST_CASE ("Split strings") {
 
 }
 
+TEST_CASE ("JSON writer") {
+    std::ostringstream ss;
+    rg::JsonWriter json(ss);
+    json.begin().value("a", 1).value("b", "x\"y\n").begin_array("c").value("", 1.5).value("", true).end()
+    .begin("d").end().value("e", std::nan("")).end();
+    CHECK(ss.str() == R"({"a":1,"b":"x\"y\n","c":[1.5,true],"d":{},"e":null})");
+    CHECK_THROWS(json.end());
+}
+
+TEST_CASE ("Huge page allocation") {
+    CHECK(!rg::huge_pages());
+    void *p = rg::alloc_aligned(rg::huge_page_bytes, 64);
+    CHECK(reinterpret_cast<uintptr_t>(p) % 64 == 0);
+    std::free(p);
+
+    rg::set_huge_pages(true);
+    p = rg::alloc_aligned(rg::huge_page_bytes + 100, 64);
+    CHECK(reinterpret_cast<uintptr_t>(p) % rg::huge_page_bytes == 0);
+    std::free(p);
+    // Small blocks keep their alignment
+    std::vector<uint32_t, rg::page_allocator<uint32_t>> v(1000, 7);
+    CHECK(v[999] == 7);
+    rg::set_huge_pages(false);
+}
+
 #endif
\ No newline at end of file
@@ -70,44 +70,124 @@ std::vector<std::string> vargas::VCF::seq_names() const {
 bool vargas::VCF::next() {
     if (_limit > 0 && _counter >= _limit) return false;
     if (!_header || !_bcf) return false;
+    if (_prefetch > 0 && _is_bcf) {
+        if (!_next_prefetched()) return false;
+    } else if (!_read_record(_curr_rec)) return false;
+
+    _load_shared();
+    _decode_genotypes();
+    ++_counter;
+    return true;
+}
+
+
+bool vargas::VCF::_read_record(bcf1_t *rec) {
     bool seqmatch;
     do {
-        if (bcf_read(_bcf, _header, _curr_rec) != 0) return false;
-        seqmatch = _region.seq_name.empty() || strcmp(_region.seq_name.c_str(), bcf_seqname(_header, _curr_rec)) == 0;
+        if (bcf_read(_bcf, _header, rec) != 0) return false;
+        seqmatch = _region.seq_name.empty() || strcmp(_region.seq_name.c_str(), bcf_seqname(_header, rec)) == 0;
         if (seqmatch) _entered_contig = true;
         else if (_assume_contig && _entered_contig) return false;
-    } while (!seqmatch || unsigned(_curr_rec->pos) < _region.min || (_region.max > 0 && unsigned(_curr_rec->pos) > _region.max));
+    } while (!seqmatch || unsigned(rec->pos) < _region.min || (_region.max > 0 && unsigned(rec->pos) > _region.max));
+    bcf_unpack(rec, BCF_UN_ALL);
+    return true;
+}
 
-    unpack_all();
-    gen_genotypes();
-    ++_counter;
+
+bool vargas::VCF::_next_prefetched() {
+    std::unique_lock<std::mutex> lock(_pf_mut);
+    if (!_reader.joinable()) _reader = std::thread(&VCF::_prefetch_loop, this);
+    _pf_cv.wait(lock, [this] { return !_ready.empty() || _pf_done; });
+    if (_ready.empty()) return false;
+    _spare.push_back(_curr_rec);
+    _curr_rec = _ready.front();
+    _ready.pop_front();
+    _pf_cv.notify_all();
     return true;
 }
 
 
-const std::vector<std::string> &vargas::VCF::gen_genotypes() {
-    FormatField<int> gt(_header, _curr_rec, "GT");
-    _genotypes.resize(gt.values.size());
-    for (size_t i = 0; i < _genotypes.size(); ++i) {
-        _genotypes[i] = (_alleles[bcf_gt_allele(gt.values.at(i))]);
+void vargas::VCF::_prefetch_loop() {
+    while (true) {
+        bcf1_t *rec;
+        {
+            std::unique_lock<std::mutex> lock(_pf_mut);
+            _pf_cv.wait(lock, [this] { return _ready.size() < _prefetch || _pf_stop; });
+            if (_pf_stop) break;
+            if (_spare.empty()) rec = bcf_init();
+            else {
+                rec = _spare.back();
+                _spare.pop_back();
+            }
+        }
+        const bool ok = _read_record(rec);
+        std::lock_guard<std::mutex> lock(_pf_mut);
+        if (!ok) {
+            _spare.push_back(rec);
+            break;
+        }
+        _ready.push_back(rec);
+        _pf_cv.notify_all();
     }
+    std::lock_guard<std::mutex> lock(_pf_mut);
+    _pf_done = true;
+    _pf_cv.notify_all();
+}
 
-    // Map of which indivs have each allele
-    _genotype_indivs.clear();
-    for (auto &allele : alleles()) {
-        _genotype_indivs[allele] = Population(_genotypes.size(), false);
+
+void vargas::VCF::_stop_prefetch() {
+    if (_reader.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_pf_mut);
+            _pf_stop = true;
+        }
+        _pf_cv.notify_all();
+        _reader.join();
     }
-    for (size_t s = 0; s < _genotypes.size(); ++s) {
-        _genotype_indivs[_genotypes[s]].set(s);
+    for (auto r : _ready) bcf_destroy(r);
+    for (auto r : _spare) bcf_destroy(r);
+    _ready.clear();
+    _spare.clear();
+    _pf_stop = _pf_done = false;
+}
+
+
+void vargas::VCF::_decode_genotypes() {
+    const int n = bcf_get_genotypes(_header, _curr_rec, (void **) &_gt, &_gt_cap);
+    _gt_len = n > 0 ? n : 0;
+
+    const size_t nalleles = _alleles.size();
+    _allele_indivs.assign(nalleles, Population(_gt_len, false));
+    for (int s = 0; s < _gt_len; ++s) {
+        const int32_t v = _gt[s];
+        if (v == bcf_int32_vector_end || bcf_gt_is_missing(v)) continue;
+        const int a = bcf_gt_allele(v);
+        if (a >= 0 && size_t(a) < nalleles) _allele_indivs[a].set(s);
     }
 
+    // Map of which indivs have each allele. Tags substituted with the REF share a string.
+    _genotype_indivs.clear();
+    for (size_t a = 0; a < nalleles; ++a) {
+        auto it = _genotype_indivs.find(_alleles[a]);
+        if (it == _genotype_indivs.end()) _genotype_indivs.emplace(_alleles[a], std::move(_allele_indivs[a]));
+        else it->second = it->second | _allele_indivs[a];
+    }
+}
+
+
+const std::vector<std::string> &vargas::VCF::gen_genotypes() {
+    _genotypes.resize(_gt_len);
+    for (int i = 0; i < _gt_len; ++i) {
+        const int32_t v = _gt[i];
+        const int a = v == bcf_int32_vector_end || bcf_gt_is_missing(v) ? -1 : bcf_gt_allele(v);
+        _genotypes[i] = a >= 0 && size_t(a) < _alleles.size() ? _alleles[a] : ".";
+    }
     return _genotypes;
 }
 
 
 const std::vector<float> &vargas::VCF::frequencies() const {
     InfoField<float> af(_header, _curr_rec, "AF");
-    static std::vector<float> _allele_freqs;
     const auto &val = af.values;
     _allele_freqs.resize(val.size() + 1); // make room for the ref
     float sum = 0;
@@ -151,6 +231,7 @@ int vargas::VCF::_init() {
         if (_header == nullptr) {
             return -2;
         }
+        _is_bcf = hts_get_format(_bcf)->format == bcf;
 
         // Load samples
         for (size_t i = 0; i < num_haplotypes() / 2; ++i) {
@@ -222,6 +303,7 @@ size_t vargas::VCF::num_haplotypes() const {
 }
 
 void vargas::VCF::close() {
+    _stop_prefetch();
     if (_bcf) bcf_close(_bcf);
     if (_header != nullptr) {
         bcf_hdr_destroy(_header);
@@ -232,9 +314,13 @@ void vargas::VCF::close() {
     if (_ingroup_cstr != nullptr) {
         free(_ingroup_cstr);
     }
+    free(_gt);
+    _gt = nullptr;
+    _gt_cap = _gt_len = 0;
     _bcf = nullptr;
     _header = nullptr;
     _curr_rec = nullptr;
+    _is_bcf = false;
     _ingroup_cstr = nullptr;
 }
 
@@ -264,7 +350,7 @@ TEST_CASE ("VCF File handler") {
         << "x\t10\t.\tC\t<CN2>,<CN0>\t99\t.\tAF=0.01,0.01;AC=2;LEN=1;NA=1;NS=1;TYPE=snp\tGT\t1|1\t2|1" << endl
         << "x\t14\t.\tG\t<DUP>,<BLAH>\t99\t.\tAF=0.01,0.1;AC=1;LEN=1;NA=1;NS=1;TYPE=snp\tGT\t1|0\t1|1" << endl
         << "y\t34\t.\tTATA\t<CN2>,<CN0>\t99\t.\tAF=0.01,0.1;AC=2;LEN=1;NA=1;NS=1;TYPE=snp\tGT\t1|1\t2|1" << endl
-        << "y\t39\t.\tT\t<CN0>\t99\t.\tAF=0.01;AC=1;LEN=1;NA=1;NS=1;TYPE=snp\tGT\t1|0\t0|1" << endl;
+        << "y\t39\t.\tT\t<CN0>\t99\t.\tAF=0.01;AC=1;LEN=1;NA=1;NS=1;TYPE=snp\tGT\t1|0\t.|1" << endl;
     }
 
     SUBCASE("File write wrapper") {
@@ -427,6 +513,29 @@ TEST_CASE ("VCF File handler") {
             CHECK(!vcf.allele_pop("T")[1]);
         }
 
+        SUBCASE("Missing genotypes") {
+            vargas::VCF vcf(tmpvcf);
+            for (int i = 0; i < 5; ++i) REQUIRE(vcf.next());
+            REQUIRE(vcf.gen_genotypes().size() == 4);
+            CHECK(vcf.gen_genotypes()[2] == ".");
+            CHECK(vcf.gen_genotypes()[3] == "");
+            CHECK(vcf.allele_pop("T").count() == 1);
+            CHECK(vcf.allele_pop("").count() == 2);
+        }
+
+        SUBCASE("Prefetch") {
+            // Text VCF is read by next() itself, since parsing it may add to the header
+            vargas::VCF vcf(tmpvcf), pf(tmpvcf);
+            pf.set_prefetch(2);
+            while (vcf.next()) {
+                REQUIRE(pf.next());
+                CHECK(pf.pos() == vcf.pos());
+                CHECK(pf.alleles() == vcf.alleles());
+                for (const auto &a : vcf.alleles()) CHECK(pf.allele_pop(a) == vcf.allele_pop(a));
+            }
+            CHECK(!pf.next());
+        }
+
         SUBCASE("Allele frequencies") {
             vargas::VCF vcf;
             vcf.open(tmpvcf);